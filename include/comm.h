@@ -7,8 +7,17 @@
 
 #include <event.h>
 #include <arpa/inet.h>
+#include <sys/uio.h>
+#include <stdint.h>
 
 #include "list.h"
+#include "ring.h"
+#include "pool.h"
+#include "frame.h"
+#include "wheel.h"
+#include "transport.h"
+#include "uring.h"
+#include "topo.h"
 
 #include <pthread.h>
 #include <semaphore.h>
@@ -18,13 +27,11 @@
 /* Enable this macro only if testing */
 #define TESTING
 
-#define NUM_HOSTS	4
-#define NUM_EPS		3
-
-/* Using two different switches */
-#define NUM_SWITCHES	2
-
-#define MAX_NODE_NAME	25
+/*
+ * Topology used when none is given in opts or by COMM_TOPOLOGY_ENV.
+ * Using two different switches
+ */
+#define DEFAULT_NUM_SWITCHES	2
 
 #define HOST_NAME_PREFIX	"host"
 #define EP_NAME_PREFIX		"rpi"
@@ -32,6 +39,10 @@
 /* Port on which end point listens */
 #define EP_LISTEN_PORT		14700
 
+/* Environment variables naming the topology file and this node in it */
+#define COMM_TOPOLOGY_ENV	"COMM_TOPOLOGY"
+#define COMM_NODE_NAME_ENV	"COMM_NODE_NAME"
+
 /* All hosts - Keep in sorted order*/
 #define HOST_NODES_LIST 						\
 	{								\
@@ -51,21 +62,132 @@
 
 #define MAX_DATA_LEN	4096
 
+/* Maximum messages queued by host waiting to be sent out */
+#define HOST_SUBMIT_RING_SIZE	4096
+
+/* Batches upto this size are handled without any extra allocation */
+#define HOST_SEND_BATCH_STACK	64
+
+/*
+ * Time given to the first attempt to connect (in ms). Kept short so that
+ * an ep dropping our packets doesn't hold up startup, doubles with every
+ * failed attempt upto MAX_CONN_TIMEOUT_SEC
+ */
+#define HOST_CONNECT_TIMEOUT_MIN_MS	250
+
 /* Maximum seconds to wait for connection to be established */
 #define MAX_CONN_TIMEOUT_SEC		5
 
-/* Interval between retrying to connect */
+/*
+ * Interval between retrying to connect at startup (in ms), doubles with
+ * every retry upto MAX_CONN_RETRY_TIMEOUT_SEC
+ */
+#define HOST_CONNECT_RETRY_MIN_MS	50
+
+/* Maximum interval between retrying to connect */
 #define MAX_CONN_RETRY_TIMEOUT_SEC	5
 
 /* Maximum times to try to reconnect */
 #define MAX_CONN_RETRIES		3
 
+/*
+ * Once up (or given up on at startup), lost connections are retried in
+ * background forever. Delay doubles with every failure, jittered (in ms)
+ */
+#define HOST_RECONNECT_MIN_MS		100
+#define HOST_RECONNECT_MAX_MS		10000
+
+/*
+ * Latest msgs kept around by host for replaying to an ep which lost some
+ * of them while reconnecting. Used if not set in opts
+ */
+#define HOST_RETRANSMIT_WINDOW		1024
+#define HOST_RETRANSMIT_WINDOW_MAX	(1 << 24)
+
 /* Maximum time during which we wish to receive atleast one heartbeat (in us) */
 #define HOST_HEARTBEAT_DURATION_US	100 * 1000
 
 /* Period in which ep sends heartbeats to host (in us) */
 #define EP_HEARTBEAT_DURATION_US		10 * 1000
 
+/*
+ * Time ep waits before acknowledging received msgs on its own (in us).
+ * Not below EP_HEARTBEAT_DURATION_US, so that acks on a busy link are no
+ * more than the heartbeats they stand in for
+ */
+#define EP_ACK_DELAY_US			EP_HEARTBEAT_DURATION_US
+
+/*
+ * Payloads shorter than this are sent uncompressed, not being worth the
+ * time. Used if not set in opts
+ */
+#define COMM_COMPRESS_MIN_LEN		256
+
+/*
+ * Group data frames are multicast to, if asked for (see opts). Switch sw
+ * uses port COMM_MCAST_PORT + sw. Used if not set in opts
+ */
+#define COMM_MCAST_GROUP		"239.255.147.0"
+#define COMM_MCAST_PORT			14701
+
+/* Socket buffers of multicast, riding out bursts without loss */
+#define COMM_MCAST_SOCK_BUF		(4 << 20)
+
+/*
+ * Payloads from this size on are sent zero copy by the io_uring engine.
+ * Below it, the kernel copying them is cheaper. Used if not set in opts
+ */
+#define COMM_ZC_MIN_LEN			2048
+
+/*
+ * Sends host can have queued with io_uring at once, over all connections.
+ * A connection takes no more at a time, the rest going through libevent
+ */
+#define HOST_URING_ENTRIES		1024
+
+/* Most frames in a chain of sends, a connection can have several */
+#define HOST_URING_CHAIN_FRAMES		64
+
+/* Bytes of control frames (copied in) a chain of sends takes */
+#define HOST_URING_COPY_MAX		256
+
+/* Pool slabs host registers with io_uring as fixed buffers, at most */
+#define HOST_URING_MAX_BUFS		1024
+
+/*
+ * Longest a frame is held back (in us) for the ones after it to go out in
+ * the same write, when coalescing. Used if not set in opts
+ */
+#define HOST_FLUSH_US			200
+
+/* Frames coalesced on a connection go out once there are this many bytes */
+#define HOST_COALESCE_MAX_BYTES		(64 * 1024)
+
+/*
+ * With SEND_ADAPTIVE, a connection starts coalescing once atleast this
+ * many frames come within a flush deadline, and stops once less than half
+ * as many do
+ */
+#define HOST_COALESCE_MIN_BATCH		4
+
+/*
+ * Bytes queued on a connection of host past which it is backed up, till
+ * back below the low watermark (see comm_backpressure_t). Used if not set
+ * in opts
+ */
+#define HOST_CONN_HIGH_WM		(4 << 20)
+#define HOST_CONN_LOW_WM		(1 << 20)
+
+/* Same for msgs in the submission queue. Used if not set in opts */
+#define HOST_SUBMIT_HIGH_WM		(HOST_SUBMIT_RING_SIZE * 3 / 4)
+#define HOST_SUBMIT_LOW_WM		(HOST_SUBMIT_RING_SIZE / 4)
+
+/* Most msgs held back for a backed up connection under DROP_OLDEST */
+#define HOST_BACKLOG_MSGS		1024
+
+/* Most datagrams ep reads in one go */
+#define EP_MCAST_BATCH			64
+
 /**** End of configurable paramters ****/
 
 /* Error Code */
@@ -79,21 +201,68 @@
 #define LOG_FATAL	1
 #define LOG_WARN	2
 
-/* ID of different nodes */
-typedef struct {
-	char name[MAX_NODE_NAME + 1];
-	char ip[NUM_SWITCHES][INET_ADDRSTRLEN];
-} nodes_t;
+/*
+ * How many connections to queue up, per connection we expect - Extra,
+ * just to be safe
+ */
+#define EP_LISTEN_QUEUE_PER_CONN	2
 
+/* Most connections ep accepts in one go */
+#define EP_ACCEPT_BATCH		64
 
-/* How many connections to queue up - Extra, just to be safe */
-#define EP_LISTEN_QUEUE_SIZE	(2 * NUM_SWITCHES * NUM_HOSTS)
+/* Most threads an ep can spread its connections over */
+#define EP_MAX_WORKERS		16
+
+/*
+ * Msgs tracked per host on ep for dropping duplicates (and for holding
+ * back msgs arriving out of order). Keep it a multiple of 64
+ */
+#define EP_MERGE_WINDOW		1024
 
 
 /* Callback function called by comm module for ep when host sends data */
 typedef void (*comm_ep_data_callback_t)(int host_num, int sw, int session,
 					int msg_num, char *buf, int len);
 
+/*
+ * Callback called by comm module for ep when a chunk of a stream arrives,
+ * the last one ending at total_len. Chunks come only once and in order
+ * with ep_ordered (see opts). Without it, each one comes once per switch
+ * (unless ep_dedup), and out of order under PATH_STRIPE or with workers
+ */
+typedef void (*comm_ep_stream_callback_t)(int host_num, int sw, int session,
+					int stream_id, uint64_t offset,
+					uint64_t total_len, char *buf, int len);
+
+/*
+ * Callback called by comm module for ep when msgs from host went missing
+ * on all switches (only with dedup). count msgs from msg_num are lost
+ */
+typedef void (*comm_ep_gap_callback_t)(int host_num, int session,
+					int msg_num, int count);
+
+/*
+ * Callback called by comm module for host when ep_num acknowledges all the
+ * msgs before ticket (as returned by host_send_msg()). latency_us is from
+ * queueing of the last of them, -1 if not known anymore
+ */
+typedef void (*comm_host_ack_callback_t)(int ep_num, int ticket,
+						long latency_us);
+
+/*
+ * Callback called by comm module for host when the path to ep_num over
+ * switch sw comes up (starts carrying msgs) or goes down
+ */
+typedef void (*comm_host_path_callback_t)(int ep_num, int sw, bool is_up);
+
+/*
+ * Called on host thread as the bytes queued on the connection to ep_num
+ * over switch sw go past the high watermark (is_high), and as they get
+ * back below the low one (or the connection goes down meanwhile)
+ */
+typedef void (*comm_host_wm_callback_t)(int ep_num, int sw, bool is_high,
+					size_t queued);
+
 /* Callback called by comm module when host/ep notice connection failure */
 typedef void (*comm_err_callback_t)(int node_num, int sw, int reason);
 
@@ -102,6 +271,38 @@ typedef void (*comm_err_callback_t)(int node_num, int sw, int reason);
 #define MSG_HEARTBEAT_REQ	1
 #define MSG_HEARTBEAT_RESP	2
 #define MSG_DATA		3
+#define MSG_STREAM		4
+
+/*
+ * Sent by ep first thing on a new connection. session and msg_num tell
+ * the next msg the ep expects (session 0 if it has none of this host).
+ * Heartbeat responses carry the same, acknowledging all msgs before it.
+ * Payload, if any, is a byte giving the newest wire format ep supports
+ * (with FRAME_WIRE_CRC if it wants checksums, FRAME_WIRE_LZ if it takes
+ * compressed payloads)
+ */
+#define MSG_RESUME		5
+
+/* Sent by ep on its own, acknowledging like a heartbeat response */
+#define MSG_ACK			6
+
+/*
+ * Switches the connection to the wire format in msg_num, with session
+ * being the one v1 headers leave out. Sent in v0 by host in reply to a
+ * resume offering it, everything after it is in the new format. Payload
+ * from host (4 bytes, little endian) is the msg_num its replay starts at.
+ * Ep echoes it back (in v0, without payload) before switching its side
+ */
+#define MSG_WIRE		7
+
+/*
+ * Sent by ep on a connection getting data frames over multicast, when
+ * some never arrived: count msgs (4 byte payload, little endian) from
+ * msg_num of session. Host resends them on the connection, as far as its
+ * retransmit window goes. msg_num of heartbeat requests on such a
+ * connection tells the msg host sends next, showing losses at the tail
+ */
+#define MSG_NACK		8
 
 /* The communication format - Don't change the order*/
 typedef struct {
@@ -113,71 +314,635 @@ typedef struct {
 	char buf[MAX_DATA_LEN];
 } comm_data_t;
 
+/*
+ * Starts the payload of every MSG_STREAM msg, followed by the chunk
+ * Don't change the order
+ */
+typedef struct {
+	int stream_id;
+	int reserved;
+	uint64_t offset;			/* Of this chunk in the stream */
+	uint64_t total_len;
+} comm_stream_hdr_t;
+
+/* Bytes of a stream carried by one msg */
+#define MAX_STREAM_CHUNK	(MAX_DATA_LEN - (int)sizeof(comm_stream_hdr_t))
+
+/* v1 header and checksum of a frame, built the first time it is sent */
+typedef struct {
+	uint8_t hdr_len;			/* 0 till built */
+	bool has_crc;				/* Set once crc is filled in */
+	uint8_t hdr[FRAME_MAX_HDR_LEN];
+	uint8_t crc[FRAME_CRC_LEN];		/* Of header and payload */
+} comm_frame_v1_t;
+
+/* Compressed payload of a frame, with a header of its own */
+typedef struct {
+	int alloc_len;
+	int len;
+	comm_frame_v1_t v1;
+	char buf[];
+} comm_frame_lz_t;
+
+/*
+ * Frame serialized once by host and shared (by reference) by the output
+ * buffers of all the connections it is sent on. Freed by the last one.
+ */
+typedef struct {
+	int refcnt;
+	int alloc_len;				/* Only upto the payload is allocated */
+	pool_t *pool;
+	uint64_t queued_ns;			/* When handed to host_send_*() */
+	comm_frame_lz_t *lz;			/* If compressed and it shrank */
+	bool lz_tried;				/* Compressed (or too short) */
+
+	/* Kept small - A full frame has to fit the largest pool class */
+	comm_frame_v1_t v1;
+	comm_data_t data;
+} comm_frame_t;
+
 struct comm_handle;
 
-/* Data kept around in host (per ep) */
+/* How host spreads msgs over the switches leading to an ep */
+typedef enum {
+	PATH_DUPLICATE = 0,		/* Every switch (lowest tail latency) */
+	PATH_ACTIVE_STANDBY,		/* One switch, other takes over on failure */
+	PATH_STRIPE,			/* One switch per msg, least loaded first */
+	PATH_NUM_POLICIES
+} comm_path_policy_t;
+
+/* What host waits for in comm_init() before returning */
+typedef enum {
+	QUORUM_ALL = 0,			/* Every path up or given up on */
+	QUORUM_EVERY_EP,		/* A path up to every ep */
+	QUORUM_EPS,			/* A path up to host_quorum_eps eps */
+	QUORUM_NUM_TYPES
+} comm_quorum_t;
+
+/* What host sends frames to eps with */
+typedef enum {
+	COMM_ENGINE_LIBEVENT = 0,	/* Bufferevents, a writev per connection */
+	COMM_ENGINE_URING,		/* io_uring, one submit for all of them */
+	COMM_ENGINE_NUM
+} comm_engine_t;
+
+/* How host flushes frames out on its connections */
+typedef enum {
+	SEND_ADAPTIVE = 0,		/* Either, going by rate of each connection */
+	SEND_LATENCY,			/* Every frame right away */
+	SEND_THROUGHPUT,		/* Coalesced, upto host_flush_us late */
+	SEND_NUM_MODES
+} comm_send_mode_t;
+
+/* What host does while a queue is past its high watermark */
+typedef enum {
+	BACKPRESSURE_EAGAIN = 0,	/* Sending msgs fails with -EAGAIN */
+	BACKPRESSURE_BLOCK,		/* Sending msgs waits */
+	BACKPRESSURE_DROP_OLDEST,	/* Oldest msgs held back for ep go */
+	BACKPRESSURE_DISCONNECT,	/* Connection dropped, replayed later */
+	BACKPRESSURE_NUM_POLICIES
+} comm_backpressure_t;
+
+/* Traffic sent by host over a switch, summed over all the eps */
+typedef struct {
+	unsigned long msgs_sent;
+	unsigned long bytes_sent;
+	unsigned long promotions;		/* Became active after failure */
+	unsigned long reconnects;
+	unsigned long msgs_replayed;		/* Part of msgs_sent */
+	unsigned long heartbeats_sent;
+	unsigned long heartbeats_suppressed;	/* Acks from ep did instead */
+	unsigned long heartbeat_bytes_saved;	/* Net of the acks */
+	unsigned long crc_errors;		/* Frames from eps, dropped */
+	unsigned long mcast_msgs_sent;		/* Once for all eps */
+	unsigned long mcast_bytes_sent;
+	unsigned long nacks;			/* From eps */
+	unsigned long msgs_resent;		/* Part of msgs_sent */
+} comm_switch_stats_t;
+
+/*
+ * Compression of payloads, by host as it sends them or by ep as they
+ * arrive. raw_bytes / lz_bytes is the ratio achieved
+ */
+typedef struct {
+	unsigned long msgs;			/* Compressed or decompressed */
+	unsigned long skipped;			/* Didn't shrink, sent as is */
+	unsigned long raw_bytes;		/* Of msgs, uncompressed */
+	unsigned long lz_bytes;			/* Of msgs, compressed */
+	unsigned long ns;			/* Spent on it, skipped ones too */
+} comm_lz_stats_t;
+
+/* Syscalls host made to put frames on its connections */
+typedef struct {
+	comm_engine_t engine;			/* In use, after any fallback */
+	unsigned long writes;			/* By libevent, one syscall each */
+	unsigned long submits;			/* io_uring_enter() calls */
+	unsigned long sends;			/* Submitted with them */
+	unsigned long zc_sends;			/* Of them zero copy */
+	unsigned long zc_copied;		/* Kernel copied the data anyway */
+	unsigned long bufs_registered;		/* Pool slabs, as fixed buffers */
+	unsigned long msgs;			/* Went out over io_uring */
+	unsigned long msgs_deferred;		/* Left to libevent meanwhile */
+} comm_engine_stats_t;
+
+/*
+ * Flushes of data frames on a connection of host. batch_msgs / batches is
+ * the batch size achieved, delay_ns / batch_msgs the delay added on average
+ */
 typedef struct {
+	bool is_coalescing;			/* Right now */
+	unsigned long batches;			/* Flushes with frames in them */
+	unsigned long batch_msgs;		/* Frames flushed */
+	unsigned long batch_bytes;
+	unsigned long max_batch;		/* Most frames in a flush */
+	unsigned long delay_ns;			/* Held back for, summed */
+	unsigned long max_delay_ns;
+	unsigned long mode_switches;		/* By SEND_ADAPTIVE */
+	size_t queued;				/* Bytes, held back ones too */
+	bool is_backed_up;			/* Past high watermark */
+	int backlog_msgs;			/* Held back, DROP_OLDEST only */
+	unsigned long times_backed_up;
+	unsigned long msgs_dropped;		/* By DROP_OLDEST */
+	unsigned long disconnects;		/* By DISCONNECT */
+} comm_conn_stats_t;
+
+/* Optional settings of comm module. Initialize with comm_opts_init() */
+typedef struct {
+	comm_ep_stream_callback_t ep_stream_callback;	/* Streams on ep */
+
+	/*
+	 * Threads serving the connections of an ep, each with its own event
+	 * loop. 0 serves them on the thread calling comm_init(). With
+	 * workers, ep callbacks are called from several threads at once
+	 */
+	int ep_num_workers;
+
+	/*
+	 * Deliver a msg only once on ep, whichever switch it comes on first.
+	 * ep_ordered also holds back msgs till the ones before them arrive
+	 */
+	bool ep_dedup;
+	bool ep_ordered;
+	comm_ep_gap_callback_t ep_gap_callback;
+
+	/*
+	 * Initial path policy of host, can be changed later with
+	 * host_set_path_policy(). With PATH_STRIPE msgs may arrive out of
+	 * order on ep (see ep_ordered)
+	 */
+	comm_path_policy_t host_path_policy;
+
+	/*
+	 * Msgs host keeps for replaying after reconnection (0 for default),
+	 * rounded up to a power of two. Replay goes on the connection which came back, so ep sees msgs
+	 * again which it got on other switches unless it drops duplicates
+	 */
+	int host_retransmit_window;
+
+	/* Called on host thread as acknowledgements arrive from eps */
+	comm_host_ack_callback_t host_ack_callback;
+
+	/*
+	 * Startup of host is over once quorum is reached, or all the paths
+	 * have been tried. The rest keep being connected in background,
+	 * msgs sent meanwhile are replayed to them from the retransmit
+	 * window once they come up
+	 */
+	comm_quorum_t host_quorum;
+	int host_quorum_eps;			/* Only for QUORUM_EPS */
+
+	/* Called on host thread as paths come up and go down */
+	comm_host_path_callback_t host_path_callback;
+
+	/*
+	 * Topology of the rack, copied in. If NULL, it is loaded from
+	 * topology_file, else from the file named by COMM_TOPOLOGY_ENV,
+	 * else the compiled in HOST_NODES_LIST and EP_NODES_LIST are used
+	 */
+	const topo_t *topology;
+	const char *topology_file;
+
+	/*
+	 * Name of this node in the topology (telling whether it is a host).
+	 * If NULL, COMM_NODE_NAME_ENV, else the hostname is used
+	 */
+	const char *node_name;
+
+	/*
+	 * Stick to the v0 wire format instead of offering/accepting the
+	 * compact one (e.g. to roll a fleet back)
+	 */
+	bool wire_legacy;
+
+	/*
+	 * Checksum every frame (CRC32C), if the other end asks for it as
+	 * well. Needs the compact wire format. A frame failing the check
+	 * is dropped along with its connection. Msgs keep arriving over
+	 * the other switches meanwhile, and are replayed on reconnection
+	 */
+	bool frame_crc;
+
+	/*
+	 * Compress payloads (see lz.h), if the other end asks for it as well.
+	 * Needs the compact wire format. Host compresses a msg once for all
+	 * the eps, if it is at least compress_min_len bytes (0 for default)
+	 * and sends it as is if it doesn't shrink
+	 */
+	bool frame_compress;
+	int compress_min_len;
+
+	/*
+	 * Send data frames once per switch by multicast (to mcast_group, NULL
+	 * for default) to the eps asking for it as well, instead of once per
+	 * ep. Connections carry the rest, eps asking over them for msgs they
+	 * missed. Needs the compact wire format. Only used by host under
+	 * PATH_DUPLICATE. Ep needs to run without workers, and drops
+	 * duplicates (turned on)
+	 */
+	bool multicast;
+	const char *mcast_group;
+
+	/*
+	 * Engine host sends frames with. COMM_ENGINE_URING queues up the
+	 * frames of every connection and hands them all to the kernel with
+	 * a single syscall, payloads of at least zc_min_len bytes (0 for
+	 * default) going out zero copy from the frame pool, registered as
+	 * fixed buffers. Falls back to libevent if the kernel can't do it.
+	 * Shared memory connections always go through libevent
+	 */
+	comm_engine_t host_engine;
+	int zc_min_len;
+
+	/*
+	 * Initial send mode of host, can be changed later with
+	 * host_set_send_mode(). Coalesced frames are flushed within
+	 * host_flush_us (0 for default), io_uring holding back its submit
+	 * as well. TCP connections are always TCP_NODELAY, Nagle would only
+	 * delay what is flushed
+	 */
+	comm_send_mode_t host_send_mode;
+	int host_flush_us;
+
+	/*
+	 * Watermarks of bytes queued on each connection and of msgs in the
+	 * submission queue (0 for defaults), and what host does once a queue
+	 * is past its high one till it is back below the low one. A backed
+	 * up connection holds back every producer under BACKPRESSURE_EAGAIN
+	 * and BACKPRESSURE_BLOCK, the other policies only affect its ep. The
+	 * submission queue holds producers back under every policy (with
+	 * -EAGAIN unless blocking). Producers on host thread never block.
+	 * Msgs an ep asks for again (replay, nacks) go out under every policy
+	 */
+	size_t host_conn_high_wm;
+	size_t host_conn_low_wm;
+	int host_submit_high_wm;
+	int host_submit_low_wm;
+	comm_backpressure_t host_backpressure;
+	comm_host_wm_callback_t host_wm_callback;
+} comm_opts_t;
+
+/* Statistics of msgs received by ep */
+typedef struct {
+	unsigned long delivered;
+	unsigned long duplicates;		/* Dropped */
+	unsigned long held;			/* Out of order, held back */
+	unsigned long lost;			/* Never arrived */
+	unsigned long acks_sent;		/* Not asked for by host */
+	unsigned long crc_errors;		/* Frames failing checksum */
+	unsigned long crc_dropped;		/* Of them, only frame dropped */
+	unsigned long invalid;			/* Unknown msg type, dropped */
+	unsigned long mcast_msgs;		/* Arrived over multicast */
+	unsigned long nacks_sent;
+	unsigned long msgs_nacked;		/* Asked for by nacks */
+} comm_ep_stats_t;
+
+/* Host side of a stream being sent */
+typedef struct {
+	struct comm_handle *handle;
+	int stream_id;
+	uint64_t offset;			/* Bytes already sent */
+	uint64_t total_len;
+} comm_stream_t;
+
+struct host_data;
+
+/* Piece of a chain of sends, a single SQE */
+typedef struct {
+	struct msghdr msg;			/* Over iov of the chain */
+	bool is_zc;				/* A single iov, zero copy */
+	int buf_index;				/* Fixed buffer of it, -1 if none */
+} host_uring_seg_t;
+
+/*
+ * Frames of a connection handed to io_uring at once, as sends linked to
+ * go out one after another. Holds references to the frames till the
+ * kernel is done with them (zero copy ones being notified later)
+ */
+typedef struct host_uring_chain {
+	struct host_uring_chain *next;		/* Free list */
+	struct host_data *host_data;
+	unsigned int gen;			/* Of connection, when queued */
+	int num_frames;
+	int num_iov;
+	int num_segs;
+	int copy_len;
+	int sends_left;				/* Sends not completed */
+	int cqes_left;				/* Along with notifications */
+	int err;				/* First failed send */
+	size_t len;				/* Bytes queued */
+	size_t sent;
+	comm_frame_t *frames[HOST_URING_CHAIN_FRAMES];
+	uint8_t copy[HOST_URING_COPY_MAX];	/* Control frames */
+	struct iovec iov[3 * HOST_URING_CHAIN_FRAMES];
+	host_uring_seg_t segs[2 * HOST_URING_CHAIN_FRAMES + 1];
+} host_uring_chain_t;
+
+/* io_uring send engine of host (see COMM_ENGINE_URING) */
+typedef struct {
+	uring_t ring;
+	bool has_zc;				/* Kernel does IORING_OP_SEND_ZC */
+	bool has_fixed;				/* Fixed buffers can be used */
+	int zc_min_len;
+	struct event *ev_complete;		/* Completions to reap */
+	struct event *ev_flush;			/* Chains to submit */
+	struct host_data **dirty;		/* Connections having them */
+	int num_dirty;
+	int chains_out;				/* Submitted, not done */
+	int cqes_out;				/* Yet to come, queued sends too */
+	host_uring_chain_t *free_chains;
+	void **bufs;				/* Slab at each fixed buffer */
+} host_uring_t;
+
+/* Data kept around in host (per ep) */
+typedef struct host_data {
 	int ep_num;
 	int ep_sw;
 
-	bool is_connected;
+	bool is_connected;			/* Socket is up */
+	bool is_live;				/* Handshake done, carries msgs */
+	bool is_init_done;			/* Startup attempt is over */
+	bool is_mcast;				/* Data frames go by multicast */
+	int wire;				/* Format of frames sent */
+	const transport_ops_t *transport;	/* As per topology */
+	struct sockaddr_storage ep_addr;	/* Resolved once, at startup */
+	socklen_t ep_addr_len;
 	int connect_fd;
 	int retries_left;
+	int reconnect_attempts;			/* Failures since last up */
 	struct event *ev_connect;
+	wheel_timer_t reconnect_timer;
 	struct bufferevent *bev_write;
-	struct event *heartbeat_check_timer;
-	struct event *heartbeat_req_timer;
-
-	int heartbeats_recv;
+	wheel_timer_t heartbeat_check_timer;
+	wheel_timer_t heartbeat_req_timer;
+	frame_parser_t parser;			/* For frames coming from ep */
+
+	int frames_recv;			/* Since last heartbeat check */
+
+	/* Frames sent through io_uring, libevent holding back meanwhile */
+	int uring_fd;				/* -1 if not used */
+	bool uring_zc;				/* Socket takes zero copy sends */
+	unsigned int uring_gen;			/* Bumped as connection goes */
+	host_uring_chain_t *uring_chain;	/* Being filled in, linked */
+	host_uring_chain_t *uring_last;
+	int uring_segs;				/* Sends of those */
+	int uring_busy;				/* Chains being sent */
+	bool uring_dirty;			/* On the list to submit */
+	bool uring_holds_write;			/* Bufferevent not writing */
+	bool uring_closing;			/* Close once it is done */
+	size_t uring_len;			/* Bytes queued, not yet sent */
+
+	/* Data frames held back to go out in one write (see send mode) */
+	bool is_coalescing;
+	struct evbuffer *coalesce;		/* Not in bufferevent yet */
+	struct event *ev_coalesce;		/* Flush deadline */
+	uint64_t send_last_ns;			/* Latest frame queued */
+	uint64_t send_gap_ns;			/* Between frames, averaged */
+	int batch_pending;			/* Frames queued, not flushed */
+	size_t batch_pending_len;
+	uint64_t batch_first_ns;		/* Oldest of them queued */
+	uint64_t batch_wait_ns;			/* Of the rest after it, summed */
+
+	/* Backpressure (see comm_backpressure_t) */
+	size_t queue_len;			/* Bytes queued, held back too */
+	bool is_backed_up;			/* Past high watermark */
+	comm_frame_t **backlog;			/* Held back, oldest first */
+	int backlog_head;
+	int backlog_count;
+	size_t backlog_len;
+
+	/* Only updated by host thread */
+	unsigned long msgs_sent;
+	unsigned long bytes_sent;
+	unsigned long promotions;
+	unsigned long reconnects;
+	unsigned long msgs_replayed;
+	unsigned long heartbeats_sent;
+	unsigned long heartbeats_suppressed;
+	unsigned long heartbeat_bytes_saved;
+	unsigned long crc_errors;
+	unsigned long nacks;
+	unsigned long msgs_resent;
+	unsigned long batches;
+	unsigned long batch_msgs;
+	unsigned long batch_bytes;
+	unsigned long max_batch;
+	unsigned long delay_ns;
+	unsigned long max_delay_ns;
+	unsigned long mode_switches;
+	unsigned long times_backed_up;
+	unsigned long msgs_dropped;
+	unsigned long disconnects;
 
 	struct comm_handle *handle;
 } host_data_t;
 
-#define HOST_TRIGGER_VAL	"t"
-#define HOST_END_VAL		"e"
+/* Data kept around in host per ep, over all the switches */
+typedef struct {
+	int active_sw;				/* Switch used by active/standby */
+	int next_sw;				/* Round robin start for striping */
+	int acked;				/* msg_num ep expects next */
+	int num_live;				/* Paths up, under lock */
+} host_ep_t;
+
+/* Multicast of data frames by host over a switch */
+typedef struct {
+	int fd;					/* -1 if not multicasting */
+	struct sockaddr_in group;		/* With port of the switch */
+	int num_live;				/* Connections taking it */
+	int num_crc;				/* Of them, checksumming */
+
+	/* Only updated by host thread */
+	unsigned long msgs_sent;
+	unsigned long bytes_sent;
+} host_mcast_t;
+
+/* Msg held back by ep till the ones before it arrive */
+typedef struct {
+	int msg_type;
+	int msg_num;
+	int session;
+	int msg_len;
+	int host_sw;				/* Arrived on */
+	char buf[];
+} ep_held_msg_t;
+
+/* Msgs received by ep from a host, over all the switches */
+typedef struct {
+	pthread_mutex_t lock;
+	bool is_valid;
+	int session;
+	int next;				/* All msgs before this are done */
+
+	/* Msgs in [next, next + EP_MERGE_WINDOW) already received */
+	unsigned long seen[EP_MERGE_WINDOW / 64];
+	ep_held_msg_t *held[EP_MERGE_WINDOW];	/* Only if ordered */
+} ep_merge_t;
+
+/* Multicast socket of ep, for a switch */
+typedef struct {
+	int sw;
+	int fd;					/* -1 if not joined */
+	struct event *ev;
+	struct comm_handle *handle;
+} ep_mcast_sock_t;
+
+/* Data frames from a host over multicast on a switch, as seen by ep */
+typedef struct {
+	struct ep_data *conn;			/* Taking multicast, else NULL */
+	bool has_next;
+	int session;
+	int next;				/* Expected next, over any path */
+} ep_mcast_t;
+
+/* Thread running an event loop for a share of connections on ep */
+typedef struct {
+	int id;
+	bool is_threaded;			/* Else runs in comm_init() */
+	pthread_t thread;
+	struct event_base *ev_base;
+
+	ring_t conn_ring;			/* Connections handed over */
+	int wakeup_fd;
+	struct event *ev_wakeup;
+	int wakeup_pending;
+	wheel_t wheel;				/* Timers of its connections */
+
+	int num_conns;
+
+	struct comm_handle *handle;
+} ep_worker_t;
 
 /* Handle to the state of comm module */
 typedef struct comm_handle {
 	bool is_host;
 	struct event_base *ev_base;
 	comm_err_callback_t err_callback;
+	comm_opts_t opts;
+	topo_t topo;				/* Own copy */
 
 	pthread_t host_event_thread;
-	struct bufferevent *host_write;		/* Write to this pipe initiates writes to eps */
-	struct bufferevent *ev_outstanding;	/* Event for incoming data to send out */
+	int wakeup_fd;				/* eventfd, wakes up the event thread */
+	struct event *ev_wakeup;		/* Event for incoming data to send out */
+	int wakeup_pending;			/* Set if wakeup_fd already signalled */
+	bool is_closing;			/* Set by comm_deinit() */
+	int node_num;				/* In topology, -1 if unknown */
 	
 	pthread_mutex_t lock;
-	list_t data_list;			/* Pending data to be sent */
+	pthread_cond_t backpressure_cond;	/* Producers blocked on lock */
+	int num_backed_up;			/* Connections holding them back */
+	bool submit_backed_up;			/* Submission queue too */
+	ring_t submit_ring;			/* Pending data to be sent */
+	pool_t frame_pool;			/* Frames sized to their payload */
+	wheel_t wheel;				/* Timers of host thread */
 	int num_succ_conns;			/* Total number of successful conn */
-
-	host_data_t host_data[NUM_EPS][NUM_SWITCHES];
-	int num_msg_sent;
+	int num_eps_live;			/* Eps with a path up */
+
+	/* Per connection, all the switches of an ep one after another */
+	host_data_t *host_data;
+	host_ep_t *host_eps;			/* Per ep */
+	comm_switch_stats_t closed_stats[MAX_SWITCHES];	/* Once deinit */
+	comm_path_policy_t path_policy;		/* Can change at any time */
+	comm_send_mode_t send_mode;		/* Can change at any time */
+	uint64_t flush_ns;			/* Deadline of coalesced frames */
+	struct timeval flush_tv;
+	comm_frame_t **rtx_window;		/* Latest msgs, by msg_num */
+	int rtx_size;				/* Power of two */
+	int rtx_count;				/* Msgs in window */
+	unsigned int rtx_next;			/* msg_num after the latest */
+	unsigned int rand_seed;			/* For jitter on host thread */
+	unsigned int num_msg_sent;
 	int session;
+	int next_stream_id;
+	host_mcast_t host_mcast[MAX_SWITCHES];
 	sem_t connect_sem;			/* Semaphore to wait for all connections */
 
-	struct event *ev_accept;
+	/* One per switch (or on all addresses), and one for local hosts */
+	int listen_fd[MAX_SWITCHES + 1];
+	struct event *ev_accept[MAX_SWITCHES + 1];
+	int num_listen;
 	list_t conn_list;			/* List of all the current connections */
+	ep_worker_t *ep_workers;
+	int num_ep_workers;
+	ep_merge_t *ep_merge;			/* Per host */
+	ep_mcast_sock_t ep_mcast_socks[MAX_SWITCHES];
+	ep_mcast_t *ep_mcast;			/* Per host per switch, if used */
+	comm_ep_stats_t ep_stats;
+	comm_lz_stats_t lz_stats;		/* Host or ep */
+	comm_engine_t engine;			/* Host sends with */
+	host_uring_t uring;			/* Only for COMM_ENGINE_URING */
+	comm_engine_stats_t engine_stats;
 	comm_ep_data_callback_t ep_callback;		/* Callback for ep when data arrives */
 
 } comm_handle_t;
 
 /* Data kept around in ep (per host) */
-typedef struct {
+typedef struct ep_data {
 	int host_num;
 	int host_sw;
 
-	bool is_metadata_read;
+	int conn_fd;
+	const transport_ops_t *transport;
 	struct bufferevent *bev;
-	int msg_read_len;			/* How much have been read already */
-	comm_data_t data;
+	frame_parser_t parser;
+	int wire;				/* Format of frames sent */
+	int wire_session;			/* Left out of v1 headers */
+	bool last_bad_crc;			/* Last frame failed checksum */
+	wheel_timer_t ack_timer;		/* Delayed ack of received msgs */
 
+	ep_worker_t *worker;			/* Serving this connection */
 	comm_handle_t *ep_handle;
 } ep_data_t;
 
 /* Function declarations */
+void comm_opts_init(comm_opts_t *opts);
 int comm_init(comm_handle_t *handle, comm_err_callback_t err_callback,
 		comm_ep_data_callback_t ep_data_callback);
+int comm_init_opts(comm_handle_t *handle, const comm_opts_t *opts,
+		comm_err_callback_t err_callback,
+		comm_ep_data_callback_t ep_data_callback);
 int host_send_msg(comm_handle_t *handle, char *buf, size_t len);
+int host_get_acked(comm_handle_t *handle, int ep_num);
+bool host_is_acked(comm_handle_t *handle, int ep_num, int ticket);
+int host_get_reach(comm_handle_t *handle, int ticket);
+int host_send_msgv(comm_handle_t *handle, const struct iovec *iov, int iovcnt);
+void host_get_pool_stats(comm_handle_t *handle, pool_stats_t *stats);
+void host_get_engine_stats(comm_handle_t *handle, comm_engine_stats_t *stats);
+int host_set_path_policy(comm_handle_t *handle, comm_path_policy_t policy);
+comm_path_policy_t host_get_path_policy(comm_handle_t *handle);
+int host_set_send_mode(comm_handle_t *handle, comm_send_mode_t mode);
+comm_send_mode_t host_get_send_mode(comm_handle_t *handle);
+int host_get_conn_stats(comm_handle_t *handle, int ep, int sw,
+			comm_conn_stats_t *stats);
+ssize_t host_get_queue_depth(comm_handle_t *handle, int ep, int sw);
+int host_get_submit_depth(comm_handle_t *handle);
+int host_get_switch_stats(comm_handle_t *handle, int sw,
+				comm_switch_stats_t *stats);
+int host_stream_open(comm_handle_t *handle, comm_stream_t *stream,
+			uint64_t total_len);
+ssize_t host_stream_write(comm_stream_t *stream, const char *buf, size_t len);
+void ep_get_stats(comm_handle_t *handle, comm_ep_stats_t *stats);
+void comm_get_lz_stats(comm_handle_t *handle, comm_lz_stats_t *stats);
+const topo_t *comm_get_topology(comm_handle_t *handle);
 void comm_deinit(comm_handle_t *handle);
 
 #endif /* __COMM_H__ */
@@ -0,0 +1,20 @@
+#ifndef __CRC_H__
+#define __CRC_H__
+
+#include <stddef.h>
+#include <stdint.h>
+
+/*
+ * CRC32C (Castagnoli) of buf, continuing from crc (0 to start). Uses
+ * SSE4.2 (x86) or ARMv8 CRC instructions if the CPU has them, else a
+ * table driven version
+ */
+uint32_t crc32c(uint32_t crc, const void *buf, size_t len);
+
+/* Table driven version, whatever the CPU */
+uint32_t crc32c_sw(uint32_t crc, const void *buf, size_t len);
+
+/* Name of the version used by crc32c() */
+const char *crc32c_impl(void);
+
+#endif /* __CRC_H__ */
@@ -0,0 +1,157 @@
+#ifndef __FRAME_H__
+#define __FRAME_H__
+
+#include <stdint.h>
+#include <stdbool.h>
+#include <errno.h>
+#include <event2/buffer.h>
+
+/* Return values of frame_parse() */
+#define FRAME_NEED_MORE		0
+#define FRAME_READY		1
+
+/* States of parser */
+#define FRAME_STATE_HDR		0	/* Waiting for header */
+#define FRAME_STATE_PAYLOAD	1	/* Header parsed, waiting for payload */
+
+/*
+ * Wire formats of frame headers. Connections start out with v0 (a raw
+ * comm_data_t header, in native byte order) and move to the newest one
+ * both ends support (see MSG_WIRE)
+ */
+#define FRAME_WIRE_V0		0
+#define FRAME_WIRE_V1		1
+#define FRAME_WIRE_NEWEST	FRAME_WIRE_V1
+
+/*
+ * Or'ed into the wire format (v1 onwards): every frame is followed by a
+ * CRC32C of its header and payload, little endian
+ */
+#define FRAME_WIRE_CRC		0x10
+#define FRAME_WIRE_VERSION(wire)	((wire) & 0x0f)
+#define FRAME_CRC_LEN		4
+
+/*
+ * Or'ed into the wire format (v1 onwards): payloads may come compressed
+ * (see lz.h), telling so with FRAME_MSG_LZ
+ */
+#define FRAME_WIRE_LZ		0x20
+
+/*
+ * Or'ed into the wire format (v1 onwards): data frames come over
+ * multicast instead, as v1 frames of their own (see frame_decode()),
+ * checksummed if any ep taking them asked for checksums. The connection
+ * carries everything else
+ */
+#define FRAME_WIRE_MCAST	0x40
+
+/* Returned by frame_parse() for a frame failing its checksum */
+#define FRAME_BAD_CRC		(-EBADMSG)
+
+/*
+ * v1 header, all of it little endian:
+ *	byte 0: version (2 bits) | S | X | inline length (4 bits)
+ *	byte 1: Z | msg_type (7 bits)
+ *	varint msg_num
+ *	varint msg_len, only with X. Else the inline length (upto 8) is used
+ *	varint session, only with S. Else the session of the connection
+ * Varints are LEB128 - 7 bits a byte, lowest first. With Z the payload is
+ * compressed, msg_len being its length on the wire
+ */
+#define FRAME_V1_VERSION	0x40
+#define FRAME_V1_VERSION_MASK	0xc0
+#define FRAME_V1_SESSION	0x20
+#define FRAME_V1_EXT_LEN	0x10
+#define FRAME_V1_INLINE_MASK	0x0f
+#define FRAME_INLINE_MAX	8
+#define FRAME_MSG_LZ		0x80
+
+/* Longest varint of a 32 bit number */
+#define FRAME_VARINT_MAX	5
+
+/* Longest header of any wire format */
+#define FRAME_MAX_HDR_LEN	(2 + 3 * FRAME_VARINT_MAX)
+
+/* A parsed frame */
+typedef struct {
+	int msg_type;
+	int msg_len;		/* Decompressed by frame_payload(), if is_lz */
+	int msg_num;
+	int session;
+	char *buf;		/* Set by frame_payload(), valid till frame_consume() */
+	bool is_lz;		/* Payload came compressed */
+	int wire_len;		/* Of the payload as it came */
+} frame_t;
+
+/* Decodes frames out of an input evbuffer, one connection per parser */
+typedef struct {
+	int state;
+	int wire;		/* Wire format of the incoming frames */
+	int session;		/* Of the connection, when frames leave it out */
+	int hdr_len;		/* Of the frame being parsed */
+	int crc_len;		/* Trailer of the frame being parsed */
+	frame_t frame;		/* Frame being parsed */
+	int max_len;		/* Longest payload allowed */
+	char *scratch;		/* Payloads split across chains copied here */
+	char *lz_buf;		/* Compressed payloads decompressed here */
+
+	unsigned long num_frames;
+	unsigned long num_copied;
+} frame_parser_t;
+
+void frame_parser_init(frame_parser_t *parser, int max_len);
+void frame_parser_destroy(frame_parser_t *parser);
+
+/*
+ * Frames after the current one are in wire format (with session being
+ * the one frames leave out)
+ */
+void frame_parser_set_wire(frame_parser_t *parser, int wire, int session);
+
+/*
+ * Returns FRAME_READY with frame pointing to the next complete frame,
+ * FRAME_NEED_MORE if it hasn't fully arrived yet or negative code if input
+ * is corrupt. Nothing is removed from input till frame_consume(). A frame
+ * failing the checksum (FRAME_BAD_CRC) can be skipped with it too, going
+ * by its length as it came
+ */
+int frame_parse(frame_parser_t *parser, struct evbuffer *input,
+		frame_t **frame);
+
+/*
+ * Payload of the frame returned by frame_parse(). Points into input if it
+ * is contiguous there, else it is copied out. A compressed one is
+ * decompressed, setting msg_len. NULL on failure (or corrupt payload).
+ * Frames that are going to be dropped need not look at their payload
+ */
+char *frame_payload(frame_parser_t *parser, struct evbuffer *input);
+
+/* Removes the frame returned by frame_parse() from input */
+void frame_consume(frame_parser_t *parser, struct evbuffer *input);
+
+/*
+ * Decodes a whole v1 frame (without compression) making up buf, like a
+ * datagram. Its payload is left in buf. conn_session is the one left out
+ * of the header. A checksum trailer, which the length tells of, is
+ * checked, and has to be there if need_crc. Returns FRAME_READY,
+ * FRAME_BAD_CRC or negative code
+ */
+int frame_decode(const void *buf, int len, int conn_session, bool need_crc,
+			frame_t *frame);
+
+/*
+ * Encodes header of a frame in wire format into hdr (FRAME_MAX_HDR_LEN
+ * bytes). conn_session is left out of v1 headers, which can also have
+ * FRAME_MSG_LZ or'ed into msg_type. Returns header length
+ */
+int frame_encode_hdr(int wire, uint8_t *hdr, int msg_type, int msg_len,
+			int msg_num, int session, int conn_session);
+
+/*
+ * Encodes the checksum trailer (FRAME_CRC_LEN bytes) of a frame having
+ * header hdr and payload buf
+ */
+void frame_encode_crc(uint8_t *trailer, const uint8_t *hdr, int hdr_len,
+			const void *buf, int len);
+
+#endif /* __FRAME_H__ */
@@ -0,0 +1,20 @@
+#ifndef __LZ_H__
+#define __LZ_H__
+
+/* Longest input lz_compress() takes (matches go back upto 64KB) */
+#define LZ_MAX_LEN		65535
+
+/*
+ * Compresses len bytes of src into dst, in the LZ4 block format. Returns
+ * the compressed length, 0 if it doesn't fit in max bytes (e.g. src doesn't
+ * shrink) or negative code on error
+ */
+int lz_compress(const void *src, int len, void *dst, int max);
+
+/*
+ * Decompresses len bytes of src into dst. Returns the decompressed length,
+ * or -EINVAL if src is corrupt or would decompress to more than max bytes
+ */
+int lz_decompress(const void *src, int len, void *dst, int max);
+
+#endif /* __LZ_H__ */
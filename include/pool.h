@@ -0,0 +1,79 @@
+#ifndef __POOL_H__
+#define __POOL_H__
+
+#include <stddef.h>
+#include <pthread.h>
+
+/*
+ * Size classes (object sizes in bytes) - Keep in increasing order. The
+ * largest holds a full payload along with its frame
+ */
+#define POOL_MAX_OBJ_SIZE	4224
+#define POOL_CLASS_SIZES	{ 64, 128, 512, 2048, POOL_MAX_OBJ_SIZE }
+#define POOL_NUM_CLASSES	5
+
+/*
+ * Memory carved up into objects at a time. Slabs are aligned to their size
+ * (a power of two)
+ */
+#define POOL_SLAB_SIZE		(64 * 1024)
+
+/* Objects kept around per thread per size class */
+#define POOL_CACHE_SIZE		32
+
+/* Pools a thread keeps caches for at a time, e.g. a host's and an ep's */
+#define POOL_NUM_CACHES		4
+
+typedef struct {
+	size_t obj_size;
+	pthread_mutex_t lock;
+	void *free_list;		/* Objects not cached by any thread */
+	void *slabs;			/* All memory allocated for this class */
+
+	unsigned long num_slabs;
+	unsigned long num_objs;
+	unsigned long allocs;
+	unsigned long frees;
+} pool_class_t;
+
+/* Pool of fixed size objects in a few size classes */
+typedef struct pool {
+	unsigned long id;		/* Unique, tags the thread caches */
+	pool_class_t classes[POOL_NUM_CLASSES];
+	struct pool *next;		/* In list of live pools */
+} pool_t;
+
+typedef struct {
+	struct {
+		size_t obj_size;
+		unsigned long num_slabs;
+		unsigned long num_objs;		/* Total objects carved out */
+		unsigned long in_use;		/* Not yet freed */
+		unsigned long allocs;
+		unsigned long frees;
+	} classes[POOL_NUM_CLASSES];
+
+	size_t bytes_reserved;			/* Memory held by the pool */
+	size_t bytes_in_use;
+} pool_stats_t;
+
+int pool_new(pool_t *pool);
+
+/* All objects must have been freed */
+void pool_destroy(pool_t *pool);
+
+/* Returns NULL if size is bigger than the largest class or out of memory */
+void *pool_alloc(pool_t *pool, size_t size);
+
+/* size must be the one passed to pool_alloc() */
+void pool_free(pool_t *pool, void *obj, size_t size);
+
+/*
+ * Slab (POOL_SLAB_SIZE bytes) obj was carved out of. E.g. to register pool
+ * memory with the kernel a slab at a time
+ */
+void *pool_slab_of(const void *obj);
+
+void pool_get_stats(pool_t *pool, pool_stats_t *stats);
+
+#endif /* __POOL_H__ */
@@ -0,0 +1,48 @@
+#ifndef __RING_H__
+#define __RING_H__
+
+#include <stdbool.h>
+
+/* Cache line size, used to keep producer and consumer indices apart */
+#define RING_CACHE_LINE	64
+
+typedef struct {
+	unsigned long seq;
+	void *data;
+} ring_slot_t;
+
+/*
+ * Bounded lock-free ring. Any number of threads can push, only one thread
+ * can pop
+ */
+typedef struct {
+	unsigned long size;	/* Always a power of two */
+	unsigned long mask;
+	ring_slot_t *slots;
+
+	unsigned long head __attribute__((aligned(RING_CACHE_LINE)));	/* Producers */
+	unsigned long tail __attribute__((aligned(RING_CACHE_LINE)));	/* Consumer */
+} ring_t;
+
+/* size is rounded up to a power of two */
+int ring_new(ring_t *ring, unsigned long size);
+void ring_destroy(ring_t *ring);
+
+/* Returns false if ring is full */
+bool ring_push(ring_t *ring, void *element);
+
+/*
+ * Claims upto n consecutive slots for the caller. Returns the number of
+ * slots claimed (0 if ring is full) and the position of the first one.
+ * Every claimed position must be filled in with ring_commit()
+ */
+unsigned long ring_reserve(ring_t *ring, unsigned long n, unsigned long *pos);
+void ring_commit(ring_t *ring, unsigned long pos, void *element);
+
+/* Returns NULL if ring is empty. Only to be called by the single consumer */
+void *ring_pop(ring_t *ring);
+
+/* Approximate number of elements in ring */
+unsigned long ring_count(ring_t *ring);
+
+#endif /* __RING_H__ */
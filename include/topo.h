@@ -0,0 +1,101 @@
+#ifndef __TOPO_H__
+#define __TOPO_H__
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <arpa/inet.h>
+
+#include "transport.h"
+
+#define MAX_NODE_NAME	25
+
+/* Most switches (i.e. addresses per node) a topology can have */
+#define MAX_SWITCHES	4
+
+/* ID of different nodes */
+typedef struct {
+	char name[MAX_NODE_NAME + 1];
+	char ip[MAX_SWITCHES][INET_ADDRSTRLEN];
+} nodes_t;
+
+/* Slot of the address index */
+typedef struct {
+	uint32_t addr;				/* IPv4, network order */
+	bool is_used;
+	bool is_host;
+	short sw;
+	int num;
+} topo_addr_t;
+
+/* Host and ep connected other than by TCP (e.g. sharing a machine) */
+typedef struct {
+	int host;
+	int ep;
+	transport_type_t transport;
+} topo_link_t;
+
+/*
+ * Hosts and endpoints of a rack, every node having an address on each of
+ * the switches. Node numbers are indices in these arrays
+ */
+typedef struct {
+	int num_switches;
+	int num_hosts;
+	int num_eps;
+	nodes_t *hosts;
+	nodes_t *eps;
+
+	int max_hosts;				/* Allocated */
+	int max_eps;
+
+	/* Open addressing hash of all the addresses, kept atmost half full */
+	topo_addr_t *index;
+	int index_bits;
+	int index_used;
+
+	topo_link_t *links;
+	int num_links;
+	int max_links;
+} topo_t;
+
+int topo_new(topo_t *topo, int num_switches);
+void topo_destroy(topo_t *topo);
+
+/* Adds a node with an address (ips[sw]) for each switch */
+int topo_add_node(topo_t *topo, bool is_host, const char *name,
+			const char * const *ips);
+
+/*
+ * Sets how host and ep connect, over every switch. Both have to be on the
+ * same machine for anything but TRANSPORT_TCP
+ */
+int topo_set_transport(topo_t *topo, int host, int ep,
+			transport_type_t transport);
+
+/* Gives how host and ep connect, TRANSPORT_TCP unless set otherwise */
+transport_type_t topo_get_transport(const topo_t *topo, int host, int ep);
+
+/*
+ * Builds topology out of a file with a line per node, like
+ *	switches 2
+ *	host host1 192.168.1.1 192.168.2.1
+ *	ep rpi1 192.168.1.11 192.168.2.11
+ *	link host1 rpi1 shm
+ * Anything after '#' is ignored. Without a switches line, the number of
+ * switches is taken from the first node. A link line (after both the
+ * nodes) sets the transport of a host and an ep: tcp, unix or shm
+ */
+int topo_load(topo_t *topo, const char *path);
+
+int topo_copy(topo_t *dst, const topo_t *src);
+
+/* Gives number of the node named name (and whether it is a host) */
+int topo_find_name(const topo_t *topo, const char *name, bool *is_host);
+
+/* Gives number of the host/ep having address ip (and the switch of it) */
+int topo_find_ip(const topo_t *topo, bool is_host, const char *ip, int *sw);
+
+/* Same as topo_find_ip(), in O(1) for a binary address (network order) */
+int topo_find_addr(const topo_t *topo, bool is_host, uint32_t addr, int *sw);
+
+#endif /* __TOPO_H__ */
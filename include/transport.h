@@ -0,0 +1,74 @@
+#ifndef __TRANSPORT_H__
+#define __TRANSPORT_H__
+
+#include <stdbool.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+
+struct event_base;
+struct bufferevent;
+
+/* Ways a host and an ep can be connected */
+typedef enum {
+	TRANSPORT_TCP = 0,		/* Over the switches, the default */
+	TRANSPORT_UNIX,			/* Unix domain socket, same machine */
+	TRANSPORT_SHM,			/* Shared memory rings, same machine */
+	TRANSPORT_NUM
+} transport_type_t;
+
+/* Bytes of the ring in each direction of a shared memory connection */
+#define TRANSPORT_SHM_RING_SIZE		(1 << 20)
+
+/*
+ * Abstract unix socket names are under this prefix. Ep listens on
+ * <prefix><ep>, host binds <prefix><ep>/<host>/<switch>/<unique> before
+ * connecting, so that ep can tell who it is (like with TCP by address)
+ */
+#define TRANSPORT_UNIX_PREFIX		"comm/"
+
+/*
+ * A transport, under the framing layer. It is always connected as a stream
+ * socket of domain (non-blocking, connect() and accept() as usual). Frames
+ * then go over the bufferevent made out of the connected socket
+ */
+typedef struct {
+	transport_type_t type;
+	const char *name;
+	int domain;
+
+	/*
+	 * Bufferevent for frames over connected fd, which it takes over
+	 * (closed on failure as well). Returns NULL on error
+	 */
+	struct bufferevent *(*bev_new)(struct event_base *base, int fd,
+					bool is_host);
+
+	/*
+	 * Frees bev along with the connection. What was written to it is
+	 * still sent out, as far as the other end takes it
+	 */
+	void (*bev_free)(struct bufferevent *bev);
+} transport_ops_t;
+
+/* Transport of type, NULL if there is no such type */
+const transport_ops_t *transport_ops(transport_type_t type);
+
+/* Type of transport named name ("tcp", "unix" or "shm"), -EINVAL if none */
+int transport_by_name(const char *name);
+
+/* Address ep listens on for unix domain and shared memory connections */
+socklen_t transport_unix_ep_addr(struct sockaddr_un *addr, const char *ep);
+
+/* Address host binds a connection with ep over switch sw to */
+socklen_t transport_unix_host_addr(struct sockaddr_un *addr, const char *ep,
+					const char *host, int sw);
+
+/*
+ * Gives name of the host (in host, of host_len bytes) and its switch out
+ * of address addr of a connection to ep. Returns -EINVAL if it isn't the
+ * address of a host
+ */
+int transport_unix_peer(const struct sockaddr_un *addr, socklen_t len,
+			const char *ep, char *host, size_t host_len, int *sw);
+
+#endif /* __TRANSPORT_H__ */
@@ -0,0 +1,77 @@
+#ifndef __URING_H__
+#define __URING_H__
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <linux/io_uring.h>
+
+/*
+ * Bare io_uring, set up with the raw syscalls. Only what the host send
+ * engine needs: queueing SQEs, submitting them all with one
+ * io_uring_enter(), reaping CQEs and registering fixed buffers. Used by a
+ * single thread
+ */
+typedef struct {
+	int fd;
+	unsigned int sq_entries;
+	unsigned int cq_entries;
+
+	/* Submission queue, shared with kernel */
+	unsigned int *sq_head;
+	unsigned int *sq_tail;
+	unsigned int *sq_mask;
+	unsigned int *sq_array;
+	unsigned int *sq_flags;
+	struct io_uring_sqe *sqes;
+	unsigned int sq_local_tail;		/* SQEs handed out, not submitted */
+
+	/* Completion queue, shared with kernel */
+	unsigned int *cq_head;
+	unsigned int *cq_tail;
+	unsigned int *cq_mask;
+	struct io_uring_cqe *cqes;
+
+	void *sq_map;
+	size_t sq_map_len;
+	void *cq_map;				/* Same as sq_map if single mmap */
+	size_t cq_map_len;
+	size_t sqes_len;
+} uring_t;
+
+/* Returns negative code if the kernel doesn't do io_uring (or won't let us) */
+int uring_new(uring_t *ring, unsigned int entries);
+void uring_destroy(uring_t *ring);
+
+/* Whether the kernel knows op */
+bool uring_has_op(uring_t *ring, int op);
+
+/* Next free SQE, zeroed. NULL if the submission queue is full */
+struct io_uring_sqe *uring_get_sqe(uring_t *ring);
+
+/* SQEs that can still be had before submitting */
+unsigned int uring_sq_space(uring_t *ring);
+
+/* SQEs handed out, not yet taken by the kernel */
+unsigned int uring_sq_pending(uring_t *ring);
+
+/*
+ * Submits all the SQEs handed out with a single io_uring_enter(), which
+ * also brings in completions held back by the kernel if the CQ ring ever
+ * filled up. Returns the number submitted, or negative code (they stay
+ * queued then)
+ */
+int uring_submit(uring_t *ring);
+
+/* Oldest completion not yet seen, NULL if none */
+struct io_uring_cqe *uring_peek_cqe(uring_t *ring);
+void uring_cqe_seen(uring_t *ring);
+
+/*
+ * Sets up a table of nr fixed buffers, all empty to start with. Filled
+ * in one by one with uring_register_buf()
+ */
+int uring_register_bufs(uring_t *ring, unsigned int nr);
+int uring_register_buf(uring_t *ring, unsigned int index, void *base,
+			size_t len);
+
+#endif /* __URING_H__ */
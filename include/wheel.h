@@ -0,0 +1,84 @@
+#ifndef __WHEEL_H__
+#define __WHEEL_H__
+
+#include <stdbool.h>
+#include <stdint.h>
+
+#include <event2/event.h>
+
+/* Slots per level (bits) and number of levels */
+#define WHEEL_BITS	6
+#define WHEEL_SLOTS	(1 << WHEEL_BITS)
+#define WHEEL_MASK	(WHEEL_SLOTS - 1)
+#define WHEEL_LEVELS	4
+
+/* Default resolution of timers (in us) */
+#define WHEEL_TICK_US	1000
+
+typedef void (*wheel_cb_t)(void *arg);
+
+/* Timer kept in a wheel. Embed it in the object it times */
+typedef struct wheel_timer {
+	struct wheel_timer *next;
+	struct wheel_timer *prev;
+	uint64_t expires;		/* In ticks */
+	uint64_t period;		/* In ticks, 0 if one shot */
+	int level;			/* -1 if not pending */
+	wheel_cb_t cb;
+	void *arg;
+} wheel_timer_t;
+
+/* List head of a slot */
+typedef struct {
+	wheel_timer_t *head;
+} wheel_slot_t;
+
+/*
+ * Hierarchical timing wheel driven by a single libevent timer. Adding and
+ * removing timers is O(1), expired timers are fired in batches per tick.
+ * Only to be used from the thread running the event base
+ */
+typedef struct {
+	struct event_base *ev_base;
+	struct event *ev_tick;
+	uint64_t tick_us;
+	uint64_t start_us;		/* Time of tick 0 */
+	uint64_t now;			/* Next tick to be run */
+	uint64_t armed;			/* Tick ev_tick fires at, if pending */
+	bool is_running;
+
+	int num_timers;
+	int level_timers[WHEEL_LEVELS];
+
+	wheel_slot_t slots[WHEEL_LEVELS][WHEEL_SLOTS];
+
+	unsigned long num_fired;
+	unsigned long num_wakeups;
+} wheel_t;
+
+/* tick_us of 0 picks WHEEL_TICK_US */
+int wheel_new(wheel_t *wheel, struct event_base *ev_base, uint64_t tick_us);
+void wheel_destroy(wheel_t *wheel);
+
+void wheel_timer_init(wheel_timer_t *timer, wheel_cb_t cb, void *arg);
+
+/*
+ * (Re)starts timer to fire after timeout_us, rounded up to ticks. Periodic
+ * timers keep firing every timeout_us till removed
+ */
+void wheel_add(wheel_t *wheel, wheel_timer_t *timer, uint64_t timeout_us,
+		bool is_periodic);
+void wheel_del(wheel_t *wheel, wheel_timer_t *timer);
+
+static inline bool wheel_pending(wheel_timer_t *timer)
+{
+	return timer->level >= 0;
+}
+
+/* Fires all timers due by now_us. Done on its own when used with libevent */
+void wheel_run(wheel_t *wheel, uint64_t now_us);
+
+/* Monotonic time as used by wheel */
+uint64_t wheel_now_us(void);
+
+#endif /* __WHEEL_H__ */
@@ -11,20 +11,10 @@
 
 /*
  * TODO: Seperate initialization and looping for ep
- * TODO: Essentially RPC, But data representation needs to be independent of
- * machine types (RPI and Intel - differences?)
  * FIXME: If no connections on host established with eps, need to fail
  * TODO: Make API more informative ->
- * E.g. Allow host to know how many EPs connected presently,
- * Indicate how many EPs it was able to send message to etc
- * Is this difficult? As multithreaded, so locks or message passing?
- * Go memcached type - Use message passing for waking up and locks for data
- * communication??
- * TODO: Numbering of packets??
- * TODO: Re-establish connection after connection broken
- * 	- Can't do anything if EP/Host is simply stuck
+ * E.g. Allow host to know how many EPs connected presently
  * TODO: Break down API into host and ep (seperate)
- * TODO: Support corrupted packets detection? MD5?
  * TODO: Error handling of libevent
  */
 
@@ -32,8 +22,12 @@
  * XXX: Endpoint doesn't seem to need to detect health of system. Does it?
  */
 
+/* For accept4() */
+#define _GNU_SOURCE
+
 #include <unistd.h>
 #include <sys/socket.h>
+#include <netinet/tcp.h>
 #include <arpa/inet.h>
 #include <assert.h>
 #include <string.h>
@@ -44,8 +38,19 @@
 #include <stdlib.h>
 #include <sys/types.h>
 #include <stdarg.h>
+#include <sys/eventfd.h>
+#include <signal.h>
+#include <limits.h>
+#include <time.h>
+#include <endian.h>
 
 #include "list.h"
+#include "ring.h"
+#include "pool.h"
+#include "frame.h"
+#include "wheel.h"
+#include "transport.h"
+#include "lz.h"
 
 #include "comm.h"
 
@@ -58,14 +63,20 @@
 #include <pthread.h>
 #include <semaphore.h>
 
-/* List of hosts and endpoints */
-nodes_t hosts[NUM_HOSTS] = HOST_NODES_LIST;
-nodes_t eps[NUM_EPS] = EP_NODES_LIST;
+/* Compiled in list of hosts and endpoints, if no topology is given */
+static const nodes_t default_hosts[] = HOST_NODES_LIST;
+static const nodes_t default_eps[] = EP_NODES_LIST;
 
 /* Forward declaration */
 static void host_connect_cb(int sockfd, short which, void *arg);
 static void host_connect_terminate_now(host_data_t *host_data);
 static void host_connect_terminate_defer(host_data_t *host_data);
+static void host_connect_retry(host_data_t *host_data);
+static void host_connect_cancel(host_data_t *host_data);
+static void host_frame_put(comm_frame_t *frame);
+static void host_uring_reset(host_data_t *host_data);
+static void host_coalesce_reset(host_data_t *host_data);
+static bool host_queue_check(host_data_t *host_data, bool is_resend);
 
 /* TODO: Not evertime errno is required */
 
@@ -112,28 +123,104 @@ static void _genericLog(int logType, bool printErrno, char *fmt, ...)
 	genericLog(__VA_ARGS__);				\
 }
 
+/* Connection of host with switch sw of ep */
+static inline host_data_t *host_data_of(comm_handle_t *handle, int ep, int sw)
+{
+	return &handle->host_data[ep * handle->topo.num_switches + sw];
+}
+
+/* How many connections to queue up on ep */
+static inline int ep_listen_queue_size(comm_handle_t *handle)
+{
+	return EP_LISTEN_QUEUE_PER_CONN * handle->topo.num_switches *
+		handle->topo.num_hosts;
+}
+
+/* Connections of host, with all the switches of all the eps */
+static inline int host_num_conns(comm_handle_t *handle)
+{
+	return handle->topo.num_eps * handle->topo.num_switches;
+}
+
+/* Builds the topology out of the compiled in lists */
+static int topo_default(topo_t *topo)
+{
+	const char *ips[DEFAULT_NUM_SWITCHES];
+	unsigned int i;
+	int j, ret;
+
+	ret = topo_new(topo, DEFAULT_NUM_SWITCHES);
+	if (ret < 0)
+		return ret;
+
+	for (i = 0; i < sizeof(default_hosts) / sizeof(default_hosts[0]); i++) {
+		for (j = 0; j < DEFAULT_NUM_SWITCHES; j++)
+			ips[j] = default_hosts[i].ip[j];
+
+		ret = topo_add_node(topo, true, default_hosts[i].name, ips);
+		if (ret < 0)
+			goto err;
+	}
+
+	for (i = 0; i < sizeof(default_eps) / sizeof(default_eps[0]); i++) {
+		for (j = 0; j < DEFAULT_NUM_SWITCHES; j++)
+			ips[j] = default_eps[i].ip[j];
+
+		ret = topo_add_node(topo, false, default_eps[i].name, ips);
+		if (ret < 0)
+			goto err;
+	}
+
+	return 0;
+
+err:
+	topo_destroy(topo);
+	return ret;
+}
+
+/* Sets up the topology of handle, as per opts */
+static int comm_topo_init(comm_handle_t *handle)
+{
+	const char *path = handle->opts.topology_file;
+
+	if (handle->opts.topology != NULL)
+		return topo_copy(&handle->topo, handle->opts.topology);
+
+	if (path == NULL)
+		path = getenv(COMM_TOPOLOGY_ENV);
+
+	if (path != NULL && path[0] != '\0')
+		return topo_load(&handle->topo, path);
+
+	return topo_default(&handle->topo);
+}
+
 /* Detects if the current node is host/ep */
-static bool is_node_host(void)
+static bool is_node_host(comm_handle_t *handle)
 {
-	/* The hostname indicates whether the node is host or ep */
-	char name[MAX_NODE_NAME + 1];
+	/* The name in topology indicates whether the node is host or ep */
+	char name[MAX_NODE_NAME + 2];
+	const char *node_name = handle->opts.node_name;
 	char prefix[] = HOST_NAME_PREFIX;
-	int i, len;
+	bool is_host;
 
-	/* Not supporting too long names */
-	assert(gethostname(name, MAX_NODE_NAME + 1) == 0);
+	if (node_name == NULL)
+		node_name = getenv(COMM_NODE_NAME_ENV);
 
-	len = strlen(prefix);
+	if (node_name == NULL || node_name[0] == '\0') {
+		name[MAX_NODE_NAME + 1] = '\0';
+		assert(gethostname(name, MAX_NODE_NAME + 1) == 0);
+		node_name = name;
+	}
 
-	assert(len <= MAX_NODE_NAME);
+	handle->node_num = topo_find_name(&handle->topo, node_name, &is_host);
+	if (handle->node_num >= 0)
+		return is_host;
 
-	/* Check for prefix */
-	for (i = 0; i < len; i++) {
-		if (name[i] != prefix[i])
-			return false;
-	}
+	handle->node_num = -1;
 
-	return true;
+	/* Unknown to topology, the prefix tells */
+	return strncmp(node_name, prefix, strlen(prefix)) == 0;
 }
 
 
@@ -157,28 +244,6 @@ static int set_nonblock(int fd)
         return 0;
 }
 
-/* Get ip address in string format */
-static int get_ip_addr(struct sockaddr_storage *addr, char *dest_ip, int dest_len)
-{
-	struct sockaddr_in *s;
-
-	/* Check which family is it */
-	if (addr->ss_family != AF_INET) {
-		/* We are only using ipv4 currently */
-		genericLog(LOG_WARN, false, "Ip is ipv6, we support only ipv4");
-		return -EINVAL;
-	}
-
-	s = (struct sockaddr_in *)addr;
-	if (inet_ntop(AF_INET, &s->sin_addr,
-			dest_ip, dest_len) == NULL) {
-		genericLog(LOG_WARN, false, "Couldn't get ipaddr");
-		return -EINVAL; 
-	}
-
-	return 0;
-}
-
 /* Host error */
 static void host_err(host_data_t *host_data, int errType)
 {
@@ -193,6 +258,32 @@ static void host_err(host_data_t *host_data, int errType)
 	}	
 }
 
+/* Msgs from switch sw of host over multicast, as seen by ep */
+static inline ep_mcast_t *ep_mcast_of(comm_handle_t *handle, int host, int sw)
+{
+	return &handle->ep_mcast[host * handle->topo.num_switches + sw];
+}
+
+/* Frees up a connection set up by ep_conn_start() */
+static void ep_conn_free(ep_data_t *ep_data)
+{
+	comm_handle_t *handle = ep_data->ep_handle;
+	ep_mcast_t *mcast;
+
+	/* Multicast from the host goes unheard till it reconnects */
+	if (handle->ep_mcast != NULL) {
+		mcast = ep_mcast_of(handle, ep_data->host_num,
+					ep_data->host_sw);
+		if (mcast->conn == ep_data)
+			mcast->conn = NULL;
+	}
+
+	ep_data->transport->bev_free(ep_data->bev);
+	wheel_del(&ep_data->worker->wheel, &ep_data->ack_timer);
+	frame_parser_destroy(&ep_data->parser);
+	free(ep_data);
+}
+
 /* EP error */
 static void ep_err(ep_data_t *ep_data, int errType)
 {
@@ -207,17 +298,51 @@ static void ep_err(ep_data_t *ep_data, int errType)
 					errType);
 
 	/* Remove connection from the list */
-	list_remove(&ep_data->ep_handle->conn_list, ep_data);
-	bufferevent_free(ep_data->bev);
-	free(ep_data);
+	pthread_mutex_lock(&handle->lock);
+	list_remove(&handle->conn_list, ep_data);
+	pthread_mutex_unlock(&handle->lock);
+
+	__atomic_sub_fetch(&ep_data->worker->num_conns, 1, __ATOMIC_RELAXED);
+
+	ep_conn_free(ep_data);
 }
 
-/* Used by host to send msg to all the eps */
-int host_send_msg(comm_handle_t *handle, char *buf, size_t len)
+/*
+ * Wakes up the thread waiting on eventfd. Wakeups are coalesced - Only the
+ * first signal after the waiter called wakeup_clear() writes to the eventfd
+ */
+static void wakeup_signal(int fd, int *pending)
 {
-	/* Write to write end of pipe */
-	comm_data_t *data;
+	uint64_t val = 1;
+
+	if (__atomic_exchange_n(pending, 1, __ATOMIC_SEQ_CST))
+		return;
+
+	if (write(fd, &val, sizeof(val)) < 0)
+		genericLog(LOG_WARN, true, "Couldn't wake up event thread");
+}
+
+/* Called by the woken up thread before it looks for work */
+static void wakeup_clear(int fd, int *pending)
+{
+	uint64_t val;
+
+	/* Reset the eventfd, then allow signalling again */
+	if (read(fd, &val, sizeof(val)) < 0 && errno != EAGAIN)
+		genericLog(LOG_WARN, true, "Couldn't read wakeup event");
+
+	__atomic_store_n(pending, 0, __ATOMIC_SEQ_CST);
+}
+
+/* Wakes up the event thread */
+static void host_wakeup(comm_handle_t *handle)
+{
+	wakeup_signal(handle->wakeup_fd, &handle->wakeup_pending);
+}
 
+/* Checks if msg can be sent. Return negative code if not */
+static int host_check_msg(size_t len)
+{
 	if (len == 0) {
 		genericLog(LOG_WARN, false,
 				"Doesn't support sending empty packets");
@@ -229,846 +354,4930 @@ int host_send_msg(comm_handle_t *handle, char *buf, size_t len)
 		return -EINVAL;
 	}
 
-	/* Read data */
-	data = malloc(sizeof(comm_data_t));
-	if (data == NULL) {
-		genericLog(LOG_WARN, false, "Out of memory");
-		return -ENOMEM;
-	}
-
-	memcpy(data->buf, buf, len);
-	data->msg_len = len;
-	data->msg_type = MSG_DATA;
+	return 0;
+}
 
-	pthread_mutex_lock(&handle->lock);
+/* Monotonic time for measuring latency */
+static uint64_t comm_now_ns(void)
+{
+	struct timespec ts;
 
-	if (list_append(&handle->data_list, data) != true) {
-		free(data);
-		genericLog(LOG_WARN, false, "Couldn't add to list");
-		pthread_mutex_unlock(&handle->lock);
-		return -ENOMEM;
-	}
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t)ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
 
-	pthread_mutex_unlock(&handle->lock);
+/* Tickets are msg_nums, kept non negative so that they don't look like errors */
+static int host_ticket(int msg_num)
+{
+	return msg_num & INT_MAX;
+}
 
-	/* Write dummy char - Just a trigger */
-	bufferevent_write(handle->host_write, HOST_TRIGGER_VAL , 1);
+/* Is ticket older than the ticket upto? (Both wrap around) */
+static bool host_ticket_before(int ticket, int upto)
+{
+	unsigned int diff = ((unsigned int)upto - ticket) & INT_MAX;
 
-	return 0;
+	return diff != 0 && diff <= INT_MAX / 2;
 }
 
-/* Runs the event loop in seperate thread */
-static void *host_event_loop(void *arg)
+/* Frames with a full payload have to come out of the pool too */
+_Static_assert(sizeof(comm_frame_t) <= POOL_MAX_OBJ_SIZE,
+		"comm_frame_t outgrew the pool");
+
+/*
+ * Allocates a frame (from the pool) holding a copy of msg. hdr (if any) is
+ * put at the start of the payload
+ */
+static comm_frame_t *host_frame_new(comm_handle_t *handle, int msg_type,
+					const void *hdr, size_t hdr_len,
+					const char *buf, size_t len)
 {
-	comm_handle_t *handle = (comm_handle_t *)arg;
+	comm_frame_t *frame;
+	comm_data_t *data;
+	size_t alloc_len;
 
-	event_base_dispatch(handle->ev_base);
+	alloc_len = offsetof(comm_frame_t, data.buf) + hdr_len + len;
 
-	/* 
-	 * Termination - i.e. all connections terminated
-	 * (either voluntary or due to errors)
-	 * TODO: Retry connections? Then need to make sure this loop doesn't
-	 * exits when all connections temporarily disconnect
-	 */
+	frame = pool_alloc(&handle->frame_pool, alloc_len);
+	if (frame == NULL) {
+		genericLog(LOG_WARN, false, "Out of memory");
+		return NULL;
+	}
 
-	return NULL;
-}
+	frame->refcnt = 1;
+	frame->alloc_len = alloc_len;
+	frame->pool = &handle->frame_pool;
+	frame->queued_ns = comm_now_ns();
+	frame->lz = NULL;
+	frame->lz_tried = false;
+	frame->v1.hdr_len = 0;
+	frame->v1.has_crc = false;
+	data = &frame->data;
 
-/* Called when connection is to be closed after reading/writing out all pending data */
-static void host_end_connection(struct bufferevent *bev, void *arg)
-{
-	host_data_t *host_data = (host_data_t *)arg;
-	
-	bufferevent_free(bev);
+	if (hdr_len != 0)
+		memcpy(data->buf, hdr, hdr_len);
 
-	/* Voluntary termination - So no error */
+	memcpy(&data->buf[hdr_len], buf, len);
+	data->msg_len = hdr_len + len;
+	data->msg_type = msg_type;
 
-	(void)host_data;
-	/* host_err(host_data, HOST_CONNECT_TERMINATE); */
+	return frame;
 }
 
-static void host_end_connection_event(struct bufferevent *bev, short event, void *arg)
+/* Are queues past their high watermark holding producers back? */
+static bool host_is_backed_up(comm_handle_t *handle)
 {
-	(void)event;
-	host_end_connection(bev, arg);
+	return __atomic_load_n(&handle->submit_backed_up, __ATOMIC_ACQUIRE) ||
+		__atomic_load_n(&handle->num_backed_up, __ATOMIC_ACQUIRE) > 0;
 }
 
-/* Prepares incoming data from host to be sent to eps */
-static void host_incoming_data(struct bufferevent *bev, void *arg)
+/*
+ * Whether producers can queue msgs now, as per backpressure. Under
+ * BACKPRESSURE_BLOCK they wait till they can, except on host thread
+ */
+static bool host_admit(comm_handle_t *handle)
 {
-	comm_handle_t *handle = (comm_handle_t *)arg;
-	comm_data_t *data;
-	int i, j, ret, len;
-	char ch;
-
-	while (1) {
-
-		ret = bufferevent_read(bev, &ch, 1);
-		if (ret == 0)
-			return;
-
-		if (ch == HOST_TRIGGER_VAL[0]) {
+	bool ret;
 
-			pthread_mutex_lock(&handle->lock);
-			data = list_pop_head(&handle->data_list);
-			assert(data != NULL);
-			pthread_mutex_unlock(&handle->lock);
+	/* Host thread lets go once it has drained the queue to low watermark */
+	if (ring_count(&handle->submit_ring) >=
+			(unsigned long)handle->opts.host_submit_high_wm &&
+			!__atomic_exchange_n(&handle->submit_backed_up, true,
+						__ATOMIC_SEQ_CST))
+		host_wakeup(handle);
 
-			data->session = handle->session;
-			data->msg_num = handle->num_msg_sent;
+	if (!host_is_backed_up(handle))
+		return true;
 
-			for (i = 0; i < NUM_EPS; i++) {
-				for (j = 0; j < NUM_SWITCHES; j++) {
-		
-					host_data_t *host_data =
-						&handle->host_data[i][j];
-					
-					if (!host_data->is_connected)
-						continue;
-
-					/* 
-					 * XXX: Do we wish to keep the data lying
-					 * around when an ep temporarily is not
-					 * connected so that we can sent it later
-					 */
-					len = (uintptr_t)&data->buf[data->msg_len] -
-						(uintptr_t)data;
-
-					ret = bufferevent_write(host_data->bev_write,
-								(char *)data, len);
-
-					if (ret < 0) {
-						hostLog(host_data, LOG_WARN, false,  
-							"Sent corrupt data");
-					
-						host_connect_terminate_now(host_data);
-					}
-				}
-			}
+	if (handle->opts.host_backpressure != BACKPRESSURE_BLOCK ||
+			pthread_equal(pthread_self(), handle->host_event_thread))
+		return false;
 
-			free(data);
+	pthread_mutex_lock(&handle->lock);
 
-			handle->num_msg_sent++;
+	while (host_is_backed_up(handle) &&
+			!__atomic_load_n(&handle->is_closing, __ATOMIC_ACQUIRE))
+		pthread_cond_wait(&handle->backpressure_cond, &handle->lock);
 
-		} else if (ch == HOST_END_VAL[0]) {
+	ret = !__atomic_load_n(&handle->is_closing, __ATOMIC_ACQUIRE);
+	pthread_mutex_unlock(&handle->lock);
 
-			for (i = 0; i < NUM_EPS; i++) {
-				for (j = 0; j < NUM_SWITCHES; j++) {
-		
-					host_data_t *host_data = &handle->host_data[i][j];
-					
-					if (!host_data->is_connected)
-						continue;
+	return ret;
+}
 
-					host_connect_terminate_defer(host_data);
-				}
-			}
+/* Lets producers go on, as far as the queue is concerned */
+static void host_submit_drained(comm_handle_t *handle)
+{
+	if (!__atomic_load_n(&handle->submit_backed_up, __ATOMIC_ACQUIRE) ||
+			ring_count(&handle->submit_ring) >
+			(unsigned long)handle->opts.host_submit_low_wm)
+		return;
 
-		} else {
-			assert(0 && "Unknown message");
-		}
-	}	
+	pthread_mutex_lock(&handle->lock);
+	__atomic_store_n(&handle->submit_backed_up, false, __ATOMIC_RELEASE);
+	pthread_cond_broadcast(&handle->backpressure_cond);
+	pthread_mutex_unlock(&handle->lock);
 }
 
-/* Called periodically to check on heartbeats */
-static void host_check_heartbeat(evutil_socket_t fd, short what, void *arg)
+/*
+ * Queues frames to be sent out. Frames are given consecutive msg numbers.
+ * Returns the number of frames queued (from the start), rest are freed
+ */
+static int host_submit_frames(comm_handle_t *handle, comm_frame_t **frames,
+				int count)
 {
-	host_data_t *host_data = (host_data_t *)arg;
-	(void)what;
-	(void)fd;
+	unsigned long pos, num = 0;
+	int i;
 
-	if (host_data->heartbeats_recv == 0) {
-		host_connect_terminate_now(host_data);
-		hostLog(host_data, LOG_WARN, false,
-				"EP connection terminated as no heartbeats");
-		return;
+	/* Claim all slots at once so that msgs are numbered consecutively */
+	if (count > 0 && host_admit(handle))
+		num = ring_reserve(&handle->submit_ring, count, &pos);
+
+	for (i = 0; i < (int)num; i++) {
+		frames[i]->data.msg_num = pos + i;
+		ring_commit(&handle->submit_ring, pos + i, frames[i]);
 	}
 
-	host_data->heartbeats_recv = 0;
+	/* Event thread is falling behind */
+	for (i = num; i < count; i++)
+		host_frame_put(frames[i]);
+
+	/* Single wakeup for the whole batch */
+	if (num > 0)
+		host_wakeup(handle);
+
+	return num;
 }
 
-/* Called periodically to ask EP to send heartbeat */
-static void host_req_heartbeat(evutil_socket_t fd, short what, void *arg)
+/*
+ * Used by host to send a batch of msgs to all the eps
+ * Msgs get consecutive msg numbers and are sent out together. Returns the
+ * number of msgs (from the start of iov) accepted, negative code if none
+ */
+int host_send_msgv(comm_handle_t *handle, const struct iovec *iov, int iovcnt)
 {
-	host_data_t *host_data = (host_data_t *)arg;
-	comm_data_t resp_data;
-	size_t len;
-	(void)fd;
-	(void)what;
+	comm_frame_t *stack_frames[HOST_SEND_BATCH_STACK];
+	comm_frame_t **frames = stack_frames;
+	int ret, count, num;
 
-	resp_data.msg_type = MSG_HEARTBEAT_REQ;
-	resp_data.msg_len = 0;
+	if (iovcnt <= 0)
+		return -EINVAL;
 
-	len = offsetof(comm_data_t, buf); 
-	if (bufferevent_write(host_data->bev_write,
-				(char *)&resp_data, len) < 0) {
-		hostLog(host_data, LOG_WARN, false,
-					"Couldn't ask for heartbeat");
-		host_connect_terminate_now(host_data);
-	}	
-}
+	if (iovcnt > HOST_SEND_BATCH_STACK) {
+		frames = malloc(iovcnt * sizeof(comm_frame_t *));
+		if (frames == NULL) {
+			genericLog(LOG_WARN, false, "Out of memory");
+			return -ENOMEM;
+		}
+	}
 
-/* Called when host gets heartbeats */
-static void host_got_heartbeat(struct bufferevent *bev, void *arg)
-{
-	host_data_t *host_data = (host_data_t *)arg;
-	ssize_t len, req_len;
-	comm_data_t data;
+	/* Accept msgs upto the first bad one */
+	for (count = 0; count < iovcnt; count++) {
 
-	req_len = offsetof(comm_data_t, buf);
-	len = bufferevent_read(bev, (char *)&data, 
-				req_len);
+		ret = host_check_msg(iov[count].iov_len);
+		if (ret < 0)
+			break;
 
-	if (len == 0)
-		return;
+		frames[count] = host_frame_new(handle, MSG_DATA, NULL, 0,
+						iov[count].iov_base,
+						iov[count].iov_len);
+		if (frames[count] == NULL) {
+			ret = -ENOMEM;
+			break;
+		}
+	}
 
-	if (req_len != len)
-		goto err;
+	num = host_submit_frames(handle, frames, count);
+	if (num == 0 && count > 0)
+		ret = -EAGAIN;
 
-	if (data.msg_type != MSG_HEARTBEAT_RESP)
-		goto err;
+	if (frames != stack_frames)
+		free(frames);
 
-	host_data->heartbeats_recv++;
+	if (num == 0)
+		return ret;
 
-	return;
-err:
-	genericLog(LOG_WARN, false, "Invalid packet data");
-	return;
+	return num;
 }
 
-
-/* Function used by list package to free up data when deleting list */
-static void data_free_fn(void *arg)
+/* Starts a stream of total_len bytes, to be sent with host_stream_write() */
+int host_stream_open(comm_handle_t *handle, comm_stream_t *stream,
+			uint64_t total_len)
 {
-	comm_data_t *data = (comm_data_t *)arg;
-	free(data);
+	if (total_len == 0) {
+		genericLog(LOG_WARN, false,
+				"Doesn't support sending empty streams");
+		return -EINVAL;
+	}
+
+	stream->handle = handle;
+	stream->stream_id = __atomic_fetch_add(&handle->next_stream_id, 1,
+						__ATOMIC_RELAXED);
+	stream->offset = 0;
+	stream->total_len = total_len;
+
+	return 0;
 }
 
 /*
- * This function is called on any error while host is writing to ep
+ * Sends out next part of the stream, split into chunks of MAX_STREAM_CHUNK
+ * Returns the bytes accepted, which can be less than len if too many msgs
+ * are already queued (-EAGAIN if none). Caller retries with the rest.
+ * Only a bounded number of chunks are ever queued, whatever the stream size
  */
-static void host_event(struct bufferevent *bev, short event, void *arg)
+ssize_t host_stream_write(comm_stream_t *stream, const char *buf, size_t len)
 {
-	host_data_t *host_data = (host_data_t *)arg;
+	comm_frame_t *frames[HOST_SEND_BATCH_STACK];
+	comm_stream_hdr_t hdr;
+	size_t chunk_len, done, queued;
+	int count, num;
 
-	(void)bev;
+	if (len == 0 || len > stream->total_len - stream->offset) {
+		genericLog(LOG_WARN, false, "Stream write beyond its length");
+		return -EINVAL;
+	}
 
-    	if (event & BEV_EVENT_EOF) {
-		/* EP disconnected */
-		host_connect_terminate_now(host_data);
-		hostLog(host_data, LOG_WARN, false,
-				"EP connection terminated");
+	/* Little endian on the wire, like the v1 header */
+	hdr.stream_id = htole32(stream->stream_id);
+	hdr.reserved = 0;
+	hdr.total_len = htole64(stream->total_len);
 
-	} else if (event & BEV_EVENT_ERROR || event & BEV_EVENT_WRITING) {
-		/* Some other error occurred */
-		host_connect_terminate_now(host_data);
-		hostLog(host_data, LOG_WARN, false,
-				"Socket failure, disconnecting ep");
-	} else {
-		host_connect_terminate_now(host_data);
-		hostLog(host_data, LOG_WARN, false,
-				"Unknown error on socket, disconnecting ep");
-	}
+	done = 0;
+	while (done < len) {
 
-	return;
-}
+		/* Build a batch of chunks */
+		queued = done;
+		for (count = 0; count < HOST_SEND_BATCH_STACK && queued < len;
+				count++) {
 
-/* 
- * Called when connection is to be terminated after sending pending data 
- * This is voluntary closing of connection
- */
-static void host_connect_terminate_defer(host_data_t *host_data)
-{
-	comm_handle_t *handle = host_data->handle;
-	struct evbuffer *output = bufferevent_get_output(host_data->bev_write);
-	size_t len = evbuffer_get_length(output);
+			chunk_len = len - queued;
+			if (chunk_len > MAX_STREAM_CHUNK)
+				chunk_len = MAX_STREAM_CHUNK;
 
-	host_data->is_connected = false;
+			hdr.offset = htole64(stream->offset + queued);
 
-	if (len == 0) {
-		bufferevent_free(host_data->bev_write);
-	} else {
-		bufferevent_setcb(host_data->bev_write,
-					host_end_connection,
-					host_end_connection,
-					host_end_connection_event,
-					host_data);
-	}
+			frames[count] = host_frame_new(stream->handle, MSG_STREAM,
+							&hdr, sizeof(hdr),
+							&buf[queued], chunk_len);
+			if (frames[count] == NULL)
+				break;
 
-	pthread_mutex_lock(&handle->lock);
-	handle->num_succ_conns--;
-	pthread_mutex_unlock(&handle->lock);
-}
+			queued += chunk_len;
+		}
 
-/* Called when connection to host terminated quickly */
-static void host_connect_terminate_now(host_data_t *host_data)
-{
-	comm_handle_t *handle = host_data->handle;
+		num = host_submit_frames(stream->handle, frames, count);
 
-	host_data->is_connected = false;
+		/* Count only the chunks actually queued, all but last are full */
+		done += (size_t)num * MAX_STREAM_CHUNK;
+		if (done > len)
+			done = len;
 
-	bufferevent_free(host_data->bev_write);
+		if (num < count || count == 0)
+			break;
+	}
 
-	event_del(host_data->heartbeat_check_timer);
-	event_del(host_data->heartbeat_req_timer);
+	if (done == 0)
+		return -EAGAIN;
 
-	pthread_mutex_lock(&handle->lock);
-	handle->num_succ_conns--;
-	pthread_mutex_unlock(&handle->lock);
+	stream->offset += done;
 
-	host_err(host_data, HOST_CONNECT_TERMINATE);
+	return done;
 }
 
-
-/* Call this after connection estabished by host with ep */
-static void host_connected(int sockfd, host_data_t *host_data)
+/* Gives statistics about memory used for msgs */
+void host_get_pool_stats(comm_handle_t *handle, pool_stats_t *stats)
 {
-	struct timeval heartbeat_check_time = { 0, HOST_HEARTBEAT_DURATION_US };
-	struct timeval heartbeat_req_time = { 0, EP_HEARTBEAT_DURATION_US };
+	pool_get_stats(&handle->frame_pool, stats);
+}
+
+/* Gives syscalls made by host to send frames. Still works after comm_deinit() */
+void host_get_engine_stats(comm_handle_t *handle, comm_engine_stats_t *stats)
+{
+	comm_engine_stats_t *from = &handle->engine_stats;
+
+	stats->engine = handle->engine;
+	stats->writes = __atomic_load_n(&from->writes, __ATOMIC_RELAXED);
+	stats->submits = __atomic_load_n(&from->submits, __ATOMIC_RELAXED);
+	stats->sends = __atomic_load_n(&from->sends, __ATOMIC_RELAXED);
+	stats->zc_sends = __atomic_load_n(&from->zc_sends, __ATOMIC_RELAXED);
+	stats->zc_copied = __atomic_load_n(&from->zc_copied, __ATOMIC_RELAXED);
+	stats->bufs_registered = __atomic_load_n(&from->bufs_registered,
+							__ATOMIC_RELAXED);
+	stats->msgs = __atomic_load_n(&from->msgs, __ATOMIC_RELAXED);
+	stats->msgs_deferred = __atomic_load_n(&from->msgs_deferred,
+						__ATOMIC_RELAXED);
+}
+
+/* Changes how msgs queued from now on are spread over the switches */
+int host_set_path_policy(comm_handle_t *handle, comm_path_policy_t policy)
+{
+	if (!handle->is_host || policy < 0 || policy >= PATH_NUM_POLICIES)
+		return -EINVAL;
+
+	__atomic_store_n(&handle->path_policy, policy, __ATOMIC_RELAXED);
+	return 0;
+}
+
+comm_path_policy_t host_get_path_policy(comm_handle_t *handle)
+{
+	return __atomic_load_n(&handle->path_policy, __ATOMIC_RELAXED);
+}
+
+/* Changes how frames queued from now on are flushed out */
+int host_set_send_mode(comm_handle_t *handle, comm_send_mode_t mode)
+{
+	if (!handle->is_host || mode < 0 || mode >= SEND_NUM_MODES)
+		return -EINVAL;
+
+	__atomic_store_n(&handle->send_mode, mode, __ATOMIC_RELAXED);
+	return 0;
+}
+
+comm_send_mode_t host_get_send_mode(comm_handle_t *handle)
+{
+	return __atomic_load_n(&handle->send_mode, __ATOMIC_RELAXED);
+}
+
+/*
+ * Gives flushes of data frames on the connection to ep over switch sw.
+ * Gone with the connections after comm_deinit()
+ */
+int host_get_conn_stats(comm_handle_t *handle, int ep, int sw,
+			comm_conn_stats_t *stats)
+{
+	host_data_t *host_data;
+
+	if (!handle->is_host || handle->host_data == NULL ||
+			ep < 0 || ep >= handle->topo.num_eps ||
+			sw < 0 || sw >= handle->topo.num_switches)
+		return -EINVAL;
+
+	host_data = host_data_of(handle, ep, sw);
+
+	stats->is_coalescing = __atomic_load_n(&host_data->is_coalescing,
+						__ATOMIC_RELAXED);
+	stats->batches = __atomic_load_n(&host_data->batches, __ATOMIC_RELAXED);
+	stats->batch_msgs = __atomic_load_n(&host_data->batch_msgs,
+						__ATOMIC_RELAXED);
+	stats->batch_bytes = __atomic_load_n(&host_data->batch_bytes,
+						__ATOMIC_RELAXED);
+	stats->max_batch = __atomic_load_n(&host_data->max_batch,
+						__ATOMIC_RELAXED);
+	stats->delay_ns = __atomic_load_n(&host_data->delay_ns,
+						__ATOMIC_RELAXED);
+	stats->max_delay_ns = __atomic_load_n(&host_data->max_delay_ns,
+						__ATOMIC_RELAXED);
+	stats->mode_switches = __atomic_load_n(&host_data->mode_switches,
+						__ATOMIC_RELAXED);
+	stats->queued = __atomic_load_n(&host_data->queue_len, __ATOMIC_RELAXED);
+	stats->is_backed_up = __atomic_load_n(&host_data->is_backed_up,
+						__ATOMIC_RELAXED);
+	stats->backlog_msgs = __atomic_load_n(&host_data->backlog_count,
+						__ATOMIC_RELAXED);
+	stats->times_backed_up = __atomic_load_n(&host_data->times_backed_up,
+						__ATOMIC_RELAXED);
+	stats->msgs_dropped = __atomic_load_n(&host_data->msgs_dropped,
+						__ATOMIC_RELAXED);
+	stats->disconnects = __atomic_load_n(&host_data->disconnects,
+						__ATOMIC_RELAXED);
+	return 0;
+}
+
+/*
+ * Gives the bytes queued on the connection to ep over switch sw, msgs held
+ * back for it included. Negative code if there's no such connection
+ */
+ssize_t host_get_queue_depth(comm_handle_t *handle, int ep, int sw)
+{
+	if (!handle->is_host || handle->host_data == NULL ||
+			ep < 0 || ep >= handle->topo.num_eps ||
+			sw < 0 || sw >= handle->topo.num_switches)
+		return -EINVAL;
+
+	return __atomic_load_n(&host_data_of(handle, ep, sw)->queue_len,
+				__ATOMIC_RELAXED);
+}
+
+/* Gives the msgs in the submission queue, not yet taken by host thread */
+int host_get_submit_depth(comm_handle_t *handle)
+{
+	if (!handle->is_host || handle->host_data == NULL)
+		return -EINVAL;
+
+	return ring_count(&handle->submit_ring);
+}
+
+/* Sums up traffic sent over switch sw */
+static void host_sum_switch_stats(comm_handle_t *handle, int sw,
+					comm_switch_stats_t *stats)
+{
+	host_data_t *host_data;
+	int i;
+
+	memset(stats, 0, sizeof(*stats));
+
+	for (i = 0; i < handle->topo.num_eps; i++) {
+		host_data = host_data_of(handle, i, sw);
+
+		stats->msgs_sent += __atomic_load_n(&host_data->msgs_sent,
+							__ATOMIC_RELAXED);
+		stats->bytes_sent += __atomic_load_n(&host_data->bytes_sent,
+							__ATOMIC_RELAXED);
+		stats->promotions += __atomic_load_n(&host_data->promotions,
+							__ATOMIC_RELAXED);
+		stats->reconnects += __atomic_load_n(&host_data->reconnects,
+							__ATOMIC_RELAXED);
+		stats->msgs_replayed += __atomic_load_n(
+						&host_data->msgs_replayed,
+						__ATOMIC_RELAXED);
+		stats->heartbeats_sent += __atomic_load_n(
+						&host_data->heartbeats_sent,
+						__ATOMIC_RELAXED);
+		stats->heartbeats_suppressed += __atomic_load_n(
+					&host_data->heartbeats_suppressed,
+					__ATOMIC_RELAXED);
+		stats->heartbeat_bytes_saved += __atomic_load_n(
+					&host_data->heartbeat_bytes_saved,
+					__ATOMIC_RELAXED);
+		stats->crc_errors += __atomic_load_n(&host_data->crc_errors,
+							__ATOMIC_RELAXED);
+		stats->nacks += __atomic_load_n(&host_data->nacks,
+							__ATOMIC_RELAXED);
+		stats->msgs_resent += __atomic_load_n(&host_data->msgs_resent,
+							__ATOMIC_RELAXED);
+	}
+
+	stats->mcast_msgs_sent = __atomic_load_n(&handle->host_mcast[sw].msgs_sent,
+							__ATOMIC_RELAXED);
+	stats->mcast_bytes_sent = __atomic_load_n(
+					&handle->host_mcast[sw].bytes_sent,
+					__ATOMIC_RELAXED);
+}
+
+/*
+ * Gives traffic sent by host over switch sw, summed over all the eps.
+ * Still works after comm_deinit()
+ */
+int host_get_switch_stats(comm_handle_t *handle, int sw,
+				comm_switch_stats_t *stats)
+{
+	if (!handle->is_host || sw < 0 || sw >= handle->topo.num_switches)
+		return -EINVAL;
+
+	if (handle->host_data == NULL)
+		*stats = handle->closed_stats[sw];
+	else
+		host_sum_switch_stats(handle, sw, stats);
+
+	return 0;
+}
+
+/*
+ * Used by host to send msg to all the eps. Returns a ticket for the msg
+ * (see host_is_acked()) or negative code on error
+ */
+int host_send_msg(comm_handle_t *handle, char *buf, size_t len)
+{
+	comm_frame_t *frame;
+	int ret;
+
+	ret = host_check_msg(len);
+	if (ret < 0)
+		return ret;
+
+	frame = host_frame_new(handle, MSG_DATA, NULL, 0, buf, len);
+	if (frame == NULL)
+		return -ENOMEM;
+
+	/* msg_num is given out on submission */
+	__atomic_add_fetch(&frame->refcnt, 1, __ATOMIC_RELAXED);
+
+	if (host_submit_frames(handle, &frame, 1) == 0) {
+		host_frame_put(frame);
+		return -EAGAIN;
+	}
+
+	ret = host_ticket(frame->data.msg_num);
+	host_frame_put(frame);
+
+	return ret;
+}
+
+/*
+ * Gives the ticket of the oldest msg ep_num hasn't acknowledged yet. All
+ * the msgs before it have reached ep_num
+ */
+int host_get_acked(comm_handle_t *handle, int ep_num)
+{
+	if (!handle->is_host || ep_num < 0 || ep_num >= handle->topo.num_eps)
+		return -EINVAL;
+
+	return host_ticket(__atomic_load_n(&handle->host_eps[ep_num].acked,
+						__ATOMIC_ACQUIRE));
+}
+
+/* Has the msg with ticket reached ep_num? */
+bool host_is_acked(comm_handle_t *handle, int ep_num, int ticket)
+{
+	int acked = host_get_acked(handle, ep_num);
+
+	return acked >= 0 && host_ticket_before(ticket, acked);
+}
+
+/* Gives the number of eps the msg with ticket has reached */
+int host_get_reach(comm_handle_t *handle, int ticket)
+{
+	int i, num = 0;
+
+	for (i = 0; i < handle->topo.num_eps; i++)
+		if (host_is_acked(handle, i, ticket))
+			num++;
+
+	return num;
+}
+
+/* Runs the event loop in seperate thread */
+static void *host_event_loop(void *arg)
+{
+	comm_handle_t *handle = (comm_handle_t *)arg;
+
+	event_base_dispatch(handle->ev_base);
+
+	/*
+	 * Termination - i.e. comm_deinit() closed all connections. Lost
+	 * connections keep being retried till then, so the loop doesn't
+	 * exit when all of them temporarily disconnect
+	 */
+
+	return NULL;
+}
+
+/* Called when connection is to be closed after reading/writing out all pending data */
+static void host_end_connection(struct bufferevent *bev, void *arg)
+{
+	host_data_t *host_data = (host_data_t *)arg;
+	
+	host_data->transport->bev_free(bev);
+	host_uring_reset(host_data);
+	host_coalesce_reset(host_data);
+
+	/* Voluntary termination - So no error */
+
+	(void)host_data;
+	/* host_err(host_data, HOST_CONNECT_TERMINATE); */
+}
+
+static void host_end_connection_event(struct bufferevent *bev, short event, void *arg)
+{
+	(void)event;
+	host_end_connection(bev, arg);
+}
+
+/* Drops a reference to the frame. Last one frees it */
+static void host_frame_put(comm_frame_t *frame)
+{
+	if (__atomic_sub_fetch(&frame->refcnt, 1, __ATOMIC_ACQ_REL) != 0)
+		return;
+
+	if (frame->lz != NULL)
+		pool_free(frame->pool, frame->lz, frame->lz->alloc_len);
+
+	pool_free(frame->pool, frame, frame->alloc_len);
+}
+
+/* Called by libevent once a connection is done with the referenced frame */
+static void host_frame_cleanup(const void *data, size_t len, void *arg)
+{
+	(void)data;
+	(void)len;
+	host_frame_put((comm_frame_t *)arg);
+}
+
+/*
+ * Compressed payload of the frame, made the first time a connection asks
+ * for it and kept along with the frame for the rest. NULL if the payload
+ * is too short or doesn't shrink
+ */
+static comm_frame_lz_t *host_frame_lz(comm_handle_t *handle,
+					comm_frame_t *frame)
+{
+	comm_lz_stats_t *stats = &handle->lz_stats;
+	comm_data_t *data = &frame->data;
+	comm_frame_lz_t *lz;
+	size_t alloc_len;
+	uint64_t start;
+	int len;
+
+	if (frame->lz_tried)
+		return frame->lz;
+
+	frame->lz_tried = true;
+
+	if (data->msg_len < handle->opts.compress_min_len)
+		return NULL;
+
+	/* Has to come out shorter than the payload */
+	alloc_len = offsetof(comm_frame_lz_t, buf) + data->msg_len - 1;
+
+	lz = pool_alloc(frame->pool, alloc_len);
+	if (lz == NULL)
+		return NULL;
+
+	start = comm_now_ns();
+	len = lz_compress(data->buf, data->msg_len, lz->buf, data->msg_len - 1);
+	__atomic_add_fetch(&stats->ns, comm_now_ns() - start, __ATOMIC_RELAXED);
+
+	if (len <= 0) {
+		pool_free(frame->pool, lz, alloc_len);
+		__atomic_add_fetch(&stats->skipped, 1, __ATOMIC_RELAXED);
+		return NULL;
+	}
+
+	lz->alloc_len = alloc_len;
+	lz->len = len;
+	lz->v1.hdr_len = 0;
+	lz->v1.has_crc = false;
+	frame->lz = lz;
+
+	__atomic_add_fetch(&stats->msgs, 1, __ATOMIC_RELAXED);
+	__atomic_add_fetch(&stats->raw_bytes, data->msg_len, __ATOMIC_RELAXED);
+	__atomic_add_fetch(&stats->lz_bytes, len, __ATOMIC_RELAXED);
+
+	return lz;
+}
+
+/* Builds the v1 header of a payload of frame, the first time it is needed */
+static void host_frame_hdr_v1(comm_handle_t *handle, comm_frame_v1_t *v1,
+				comm_data_t *data, int msg_type, int len)
+{
+	if (v1->hdr_len == 0)
+		v1->hdr_len = frame_encode_hdr(FRAME_WIRE_V1, v1->hdr, msg_type,
+						len, data->msg_num,
+						data->session, handle->session);
+}
+
+/* Marks completions of zero copy sends */
+#define HOST_URING_ZC_TAG	1UL
+
+/*
+ * Counts syscalls libevent makes to write out the connection, and keeps
+ * bytes queued on it up to date for other threads
+ */
+static void host_output_cb(struct evbuffer *buf,
+				const struct evbuffer_cb_info *info, void *arg)
+{
+	host_data_t *host_data = (host_data_t *)arg;
+	comm_engine_stats_t *stats = &host_data->handle->engine_stats;
+
+	if (info->n_deleted != 0)
+		__atomic_store_n(&stats->writes, stats->writes + 1,
+					__ATOMIC_RELAXED);
+
+	__atomic_store_n(&host_data->queue_len, evbuffer_get_length(buf) +
+				evbuffer_get_length(host_data->coalesce) +
+				host_data->uring_len + host_data->backlog_len,
+				__ATOMIC_RELAXED);
+}
+
+/* Bytes waiting to go out on the connection */
+static size_t host_pending_len(host_data_t *host_data)
+{
+	return evbuffer_get_length(bufferevent_get_output(host_data->bev_write)) +
+		evbuffer_get_length(host_data->coalesce) + host_data->uring_len;
+}
+
+/* Data frame of len bytes queued on the connection at now */
+static void host_batch_add(host_data_t *host_data, uint64_t now, size_t len)
+{
+	if (host_data->batch_pending++ == 0)
+		host_data->batch_first_ns = now;
+	else
+		host_data->batch_wait_ns += now - host_data->batch_first_ns;
+
+	host_data->batch_pending_len += len;
+}
+
+/* Data frames queued on the connection are on their way out */
+static void host_batch_done(host_data_t *host_data)
+{
+	unsigned long num = host_data->batch_pending;
+	uint64_t oldest;
+
+	if (num == 0)
+		return;
+
+	/* The rest waited as long, less the time they came after the oldest */
+	oldest = comm_now_ns() - host_data->batch_first_ns;
+
+	__atomic_store_n(&host_data->batches, host_data->batches + 1,
+				__ATOMIC_RELAXED);
+	__atomic_store_n(&host_data->batch_msgs, host_data->batch_msgs + num,
+				__ATOMIC_RELAXED);
+	__atomic_store_n(&host_data->batch_bytes,
+				host_data->batch_bytes + host_data->batch_pending_len,
+				__ATOMIC_RELAXED);
+	__atomic_store_n(&host_data->delay_ns, host_data->delay_ns +
+				oldest * num - host_data->batch_wait_ns,
+				__ATOMIC_RELAXED);
+
+	if (num > host_data->max_batch)
+		__atomic_store_n(&host_data->max_batch, num, __ATOMIC_RELAXED);
+	if (oldest > host_data->max_delay_ns)
+		__atomic_store_n(&host_data->max_delay_ns, oldest,
+					__ATOMIC_RELAXED);
+
+	host_data->batch_pending = 0;
+	host_data->batch_pending_len = 0;
+	host_data->batch_wait_ns = 0;
+}
+
+/*
+ * Decides whether the data frame queued now on the connection is to be
+ * coalesced with the ones after it. SEND_ADAPTIVE goes by the gap between
+ * frames, averaged (the latest weighing 1/8th)
+ */
+static void host_send_adapt(host_data_t *host_data, uint64_t now)
+{
+	comm_handle_t *handle = host_data->handle;
+	uint64_t gap = now - host_data->send_last_ns;
+	uint64_t avg = host_data->send_gap_ns;
+	bool is_coalescing;
+
+	/* Idle spells count as no more than a deadline */
+	if (gap > handle->flush_ns)
+		gap = handle->flush_ns;
+
+	avg = avg - avg / 8 + gap / 8;
+	host_data->send_gap_ns = avg;
+	host_data->send_last_ns = now;
+
+	switch (__atomic_load_n(&handle->send_mode, __ATOMIC_RELAXED)) {
+	case SEND_LATENCY:
+		is_coalescing = false;
+		break;
+
+	case SEND_THROUGHPUT:
+		is_coalescing = true;
+		break;
+
+	case SEND_ADAPTIVE:
+	default:
+		if (host_data->is_coalescing)
+			is_coalescing = 2 * handle->flush_ns >=
+					avg * HOST_COALESCE_MIN_BATCH;
+		else
+			is_coalescing = handle->flush_ns >=
+					avg * HOST_COALESCE_MIN_BATCH;
+		break;
+	}
+
+	if (is_coalescing != host_data->is_coalescing)
+		__atomic_store_n(&host_data->mode_switches,
+					host_data->mode_switches + 1,
+					__ATOMIC_RELAXED);
+
+	__atomic_store_n(&host_data->is_coalescing, is_coalescing,
+				__ATOMIC_RELAXED);
+}
+
+/* Hands frames coalesced on the connection over to the bufferevent */
+static void host_coalesce_flush(host_data_t *host_data)
+{
+	struct evbuffer *output = bufferevent_get_output(host_data->bev_write);
+
+	if (evbuffer_get_length(host_data->coalesce) == 0)
+		return;
+
+	evtimer_del(host_data->ev_coalesce);
+
+	/* Moves the chains over, references to frames as well */
+	evbuffer_add_buffer(output, host_data->coalesce);
+	host_batch_done(host_data);
+}
+
+/* Deadline of frames coalesced on the connection */
+static void host_coalesce_timeout(evutil_socket_t fd, short what, void *arg)
+{
+	(void)fd;
+	(void)what;
+
+	host_coalesce_flush((host_data_t *)arg);
+}
+
+/* Drops frames coalesced on a connection going away */
+static void host_coalesce_reset(host_data_t *host_data)
+{
+	if (host_data->ev_coalesce != NULL)
+		evtimer_del(host_data->ev_coalesce);
+	if (host_data->coalesce != NULL)
+		evbuffer_drain(host_data->coalesce,
+				evbuffer_get_length(host_data->coalesce));
+
+	host_data->batch_pending = 0;
+	host_data->batch_pending_len = 0;
+	host_data->batch_wait_ns = 0;
+}
+
+/*
+ * Writes out frames held back on the connection right away, instead of
+ * once the loop gets to it. What the socket doesn't take is left to
+ * libevent, as is everything if libevent has something to send before
+ * (or if there's no socket, as with shared memory)
+ */
+static void host_flush_now(host_data_t *host_data)
+{
+	struct evbuffer *output = bufferevent_get_output(host_data->bev_write);
+	evutil_socket_t fd = bufferevent_getfd(host_data->bev_write);
+	comm_engine_stats_t *stats = &host_data->handle->engine_stats;
+
+	/* Output of bufferevent only drains through it, hence the detour */
+	if (fd >= 0 && evbuffer_get_length(output) == 0) {
+		evbuffer_write(host_data->coalesce, fd);
+		__atomic_store_n(&stats->writes, stats->writes + 1,
+					__ATOMIC_RELAXED);
+	}
+
+	host_coalesce_flush(host_data);
+	host_batch_done(host_data);
+}
+
+/*
+ * Fixed buffer (pool slab) holding ptr, registered the first time it is
+ * needed. Slabs live as long as the pool, so they stay registered. -1 if
+ * there is no room left (or the kernel won't pin any more memory)
+ */
+static int host_uring_buf(comm_handle_t *handle, const void *ptr)
+{
+	host_uring_t *uring = &handle->uring;
+	comm_engine_stats_t *stats = &handle->engine_stats;
+	void *slab = pool_slab_of(ptr);
+	unsigned int i, index;
+	int ret;
+
+	if (!uring->has_fixed)
+		return -1;
+
+	index = ((uintptr_t)slab / POOL_SLAB_SIZE) % HOST_URING_MAX_BUFS;
+
+	for (i = 0; i < HOST_URING_MAX_BUFS; i++) {
+
+		if (uring->bufs[index] == slab)
+			return index;
+
+		if (uring->bufs[index] == NULL)
+			break;
+
+		index = (index + 1) % HOST_URING_MAX_BUFS;
+	}
+
+	if (i == HOST_URING_MAX_BUFS)
+		return -1;
+
+	ret = uring_register_buf(&uring->ring, index, slab, POOL_SLAB_SIZE);
+	if (ret < 0) {
+		genericLog(LOG_WARN, false,
+			"Couldn't register frame pool with io_uring (%s), "
+			"sending without fixed buffers", strerror(-ret));
+		uring->has_fixed = false;
+		return -1;
+	}
+
+	uring->bufs[index] = slab;
+	__atomic_store_n(&stats->bufs_registered, stats->bufs_registered + 1,
+				__ATOMIC_RELAXED);
+	return index;
+}
+
+static host_uring_chain_t *host_uring_chain_new(comm_handle_t *handle,
+						host_data_t *host_data)
+{
+	host_uring_t *uring = &handle->uring;
+	host_uring_chain_t *chain = uring->free_chains;
+
+	if (chain != NULL)
+		uring->free_chains = chain->next;
+	else if ((chain = malloc(sizeof(*chain))) == NULL)
+		return NULL;
+
+	chain->next = NULL;
+	chain->host_data = host_data;
+	chain->gen = host_data->uring_gen;
+	chain->num_frames = 0;
+	chain->num_iov = 0;
+	chain->num_segs = 0;
+	chain->copy_len = 0;
+	chain->cqes_left = 0;
+	chain->err = 0;
+	chain->len = 0;
+	chain->sent = 0;
+
+	return chain;
+}
+
+/* Drops the references of the chain, keeping it around for reuse */
+static void host_uring_chain_free(comm_handle_t *handle,
+					host_uring_chain_t *chain)
+{
+	int i;
+
+	for (i = 0; i < chain->num_frames; i++)
+		host_frame_put(chain->frames[i]);
+
+	chain->next = handle->uring.free_chains;
+	handle->uring.free_chains = chain;
+}
+
+/* Adds len bytes at base to the chain, zero copy out of buf_index or not */
+static void host_uring_chain_add(host_uring_chain_t *chain, const void *base,
+					size_t len, bool is_zc, int buf_index)
+{
+	struct iovec *iov = &chain->iov[chain->num_iov++];
+	host_uring_seg_t *seg = NULL;
+
+	iov->iov_base = (void *)base;
+	iov->iov_len = len;
+	chain->len += len;
+
+	if (chain->num_segs != 0)
+		seg = &chain->segs[chain->num_segs - 1];
+
+	/* Copied pieces go together, as a single sendmsg */
+	if (is_zc || seg == NULL || seg->is_zc) {
+		seg = &chain->segs[chain->num_segs++];
+		memset(&seg->msg, 0, sizeof(seg->msg));
+		seg->msg.msg_iov = iov;
+		seg->is_zc = is_zc;
+		seg->buf_index = buf_index;
+
+		/* Zero copy sends are followed by a notification */
+		chain->cqes_left += is_zc ? 2 : 1;
+		chain->host_data->handle->uring.cqes_out += is_zc ? 2 : 1;
+	}
+
+	seg->msg.msg_iovlen++;
+}
+
+/*
+ * Stops libevent from writing out the connection while io_uring has
+ * frames of it, anything written to the bufferevent meanwhile comes after
+ */
+static void host_uring_hold(host_data_t *host_data)
+{
+	if (host_data->uring_holds_write)
+		return;
+
+	bufferevent_disable(host_data->bev_write, EV_WRITE);
+	host_data->uring_holds_write = true;
+}
+
+/*
+ * Has the chains of the connection submitted once the loop gets to it. A
+ * coalescing connection gives the rest upto the flush deadline to join in
+ */
+static void host_uring_mark(host_data_t *host_data)
+{
+	comm_handle_t *handle = host_data->handle;
+	host_uring_t *uring = &handle->uring;
+
+	/* Still there from a flush which had no room for it */
+	if (!host_data->uring_dirty) {
+		uring->dirty[uring->num_dirty++] = host_data;
+		host_data->uring_dirty = true;
+	}
+
+	if (!host_data->is_coalescing)
+		event_active(uring->ev_flush, 0, 0);
+	else if (!event_pending(uring->ev_flush, EV_TIMEOUT, NULL))
+		event_add(uring->ev_flush, &handle->flush_tv);
+}
+
+/* Forgets about frames queued on a connection going away */
+static void host_uring_reset(host_data_t *host_data)
+{
+	host_uring_chain_t *chain;
+
+	while ((chain = host_data->uring_chain) != NULL) {
+		host_data->uring_chain = chain->next;
+		host_data->handle->uring.cqes_out -= chain->cqes_left;
+		host_uring_chain_free(host_data->handle, chain);
+	}
+
+	/* Chains still out are ignored as they complete */
+	host_data->uring_last = NULL;
+	host_data->uring_segs = 0;
+	host_data->uring_gen++;
+	host_data->uring_fd = -1;
+	host_data->uring_busy = 0;
+	host_data->uring_holds_write = false;
+	host_data->uring_closing = false;
+	host_data->uring_len = 0;
+}
+
+/*
+ * Chain the next frame of the connection goes on, copy_len bytes of it
+ * to be copied in. NULL if the connection can't take it now, the frame
+ * then goes to libevent
+ */
+static host_uring_chain_t *host_uring_chain_of(host_data_t *host_data,
+						size_t copy_len)
+{
+	comm_handle_t *handle = host_data->handle;
+	comm_engine_stats_t *stats = &handle->engine_stats;
+	host_uring_t *uring = &handle->uring;
+	host_uring_chain_t *chain = host_data->uring_last;
+	struct evbuffer *output;
+
+	if (host_data->uring_fd < 0)
+		return NULL;
+
+	output = bufferevent_get_output(host_data->bev_write);
+
+	/*
+	 * Frames go out in order, after whatever libevent has. All the
+	 * chains of a connection have to fit a single submit, and all the
+	 * completions to come have to fit the CQ ring (a frame can take upto
+	 * 3 sends, one zero copy)
+	 */
+	if (evbuffer_get_length(output) != 0 ||
+			host_data->uring_segs + 3 > HOST_URING_ENTRIES ||
+			uring->cqes_out + 4 > (int)uring->ring.cq_entries)
+		goto defer;
+
+	if (chain != NULL && chain->num_frames < HOST_URING_CHAIN_FRAMES &&
+			chain->copy_len + copy_len <= HOST_URING_COPY_MAX)
+		return chain;
+
+	chain = host_uring_chain_new(handle, host_data);
+	if (chain == NULL)
+		goto defer;
+
+	if (host_data->uring_last != NULL) {
+		host_data->uring_last->next = chain;
+	} else {
+		host_data->uring_chain = chain;
+		host_uring_hold(host_data);
+
+		/* Else once the chains being sent are done */
+		if (host_data->uring_busy == 0)
+			host_uring_mark(host_data);
+	}
+
+	host_data->uring_last = chain;
+	return chain;
+
+defer:
+	/* Held back till io_uring is done with what it has */
+	if (host_data->uring_busy != 0 || host_data->uring_chain != NULL)
+		host_uring_hold(host_data);
+
+	__atomic_store_n(&stats->msgs_deferred, stats->msgs_deferred + 1,
+				__ATOMIC_RELAXED);
+	return NULL;
+}
+
+/*
+ * Queues a frame (header, payload and checksum, any of which can be empty)
+ * on the connection, to be submitted along with the frames of every other
+ * connection once the loop is through with the callbacks at hand (or once
+ * the frames before it are sent). Returns -EAGAIN if the connection can't
+ * take it now
+ */
+static int host_uring_queue(host_data_t *host_data, comm_frame_t *frame,
+				const void *hdr, int hdr_len, const void *ref,
+				size_t len, const void *crc)
+{
+	comm_handle_t *handle = host_data->handle;
+	comm_engine_stats_t *stats = &handle->engine_stats;
+	host_uring_chain_t *chain;
+	int num_segs;
+	bool is_zc;
+
+	chain = host_uring_chain_of(host_data, 0);
+	if (chain == NULL)
+		return -EAGAIN;
+
+	num_segs = chain->num_segs;
+
+	__atomic_add_fetch(&frame->refcnt, 1, __ATOMIC_RELAXED);
+	chain->frames[chain->num_frames++] = frame;
+
+	if (hdr_len != 0)
+		host_uring_chain_add(chain, hdr, hdr_len, false, -1);
+
+	is_zc = host_data->uring_zc && len >= (size_t)handle->uring.zc_min_len;
+	if (len != 0)
+		host_uring_chain_add(chain, ref, len, is_zc,
+					is_zc ? host_uring_buf(handle, ref) : -1);
+
+	if (crc != NULL)
+		host_uring_chain_add(chain, crc, FRAME_CRC_LEN, false, -1);
+
+	host_data->uring_len += hdr_len + len + (crc != NULL ? FRAME_CRC_LEN : 0);
+	host_data->uring_segs += chain->num_segs - num_segs;
+
+	__atomic_store_n(&stats->msgs, stats->msgs + 1, __ATOMIC_RELAXED);
+	return 0;
+}
+
+/*
+ * Writes a frame of len bytes at buf (copied) on the connection, in order
+ * with the frames queued on io_uring. Returns negative code on error
+ */
+static int host_write_copy(host_data_t *host_data, const void *buf,
+				size_t len)
+{
+	host_uring_chain_t *chain = NULL;
+	int num_segs;
+
+	/* Coalesced frames go first */
+	host_coalesce_flush(host_data);
+
+	if (len <= HOST_URING_COPY_MAX)
+		chain = host_uring_chain_of(host_data, len);
+
+	if (chain == NULL)
+		return bufferevent_write(host_data->bev_write, buf, len);
+
+	num_segs = chain->num_segs;
+
+	memcpy(&chain->copy[chain->copy_len], buf, len);
+	host_uring_chain_add(chain, &chain->copy[chain->copy_len], len, false,
+				-1);
+	chain->copy_len += len;
+
+	host_data->uring_len += len;
+	host_data->uring_segs += chain->num_segs - num_segs;
+	return 0;
+}
+
+/*
+ * Puts the sends of the chain in the submission queue, linked in order
+ * (and to the next chain, if any). Returns -ENOSPC, having queued none of
+ * them, if the queue can't take them all
+ */
+static int host_uring_prep(comm_handle_t *handle, host_uring_chain_t *chain)
+{
+	comm_engine_stats_t *stats = &handle->engine_stats;
+	host_data_t *host_data = chain->host_data;
+	struct io_uring_sqe *sqe;
+	host_uring_seg_t *seg;
+	int i, flags;
+
+	if (uring_sq_space(&handle->uring.ring) <
+			(unsigned int)chain->num_segs)
+		return -ENOSPC;
+
+	for (i = 0; i < chain->num_segs; i++) {
+
+		seg = &chain->segs[i];
+		sqe = uring_get_sqe(&handle->uring.ring);
+		if (sqe == NULL)
+			return -ENOSPC;
+
+		/* Whole send or an error, never a short one */
+		flags = MSG_WAITALL | MSG_NOSIGNAL;
+		if (i < chain->num_segs - 1 || chain->next != NULL) {
+			flags |= MSG_MORE;
+			sqe->flags |= IOSQE_IO_LINK;
+		}
+
+		sqe->fd = host_data->uring_fd;
+		sqe->msg_flags = flags;
+		sqe->user_data = (uintptr_t)chain;
+
+		if (seg->is_zc) {
+			/* Tagged, chains being aligned */
+			sqe->user_data |= HOST_URING_ZC_TAG;
+			sqe->opcode = IORING_OP_SEND_ZC;
+			sqe->addr = (uintptr_t)seg->msg.msg_iov[0].iov_base;
+			sqe->len = seg->msg.msg_iov[0].iov_len;
+
+			if (seg->buf_index >= 0) {
+				sqe->ioprio |= IORING_RECVSEND_FIXED_BUF;
+				sqe->buf_index = seg->buf_index;
+			}
+
+			__atomic_store_n(&stats->zc_sends, stats->zc_sends + 1,
+						__ATOMIC_RELAXED);
+		} else {
+			sqe->opcode = IORING_OP_SENDMSG;
+			sqe->addr = (uintptr_t)&seg->msg;
+			sqe->len = 1;
+		}
+	}
+
+	chain->sends_left = chain->num_segs;
+
+	__atomic_store_n(&stats->sends, stats->sends + chain->num_segs,
+				__ATOMIC_RELAXED);
+	return 0;
+}
+
+/* Lets libevent write out the connection again, closing it if asked to */
+static void host_uring_release(host_data_t *host_data)
+{
+	struct evbuffer *output = bufferevent_get_output(host_data->bev_write);
+
+	if (host_data->uring_holds_write) {
+		bufferevent_enable(host_data->bev_write, EV_WRITE);
+		host_data->uring_holds_write = false;
+	}
+
+	/* Else libevent closes it once it is written out */
+	if (host_data->uring_closing && evbuffer_get_length(output) == 0)
+		host_end_connection(host_data->bev_write, host_data);
+}
+
+/* All the sends of a chain are over */
+static void host_uring_chain_sent(host_uring_chain_t *chain)
+{
+	host_data_t *host_data = chain->host_data;
+
+	/* Connection went away meanwhile */
+	if (chain->gen != host_data->uring_gen)
+		return;
+
+	host_data->uring_busy--;
+	host_data->uring_len -= chain->len;
+
+	if (chain->err == 0 && chain->sent == chain->len) {
+
+		/* Frames queued meanwhile go next */
+		if (host_data->uring_busy == 0 &&
+				host_data->uring_chain != NULL)
+			host_uring_mark(host_data);
+		else if (host_data->uring_busy == 0)
+			host_uring_release(host_data);
+
+		/* Unless it is going away */
+		if (host_data->is_connected)
+			host_queue_check(host_data, false);
+		return;
+	}
+
+	hostLog(host_data, LOG_WARN, false, "Send failed: %s",
+		strerror(chain->err != 0 ? -chain->err : EPIPE));
+
+	if (host_data->uring_closing)
+		host_end_connection(host_data->bev_write, host_data);
+	else
+		host_connect_terminate_now(host_data);
+}
+
+static void host_uring_complete(comm_handle_t *handle,
+				struct io_uring_cqe *cqe)
+{
+	host_uring_chain_t *chain = (host_uring_chain_t *)(uintptr_t)
+					(cqe->user_data & ~HOST_URING_ZC_TAG);
+	comm_engine_stats_t *stats = &handle->engine_stats;
+	int done = 1;
+
+	if (cqe->flags & IORING_CQE_F_NOTIF) {
+		/* Kernel is done with the zero copy payload */
+		if (cqe->res & IORING_NOTIF_USAGE_ZC_COPIED)
+			__atomic_store_n(&stats->zc_copied,
+					stats->zc_copied + 1, __ATOMIC_RELAXED);
+	} else {
+		/* Zero copy send, which won't be notified after all */
+		if ((cqe->user_data & HOST_URING_ZC_TAG) &&
+				!(cqe->flags & IORING_CQE_F_MORE))
+			done = 2;
+
+		if (cqe->res < 0) {
+			if (chain->err == 0)
+				chain->err = cqe->res;
+		} else {
+			chain->sent += cqe->res;
+		}
+
+		if (--chain->sends_left == 0)
+			host_uring_chain_sent(chain);
+	}
+
+	chain->cqes_left -= done;
+	handle->uring.cqes_out -= done;
+
+	if (chain->cqes_left == 0) {
+		host_uring_chain_free(handle, chain);
+		handle->uring.chains_out--;
+	}
+}
+
+/* Handles all the completions there are */
+static void host_uring_reap(comm_handle_t *handle)
+{
+	host_uring_t *uring = &handle->uring;
+	struct io_uring_cqe *cqe;
+
+	while ((cqe = uring_peek_cqe(&uring->ring)) != NULL) {
+		host_uring_complete(handle, cqe);
+		uring_cqe_seen(&uring->ring);
+	}
+
+	/* Loop keeps running till everything submitted is over */
+	if (uring->chains_out > 0 && !event_pending(uring->ev_complete,
+							EV_READ, NULL))
+		event_add(uring->ev_complete, NULL);
+}
+
+/*
+ * Hands all the queued sends to the kernel at once. Returns negative code
+ * if the submit failed
+ */
+static int host_uring_submit(comm_handle_t *handle)
+{
+	comm_engine_stats_t *stats = &handle->engine_stats;
+	host_uring_t *uring = &handle->uring;
+	int ret;
+
+	if (uring_sq_pending(&uring->ring) != 0)
+		__atomic_store_n(&stats->submits, stats->submits + 1,
+					__ATOMIC_RELAXED);
+
+	ret = uring_submit(&uring->ring);
+
+	/* Left in the queue, retried as completions come in */
+	if (ret < 0)
+		genericLog(LOG_WARN, false, "io_uring submit failed: %s",
+				strerror(-ret));
+
+	/* Sends which could go out right away are already done */
+	host_uring_reap(handle);
+
+	return ret < 0 ? ret : 0;
+}
+
+/* Called once the loop is through with callbacks which queued frames */
+static void host_uring_flush(evutil_socket_t fd, short what, void *arg)
+{
+	comm_handle_t *handle = (comm_handle_t *)arg;
+	host_uring_t *uring = &handle->uring;
+	host_uring_chain_t *chain;
+	host_data_t *host_data;
+	int i, num_left = 0;
+
+	(void)fd;
+	(void)what;
+
+	for (i = 0; i < uring->num_dirty; i++) {
+
+		host_data = uring->dirty[i];
+
+		/* Connection went away meanwhile */
+		if (host_data->uring_chain == NULL ||
+				host_data->uring_busy != 0) {
+			host_data->uring_dirty = false;
+			continue;
+		}
+
+		/*
+		 * Linked sends can't be split over submits. If the queue
+		 * still has no room for them (submit failed), they wait for
+		 * the next flush, libevent holding back the connection
+		 */
+		if (uring_sq_space(&uring->ring) <
+				(unsigned int)host_data->uring_segs &&
+				(host_uring_submit(handle) < 0 ||
+				 uring_sq_space(&uring->ring) <
+				 (unsigned int)host_data->uring_segs)) {
+			uring->dirty[num_left++] = host_data;
+			continue;
+		}
+
+		host_batch_done(host_data);
+		host_data->uring_dirty = false;
+
+		while ((chain = host_data->uring_chain) != NULL) {
+			/* Not with the room checked for above */
+			if (host_uring_prep(handle, chain) < 0) {
+				hostLog(host_data, LOG_WARN, false,
+					"io_uring queue full");
+				host_connect_terminate_now(host_data);
+				break;
+			}
+
+			/* Left to completions from now on */
+			host_data->uring_chain = chain->next;
+			host_data->uring_busy++;
+			uring->chains_out++;
+		}
+
+		host_data->uring_last = NULL;
+		host_data->uring_segs = 0;
+	}
+
+	uring->num_dirty = num_left;
+
+	/* Retried after a while, whatever comes in meanwhile */
+	if (num_left != 0)
+		event_add(uring->ev_flush, &handle->flush_tv);
+
+	host_uring_submit(handle);
+}
+
+/* Completions are there to be reaped */
+static void host_uring_ready(evutil_socket_t fd, short what, void *arg)
+{
+	comm_handle_t *handle = (comm_handle_t *)arg;
+
+	(void)fd;
+	(void)what;
+
+	/* Anything a failed submit left behind */
+	host_uring_submit(handle);
+	host_uring_reap(handle);
+}
+
+/* Sets up connection to send through io_uring, if host uses it */
+static void host_uring_connected(host_data_t *host_data)
+{
+	comm_handle_t *handle = host_data->handle;
+
+	host_uring_reset(host_data);
+
+	/* Shared memory has no socket to send on */
+	if (handle->engine != COMM_ENGINE_URING ||
+			host_data->transport->type == TRANSPORT_SHM)
+		return;
+
+	host_data->uring_fd = bufferevent_getfd(host_data->bev_write);
+	host_data->uring_zc = handle->uring.has_zc &&
+				host_data->transport->type == TRANSPORT_TCP;
+}
+
+/*
+ * Queues the frame on the connection without copying it. The output buffer
+ * holds a reference to the frame till the data has been flushed.
+ * In v1, the header and checksum (built once per frame) are copied in,
+ * along with tiny payloads. Connections taking compressed payloads share
+ * the compressed copy. Connections sending through io_uring queue the
+ * pieces of the frame on their chain instead. Coalescing connections
+ * hold the frame back till the flush deadline (or till enough is held
+ * back), the rest write it out right away. Returns the bytes queued
+ */
+static int host_write_frame(host_data_t *host_data, comm_frame_t *frame)
+{
+	struct evbuffer *output = bufferevent_get_output(host_data->bev_write);
+	comm_handle_t *handle = host_data->handle;
+	comm_data_t *data = &frame->data;
+	size_t len = offsetof(comm_data_t, buf) + data->msg_len;
+	int msg_type = data->msg_type;
+	comm_frame_v1_t *v1 = NULL;
+	comm_frame_lz_t *lz = NULL;
+	const void *ref = data;
+	const void *crc = NULL;
+	uint64_t now = comm_now_ns();
+	int hdr_len = 0;
+	int ret;
+
+	host_send_adapt(host_data, now);
+
+	if (FRAME_WIRE_VERSION(host_data->wire) == FRAME_WIRE_V1) {
+		if (host_data->wire & FRAME_WIRE_LZ)
+			lz = host_frame_lz(handle, frame);
+
+		if (lz != NULL) {
+			v1 = &lz->v1;
+			ref = lz->buf;
+			len = lz->len;
+			msg_type |= FRAME_MSG_LZ;
+		} else {
+			v1 = &frame->v1;
+			ref = data->buf;
+			len = data->msg_len;
+		}
+
+		host_frame_hdr_v1(handle, v1, data, msg_type, len);
+		hdr_len = v1->hdr_len;
+	}
+
+	/* Only ever in v1 */
+	if (host_data->wire & FRAME_WIRE_CRC) {
+		if (!v1->has_crc) {
+			frame_encode_crc(v1->crc, v1->hdr, hdr_len, ref, len);
+			v1->has_crc = true;
+		}
+		crc = v1->crc;
+	}
+
+	if (host_uring_queue(host_data, frame, hdr_len != 0 ? v1->hdr : NULL,
+				hdr_len, ref, len, crc) == 0)
+		goto done;
+
+	/*
+	 * Held back till flushed as per send mode. io_uring does its own
+	 * coalescing, frames it leaves to libevent go straight to it
+	 */
+	if (host_data->uring_fd < 0)
+		output = host_data->coalesce;
+
+	if (hdr_len != 0 && evbuffer_add(output, v1->hdr, hdr_len) < 0)
+		return -ENOMEM;
+
+	if (hdr_len != 0 && len <= FRAME_INLINE_MAX) {
+		ret = len != 0 ? evbuffer_add(output, ref, len) : 0;
+	} else {
+		__atomic_add_fetch(&frame->refcnt, 1, __ATOMIC_RELAXED);
+
+		ret = evbuffer_add_reference(output, ref, len,
+						host_frame_cleanup, frame);
+		if (ret < 0)
+			host_frame_put(frame);
+	}
+
+	if (ret < 0)
+		return ret;
+
+	if (crc != NULL && evbuffer_add(output, crc, FRAME_CRC_LEN) < 0)
+		return -ENOMEM;
+
+done:
+	len += hdr_len + (crc != NULL ? FRAME_CRC_LEN : 0);
+	host_batch_add(host_data, now, len);
+
+	if (output == host_data->coalesce) {
+		if (!host_data->is_coalescing)
+			host_flush_now(host_data);
+		else if (evbuffer_get_length(output) >= HOST_COALESCE_MAX_BYTES)
+			host_coalesce_flush(host_data);
+		else if (!evtimer_pending(host_data->ev_coalesce, NULL))
+			evtimer_add(host_data->ev_coalesce, &handle->flush_tv);
+	} else if (host_data->uring_last == NULL) {
+		/* Left to libevent, nothing queued on io_uring */
+		host_batch_done(host_data);
+	}
+
+	return len;
+}
+
+/* Writes frame out on a connection. Returns false if the connection broke */
+static bool host_put_frame(host_data_t *host_data, comm_frame_t *frame)
+{
+	int len;
+
+	/* 
+	 * XXX: Do we wish to keep the data lying
+	 * around when an ep temporarily is not
+	 * connected so that we can sent it later
+	 */
+	len = host_write_frame(host_data, frame);
+	if (len < 0) {
+		hostLog(host_data, LOG_WARN, false,  
+			"Sent corrupt data");
+	
+		host_connect_terminate_now(host_data);
+		return false;
+	}
+
+	__atomic_store_n(&host_data->msgs_sent, host_data->msgs_sent + 1,
+				__ATOMIC_RELAXED);
+	__atomic_store_n(&host_data->bytes_sent, host_data->bytes_sent + len,
+				__ATOMIC_RELAXED);
+	return true;
+}
+
+/* Bytes a frame held back counts for */
+static size_t host_frame_len(comm_frame_t *frame)
+{
+	return offsetof(comm_data_t, buf) + frame->data.msg_len;
+}
+
+/* Oldest frame held back for a connection, its reference goes to caller */
+static comm_frame_t *host_backlog_pop(host_data_t *host_data)
+{
+	comm_frame_t *frame = host_data->backlog[host_data->backlog_head];
+
+	host_data->backlog_head = (host_data->backlog_head + 1) %
+					HOST_BACKLOG_MSGS;
+	host_data->backlog_count--;
+	host_data->backlog_len -= host_frame_len(frame);
+
+	return frame;
+}
+
+/*
+ * Holds frame back for a backed up connection (under DROP_OLDEST), making
+ * room for it by dropping the oldest ones. Held back frames take no more
+ * than the high watermark
+ */
+static void host_backlog_push(host_data_t *host_data, comm_frame_t *frame)
+{
+	comm_handle_t *handle = host_data->handle;
+	size_t len = host_frame_len(frame);
+	int num = 0;
+
+	if (host_data->backlog == NULL)
+		host_data->backlog = calloc(HOST_BACKLOG_MSGS,
+						sizeof(comm_frame_t *));
+
+	while (host_data->backlog_count != 0 &&
+			(host_data->backlog_count == HOST_BACKLOG_MSGS ||
+			host_data->backlog_len + len >
+			handle->opts.host_conn_high_wm)) {
+		host_frame_put(host_backlog_pop(host_data));
+		num++;
+	}
+
+	/* No room at all, the frame itself goes */
+	if (host_data->backlog == NULL) {
+		num++;
+	} else {
+		__atomic_add_fetch(&frame->refcnt, 1, __ATOMIC_RELAXED);
+		host_data->backlog[(host_data->backlog_head +
+				host_data->backlog_count) % HOST_BACKLOG_MSGS] =
+				frame;
+		host_data->backlog_count++;
+		host_data->backlog_len += len;
+	}
+
+	if (num != 0)
+		__atomic_store_n(&host_data->msgs_dropped,
+					host_data->msgs_dropped + num,
+					__ATOMIC_RELAXED);
+}
+
+/*
+ * Connection going past its high watermark (is_high), or getting back
+ * below the low one, with len bytes queued
+ */
+static void host_set_backed_up(host_data_t *host_data, bool is_high,
+				size_t len)
+{
+	comm_handle_t *handle = host_data->handle;
+	comm_backpressure_t policy = handle->opts.host_backpressure;
+
+	__atomic_store_n(&host_data->is_backed_up, is_high, __ATOMIC_RELAXED);
+
+	if (is_high) {
+		__atomic_store_n(&host_data->times_backed_up,
+					host_data->times_backed_up + 1,
+					__ATOMIC_RELAXED);
+		hostLog(host_data, LOG_WARN, false,
+			"Backed up, %zu bytes queued", len);
+	}
+
+	/* These hold back producers, till every connection is fine */
+	if (policy == BACKPRESSURE_EAGAIN || policy == BACKPRESSURE_BLOCK) {
+		pthread_mutex_lock(&handle->lock);
+		__atomic_store_n(&handle->num_backed_up,
+					handle->num_backed_up + (is_high ? 1 : -1),
+					__ATOMIC_RELEASE);
+		if (handle->num_backed_up == 0)
+			pthread_cond_broadcast(&handle->backpressure_cond);
+		pthread_mutex_unlock(&handle->lock);
+	}
+
+	if (handle->opts.host_wm_callback != NULL)
+		handle->opts.host_wm_callback(host_data->ep_num,
+						host_data->ep_sw, is_high, len);
+}
+
+/*
+ * Checks the bytes queued on the connection against its watermarks, as
+ * they change. Once back below the low one, frames held back go out first.
+ * Frames ep asked for (is_resend) go out whatever the policy, going past
+ * the high watermark with them doesn't drop the connection. Returns false
+ * if the connection got dropped
+ */
+static bool host_queue_check(host_data_t *host_data, bool is_resend)
+{
+	comm_handle_t *handle = host_data->handle;
+	size_t len = host_pending_len(host_data);
+	comm_frame_t *frame;
+	bool ret;
+
+	if (host_data->is_backed_up && len <= handle->opts.host_conn_low_wm) {
+
+		while (host_data->backlog_count != 0 &&
+				len < handle->opts.host_conn_high_wm) {
+			frame = host_backlog_pop(host_data);
+			ret = host_put_frame(host_data, frame);
+			host_frame_put(frame);
+			if (!ret)
+				return false;
+
+			len = host_pending_len(host_data);
+		}
+
+		if (host_data->backlog_count == 0)
+			host_set_backed_up(host_data, false, len);
+
+	} else if (!host_data->is_backed_up &&
+			len >= handle->opts.host_conn_high_wm) {
+
+		host_set_backed_up(host_data, true, len);
+
+		if (handle->opts.host_backpressure == BACKPRESSURE_DISCONNECT &&
+				!is_resend) {
+			__atomic_store_n(&host_data->disconnects,
+						host_data->disconnects + 1,
+						__ATOMIC_RELAXED);
+			host_connect_terminate_now(host_data);
+			return false;
+		}
+	}
+
+	__atomic_store_n(&host_data->queue_len, len + host_data->backlog_len,
+				__ATOMIC_RELAXED);
+	return true;
+}
+
+/* Forgets backpressure of a connection going down, and what it held back */
+static void host_backlog_reset(host_data_t *host_data)
+{
+	while (host_data->backlog_count != 0)
+		host_frame_put(host_backlog_pop(host_data));
+
+	if (host_data->is_backed_up)
+		host_set_backed_up(host_data, false, 0);
+
+	__atomic_store_n(&host_data->queue_len, 0, __ATOMIC_RELAXED);
+}
+
+/*
+ * Queues frame on a connection, holding it back if the connection is
+ * backed up under DROP_OLDEST. Returns false if the connection broke (or
+ * got dropped for being backed up)
+ */
+static bool host_send_on(host_data_t *host_data, comm_frame_t *frame)
+{
+	if (host_data->is_backed_up && host_data->handle->opts.host_backpressure ==
+			BACKPRESSURE_DROP_OLDEST)
+		host_backlog_push(host_data, frame);
+	else if (!host_put_frame(host_data, frame))
+		return false;
+
+	return host_queue_check(host_data, false);
+}
+
+/*
+ * Queues frame ep asked for (replay or nack) on a connection. It is never
+ * held back or dropped for the connection being backed up, else the
+ * retransmit window (larger than the default high watermark) couldn't be
+ * replayed. Returns false if the connection broke
+ */
+static bool host_resend_on(host_data_t *host_data, comm_frame_t *frame)
+{
+	if (!host_put_frame(host_data, frame))
+		return false;
+
+	return host_queue_check(host_data, true);
+}
+
+/* Output of the connection drained to its low watermark */
+static void host_write_ready(struct bufferevent *bev, void *arg)
+{
+	(void)bev;
+
+	host_queue_check((host_data_t *)arg, false);
+}
+
+/*
+ * Switch carrying msgs to ep under active/standby. Sticks to the active
+ * one while it is up, else promotes the first one connected
+ */
+static host_data_t *host_pick_active(comm_handle_t *handle, int ep)
+{
+	host_ep_t *host_ep = &handle->host_eps[ep];
+	host_data_t *host_data = host_data_of(handle, ep, host_ep->active_sw);
+	int j;
+
+	if (host_data->is_live)
+		return host_data;
+
+	for (j = 0; j < handle->topo.num_switches; j++) {
+
+		host_data = host_data_of(handle, ep, j);
+
+		if (!host_data->is_live)
+			continue;
+
+		hostLog(host_data, LOG_WARN, false,
+			"Promoted to active switch");
+
+		host_ep->active_sw = j;
+		__atomic_store_n(&host_data->promotions,
+				host_data->promotions + 1, __ATOMIC_RELAXED);
+		return host_data;
+	}
+
+	return NULL;
+}
+
+/*
+ * Switch carrying next msg to ep under striping. The one with least data
+ * still waiting to go out, going round robin among equals
+ */
+static host_data_t *host_pick_stripe(comm_handle_t *handle, int ep)
+{
+	int num_switches = handle->topo.num_switches;
+	host_ep_t *host_ep = &handle->host_eps[ep];
+	host_data_t *host_data, *best = NULL;
+	size_t len, best_len = 0;
+	int i, j;
+
+	for (i = 0; i < num_switches; i++) {
+
+		j = (host_ep->next_sw + i) % num_switches;
+		host_data = host_data_of(handle, ep, j);
+
+		if (!host_data->is_live)
+			continue;
+
+		len = host_pending_len(host_data);
+
+		if (best == NULL || len < best_len) {
+			best = host_data;
+			best_len = len;
+		}
+	}
+
+	if (best != NULL)
+		host_ep->next_sw = (best->ep_sw + 1) % num_switches;
+
+	return best;
+}
+
+/*
+ * Slot of msg_num in the retransmit window. Its size being a power of two,
+ * slots keep lining up as msg_nums wrap around
+ */
+static comm_frame_t **host_rtx_slot(comm_handle_t *handle,
+					unsigned int msg_num)
+{
+	return &handle->rtx_window[msg_num & (handle->rtx_size - 1)];
+}
+
+/* Keeps the frame around for replay, in place of the oldest one */
+static void host_rtx_add(comm_handle_t *handle, comm_frame_t *frame)
+{
+	comm_frame_t **slot = host_rtx_slot(handle, frame->data.msg_num);
+
+	/* msg_nums are fanned out one after another */
+	if (*slot != NULL)
+		host_frame_put(*slot);
+	else
+		handle->rtx_count++;
+
+	*slot = frame;
+	handle->rtx_next = (unsigned int)frame->data.msg_num + 1;
+}
+
+/* First msg replayed to an ep which told us session and next */
+static unsigned int host_replay_start(comm_handle_t *handle, int session,
+					int next)
+{
+	unsigned int oldest = (unsigned int)handle->rtx_next - handle->rtx_count;
+
+	/* Ep has nothing of this session */
+	if (session != handle->session)
+		return oldest;
+
+	if ((int)(oldest - (unsigned int)next) > 0)
+		return oldest;
+
+	/* Ep claims to be ahead of us */
+	if ((int)((unsigned int)handle->rtx_next - (unsigned int)next) < 0)
+		return handle->rtx_next;
+
+	return next;
+}
+
+/*
+ * Sends msgs from the window which ep hasn't received yet. session and next
+ * are as told by ep. Returns false if the connection broke
+ */
+static bool host_replay(host_data_t *host_data, int session, int next)
+{
+	comm_handle_t *handle = host_data->handle;
+	unsigned int from = host_replay_start(handle, session, next), n;
+	comm_frame_t *frame;
+	int missed;
+
+	missed = (int)(from - (unsigned int)next);
+	if (session == handle->session && missed > 0)
+		hostLog(host_data, LOG_WARN, false,
+			"%d msgs no longer kept for replay", missed);
+
+	for (n = from; n != (unsigned int)handle->rtx_next; n++) {
+
+		frame = *host_rtx_slot(handle, n);
+
+		if (!host_resend_on(host_data, frame))
+			return false;
+
+		__atomic_store_n(&host_data->msgs_replayed,
+				host_data->msgs_replayed + 1, __ATOMIC_RELAXED);
+	}
+
+	return true;
+}
+
+/*
+ * Sends the frame once over every switch having eps which take multicast,
+ * as a v1 frame of its own (uncompressed). It carries the checksum the
+ * connections have if any of those eps asked for checksums, the others
+ * check it too. A datagram failing to go out is lost like any other, eps
+ * ask for it again
+ */
+static void host_mcast_send(comm_handle_t *handle, comm_frame_t *frame)
+{
+	comm_data_t *data = &frame->data;
+	comm_frame_v1_t *v1 = &frame->v1;
+	host_mcast_t *mcast;
+	struct iovec iov[3];
+	struct msghdr msg;
+	ssize_t len;
+	int j;
+
+	host_frame_hdr_v1(handle, v1, data, data->msg_type, data->msg_len);
+
+	iov[0].iov_base = v1->hdr;
+	iov[0].iov_len = v1->hdr_len;
+	iov[1].iov_base = data->buf;
+	iov[1].iov_len = data->msg_len;
+	iov[2].iov_base = v1->crc;
+	iov[2].iov_len = FRAME_CRC_LEN;
+
+	memset(&msg, 0, sizeof(msg));
+	msg.msg_iov = iov;
+
+	for (j = 0; j < handle->topo.num_switches; j++) {
+
+		mcast = &handle->host_mcast[j];
+		if (mcast->num_live == 0)
+			continue;
+
+		/* Same as the one connections send */
+		if (mcast->num_crc != 0 && !v1->has_crc) {
+			frame_encode_crc(v1->crc, v1->hdr, v1->hdr_len,
+						data->buf, data->msg_len);
+			v1->has_crc = true;
+		}
+
+		msg.msg_name = &mcast->group;
+		msg.msg_namelen = sizeof(mcast->group);
+		msg.msg_iovlen = mcast->num_crc != 0 ? 3 : 2;
+
+		len = sendmsg(mcast->fd, &msg, 0);
+		if (len < 0)
+			continue;
+
+		__atomic_store_n(&mcast->msgs_sent, mcast->msgs_sent + 1,
+					__ATOMIC_RELAXED);
+		__atomic_store_n(&mcast->bytes_sent, mcast->bytes_sent + len,
+					__ATOMIC_RELAXED);
+	}
+}
+
+/* Sends out the frame to all the connected eps, as per path policy */
+static void host_fan_out(comm_handle_t *handle, comm_frame_t *frame)
+{
+	comm_data_t *data = &frame->data;
+	comm_path_policy_t policy;
+	host_data_t *host_data;
+	int i, j;
+
+	/* msg_num was given out when the msg was queued */
+	data->session = handle->session;
+
+	policy = __atomic_load_n(&handle->path_policy, __ATOMIC_RELAXED);
+
+	for (i = 0; i < handle->topo.num_eps; i++) {
+
+		switch (policy) {
+		case PATH_ACTIVE_STANDBY:
+		case PATH_STRIPE:
+
+			/* Retry on other switch if the chosen one breaks */
+			do {
+				if (policy == PATH_STRIPE)
+					host_data = host_pick_stripe(handle, i);
+				else
+					host_data = host_pick_active(handle, i);
+			} while (host_data != NULL &&
+					!host_send_on(host_data, frame));
+			break;
+
+		case PATH_DUPLICATE:
+		default:
+			for (j = 0; j < handle->topo.num_switches; j++) {
+
+				host_data = host_data_of(handle, i, j);
+
+				/* Multicast covers it, once for all */
+				if (host_data->is_live && !host_data->is_mcast)
+					host_send_on(host_data, frame);
+			}
+			break;
+		}
+	}
+
+	if (policy == PATH_DUPLICATE)
+		host_mcast_send(handle, frame);
+
+	/* Connections now hold their own references, ours stays in window */
+	host_rtx_add(handle, frame);
+
+	handle->num_msg_sent++;
+}
+
+/* Prepares incoming data from host to be sent to eps */
+static void host_incoming_data(evutil_socket_t fd, short what, void *arg)
+{
+	comm_handle_t *handle = (comm_handle_t *)arg;
+	comm_frame_t *frame;
+	int i;
+
+	(void)what;
+
+	wakeup_clear(fd, &handle->wakeup_pending);
+
+	/*
+	 * One wakeup drains everything queued till now. All the frames get
+	 * queued on the connections before returning to the loop, so each
+	 * connection flushes them out together with a single writev
+	 */
+	while ((frame = ring_pop(&handle->submit_ring)) != NULL)
+		host_fan_out(handle, frame);
+
+	host_submit_drained(handle);
+
+	if (!__atomic_load_n(&handle->is_closing, __ATOMIC_ACQUIRE))
+		return;
+
+	for (i = 0; i < host_num_conns(handle); i++) {
+
+		host_data_t *host_data = &handle->host_data[i];
+
+		host_connect_cancel(host_data);
+
+		if (!host_data->is_connected)
+			continue;
+
+		host_connect_terminate_defer(host_data);
+	}
+
+	/* Let the loop exit once pending data is flushed */
+	event_del(handle->ev_wakeup);
+}
+
+/* Called periodically to check on heartbeats */
+static void host_check_heartbeat(void *arg)
+{
+	host_data_t *host_data = (host_data_t *)arg;
+
+	/* Anything from ep shows it is alive, not just heartbeats */
+	if (host_data->frames_recv == 0) {
+		host_connect_terminate_now(host_data);
+		hostLog(host_data, LOG_WARN, false,
+				"EP connection terminated as no heartbeats");
+		return;
+	}
+
+	host_data->frames_recv = 0;
+}
+
+/* Puts a heartbeat request in hdr. Returns its length */
+static int host_heartbeat_req(host_data_t *host_data, uint8_t *hdr)
+{
+	comm_handle_t *handle = host_data->handle;
+	int len;
+
+	/* Tells multicast eps what they should have got by now */
+	len = frame_encode_hdr(host_data->wire, hdr, MSG_HEARTBEAT_REQ, 0,
+				handle->rtx_next, handle->session,
+				handle->session);
+	if (host_data->wire & FRAME_WIRE_CRC) {
+		frame_encode_crc(&hdr[len], hdr, len, NULL, 0);
+		len += FRAME_CRC_LEN;
+	}
+
+	return len;
+}
+
+/*
+ * Called once ep has been quiet for a while to ask it for a heartbeat.
+ * Anything ep sends on its own puts this off (see host_ep_talked())
+ */
+static void host_req_heartbeat(void *arg)
+{
+	host_data_t *host_data = (host_data_t *)arg;
+	uint8_t hdr[FRAME_MAX_HDR_LEN + FRAME_CRC_LEN];
+	int len = host_heartbeat_req(host_data, hdr);
+
+	wheel_add(&host_data->handle->wheel, &host_data->heartbeat_req_timer,
+			EP_HEARTBEAT_DURATION_US, false);
+
+	__atomic_store_n(&host_data->heartbeats_sent,
+			host_data->heartbeats_sent + 1, __ATOMIC_RELAXED);
+
+	if (host_write_copy(host_data, hdr, len) < 0) {
+		hostLog(host_data, LOG_WARN, false,
+					"Couldn't ask for heartbeat");
+		host_connect_terminate_now(host_data);
+	}
+}
+
+/*
+ * Ep sent a frame of type on its own, so is alive. No heartbeat requests
+ * till it has been quiet for a while - Its acks come every EP_ACK_DELAY_US
+ * as long as msgs flow
+ */
+static void host_ep_talked(host_data_t *host_data, int msg_type)
+{
+	uint8_t hdr[FRAME_MAX_HDR_LEN + FRAME_CRC_LEN];
+
+	/* Connection is going away */
+	if (!wheel_pending(&host_data->heartbeat_req_timer))
+		return;
+
+	wheel_add(&host_data->handle->wheel, &host_data->heartbeat_req_timer,
+			EP_ACK_DELAY_US + EP_HEARTBEAT_DURATION_US, false);
+
+	if (msg_type != MSG_ACK)
+		return;
+
+	/* The ack costs what the response would have, the request is saved */
+	__atomic_store_n(&host_data->heartbeats_suppressed,
+			host_data->heartbeats_suppressed + 1, __ATOMIC_RELAXED);
+	__atomic_store_n(&host_data->heartbeat_bytes_saved,
+			host_data->heartbeat_bytes_saved +
+				host_heartbeat_req(host_data, hdr),
+			__ATOMIC_RELAXED);
+}
+
+/*
+ * Ep expects msg next (of session), so has all msgs before it. Any switch
+ * counts - An ep has a msg as soon as it arrives on one of them
+ */
+static void host_ack(host_data_t *host_data, int session, int next)
+{
+	comm_handle_t *handle = host_data->handle;
+	int ep = host_data->ep_num;
+	unsigned int acked = handle->host_eps[ep].acked;
+	comm_frame_t *frame;
+	long latency_us = -1;
+
+	if (session != handle->session)
+		return;
+
+	/* Old news, or beyond what was ever sent */
+	if ((int)((unsigned int)next - acked) <= 0 ||
+			(int)((unsigned int)handle->rtx_next - next) < 0)
+		return;
+
+	__atomic_store_n(&handle->host_eps[ep].acked, next, __ATOMIC_RELEASE);
+
+	if (handle->opts.host_ack_callback == NULL)
+		return;
+
+	frame = *host_rtx_slot(handle, (unsigned int)next - 1);
+	if (frame != NULL &&
+			(unsigned int)frame->data.msg_num == (unsigned int)next - 1)
+		latency_us = (comm_now_ns() - frame->queued_ns) / 1000;
+
+	handle->opts.host_ack_callback(ep, host_ticket(next), latency_us);
+}
+
+/*
+ * Ep asked for msgs it missed over multicast. Resends them on the
+ * connection, as far as the window goes. Returns false if the connection
+ * broke
+ */
+static bool host_resend(host_data_t *host_data, frame_t *frame,
+			struct evbuffer *input)
+{
+	comm_handle_t *handle = host_data->handle;
+	unsigned int oldest = (unsigned int)handle->rtx_next - handle->rtx_count;
+	unsigned int from = frame->msg_num, n;
+	uint32_t count;
+	char *buf;
+	int missed;
+
+	buf = frame_payload(&host_data->parser, input);
+	if (buf == NULL || frame->msg_len != sizeof(count)) {
+		hostLog(host_data, LOG_WARN, false, "Invalid nack from ep");
+		return true;
+	}
+
+	memcpy(&count, buf, sizeof(count));
+	count = le32toh(count);
+
+	__atomic_store_n(&host_data->nacks, host_data->nacks + 1,
+				__ATOMIC_RELAXED);
+
+	if (frame->session != handle->session || !host_data->is_live)
+		return true;
+
+	missed = (int)(oldest - from);
+	if (missed > 0) {
+		hostLog(host_data, LOG_WARN, false,
+			"%d msgs no longer kept for resending",
+			(uint32_t)missed < count ? missed : (int)count);
+
+		if ((uint32_t)missed >= count)
+			return true;
+
+		from = oldest;
+		count -= missed;
+	}
+
+	/* Nothing beyond what was ever sent */
+	if ((int)((unsigned int)handle->rtx_next - from) < 0)
+		return true;
+	if (count > (unsigned int)handle->rtx_next - from)
+		count = (unsigned int)handle->rtx_next - from;
+
+	for (n = from; n != from + count; n++) {
+
+		if (!host_resend_on(host_data,
+				*host_rtx_slot(handle, n)))
+			return false;
+
+		__atomic_store_n(&host_data->msgs_resent,
+				host_data->msgs_resent + 1, __ATOMIC_RELAXED);
+	}
+
+	return true;
+}
+
+/* Startup attempt to connect with ep is over, successful or not */
+static void host_init_done(host_data_t *host_data)
+{
+	host_data->is_init_done = true;
+	sem_post(&host_data->handle->connect_sem);
+}
+
+/*
+ * Ep told us where it is. Catches it up and starts sending msgs on the
+ * connection. Returns false if the connection broke
+ */
+static bool host_go_live(host_data_t *host_data, frame_t *frame)
+{
+	comm_handle_t *handle = host_data->handle;
+
+	host_ack(host_data, frame->session, frame->msg_num);
+
+	if (!host_replay(host_data, frame->session, frame->msg_num))
+		return false;
+
+	host_data->is_live = true;
+	host_data->reconnect_attempts = 0;
+
+	pthread_mutex_lock(&handle->lock);
+	handle->num_succ_conns++;
+	if (handle->host_eps[host_data->ep_num].num_live++ == 0)
+		handle->num_eps_live++;
+	pthread_mutex_unlock(&handle->lock);
+
+	if (handle->opts.host_path_callback != NULL)
+		handle->opts.host_path_callback(host_data->ep_num,
+						host_data->ep_sw, true);
+
+	if (!host_data->is_init_done) {
+		host_init_done(host_data);
+		return true;
+	}
+
+	__atomic_store_n(&host_data->reconnects, host_data->reconnects + 1,
+				__ATOMIC_RELAXED);
+	hostLog(host_data, LOG_WARN, false, "Reconnected to ep");
+
+	return true;
+}
+
+/*
+ * Moves the connection to the newest wire format offered by ep in its
+ * resume. Old eps offer none and stay at v0. Returns false if the
+ * connection broke
+ */
+static bool host_offer_wire(host_data_t *host_data, frame_t *frame,
+				struct evbuffer *input)
+{
+	comm_handle_t *handle = host_data->handle;
+	uint8_t buf[FRAME_MAX_HDR_LEN + sizeof(uint32_t)];
+	uint32_t start;
+	char *caps;
+	int wire, len;
+
+	if (handle->opts.wire_legacy || frame->msg_len < 1)
+		return true;
+
+	caps = frame_payload(&host_data->parser, input);
+	if (caps == NULL)
+		return true;
+
+	wire = FRAME_WIRE_VERSION((uint8_t)caps[0]);
+	if (wire > FRAME_WIRE_NEWEST)
+		wire = FRAME_WIRE_NEWEST;
+
+	if (wire == FRAME_WIRE_V0)
+		return true;
+
+	/* Checksums and compression only if both ends want them */
+	if (((uint8_t)caps[0] & FRAME_WIRE_CRC) && handle->opts.frame_crc)
+		wire |= FRAME_WIRE_CRC;
+	if (((uint8_t)caps[0] & FRAME_WIRE_LZ) && handle->opts.frame_compress)
+		wire |= FRAME_WIRE_LZ;
+	/* An ep on this machine is better off with its own connection */
+	if (((uint8_t)caps[0] & FRAME_WIRE_MCAST) &&
+			handle->host_mcast[host_data->ep_sw].fd >= 0 &&
+			host_data->transport->type == TRANSPORT_TCP)
+		wire |= FRAME_WIRE_MCAST;
+
+	/*
+	 * Everything after it (starting with the replay) is in new format.
+	 * Tells where the replay starts, ep drops nothing before it
+	 */
+	start = htole32(host_replay_start(handle, frame->session,
+						frame->msg_num));
+	len = frame_encode_hdr(FRAME_WIRE_V0, buf, MSG_WIRE, sizeof(start),
+				wire, handle->session, 0);
+	memcpy(&buf[len], &start, sizeof(start));
+	len += sizeof(start);
+
+	if (host_write_copy(host_data, buf, len) < 0) {
+		hostLog(host_data, LOG_WARN, false,
+			"Couldn't switch wire format");
+		host_connect_terminate_now(host_data);
+		return false;
+	}
+
+	host_data->wire = wire;
+
+	return true;
+}
+
+/* Called when host gets heartbeats */
+static void host_got_heartbeat(struct bufferevent *bev, void *arg)
+{
+	host_data_t *host_data = (host_data_t *)arg;
+	struct evbuffer *input = bufferevent_get_input(bev);
+	comm_handle_t *handle = host_data->handle;
+	host_mcast_t *mcast;
+	frame_t *frame;
+	int ret;
+
+	while ((ret = frame_parse(&host_data->parser, input, &frame)) ==
+			FRAME_READY) {
+
+		host_data->frames_recv++;
+
+		/* Answers to our own requests don't make link busy */
+		if (frame->msg_type != MSG_HEARTBEAT_RESP)
+			host_ep_talked(host_data, frame->msg_type);
+
+		switch (frame->msg_type) {
+		case MSG_HEARTBEAT_RESP:
+		case MSG_ACK:
+			/* Acks are piggybacked on heartbeats */
+			host_ack(host_data, frame->session, frame->msg_num);
+			break;
+		case MSG_RESUME:
+			if (host_data->is_live) {
+				hostLog(host_data, LOG_WARN, false,
+					"Unexpected resume from ep");
+				break;
+			}
+
+			/* Connection is gone if this fails */
+			if (!host_offer_wire(host_data, frame, input) ||
+					!host_go_live(host_data, frame))
+				return;
+			break;
+		case MSG_WIRE:
+			if (frame->msg_num != host_data->wire) {
+				hostLog(host_data, LOG_WARN, false,
+					"Ep switched to wrong wire format");
+				host_connect_terminate_now(host_data);
+				return;
+			}
+
+			/* Ep is done with v0, rest of its frames are in new format */
+			frame_parser_set_wire(&host_data->parser, host_data->wire,
+						host_data->handle->session);
+
+			/*
+			 * Ep listens to multicast from us by now. Msgs before
+			 * went on the connection
+			 */
+			if ((host_data->wire & FRAME_WIRE_MCAST) &&
+					host_data->is_live) {
+				mcast = &handle->host_mcast[host_data->ep_sw];
+				host_data->is_mcast = true;
+				mcast->num_live++;
+				if (host_data->wire & FRAME_WIRE_CRC)
+					mcast->num_crc++;
+			}
+			break;
+		case MSG_NACK:
+			/* Connection is gone if this fails */
+			if (!host_resend(host_data, frame, input))
+				return;
+			break;
+		default:
+			hostLog(host_data, LOG_WARN, false,
+				"Invalid packet data");
+			break;
+		}
+
+		frame_consume(&host_data->parser, input);
+	}
+
+	if (ret == FRAME_BAD_CRC) {
+		/* Can't trust its length either, start over on a new one */
+		__atomic_store_n(&host_data->crc_errors,
+				host_data->crc_errors + 1, __ATOMIC_RELAXED);
+		hostLog(host_data, LOG_WARN, false,
+			"Frame from ep failed checksum");
+		host_connect_terminate_now(host_data);
+	} else if (ret < 0) {
+		/* Can't find the frame boundaries anymore */
+		hostLog(host_data, LOG_WARN, false, "Corrupt data from ep");
+		host_connect_terminate_now(host_data);
+	}
+}
+
+/* Frees up frames still queued in the submission ring */
+static void host_drain_submit_ring(comm_handle_t *handle)
+{
+	comm_frame_t *frame;
+
+	while ((frame = ring_pop(&handle->submit_ring)) != NULL)
+		host_frame_put(frame);
+}
+
+/*
+ * This function is called on any error while host is writing to ep
+ */
+static void host_event(struct bufferevent *bev, short event, void *arg)
+{
+	host_data_t *host_data = (host_data_t *)arg;
+
+	(void)bev;
+
+    	if (event & BEV_EVENT_EOF) {
+		/* EP disconnected */
+		host_connect_terminate_now(host_data);
+		hostLog(host_data, LOG_WARN, false,
+				"EP connection terminated");
+
+	} else if (event & BEV_EVENT_ERROR || event & BEV_EVENT_WRITING) {
+		/* Some other error occurred */
+		host_connect_terminate_now(host_data);
+		hostLog(host_data, LOG_WARN, false,
+				"Socket failure, disconnecting ep");
+	} else {
+		host_connect_terminate_now(host_data);
+		hostLog(host_data, LOG_WARN, false,
+				"Unknown error on socket, disconnecting ep");
+	}
+
+	return;
+}
+
+/* Marks connection as not carrying msgs anymore */
+static void host_connect_down(host_data_t *host_data)
+{
+	comm_handle_t *handle = host_data->handle;
+
+	host_data->is_connected = false;
+
+	wheel_del(&handle->wheel, &host_data->heartbeat_check_timer);
+	wheel_del(&handle->wheel, &host_data->heartbeat_req_timer);
+	frame_parser_destroy(&host_data->parser);
+	host_backlog_reset(host_data);
+
+	if (!host_data->is_live)
+		return;
+
+	host_data->is_live = false;
+
+	if (host_data->is_mcast) {
+		host_data->is_mcast = false;
+		handle->host_mcast[host_data->ep_sw].num_live--;
+		if (host_data->wire & FRAME_WIRE_CRC)
+			handle->host_mcast[host_data->ep_sw].num_crc--;
+	}
+
+	pthread_mutex_lock(&handle->lock);
+	handle->num_succ_conns--;
+	if (--handle->host_eps[host_data->ep_num].num_live == 0)
+		handle->num_eps_live--;
+	pthread_mutex_unlock(&handle->lock);
+
+	if (handle->opts.host_path_callback != NULL)
+		handle->opts.host_path_callback(host_data->ep_num,
+						host_data->ep_sw, false);
+}
+
+/*
+ * Called when connection is to be terminated after sending pending data
+ * This is voluntary closing of connection
+ */
+static void host_connect_terminate_defer(host_data_t *host_data)
+{
+	struct evbuffer *output = bufferevent_get_output(host_data->bev_write);
+	size_t len;
+
+	host_connect_down(host_data);
+
+	host_coalesce_flush(host_data);
+	len = evbuffer_get_length(output);
+
+	if (len == 0 && host_data->uring_busy == 0 &&
+			host_data->uring_chain == NULL) {
+		host_end_connection(host_data->bev_write, host_data);
+	} else {
+		bufferevent_setcb(host_data->bev_write,
+					host_end_connection,
+					host_end_connection,
+					host_end_connection_event,
+					host_data);
+		bufferevent_setwatermark(host_data->bev_write, EV_WRITE, 0, 0);
+
+		/* Once io_uring is done, if libevent has nothing left */
+		host_data->uring_closing = true;
+	}
+}
+
+/* Called when connection to host terminated quickly */
+static void host_connect_terminate_now(host_data_t *host_data)
+{
+	bool was_live = host_data->is_live;
+
+	host_connect_down(host_data);
+
+	host_data->transport->bev_free(host_data->bev_write);
+	host_uring_reset(host_data);
+	host_coalesce_reset(host_data);
+
+	if (was_live)
+		host_err(host_data, HOST_CONNECT_TERMINATE);
+
+	host_connect_retry(host_data);
+}
+
+/* Call this after connection estabished by host with ep */
+static void host_connected(int sockfd, host_data_t *host_data)
+{
+	comm_handle_t *handle = host_data->handle;
+	wheel_t *wheel = &handle->wheel;
+	int val = 1;
+
+	/* Kept over reconnections */
+	if (host_data->coalesce == NULL)
+		host_data->coalesce = evbuffer_new();
+	if (host_data->ev_coalesce == NULL)
+		host_data->ev_coalesce = evtimer_new(handle->ev_base,
+							host_coalesce_timeout,
+							host_data);
+	if (host_data->coalesce == NULL || host_data->ev_coalesce == NULL) {
+		hostLog(host_data, LOG_WARN, false,
+			"Couldn't allocate coalescing buffer");
+		close(sockfd);
+		host_connect_retry(host_data);
+		return;
+	}
+
+	/* Frames are flushed when they are meant to go, Nagle would delay them */
+	if (host_data->transport->type == TRANSPORT_TCP &&
+			setsockopt(sockfd, IPPROTO_TCP, TCP_NODELAY, &val,
+					sizeof(val)) < 0)
+		hostLog(host_data, LOG_WARN, true, "Couldn't set TCP_NODELAY");
+
+	host_data->bev_write =
+		host_data->transport->bev_new(host_data->handle->ev_base,
+						sockfd, true);
+	if (host_data->bev_write == NULL) {
+		hostLog(host_data, LOG_WARN, false,
+			"Couldn't set up %s connection",
+			host_data->transport->name);
+		host_connect_retry(host_data);
+		return;
+	}
+
+	host_data->connect_fd = -1;
+	host_data->frames_recv = 0;
+
+	/* Taken to be idle, till frames show otherwise */
+	host_data->is_coalescing = handle->send_mode == SEND_THROUGHPUT;
+	host_data->send_last_ns = 0;
+	host_data->send_gap_ns = handle->flush_ns;
+
+	host_data->is_connected = true;
+
+	/* Every connection starts out in v0 */
+	host_data->wire = FRAME_WIRE_V0;
+	frame_parser_init(&host_data->parser, MAX_DATA_LEN);
+
+	bufferevent_setcb(host_data->bev_write,
+				host_got_heartbeat,
+				host_write_ready,
+				host_event,
+				host_data);
+	bufferevent_setwatermark(host_data->bev_write, EV_WRITE,
+					handle->opts.host_conn_low_wm, 0);
+
+	bufferevent_enable(host_data->bev_write,
+				EV_READ | EV_WRITE);
+
+	evbuffer_add_cb(bufferevent_get_output(host_data->bev_write),
+			host_output_cb, host_data);
+	host_uring_connected(host_data);
+
+	/*
+	 * Msgs start flowing once ep tells us where to resume from. Till
+	 * then heartbeats make sure it doesn't take forever
+	 */
+	wheel_add(wheel, &host_data->heartbeat_check_timer,
+			HOST_HEARTBEAT_DURATION_US, true);
+	wheel_add(wheel, &host_data->heartbeat_req_timer,
+			EP_HEARTBEAT_DURATION_US, false);
+}
+
+/* Failed attempts to connect since the connection was last up */
+static int host_connect_attempts(host_data_t *host_data)
+{
+	if (!host_data->is_init_done)
+		return MAX_CONN_RETRIES - host_data->retries_left;
+
+	return host_data->reconnect_attempts;
+}
+
+/* Value doubled for every attempt, clamped to max */
+static long host_backoff(long min, long max, int attempts)
+{
+	int shift = attempts < 16 ? attempts : 16;
+
+	return (min << shift) < max ? (min << shift) : max;
+}
+
+/* Tries to connect the socket with ep */
+static void host_try_connect(host_data_t *host_data)
+{
+	int ret;
+	long timeout_ms;
+	int sockfd = host_data->connect_fd;
+
+	/* connect: create a connection with the server */
+	ret = connect(sockfd, (struct sockaddr *)&host_data->ep_addr,
+			host_data->ep_addr_len);
+	if (ret < 0 && errno == EINPROGRESS) {
+		/*
+		 * Couldn't connect right away but will connect in
+		 * future
+		 */
+
+		struct timeval tv;
+		host_data->ev_connect =
+			event_new(host_data->handle->ev_base, sockfd,
+					EV_WRITE, host_connect_cb,
+					host_data);
+
+		timeout_ms = host_backoff(HOST_CONNECT_TIMEOUT_MIN_MS,
+					MAX_CONN_TIMEOUT_SEC * 1000L,
+					host_connect_attempts(host_data));
+
+		tv.tv_sec = timeout_ms / 1000;
+		tv.tv_usec = (timeout_ms % 1000) * 1000;
+
+		event_add(host_data->ev_connect, &tv);
+
+	} else if (ret < 0) {
+		/* Error on connecting. try again */
+		close(sockfd);
+		host_connect_retry(host_data);
+	} else {
+		host_connected(sockfd, host_data);
+	}
+}
+
+/*
+ * Names a unix domain socket after us and the switch, as ep tells hosts
+ * apart by that (like by address over TCP)
+ */
+static int host_bind_local(host_data_t *host_data, int sockfd)
+{
+	comm_handle_t *handle = host_data->handle;
+	struct sockaddr_un addr;
+	socklen_t len;
+
+	len = transport_unix_host_addr(&addr,
+				handle->topo.eps[host_data->ep_num].name,
+				handle->topo.hosts[handle->node_num].name,
+				host_data->ep_sw);
+
+	return bind(sockfd, (struct sockaddr *)&addr, len);
+}
+
+/* Opens a new socket and starts connecting it with ep */
+static void host_connect_start(host_data_t *host_data)
+{
+	int sockfd;
+
+	sockfd = socket(host_data->transport->domain,
+			SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+	if (sockfd < 0) {
+		hostLog(host_data, LOG_WARN, true,
+				"Couldn't open socket with ep");
+		host_connect_retry(host_data);
+		return;
+	}
+
+	if (host_data->transport->domain == AF_UNIX &&
+			host_bind_local(host_data, sockfd) < 0) {
+		hostLog(host_data, LOG_WARN, true,
+				"Couldn't name socket with ep");
+		close(sockfd);
+		host_connect_retry(host_data);
+		return;
+	}
+
+	host_data->connect_fd = sockfd;
+
+	host_try_connect(host_data);
+}
+
+/* Called when it is time to try connecting again */
+static void host_reconnect_cb(void *arg)
+{
+	host_connect_start((host_data_t *)arg);
+}
+
+/*
+ * Schedules next attempt to connect after a failed one (or a lost
+ * connection). At startup it is retried MAX_CONN_RETRIES times, waiting
+ * HOST_CONNECT_RETRY_MIN_MS at first and doubling upto
+ * MAX_CONN_RETRY_TIMEOUT_SEC. After that forever, backing off exponentially
+ * with jitter so that hosts don't storm an ep coming back
+ */
+static void host_connect_retry(host_data_t *host_data)
+{
+	comm_handle_t *handle = host_data->handle;
+	long delay_ms;
+
+	host_data->connect_fd = -1;
+
+	if (__atomic_load_n(&handle->is_closing, __ATOMIC_ACQUIRE))
+		return;
+
+	if (!host_data->is_init_done) {
+
+		if (host_data->retries_left > 0) {
+			delay_ms = host_backoff(HOST_CONNECT_RETRY_MIN_MS,
+					MAX_CONN_RETRY_TIMEOUT_SEC * 1000L,
+					host_connect_attempts(host_data));
+
+			host_data->retries_left--;
+
+			wheel_add(&handle->wheel, &host_data->reconnect_timer,
+					delay_ms * 1000, false);
+			return;
+		}
+
+		hostLog(host_data, LOG_WARN, false, "Couldn't connect to ep");
+		host_err(host_data, HOST_CONNECT_FAIL);
+
+		host_init_done(host_data);
+	}
+
+	delay_ms = host_backoff(HOST_RECONNECT_MIN_MS, HOST_RECONNECT_MAX_MS,
+				host_data->reconnect_attempts);
+
+	/* Anywhere in the upper half */
+	delay_ms = delay_ms / 2 + rand_r(&handle->rand_seed) % (delay_ms / 2 + 1);
+
+	host_data->reconnect_attempts++;
+
+	wheel_add(&handle->wheel, &host_data->reconnect_timer,
+			delay_ms * 1000, false);
+}
+
+/* Called when finally connect succeeded or timeout */
+static void host_connect_cb(int sockfd, short which, void *arg)
+{
+	socklen_t optlen = sizeof(int);
+	int ret, optval;
+	host_data_t *host_data = (host_data_t *)arg;
+
+	sockfd = host_data->connect_fd;
+
+	assert(host_data->is_connected == false);
+
+	event_free(host_data->ev_connect);
+	host_data->ev_connect = NULL;
+
+	if (which & EV_TIMEOUT) {
+		optval = ETIMEDOUT;
+	} else {
+		ret = getsockopt(sockfd, SOL_SOCKET, SO_ERROR,
+					&optval, &optlen);
+		if (ret < 0) {
+			genericLog(LOG_WARN, true, "getsockopt() failed");
+			optval = errno;
+		}
+	}
+
+	if (optval == 0) {
+		/* connection successful */
+		host_connected(sockfd, host_data);
+		return;
+	}
+
+	close(sockfd);
+	host_connect_retry(host_data);
+}
+
+/* Stops trying to connect with ep */
+static void host_connect_cancel(host_data_t *host_data)
+{
+	wheel_del(&host_data->handle->wheel, &host_data->reconnect_timer);
+
+	if (host_data->ev_connect == NULL)
+		return;
+
+	event_free(host_data->ev_connect);
+	host_data->ev_connect = NULL;
+
+	close(host_data->connect_fd);
+	host_data->connect_fd = -1;
+}
+
+/* Frees up msgs kept for replay */
+static void host_rtx_free(comm_handle_t *handle)
+{
+	int i;
+
+	for (i = 0; i < handle->rtx_size; i++) {
+		if (handle->rtx_window[i] != NULL)
+			host_frame_put(handle->rtx_window[i]);
+	}
+
+	free(handle->rtx_window);
+}
+
+/* Are enough paths up to be done with startup? */
+static bool host_quorum_met(comm_handle_t *handle)
+{
+	int num_eps = handle->topo.num_eps;
+	bool is_met;
+
+	pthread_mutex_lock(&handle->lock);
+
+	switch (handle->opts.host_quorum) {
+	case QUORUM_EVERY_EP:
+		is_met = handle->num_eps_live == num_eps;
+		break;
+	case QUORUM_EPS:
+		is_met = handle->num_eps_live >= handle->opts.host_quorum_eps;
+		break;
+	case QUORUM_ALL:
+	default:
+		is_met = false;
+		break;
+	}
+
+	pthread_mutex_unlock(&handle->lock);
+
+	return is_met;
+}
+
+static void host_mcast_close(comm_handle_t *handle)
+{
+	int j;
+
+	for (j = 0; j < handle->topo.num_switches; j++) {
+		if (handle->host_mcast[j].fd >= 0)
+			close(handle->host_mcast[j].fd);
+		handle->host_mcast[j].fd = -1;
+	}
+}
+
+/* Group of opts (or the default one) on port of switch sw */
+static int comm_mcast_group(comm_handle_t *handle, int sw,
+				struct sockaddr_in *group)
+{
+	const char *ip = handle->opts.mcast_group;
+
+	if (ip == NULL)
+		ip = COMM_MCAST_GROUP;
+
+	memset(group, 0, sizeof(*group));
+	group->sin_family = AF_INET;
+	group->sin_port = htons(COMM_MCAST_PORT + sw);
+
+	if (inet_pton(AF_INET, ip, &group->sin_addr) != 1 ||
+			!IN_MULTICAST(ntohl(group->sin_addr.s_addr))) {
+		genericLog(LOG_FATAL, false, "Invalid multicast group: %s", ip);
+		return -EINVAL;
+	}
+
+	return 0;
+}
+
+/*
+ * Opens a socket per switch for multicasting data frames, if asked for.
+ * Each goes out of our own address on the switch. Return negative code
+ * on error
+ */
+static int host_mcast_init(comm_handle_t *handle)
+{
+	struct sockaddr_in addr;
+	host_mcast_t *mcast;
+	int j, val, ret;
+
+	for (j = 0; j < MAX_SWITCHES; j++) {
+		handle->host_mcast[j].fd = -1;
+		handle->host_mcast[j].num_live = 0;
+		handle->host_mcast[j].num_crc = 0;
+		handle->host_mcast[j].msgs_sent = 0;
+		handle->host_mcast[j].bytes_sent = 0;
+	}
+
+	if (!handle->opts.multicast)
+		return 0;
+
+	if (handle->opts.wire_legacy || handle->node_num < 0) {
+		genericLog(LOG_WARN, false, "Multicast needs the compact wire "
+				"format and a host in topology, not used");
+		return 0;
+	}
+
+	for (j = 0; j < handle->topo.num_switches; j++) {
+
+		mcast = &handle->host_mcast[j];
+
+		ret = comm_mcast_group(handle, j, &mcast->group);
+		if (ret < 0)
+			goto err;
+
+		memset(&addr, 0, sizeof(addr));
+		addr.sin_family = AF_INET;
+		ret = inet_pton(AF_INET,
+				handle->topo.hosts[handle->node_num].ip[j],
+				&addr.sin_addr);
+		assert(ret == 1);
+
+		mcast->fd = socket(AF_INET, SOCK_DGRAM | SOCK_NONBLOCK |
+					SOCK_CLOEXEC, 0);
+		if (mcast->fd < 0) {
+			ret = -errno;
+			genericLog(LOG_FATAL, true,
+					"Couldn't open multicast socket");
+			goto err;
+		}
+
+		/* Eps find out who sent it by its source address */
+		if (bind(mcast->fd, (struct sockaddr *)&addr,
+					sizeof(addr)) < 0 ||
+				setsockopt(mcast->fd, IPPROTO_IP,
+					IP_MULTICAST_IF, &addr.sin_addr,
+					sizeof(addr.sin_addr)) < 0) {
+			ret = -errno;
+			genericLog(LOG_FATAL, true,
+				"Couldn't multicast over switch %d", j);
+			goto err;
+		}
+
+		/* Stays within the rack, reaching eps on this machine too */
+		val = 1;
+		setsockopt(mcast->fd, IPPROTO_IP, IP_MULTICAST_TTL, &val,
+				sizeof(val));
+		setsockopt(mcast->fd, IPPROTO_IP, IP_MULTICAST_LOOP, &val,
+				sizeof(val));
+
+		val = COMM_MCAST_SOCK_BUF;
+		setsockopt(mcast->fd, SOL_SOCKET, SO_SNDBUF, &val, sizeof(val));
+	}
+
+	return 0;
+
+err:
+	host_mcast_close(handle);
+	return ret;
+}
+
+static void host_uring_deinit(comm_handle_t *handle)
+{
+	host_uring_t *uring = &handle->uring;
+	host_uring_chain_t *chain;
+
+	if (handle->engine != COMM_ENGINE_URING)
+		return;
+
+	/* Loop only exits once every chain is over */
+	while ((chain = uring->free_chains) != NULL) {
+		uring->free_chains = chain->next;
+		free(chain);
+	}
+
+	event_free(uring->ev_complete);
+	event_free(uring->ev_flush);
+	uring_destroy(&uring->ring);
+	free(uring->dirty);
+	free(uring->bufs);
+}
+
+/*
+ * Sets up the io_uring engine if asked for. Host sticks to libevent if
+ * the kernel doesn't have what it needs
+ */
+static int host_uring_init(comm_handle_t *handle)
+{
+	host_uring_t *uring = &handle->uring;
+	int ret;
+
+	handle->engine = COMM_ENGINE_LIBEVENT;
+	memset(&handle->engine_stats, 0, sizeof(handle->engine_stats));
+	memset(uring, 0, sizeof(*uring));
+
+	if (handle->opts.host_engine != COMM_ENGINE_URING)
+		return 0;
+
+	ret = uring_new(&uring->ring, HOST_URING_ENTRIES);
+	if (ret < 0) {
+		genericLog(LOG_WARN, false,
+			"io_uring not available (%s), sending with libevent",
+			strerror(-ret));
+		return 0;
+	}
+
+	if (!uring_has_op(&uring->ring, IORING_OP_SENDMSG)) {
+		genericLog(LOG_WARN, false,
+			"io_uring can't send, sending with libevent");
+		uring_destroy(&uring->ring);
+		return 0;
+	}
+
+	uring->zc_min_len = handle->opts.zc_min_len;
+	if (uring->zc_min_len <= 0)
+		uring->zc_min_len = COMM_ZC_MIN_LEN;
+
+	/* Older kernels copy everything */
+	uring->has_zc = uring_has_op(&uring->ring, IORING_OP_SEND_ZC);
+	uring->has_fixed = uring->has_zc &&
+			uring_register_bufs(&uring->ring, HOST_URING_MAX_BUFS) == 0;
+
+	uring->dirty = calloc(host_num_conns(handle), sizeof(host_data_t *));
+	uring->bufs = calloc(HOST_URING_MAX_BUFS, sizeof(void *));
+	uring->ev_complete = event_new(handle->ev_base, uring->ring.fd, EV_READ,
+					host_uring_ready, handle);
+	uring->ev_flush = event_new(handle->ev_base, -1, 0, host_uring_flush,
+					handle);
+
+	if (uring->dirty == NULL || uring->bufs == NULL ||
+			uring->ev_complete == NULL || uring->ev_flush == NULL) {
+		if (uring->ev_complete != NULL)
+			event_free(uring->ev_complete);
+		if (uring->ev_flush != NULL)
+			event_free(uring->ev_flush);
+		free(uring->dirty);
+		free(uring->bufs);
+		uring_destroy(&uring->ring);
+		return -ENOMEM;
+	}
+
+	handle->engine = COMM_ENGINE_URING;
+	return 0;
+}
+
+/* Flushes out pending data, stops the host thread and frees up everything */
+static void host_deinit(comm_handle_t *handle)
+{
+	int i;
+
+	/* Send signal to end and force flush. Wait for response */
+	__atomic_store_n(&handle->is_closing, true, __ATOMIC_RELEASE);
+	host_wakeup(handle);
+
+	/* Producers blocked by backpressure give up */
+	pthread_mutex_lock(&handle->lock);
+	pthread_cond_broadcast(&handle->backpressure_cond);
+	pthread_mutex_unlock(&handle->lock);
+
+	pthread_join(handle->host_event_thread, NULL);
+
+	/* Producers racing with deinit might have left frames behind */
+	host_drain_submit_ring(handle);
+
+	wheel_destroy(&handle->wheel);
+	host_rtx_free(handle);
+
+	event_free(handle->ev_wakeup);
+	close(handle->wakeup_fd);
+	host_mcast_close(handle);
+	host_uring_deinit(handle);
+
+	/* Connections are all gone, nothing is left coalesced */
+	for (i = 0; i < host_num_conns(handle); i++) {
+		if (handle->host_data[i].ev_coalesce != NULL)
+			event_free(handle->host_data[i].ev_coalesce);
+		if (handle->host_data[i].coalesce != NULL)
+			evbuffer_free(handle->host_data[i].coalesce);
+		free(handle->host_data[i].backlog);
+	}
+
+	ring_destroy(&handle->submit_ring);
+	pool_destroy(&handle->frame_pool);
+	pthread_cond_destroy(&handle->backpressure_cond);
+	pthread_mutex_destroy(&handle->lock);
+
+	/* Connections go away, their totals stay */
+	for (i = 0; i < handle->topo.num_switches; i++)
+		host_sum_switch_stats(handle, i, &handle->closed_stats[i]);
+
+	free(handle->host_data);
+	free(handle->host_eps);
+	handle->host_data = NULL;
+	handle->host_eps = NULL;
+	topo_destroy(&handle->topo);
+}
+
+/* Picks transport to ep as per topology, and its address over it */
+static void host_resolve_ep(host_data_t *host_data)
+{
+	comm_handle_t *handle = host_data->handle;
+	const nodes_t *ep = &handle->topo.eps[host_data->ep_num];
+	struct sockaddr_in *addr = (struct sockaddr_in *)&host_data->ep_addr;
+	transport_type_t type = TRANSPORT_TCP;
+	int ret;
+
+	if (handle->node_num >= 0)
+		type = topo_get_transport(&handle->topo, handle->node_num,
+						host_data->ep_num);
+
+	host_data->transport = transport_ops(type);
+
+	if (host_data->transport->domain == AF_UNIX) {
+		host_data->ep_addr_len = transport_unix_ep_addr(
+				(struct sockaddr_un *)&host_data->ep_addr,
+				ep->name);
+		return;
+	}
+
+	/* Numeric, already checked by topology. No lookups needed */
+	memset(addr, 0, sizeof(*addr));
+	addr->sin_family = AF_INET;
+	addr->sin_port = htons(EP_LISTEN_PORT);
+	ret = inet_pton(AF_INET, ep->ip[host_data->ep_sw], &addr->sin_addr);
+	assert(ret == 1);
+	(void)ret;
+
+	host_data->ep_addr_len = sizeof(*addr);
+}
+
+/* Initialize the host. Return negative code on error */
+static int host_init(comm_handle_t *handle)
+{
+	/* Create an eventfd to wake up the new thread being spawned */
+	int i, ret;
+	int num_conn;
+	int rtx_size;
+
+	srand(time(0));
+	handle->num_msg_sent = 0;
+	handle->session = rand();
+	handle->next_stream_id = 0;
+	handle->num_succ_conns = 0;
+	handle->wakeup_pending = 0;
+	handle->is_closing = false;
+	handle->rand_seed = time(0) ^ getpid();
+
+	/* Session 0 tells that ep has nothing from us */
+	if (handle->session == 0)
+		handle->session = 1;
+
+	handle->path_policy = handle->opts.host_path_policy;
+	if (handle->path_policy < 0 ||
+			handle->path_policy >= PATH_NUM_POLICIES) {
+		genericLog(LOG_WARN, false, "Invalid path policy: %d",
+				handle->path_policy);
+		handle->path_policy = PATH_DUPLICATE;
+	}
+
+	handle->send_mode = handle->opts.host_send_mode;
+	if (handle->send_mode < 0 || handle->send_mode >= SEND_NUM_MODES) {
+		genericLog(LOG_WARN, false, "Invalid send mode: %d",
+				handle->send_mode);
+		handle->send_mode = SEND_ADAPTIVE;
+	}
+
+	if (handle->opts.host_flush_us <= 0)
+		handle->opts.host_flush_us = HOST_FLUSH_US;
+
+	handle->flush_ns = handle->opts.host_flush_us * 1000ULL;
+	handle->flush_tv.tv_sec = handle->opts.host_flush_us / 1000000;
+	handle->flush_tv.tv_usec = handle->opts.host_flush_us % 1000000;
+
+	if (handle->opts.host_backpressure < 0 || handle->opts.host_backpressure >=
+			BACKPRESSURE_NUM_POLICIES) {
+		genericLog(LOG_WARN, false, "Invalid backpressure policy: %d",
+				handle->opts.host_backpressure);
+		handle->opts.host_backpressure = BACKPRESSURE_EAGAIN;
+	}
+
+	if (handle->opts.host_conn_high_wm == 0)
+		handle->opts.host_conn_high_wm = HOST_CONN_HIGH_WM;
+	if (handle->opts.host_conn_low_wm == 0 ||
+			handle->opts.host_conn_low_wm >
+			handle->opts.host_conn_high_wm)
+		handle->opts.host_conn_low_wm = handle->opts.host_conn_high_wm *
+						HOST_CONN_LOW_WM /
+						HOST_CONN_HIGH_WM;
+
+	if (handle->opts.host_submit_high_wm <= 0 ||
+			handle->opts.host_submit_high_wm > HOST_SUBMIT_RING_SIZE)
+		handle->opts.host_submit_high_wm = HOST_SUBMIT_HIGH_WM;
+	if (handle->opts.host_submit_low_wm <= 0 ||
+			handle->opts.host_submit_low_wm >
+			handle->opts.host_submit_high_wm)
+		handle->opts.host_submit_low_wm =
+				handle->opts.host_submit_high_wm *
+				HOST_SUBMIT_LOW_WM / HOST_SUBMIT_HIGH_WM;
+
+	handle->num_backed_up = 0;
+	handle->submit_backed_up = false;
+
+	rtx_size = handle->opts.host_retransmit_window;
+	if (rtx_size <= 0)
+		rtx_size = HOST_RETRANSMIT_WINDOW;
+	if (rtx_size > HOST_RETRANSMIT_WINDOW_MAX)
+		rtx_size = HOST_RETRANSMIT_WINDOW_MAX;
+
+	/* Slots are picked by masking msg_nums */
+	handle->rtx_size = 1;
+	while (handle->rtx_size < rtx_size)
+		handle->rtx_size <<= 1;
+
+	handle->rtx_count = 0;
+	handle->rtx_next = 0;
+	handle->num_eps_live = 0;
+
+	if (handle->opts.host_quorum < 0 ||
+			handle->opts.host_quorum >= QUORUM_NUM_TYPES) {
+		genericLog(LOG_WARN, false, "Invalid quorum: %d",
+				handle->opts.host_quorum);
+		handle->opts.host_quorum = QUORUM_ALL;
+	}
+
+	/* Atleast one ep, never more than there are */
+	if (handle->opts.host_quorum_eps <= 0)
+		handle->opts.host_quorum_eps = 1;
+	if (handle->opts.host_quorum_eps > handle->topo.num_eps)
+		handle->opts.host_quorum_eps = handle->topo.num_eps;
+
+	/* Sized as per topology, all zeroes to start with */
+	handle->host_data = calloc(host_num_conns(handle),
+					sizeof(host_data_t));
+	handle->host_eps = calloc(handle->topo.num_eps, sizeof(host_ep_t));
+	if (handle->host_data == NULL || handle->host_eps == NULL) {
+		genericLog(LOG_FATAL, false,
+				"Couldn't allocate connections to %d eps",
+				handle->topo.num_eps);
+		ret = -ENOMEM;
+		goto conns_err;
+	}
+
+	sem_init(&handle->connect_sem, 0, 0);
+
+	ret = pthread_mutex_init(&handle->lock, NULL);
+	if (ret != 0) {
+		genericLog(LOG_FATAL, false, "Mutex init failed");
+		ret = -ret;
+		goto conns_err;
+	}
+
+	ret = pthread_cond_init(&handle->backpressure_cond, NULL);
+	if (ret != 0) {
+		genericLog(LOG_FATAL, false, "Condition init failed");
+		ret = -ret;
+		goto cond_err;
+	}
+
+	ret = pool_new(&handle->frame_pool);
+	if (ret < 0) {
+		genericLog(LOG_FATAL, false, "Couldn't allocate frame pool");
+		goto pool_err;
+	}
+
+	ret = ring_new(&handle->submit_ring, HOST_SUBMIT_RING_SIZE);
+	if (ret < 0) {
+		genericLog(LOG_FATAL, false, "Couldn't allocate submission ring");
+		goto ring_err;
+	}
+
+	handle->rtx_window = calloc(handle->rtx_size, sizeof(comm_frame_t *));
+	if (handle->rtx_window == NULL) {
+		genericLog(LOG_FATAL, false,
+				"Couldn't allocate retransmit window");
+		ret = -ENOMEM;
+		goto rtx_err;
+	}
+
+	/* All per connection timers of host thread */
+	ret = wheel_new(&handle->wheel, handle->ev_base, 0);
+	if (ret < 0) {
+		genericLog(LOG_FATAL, false, "Couldn't allocate timing wheel");
+		goto wheel_err;
+	}
+
+	handle->wakeup_fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+	if (handle->wakeup_fd < 0) {
+		ret = -errno;
+		genericLog(LOG_FATAL, true, "Couldn't open eventfd");
+		goto eventfd_err;
+	}
+
+	handle->ev_wakeup = event_new(handle->ev_base, handle->wakeup_fd,
+					EV_READ | EV_PERSIST,
+					host_incoming_data, handle);
+
+	event_add(handle->ev_wakeup, NULL);
+
+	ret = host_mcast_init(handle);
+	if (ret < 0)
+		goto mcast_err;
+
+	ret = host_uring_init(handle);
+	if (ret < 0) {
+		genericLog(LOG_FATAL, false, "Couldn't set up io_uring");
+		goto uring_err;
+	}
+
+	/* Initialization */
+	for (i = 0; i < host_num_conns(handle); i++) {
+		host_data_t *host_data = &handle->host_data[i];
+
+		host_data->ep_num = i / handle->topo.num_switches;
+		host_data->ep_sw = i % handle->topo.num_switches;
+
+		host_data->is_connected = false;
+		host_data->is_live = false;
+		host_data->is_init_done = false;
+		host_data->connect_fd = -1;
+		host_data->retries_left = MAX_CONN_RETRIES;
+		host_data->reconnect_attempts = 0;
+		host_data->ev_connect = NULL;
+		host_data->frames_recv = 0;
+		host_data->heartbeats_sent = 0;
+		host_data->heartbeats_suppressed = 0;
+		host_data->heartbeat_bytes_saved = 0;
+		host_data->msgs_sent = 0;
+		host_data->bytes_sent = 0;
+		host_data->promotions = 0;
+		host_data->reconnects = 0;
+		host_data->msgs_replayed = 0;
+		host_data->is_mcast = false;
+		host_data->nacks = 0;
+		host_data->msgs_resent = 0;
+		host_data->uring_fd = -1;
+		host_data->handle = handle;
+
+		host_resolve_ep(host_data);
+
+		wheel_timer_init(&host_data->reconnect_timer,
+				host_reconnect_cb, host_data);
+
+		/* Checker for periodic heartbeat */
+		wheel_timer_init(&host_data->heartbeat_check_timer,
+				host_check_heartbeat, host_data);
+
+		/* Request heartbeat from a quiet ep */
+		wheel_timer_init(&host_data->heartbeat_req_timer,
+				host_req_heartbeat, host_data);
+	}
+
+	/* Try to connect with the eps */
+	for (i = 0; i < host_num_conns(handle); i++)
+		host_connect_start(&handle->host_data[i]);
+
+	/* start a new thread that will handle the event loop */
+	ret = pthread_create(&handle->host_event_thread, NULL,
+				host_event_loop, (void *)handle);
+	if (ret != 0) {
+		genericLog(LOG_FATAL, false,
+				"Couldn't start a new event handler thread");
+		ret = -ret;
+		goto sock_err;
+	}
+
+	/*
+	 * Wait for all connections to be tried to be connected, or just
+	 * till quorum. Startup attempts still going on finish in background
+	 */
+	for (i = 0; i < host_num_conns(handle); i++) {
+		while (sem_wait(&handle->connect_sem) < 0 && errno == EINTR)
+			;
+
+		if (host_quorum_met(handle))
+			break;
+	}
+
+	pthread_mutex_lock(&handle->lock);
+	num_conn = handle->num_succ_conns;
+	pthread_mutex_unlock(&handle->lock);
+
+	if (num_conn == 0) {
+		genericLog(LOG_FATAL, false, "No connections established");
+		host_deinit(handle);
+		return -1;
+	}
+
+	return 0;
+
+sock_err:
+	for (i = 0; i < host_num_conns(handle); i++) {
+
+		host_data_t *host_data = &handle->host_data[i];
+
+		host_connect_cancel(host_data);
+
+		if (host_data->is_connected == false)
+			continue;
+		host_data->transport->bev_free(host_data->bev_write);
+		frame_parser_destroy(&host_data->parser);
+	}
+
+	host_uring_deinit(handle);
+
+uring_err:
+	host_mcast_close(handle);
+
+mcast_err:
+	event_free(handle->ev_wakeup);
+	close(handle->wakeup_fd);
+
+eventfd_err:
+	wheel_destroy(&handle->wheel);
+
+wheel_err:
+	free(handle->rtx_window);
+
+rtx_err:
+	ring_destroy(&handle->submit_ring);
+
+ring_err:
+	pool_destroy(&handle->frame_pool);
+
+pool_err:
+	pthread_cond_destroy(&handle->backpressure_cond);
+
+cond_err:
+	pthread_mutex_destroy(&handle->lock);
+
+conns_err:
+	free(handle->host_data);
+	free(handle->host_eps);
+	topo_destroy(&handle->topo);
+	return ret;
+}
+
+/*
+ * This function is called on any error while ep is reading/writing
+ */
+void ep_event(struct bufferevent *bev, short event, void *arg)
+{
+	ep_data_t *ep_data = (ep_data_t *)arg;
+	(void)bev;
+
+    	if (event & BEV_EVENT_EOF) {
+		/* Host disconnected */
+		epLog(ep_data, LOG_WARN, false,
+			"Host connection terminated");
+
+	} else if (event & BEV_EVENT_ERROR || event & BEV_EVENT_WRITING ||
+			event & BEV_EVENT_READING) {
+		/* Some other error occurred */
+		epLog(ep_data, LOG_WARN, false,
+			"Socket failure, disconnecting host");
+	} else {
+		epLog(ep_data, LOG_WARN, false,
+			"Unknown error on socket, disconnecting host");
+	} 
+
+	ep_err(ep_data, EP_CONNECT_TERMINATE);
+	return;
+}
+
+/*
+ * This function will be called by libevent after heartbeat is sent to host
+ */
+static void ep_write(struct bufferevent *bev, void *arg)
+{
+	(void)bev;
+	(void)arg;
+}
+
+/* Passes a chunk of a stream on to the application */
+static void ep_stream_chunk(comm_handle_t *handle, int host_num, int host_sw,
+				frame_t *frame)
+{
+	comm_stream_hdr_t hdr;
+	uint64_t len;
+
+	if (frame->msg_len < (int)sizeof(hdr)) {
+		genericLog(LOG_WARN, false, "HOST(%d:%d): Stream msg too short",
+				host_num, host_sw);
+		return;
+	}
+
+	/* Chunk follows the header (little endian) in the payload */
+	memcpy(&hdr, frame->buf, sizeof(hdr));
+	hdr.stream_id = le32toh(hdr.stream_id);
+	hdr.offset = le64toh(hdr.offset);
+	hdr.total_len = le64toh(hdr.total_len);
+	len = frame->msg_len - sizeof(hdr);
+
+	if (hdr.offset > hdr.total_len || len > hdr.total_len - hdr.offset) {
+		genericLog(LOG_WARN, false,
+				"HOST(%d:%d): Stream chunk out of bounds",
+				host_num, host_sw);
+		return;
+	}
+
+	if (handle->opts.ep_stream_callback == NULL) {
+		genericLog(LOG_WARN, false,
+				"HOST(%d:%d): No stream callback, dropping "
+				"stream chunk", host_num, host_sw);
+		return;
+	}
+
+	handle->opts.ep_stream_callback(host_num,
+					host_sw,
+					frame->session,
+					hdr.stream_id,
+					hdr.offset,
+					hdr.total_len,
+					&frame->buf[sizeof(hdr)],
+					len);
+}
+
+/* Passes a msg (with its payload) on to the application */
+static void ep_deliver(comm_handle_t *handle, int host_num, int host_sw,
+			frame_t *frame)
+{
+	__atomic_add_fetch(&handle->ep_stats.delivered, 1, __ATOMIC_RELAXED);
+
+	if (frame->msg_type == MSG_STREAM) {
+		ep_stream_chunk(handle, host_num, host_sw, frame);
+		return;
+	}
+
+	/* Call the callback indicating reception of data */
+	handle->ep_callback(host_num,
+				host_sw,
+				frame->session,
+				frame->msg_num,
+				frame->buf,
+				frame->msg_len);
+}
+
+/* Payload of frame, decompressing it if it came so */
+static char *ep_payload(ep_data_t *ep_data, frame_t *frame,
+			struct evbuffer *input)
+{
+	comm_lz_stats_t *stats = &ep_data->ep_handle->lz_stats;
+	uint64_t start;
+	char *buf;
+
+	/* Datagram, all of it already at hand */
+	if (input == NULL)
+		return frame->buf;
+
+	if (!frame->is_lz || frame->buf != NULL)
+		return frame_payload(&ep_data->parser, input);
+
+	start = comm_now_ns();
+	buf = frame_payload(&ep_data->parser, input);
+	if (buf == NULL)
+		return NULL;
+
+	__atomic_add_fetch(&stats->ns, comm_now_ns() - start, __ATOMIC_RELAXED);
+	__atomic_add_fetch(&stats->msgs, 1, __ATOMIC_RELAXED);
+	__atomic_add_fetch(&stats->raw_bytes, frame->msg_len, __ATOMIC_RELAXED);
+	__atomic_add_fetch(&stats->lz_bytes, frame->wire_len, __ATOMIC_RELAXED);
+
+	return buf;
+}
+
+static bool ep_merge_test(ep_merge_t *merge, int msg_num)
+{
+	unsigned int bit = (unsigned int)msg_num % EP_MERGE_WINDOW;
+
+	return merge->seen[bit / 64] & (1UL << (bit % 64));
+}
+
+static void ep_merge_set(ep_merge_t *merge, int msg_num)
+{
+	unsigned int bit = (unsigned int)msg_num % EP_MERGE_WINDOW;
+
+	merge->seen[bit / 64] |= 1UL << (bit % 64);
+}
+
+static void ep_merge_clear(ep_merge_t *merge, int msg_num)
+{
+	unsigned int bit = (unsigned int)msg_num % EP_MERGE_WINDOW;
+
+	merge->seen[bit / 64] &= ~(1UL << (bit % 64));
+}
+
+/* Delivers the msg held back at msg_num, if any */
+static void ep_merge_release(comm_handle_t *handle, int host_num,
+				ep_merge_t *merge, int msg_num)
+{
+	unsigned int slot = (unsigned int)msg_num % EP_MERGE_WINDOW;
+	ep_held_msg_t *held = merge->held[slot];
+	frame_t frame;
+
+	if (held == NULL)
+		return;
+
+	merge->held[slot] = NULL;
+
+	frame.msg_type = held->msg_type;
+	frame.msg_len = held->msg_len;
+	frame.msg_num = held->msg_num;
+	frame.session = held->session;
+	frame.buf = held->buf;
+
+	ep_deliver(handle, host_num, held->host_sw, &frame);
+
+	free(held);
+}
+
+/* Forgets everything about older session. Starts afresh at msg_num */
+static void ep_merge_reset(ep_merge_t *merge, int session, int msg_num)
+{
+	int i;
+
+	for (i = 0; i < EP_MERGE_WINDOW; i++) {
+		free(merge->held[i]);
+		merge->held[i] = NULL;
+	}
+
+	memset(merge->seen, 0, sizeof(merge->seen));
+
+	merge->is_valid = true;
+	merge->session = session;
+	merge->next = msg_num;
+}
+
+/*
+ * Moves window ahead till next, delivering msgs held back on the way and
+ * reporting the ones which never arrived
+ */
+static void ep_merge_slide(comm_handle_t *handle, int host_num,
+				ep_merge_t *merge, int next)
+{
+	int ahead = (int)((unsigned int)next - (unsigned int)merge->next);
+	int gap_start = 0, gap_len = 0, i;
+
+	/* Only the window can have anything in it, however far next is */
+	for (i = 0; i < ahead && i < EP_MERGE_WINDOW; i++) {
+
+		if (ep_merge_test(merge, merge->next)) {
+			ep_merge_clear(merge, merge->next);
+			ep_merge_release(handle, host_num, merge, merge->next);
+		} else {
+			if (gap_len == 0)
+				gap_start = merge->next;
+			gap_len++;
+		}
+
+		merge->next++;
+	}
+
+	if (ahead > EP_MERGE_WINDOW) {
+		if (gap_len == 0)
+			gap_start = merge->next;
+		gap_len += ahead - EP_MERGE_WINDOW;
+		merge->next = next;
+	}
+
+	/* Without dedup, msgs arriving later are still delivered */
+	if (gap_len == 0 || !handle->opts.ep_dedup)
+		return;
+
+	__atomic_add_fetch(&handle->ep_stats.lost, gap_len, __ATOMIC_RELAXED);
+
+	if (handle->opts.ep_gap_callback)
+		handle->opts.ep_gap_callback(host_num, merge->session,
+						gap_start, gap_len);
+}
+
+/*
+ * Host replays from start on a new connection. A session we have nothing
+ * of is taken from there on, whichever switch its msgs come over first.
+ * Msgs of ours before start are no longer kept by host, they are given up
+ * on right away instead of holding back the ones after them
+ */
+static void ep_merge_seed(comm_handle_t *handle, int host_num, int session,
+				int start)
+{
+	ep_merge_t *merge = &handle->ep_merge[host_num];
+
+	pthread_mutex_lock(&merge->lock);
+	if (!merge->is_valid || merge->session != session)
+		ep_merge_reset(merge, session, start);
+	else if ((int)((unsigned int)start - (unsigned int)merge->next) > 0)
+		ep_merge_slide(handle, host_num, merge, start);
+	pthread_mutex_unlock(&merge->lock);
+}
+
+/*
+ * Delivers a msg only the first time it arrives (over any switch), in
+ * order of msg numbers if asked to. Duplicates are dropped without looking
+ * at their payload. Returns negative code if payload couldn't be read
+ */
+static int ep_merge_frame(ep_data_t *ep_data, frame_t *frame,
+				struct evbuffer *input)
+{
+	comm_handle_t *handle = ep_data->ep_handle;
+	ep_merge_t *merge = &handle->ep_merge[ep_data->host_num];
+	ep_held_msg_t *held;
+	int diff, ret = 0;
+
+	/* Serializes delivery of msgs from a host across switches */
+	pthread_mutex_lock(&merge->lock);
+
+	/* Host didn't tell where its replay starts (see ep_merge_seed()) */
+	if (!merge->is_valid || merge->session != frame->session)
+		ep_merge_reset(merge, frame->session, frame->msg_num);
+
+	diff = (int)((unsigned int)frame->msg_num - (unsigned int)merge->next);
+
+	if (diff < 0 || (diff < EP_MERGE_WINDOW &&
+				ep_merge_test(merge, frame->msg_num))) {
+		/* Already got it on other switch */
+		__atomic_add_fetch(&handle->ep_stats.duplicates, 1,
+					__ATOMIC_RELAXED);
+		goto out;
+	}
+
+	/* Way ahead - Give up on the oldest msgs */
+	if (diff >= EP_MERGE_WINDOW)
+		ep_merge_slide(ep_data->ep_handle, ep_data->host_num, merge,
+				frame->msg_num - EP_MERGE_WINDOW + 1);
+
+	if (ep_payload(ep_data, frame, input) == NULL &&
+			frame->msg_len != 0) {
+		ret = -ENOMEM;
+		goto out;
+	}
+
+	ep_merge_set(merge, frame->msg_num);
+
+	if (handle->opts.ep_ordered && frame->msg_num != merge->next) {
+
+		/* Hold a copy till the msgs before it arrive */
+		held = malloc(sizeof(ep_held_msg_t) + frame->msg_len);
+		if (held == NULL) {
+			ep_merge_clear(merge, frame->msg_num);
+			ret = -ENOMEM;
+			goto out;
+		}
+
+		held->msg_type = frame->msg_type;
+		held->msg_num = frame->msg_num;
+		held->session = frame->session;
+		held->msg_len = frame->msg_len;
+		held->host_sw = ep_data->host_sw;
+		memcpy(held->buf, frame->buf, frame->msg_len);
+
+		merge->held[(unsigned int)frame->msg_num % EP_MERGE_WINDOW] = held;
+
+		__atomic_add_fetch(&handle->ep_stats.held, 1, __ATOMIC_RELAXED);
+		goto out;
+	}
+
+	ep_deliver(handle, ep_data->host_num, ep_data->host_sw, frame);
+
+	/* Move past everything received in order */
+	while (ep_merge_test(merge, merge->next)) {
+		ep_merge_clear(merge, merge->next);
+		ep_merge_release(handle, ep_data->host_num, merge, merge->next);
+		merge->next++;
+	}
+
+out:
+	pthread_mutex_unlock(&merge->lock);
+	return ret;
+}
+
+/*
+ * Without dedup, msgs are delivered as they come over each switch. Only
+ * keeps track of the ones that arrived over any of them, for acking
+ */
+static void ep_merge_note(comm_handle_t *handle, int host_num,
+				frame_t *frame)
+{
+	ep_merge_t *merge = &handle->ep_merge[host_num];
+	int diff;
+
+	pthread_mutex_lock(&merge->lock);
+
+	if (!merge->is_valid || merge->session != frame->session)
+		ep_merge_reset(merge, frame->session, frame->msg_num);
+
+	diff = (int)((unsigned int)frame->msg_num - (unsigned int)merge->next);
+
+	if (diff < 0 || (diff < EP_MERGE_WINDOW &&
+				ep_merge_test(merge, frame->msg_num)))
+		goto out;
+
+	if (diff >= EP_MERGE_WINDOW)
+		ep_merge_slide(handle, host_num, merge,
+				frame->msg_num - EP_MERGE_WINDOW + 1);
+
+	ep_merge_set(merge, frame->msg_num);
+
+	while (ep_merge_test(merge, merge->next)) {
+		ep_merge_clear(merge, merge->next);
+		merge->next++;
+	}
+
+out:
+	pthread_mutex_unlock(&merge->lock);
+}
+
+/* Gives statistics about msgs received */
+void ep_get_stats(comm_handle_t *handle, comm_ep_stats_t *stats)
+{
+	stats->delivered = __atomic_load_n(&handle->ep_stats.delivered,
+						__ATOMIC_RELAXED);
+	stats->duplicates = __atomic_load_n(&handle->ep_stats.duplicates,
+						__ATOMIC_RELAXED);
+	stats->held = __atomic_load_n(&handle->ep_stats.held,
+						__ATOMIC_RELAXED);
+	stats->lost = __atomic_load_n(&handle->ep_stats.lost,
+						__ATOMIC_RELAXED);
+	stats->acks_sent = __atomic_load_n(&handle->ep_stats.acks_sent,
+						__ATOMIC_RELAXED);
+	stats->crc_errors = __atomic_load_n(&handle->ep_stats.crc_errors,
+						__ATOMIC_RELAXED);
+	stats->crc_dropped = __atomic_load_n(&handle->ep_stats.crc_dropped,
+						__ATOMIC_RELAXED);
+	stats->invalid = __atomic_load_n(&handle->ep_stats.invalid,
+						__ATOMIC_RELAXED);
+	stats->mcast_msgs = __atomic_load_n(&handle->ep_stats.mcast_msgs,
+						__ATOMIC_RELAXED);
+	stats->nacks_sent = __atomic_load_n(&handle->ep_stats.nacks_sent,
+						__ATOMIC_RELAXED);
+	stats->msgs_nacked = __atomic_load_n(&handle->ep_stats.msgs_nacked,
+						__ATOMIC_RELAXED);
+}
+
+/*
+ * Gives compression done by host on msgs sent (or decompression by ep on
+ * msgs received). Still works after comm_deinit()
+ */
+void comm_get_lz_stats(comm_handle_t *handle, comm_lz_stats_t *stats)
+{
+	stats->msgs = __atomic_load_n(&handle->lz_stats.msgs,
+					__ATOMIC_RELAXED);
+	stats->skipped = __atomic_load_n(&handle->lz_stats.skipped,
+					__ATOMIC_RELAXED);
+	stats->raw_bytes = __atomic_load_n(&handle->lz_stats.raw_bytes,
+					__ATOMIC_RELAXED);
+	stats->lz_bytes = __atomic_load_n(&handle->lz_stats.lz_bytes,
+					__ATOMIC_RELAXED);
+	stats->ns = __atomic_load_n(&handle->lz_stats.ns, __ATOMIC_RELAXED);
+}
+
+/* Frees up state kept for msgs from hosts */
+static void ep_merge_free(comm_handle_t *handle)
+{
+	int i;
+
+	if (handle->ep_merge == NULL)
+		return;
+
+	for (i = 0; i < handle->topo.num_hosts; i++) {
+		ep_merge_reset(&handle->ep_merge[i], 0, 0);
+		pthread_mutex_destroy(&handle->ep_merge[i].lock);
+	}
+
+	free(handle->ep_merge);
+	handle->ep_merge = NULL;
+}
+
+/*
+ * Sets up state for acking msgs from each host, whichever switch they come
+ * over, and for dropping duplicates if asked to
+ */
+static int ep_merge_init(comm_handle_t *handle)
+{
+	int i;
+
+	/*
+	 * Ordering needs dropping of duplicates too, so does multicast (msgs
+	 * come over it and the connection)
+	 */
+	if (handle->opts.ep_ordered || handle->opts.multicast)
+		handle->opts.ep_dedup = true;
+
+	handle->ep_merge = calloc(handle->topo.num_hosts, sizeof(ep_merge_t));
+	if (handle->ep_merge == NULL)
+		return -ENOMEM;
+
+	for (i = 0; i < handle->topo.num_hosts; i++)
+		pthread_mutex_init(&handle->ep_merge[i].lock, NULL);
+
+	return 0;
+}
+
+/*
+ * Sends msg of type telling host the next msg we expect from it. That
+ * acknowledges all the msgs before it (and lets host replay what got lost
+ * along with the last connection)
+ */
+static int ep_send_ack(ep_data_t *ep_data, int msg_type)
+{
+	comm_handle_t *handle = ep_data->ep_handle;
+	uint8_t buf[FRAME_MAX_HDR_LEN + 1 + FRAME_CRC_LEN];
+	ep_merge_t *merge = &handle->ep_merge[ep_data->host_num];
+	comm_data_t resume_data;
+	int len;
+
+	resume_data.msg_type = msg_type;
+	resume_data.msg_len = 0;
+	resume_data.session = 0;
+	resume_data.msg_num = 0;
+
+	/* Offer the newest wire format, old hosts ignore it */
+	if (msg_type == MSG_RESUME && !handle->opts.wire_legacy)
+		resume_data.msg_len = 1;
+
+	/*
+	 * Whatever came over any switch needn't come again. Not just this
+	 * one, host may spread msgs over them
+	 */
+	pthread_mutex_lock(&merge->lock);
+	if (merge->is_valid) {
+		resume_data.session = merge->session;
+		resume_data.msg_num = merge->next;
+	}
+	pthread_mutex_unlock(&merge->lock);
+
+	len = frame_encode_hdr(ep_data->wire, buf, msg_type,
+				resume_data.msg_len, resume_data.msg_num,
+				resume_data.session, ep_data->wire_session);
+
+	if (resume_data.msg_len != 0)
+		buf[len++] = FRAME_WIRE_NEWEST |
+				(handle->opts.frame_crc ? FRAME_WIRE_CRC : 0) |
+				(handle->opts.frame_compress ? FRAME_WIRE_LZ : 0) |
+				(handle->opts.multicast ? FRAME_WIRE_MCAST : 0);
+
+	if (ep_data->wire & FRAME_WIRE_CRC) {
+		frame_encode_crc(&buf[len], buf, len, NULL, 0);
+		len += FRAME_CRC_LEN;
+	}
+
+	return bufferevent_write(ep_data->bev, buf, len);
+}
+
+/* Host picked wire format from what we offered. Switches over to it */
+static int ep_switch_wire(ep_data_t *ep_data, frame_t *frame,
+				struct evbuffer *input)
+{
+	comm_opts_t *opts = &ep_data->ep_handle->opts;
+	int wire = FRAME_WIRE_VERSION(frame->msg_num);
+	uint8_t hdr[FRAME_MAX_HDR_LEN];
+	ep_mcast_t *mcast;
+	uint32_t start;
+	char *buf;
+	int len;
+
+	if (opts->wire_legacy || wire <= FRAME_WIRE_V0 ||
+			wire > FRAME_WIRE_NEWEST ||
+			(frame->msg_num & ~(FRAME_WIRE_CRC | FRAME_WIRE_LZ |
+						FRAME_WIRE_MCAST | wire)) != 0 ||
+			((frame->msg_num & FRAME_WIRE_CRC) && !opts->frame_crc) ||
+			((frame->msg_num & FRAME_WIRE_LZ) &&
+				!opts->frame_compress) ||
+			((frame->msg_num & FRAME_WIRE_MCAST) &&
+				!opts->multicast)) {
+		epLog(ep_data, LOG_WARN, false, "Invalid wire format: %d",
+			frame->msg_num);
+		ep_err(ep_data, EP_INVALID_MSG);
+		return -EINVAL;
+	}
+
+	/* Before anything of the replay (or multicast) can get merged */
+	if (frame->msg_len == sizeof(start)) {
+		buf = frame_payload(&ep_data->parser, input);
+		if (buf != NULL) {
+			memcpy(&start, buf, sizeof(start));
+			ep_merge_seed(ep_data->ep_handle, ep_data->host_num,
+					frame->session, le32toh(start));
+		}
+	}
+
+	/* Host is in new format from the next frame on */
+	frame_parser_set_wire(&ep_data->parser, frame->msg_num,
+				frame->session);
+
+	/* Last frame of ours in v0, telling host to switch as well */
+	len = frame_encode_hdr(FRAME_WIRE_V0, hdr, MSG_WIRE, 0,
+				frame->msg_num, frame->session, 0);
+	if (bufferevent_write(ep_data->bev, hdr, len) < 0) {
+		epLog(ep_data, LOG_WARN, false, "Couldn't switch wire format");
+		ep_err(ep_data, EP_CONNECT_TERMINATE);
+		return -EIO;
+	}
+
+	ep_data->wire = frame->msg_num;
+	ep_data->wire_session = frame->session;
+
+	/* Newest connection from host over the switch takes its multicast */
+	if (ep_data->wire & FRAME_WIRE_MCAST) {
+		mcast = ep_mcast_of(ep_data->ep_handle, ep_data->host_num,
+					ep_data->host_sw);
+		mcast->conn = ep_data;
+		mcast->has_next = false;
+	}
+
+	return 0;
+}
+
+/* Asks host for count msgs from msg_num of session, missed over multicast */
+static int ep_send_nack(ep_data_t *ep_data, int session, int msg_num,
+			int count)
+{
+	comm_handle_t *handle = ep_data->ep_handle;
+	uint8_t buf[FRAME_MAX_HDR_LEN + sizeof(uint32_t) + FRAME_CRC_LEN];
+	uint32_t le_count = htole32(count);
+	int len;
+
+	len = frame_encode_hdr(ep_data->wire, buf, MSG_NACK, sizeof(le_count),
+				msg_num, session, ep_data->wire_session);
+	memcpy(&buf[len], &le_count, sizeof(le_count));
+	len += sizeof(le_count);
+
+	if (ep_data->wire & FRAME_WIRE_CRC) {
+		frame_encode_crc(&buf[len], buf, len, NULL, 0);
+		len += FRAME_CRC_LEN;
+	}
+
+	__atomic_add_fetch(&handle->ep_stats.nacks_sent, 1, __ATOMIC_RELAXED);
+	__atomic_add_fetch(&handle->ep_stats.msgs_nacked, count,
+				__ATOMIC_RELAXED);
+
+	return bufferevent_write(ep_data->bev, buf, len);
+}
+
+/* Has msg_num (at or after next, of the same session) arrived already? */
+static bool ep_merge_has(ep_merge_t *merge, int msg_num)
+{
+	int diff = (int)((unsigned int)msg_num - (unsigned int)merge->next);
+
+	return diff < EP_MERGE_WINDOW && ep_merge_test(merge, msg_num);
+}
+
+/*
+ * Msgs of session before upto should have come over multicast by now. Asks
+ * host for the ones which haven't arrived over any switch, past those
+ * asked for already. Returns negative code if the connection got closed
+ */
+static int ep_mcast_check(ep_data_t *ep_data, ep_mcast_t *mcast,
+				int session, int upto)
+{
+	comm_handle_t *handle = ep_data->ep_handle;
+	ep_merge_t *merge = &handle->ep_merge[ep_data->host_num];
+	unsigned int from, to;
+	bool is_known;
 
-	comm_handle_t *handle = host_data->handle;
+	pthread_mutex_lock(&merge->lock);
 
-	host_data->bev_write =
-		bufferevent_socket_new(host_data->handle->ev_base, sockfd,
-					BEV_OPT_CLOSE_ON_FREE);
+	is_known = merge->is_valid && merge->session == session;
 
-	host_data->is_connected = true;
-			
-	bufferevent_setcb(host_data->bev_write,
-				host_got_heartbeat,
-				NULL,
-				host_event,
-				host_data);
+	/* Nothing to go by on this switch yet, all that was merged counts */
+	if (!mcast->has_next || mcast->session != session) {
+		mcast->has_next = true;
+		mcast->session = session;
+		mcast->next = is_known ? merge->next : upto;
+	}
 
-	bufferevent_enable(host_data->bev_write,
-				EV_READ | EV_WRITE);
+	from = mcast->next;
+	to = upto;
 
-	/* Checker for periodic heartbeat */
-	host_data->heartbeat_check_timer = event_new(handle->ev_base, -1, EV_PERSIST,
-			host_check_heartbeat, host_data);
+	if (is_known) {
+		if ((int)(from - (unsigned int)merge->next) < 0)
+			from = merge->next;
 
-	event_add(host_data->heartbeat_check_timer, &heartbeat_check_time);
+		while ((int)(to - from) > 0 && ep_merge_has(merge, from))
+			from++;
+		while ((int)(to - from) > 0 && ep_merge_has(merge, to - 1))
+			to--;
+	}
 
-	/* Request periodic heartbeat */
-	host_data->heartbeat_req_timer = event_new(handle->ev_base, -1, EV_PERSIST,
-			host_req_heartbeat, host_data);
+	pthread_mutex_unlock(&merge->lock);
 
-	event_add(host_data->heartbeat_req_timer, &heartbeat_req_time);
+	if ((int)((unsigned int)upto - mcast->next) > 0)
+		mcast->next = upto;
 
-	pthread_mutex_lock(&handle->lock);
-	handle->num_succ_conns++;
-	pthread_mutex_unlock(&handle->lock);
+	if ((int)(to - from) <= 0)
+		return 0;
 
-	sem_post(&host_data->handle->connect_sem);
+	if (ep_send_nack(ep_data, session, from, to - from) < 0) {
+		epLog(ep_data, LOG_WARN, false, "Couldn't send nack");
+		ep_err(ep_data, EP_CONNECT_TERMINATE);
+		return -EIO;
+	}
+
+	return 0;
 }
 
-/* Tries to reconnect after failed attempt - Doesn't immedaitely reconnect */
-static void host_try_connect(host_data_t *host_data)
+/* Msg arrived on a connection taking multicast, over either of them */
+static void ep_mcast_saw(ep_data_t *ep_data, frame_t *frame)
 {
-	int ret;
-	int sockfd = host_data->connect_fd;
+	ep_mcast_t *mcast = ep_mcast_of(ep_data->ep_handle, ep_data->host_num,
+					ep_data->host_sw);
+	unsigned int next = (unsigned int)frame->msg_num + 1;
+
+	if (!mcast->has_next || mcast->session != frame->session) {
+		mcast->has_next = true;
+		mcast->session = frame->session;
+		mcast->next = next;
+	} else if ((int)(next - (unsigned int)mcast->next) > 0) {
+		mcast->next = next;
+	}
+}
 
-	if (host_data->retries_left > 0) {
+static bool ep_mcast_recv(ep_mcast_sock_t *sock, int max);
 
-		struct hostent *server;
-		struct sockaddr_in serveraddr;
-		int sockfd = host_data->connect_fd;
-		char *ep_name = eps[host_data->ep_num].ip[host_data->ep_sw];
+/* Acks msgs received since the last ack */
+static void ep_ack_timeout(void *arg)
+{
+	ep_data_t *ep_data = (ep_data_t *)arg;
 
-		server = gethostbyname(ep_name);
-		if (server == NULL) {
-			hostLog(host_data, LOG_WARN, false, 
-				"Issue in EPs ipaddr", ep_name);
-			host_err(host_data, HOST_CONNECT_FAIL);
+	if (ep_send_ack(ep_data, MSG_ACK) < 0) {
+		epLog(ep_data, LOG_WARN, false, "Couldn't send ack");
+		ep_err(ep_data, EP_CONNECT_TERMINATE);
+		return;
+	}
 
-			close(sockfd);
-			return;
-		}
+	__atomic_add_fetch(&ep_data->ep_handle->ep_stats.acks_sent, 1,
+				__ATOMIC_RELAXED);
+}
 
-		/* build the server's Internet address */
-		bzero((char *) &serveraddr, sizeof(serveraddr));
-		serveraddr.sin_family = AF_INET;
-		bcopy((char *)server->h_addr, 
-			(char *)&serveraddr.sin_addr.s_addr,
-			server->h_length);
-		serveraddr.sin_port = htons((unsigned short)EP_LISTEN_PORT);
-
-		/* connect: create a connection with the server */
-    		ret = connect(sockfd, (struct sockaddr *)&serveraddr,
-				sizeof(serveraddr));
-		if (ret < 0 && errno == EINPROGRESS) {
-			/* 
-			 * Couldn't connect right away but will connect in
-			 * future
-			 */
+/*
+ * Acts on a frame received from host. Returns negative code if the
+ * connection got closed
+ */
+static int ep_handle_frame(ep_data_t *ep_data, frame_t *frame,
+				struct evbuffer *input)
+{
+	comm_handle_t *handle = ep_data->ep_handle;
+	ep_mcast_sock_t *sock;
+	ep_mcast_t *mcast;
+	bool drained;
 
-			struct timeval tv;
-			host_data->ev_connect =
-				event_new(host_data->handle->ev_base, sockfd,
-						EV_WRITE, host_connect_cb,
-						host_data);
-				
-			tv.tv_sec = MAX_CONN_TIMEOUT_SEC;
-			tv.tv_usec = 0;
+	switch (frame->msg_type) {
+	case MSG_HEARTBEAT_REQ:
 
-			event_add(host_data->ev_connect, &tv);
+		mcast = handle->ep_mcast == NULL ? NULL :
+				ep_mcast_of(handle, ep_data->host_num,
+						ep_data->host_sw);
 
-			return;
+		if (mcast != NULL && mcast->conn == ep_data) {
+			/* Whatever host multicast before asking is here by now */
+			sock = &handle->ep_mcast_socks[ep_data->host_sw];
+			drained = ep_mcast_recv(sock, EP_MCAST_BATCH);
 
-		} else if (ret < 0){
-			/* XXX: Check this!! Not sure about this function */
-			/* Error on connecting. try again */
-			struct timeval tv;
-			host_data->ev_connect =
-				event_new(host_data->handle->ev_base, -1,
-						0, host_connect_cb,
-						host_data);
-				
-			tv.tv_sec = MAX_CONN_RETRY_TIMEOUT_SEC;
-			tv.tv_usec = 0;
+			/* Connection broke meanwhile, asking for some of it */
+			if (mcast->conn != ep_data)
+				return -EIO;
 
-			event_add(host_data->ev_connect, &tv);
+			/*
+			 * Rest is read a batch at a time like any other, what
+			 * is missing then gets asked for at the next heartbeat
+			 */
+			if (!drained)
+				event_active(sock->ev, EV_READ, 0);
+			else if (ep_mcast_check(ep_data, mcast, frame->session,
+						frame->msg_num) < 0)
+				return -EIO;
+		}
 
-			host_data->retries_left--;
+		/* Acks everything received till now along */
+		wheel_del(&ep_data->worker->wheel, &ep_data->ack_timer);
 
-			return;
-		} else {
-			host_connected(sockfd, host_data);
-			return;
+		if (ep_send_ack(ep_data, MSG_HEARTBEAT_RESP) < 0) {
+			epLog(ep_data, LOG_WARN, false,
+				"Couldn't send heartbeat");
+			ep_err(ep_data, EP_HEARTBEAT_FAIL);
+			return -EIO;
 		}
 
-	}
+		return 0;
 
-	hostLog(host_data, LOG_WARN, false, "Couldn't connect to ep");
-	host_err(host_data, HOST_CONNECT_FAIL);
+	case MSG_WIRE:
+		return ep_switch_wire(ep_data, frame, input);
 
-	sem_post(&host_data->handle->connect_sem);
+	case MSG_DATA:
+	case MSG_STREAM:
 
-	close(sockfd);
+		/* Ack soon - It also keeps host from asking for heartbeats */
+		if (!wheel_pending(&ep_data->ack_timer))
+			wheel_add(&ep_data->worker->wheel, &ep_data->ack_timer,
+					EP_ACK_DELAY_US, false);
 
-	return;
-}
+		if (ep_data->wire & FRAME_WIRE_MCAST)
+			ep_mcast_saw(ep_data, frame);
 
-/* Called when finally connect succeeded or timeout */
-static void host_connect_cb(int sockfd, short which, void *arg)
-{
-	socklen_t optlen;
-	int ret, optval;
-	host_data_t *host_data = (host_data_t *)arg;
+		if (handle->opts.ep_dedup) {
+			if (ep_merge_frame(ep_data, frame, input) < 0)
+				goto err;
+			return 0;
+		}
 
-	(void)which;
+		if (ep_payload(ep_data, frame, input) == NULL &&
+				frame->msg_len != 0)
+			goto err;
 
-	sockfd = host_data->connect_fd;
+		ep_deliver(handle, ep_data->host_num, ep_data->host_sw, frame);
 
-	assert(host_data->is_connected == false);
+		/* Acked (or resumed from) only once it arrived on some switch */
+		ep_merge_note(handle, ep_data->host_num, frame);
+		return 0;
 
-	event_del(host_data->ev_connect);
-	event_free(host_data->ev_connect);
+	default:
+		/* Whatever it was, its copy over other switches may do */
+		__atomic_add_fetch(&handle->ep_stats.invalid, 1,
+					__ATOMIC_RELAXED);
+		epLog(ep_data, LOG_WARN, false, "Invalid message type: %d",
+			frame->msg_type);
+		return 0;
+	}
 
+err:
+	epLog(ep_data, LOG_WARN, false, "Couldn't read payload");
+	ep_err(ep_data, EP_INVALID_MSG);
+	return -ENOMEM;
+}
 
-	ret = getsockopt(sockfd, SOL_SOCKET, SO_ERROR, &optval, &optlen);
-	if (ret < 0) {
-		genericLog(LOG_WARN, true, "getsockopt() failed");
-		host_err(host_data, HOST_CONNECT_FAIL);
+/* Acts on a data frame multicast by a host, as if it came on its connection */
+static void ep_mcast_frame(ep_mcast_sock_t *sock, struct sockaddr_in *addr,
+				char *buf, ssize_t len)
+{
+	comm_handle_t *handle = sock->handle;
+	ep_data_t *ep_data;
+	ep_mcast_t *mcast;
+	frame_t frame;
+	int host_num, sw, ret;
+
+	host_num = topo_find_addr(&handle->topo, true, addr->sin_addr.s_addr,
+					&sw);
+	if (host_num < 0 || sw != sock->sw)
+		return;
+
+	/* Connection isn't set up for it, yet or anymore */
+	mcast = ep_mcast_of(handle, host_num, sw);
+	ep_data = mcast->conn;
+	if (ep_data == NULL)
+		return;
+
+	/* Longer ones got truncated */
+	ret = len > FRAME_MAX_HDR_LEN + MAX_DATA_LEN + FRAME_CRC_LEN ? -EINVAL :
+		frame_decode(buf, len, ep_data->wire_session,
+				ep_data->wire & FRAME_WIRE_CRC, &frame);
+
+	/* Lost like any other datagram, gets asked for again */
+	if (ret == FRAME_BAD_CRC) {
+		__atomic_add_fetch(&handle->ep_stats.crc_errors, 1,
+					__ATOMIC_RELAXED);
+		__atomic_add_fetch(&handle->ep_stats.crc_dropped, 1,
+					__ATOMIC_RELAXED);
 		return;
 	}
 
-	if (optval == 0) {
-		/* connection successful */
-		host_connected(sockfd, host_data);
+	if (ret < 0 || (frame.msg_type != MSG_DATA &&
+				frame.msg_type != MSG_STREAM)) {
+		__atomic_add_fetch(&handle->ep_stats.invalid, 1,
+					__ATOMIC_RELAXED);
 		return;
-	} else {
+	}
 
-		host_try_connect(host_data);
+	__atomic_add_fetch(&handle->ep_stats.mcast_msgs, 1, __ATOMIC_RELAXED);
+
+	/* Anything before it on this switch is lost */
+	if (ep_mcast_check(ep_data, mcast, frame.session, frame.msg_num) < 0)
 		return;
+
+	ep_handle_frame(ep_data, &frame, NULL);
+}
+
+/*
+ * Acts on upto max datagrams waiting on the socket. Returns false if there
+ * may be more
+ */
+static bool ep_mcast_recv(ep_mcast_sock_t *sock, int max)
+{
+	char buf[FRAME_MAX_HDR_LEN + MAX_DATA_LEN + FRAME_CRC_LEN + 1];
+	struct sockaddr_in addr;
+	socklen_t addr_len;
+	ssize_t len;
+	int i;
+
+	for (i = 0; i < max; i++) {
+
+		addr_len = sizeof(addr);
+		len = recvfrom(sock->fd, buf, sizeof(buf), MSG_TRUNC,
+				(struct sockaddr *)&addr, &addr_len);
+		if (len < 0)
+			return true;
+
+		ep_mcast_frame(sock, &addr, buf, len);
 	}
-	
+
+	return false;
 }
 
-/* Initialize the host. Return negative code on error */
-static int host_init(comm_handle_t *handle)
+/* Called by libevent when datagrams arrive on a multicast socket */
+static void ep_mcast_read(evutil_socket_t fd, short what, void *arg)
 {
-	/* 
-	 * TODO: EP might come up later than host, so might be good idea
-	 * to wait for some time and then retry upto some limit
-	 */
+	(void)fd;
+	(void)what;
 
-	/* Create a pipe to comm with the new thread being spawned */
-	int i, j, ret;
-	struct bufferevent *pair[2];
-	int num_conn;
+	/* Leave some for the connections too */
+	ep_mcast_recv((ep_mcast_sock_t *)arg, EP_MCAST_BATCH);
+}
 
-	srand(time(0));
-	handle->num_msg_sent = 0;
-	handle->session = rand();
-	handle->num_succ_conns = 0;
+/* Leaves the multicast group */
+static void ep_mcast_free(comm_handle_t *handle)
+{
+	ep_mcast_sock_t *sock;
+	int j;
 
-	sem_init(&handle->connect_sem, 0, 0);
+	for (j = 0; j < MAX_SWITCHES; j++) {
+		sock = &handle->ep_mcast_socks[j];
 
-	ret = bufferevent_pair_new(handle->ev_base, BEV_OPT_CLOSE_ON_FREE, pair);
-	if (ret < 0) {
-		genericLog(LOG_FATAL, true, "Couldn't open pipes");
-		return ret;
+		if (sock->ev != NULL)
+			event_free(sock->ev);
+		if (sock->fd >= 0)
+			close(sock->fd);
+
+		sock->ev = NULL;
+		sock->fd = -1;
 	}
 
-	handle->host_write = pair[1]; /* Write end of pipe */
-	handle->ev_outstanding = pair[0];
+	free(handle->ep_mcast);
+	handle->ep_mcast = NULL;
+}
+
+/*
+ * Joins the multicast group over every switch (on our own address there),
+ * if asked for. Return negative code on error
+ */
+static int ep_mcast_init(comm_handle_t *handle)
+{
+	ep_mcast_sock_t *sock;
+	struct sockaddr_in group;
+	struct ip_mreq mreq;
+	int j, val, ret;
+
+	for (j = 0; j < MAX_SWITCHES; j++) {
+		handle->ep_mcast_socks[j].ev = NULL;
+		handle->ep_mcast_socks[j].fd = -1;
+	}
 
-	bufferevent_setcb(handle->ev_outstanding, host_incoming_data, NULL, NULL,
-			  handle);
+	handle->ep_mcast = NULL;
 
-	bufferevent_enable(handle->ev_outstanding, EV_READ);
+	if (!handle->opts.multicast)
+		return 0;
 
-	/* Initialization */
-	for (i = 0; i < NUM_EPS; i++) {
-		for (j = 0; j < NUM_SWITCHES; j++) {
-			host_data_t *host_data = &handle->host_data[i][j];
-
-			host_data->ep_num = i;
-			host_data->ep_sw = j;
-			host_data->is_connected = false;
-			host_data->retries_left = MAX_CONN_RETRIES;
-			host_data->ev_connect = NULL;
-			host_data->heartbeats_recv = 0;
-			host_data->handle = handle;
+	handle->ep_mcast = calloc(handle->topo.num_hosts *
+					handle->topo.num_switches,
+					sizeof(ep_mcast_t));
+	if (handle->ep_mcast == NULL)
+		return -ENOMEM;
+
+	for (j = 0; j < handle->topo.num_switches; j++) {
+
+		sock = &handle->ep_mcast_socks[j];
+		sock->sw = j;
+		sock->handle = handle;
+
+		ret = comm_mcast_group(handle, j, &group);
+		if (ret < 0)
+			goto err;
+
+		mreq.imr_multiaddr = group.sin_addr;
+		ret = inet_pton(AF_INET,
+				handle->topo.eps[handle->node_num].ip[j],
+				&mreq.imr_interface);
+		assert(ret == 1);
+
+		sock->fd = socket(AF_INET, SOCK_DGRAM | SOCK_NONBLOCK |
+					SOCK_CLOEXEC, 0);
+		if (sock->fd < 0) {
+			ret = -errno;
+			genericLog(LOG_FATAL, true,
+					"Couldn't open multicast socket");
+			goto err;
+		}
+
+		/* Other eps on this machine listen to it too */
+		val = 1;
+		setsockopt(sock->fd, SOL_SOCKET, SO_REUSEADDR, &val,
+				sizeof(val));
+
+		val = COMM_MCAST_SOCK_BUF;
+		setsockopt(sock->fd, SOL_SOCKET, SO_RCVBUF, &val, sizeof(val));
+
+		if (bind(sock->fd, (struct sockaddr *)&group,
+					sizeof(group)) < 0 ||
+				setsockopt(sock->fd, IPPROTO_IP,
+					IP_ADD_MEMBERSHIP, &mreq,
+					sizeof(mreq)) < 0) {
+			ret = -errno;
+			genericLog(LOG_FATAL, true,
+				"Couldn't join multicast over switch %d", j);
+			goto err;
 		}
+
+		/* Same loop as the connections, no workers */
+		sock->ev = event_new(handle->ev_base, sock->fd,
+					EV_READ | EV_PERSIST, ep_mcast_read,
+					sock);
+		if (sock->ev == NULL) {
+			ret = -ENOMEM;
+			goto err;
+		}
+
+		event_add(sock->ev, NULL);
 	}
 
-	/* Try to connect with the eps */
-	for (i = 0; i < NUM_EPS; i++) {
-		for (j = 0; j < NUM_SWITCHES; j++) {
-
-			int sockfd;
-
-			host_data_t *host_data = &handle->host_data[i][j];
-					
-	    		host_data->connect_fd = 
-				sockfd = socket(AF_INET, SOCK_STREAM, 0);
-    			if (sockfd < 0) {
-				hostLog(host_data, LOG_WARN, true,
-						"Couldn't open socket with ep");
-				host_err(host_data, HOST_CONNECT_FAIL);
-				continue;
-			}
+	return 0;
 
-			ret = set_nonblock(sockfd);
-			if (ret < 0) {
-				host_err(host_data, HOST_CONNECT_FAIL);
-				close(sockfd);
-				continue;
-			}
+err:
+	ep_mcast_free(handle);
+	return ret;
+}
 
-			host_data->connect_fd = sockfd;
+/*
+ * Frame on the connection failed checksum. With dedup, the copy over
+ * other switches can stand in for it - Only the frame is dropped. Else
+ * (or if the one before failed too, so its length is likely what got
+ * corrupted) the connection goes, host replays after reconnecting.
+ * Returns false then
+ */
+static bool ep_bad_crc(ep_data_t *ep_data)
+{
+	comm_handle_t *handle = ep_data->ep_handle;
 
-			host_try_connect(host_data);
-		}
+	__atomic_add_fetch(&handle->ep_stats.crc_errors, 1, __ATOMIC_RELAXED);
+
+	if (!handle->opts.ep_dedup || ep_data->last_bad_crc) {
+		epLog(ep_data, LOG_WARN, false, "Frame failed checksum");
+		ep_err(ep_data, EP_INVALID_MSG);
+		return false;
 	}
 
-	list_new(&handle->data_list, data_free_fn);
+	__atomic_add_fetch(&handle->ep_stats.crc_dropped, 1, __ATOMIC_RELAXED);
+	epLog(ep_data, LOG_WARN, false, "Frame failed checksum, dropped");
+	ep_data->last_bad_crc = true;
 
-	ret = pthread_mutex_init(&handle->lock, NULL);
-	if (ret < 0) {
-		genericLog(LOG_FATAL, true, "Mutex init failed");
-		goto sock_err;
+	return true;
+}
+
+/*
+ * This function will be called by libevent when there is a pending data to
+ * be read by end point on existing connection
+ * Payloads are handed to the callbacks straight out of the input buffer
+ * whenever they are contiguous in it
+ */
+static void ep_read(struct bufferevent *bev, void *arg)
+{
+	ep_data_t *ep_data = (ep_data_t *)arg;
+	struct evbuffer *input = bufferevent_get_input(bev);
+	frame_t *frame;
+	int ret;
+
+	while ((ret = frame_parse(&ep_data->parser, input, &frame)) ==
+			FRAME_READY || ret == FRAME_BAD_CRC) {
+
+		if (ret == FRAME_BAD_CRC) {
+			if (!ep_bad_crc(ep_data))
+				return;
+		} else {
+			ep_data->last_bad_crc = false;
+
+			if (ep_handle_frame(ep_data, frame, input) < 0)
+				return;
+		}
+
+		frame_consume(&ep_data->parser, input);
 	}
 
-	/* start a new thread that will handle the event loop */
-	ret = pthread_create(&handle->host_event_thread, NULL,
-				host_event_loop, (void *)handle);
 	if (ret < 0) {
-		genericLog(LOG_FATAL, true, 
-				"Couldn't start a new event handler thread");
-		goto thread_err;
+		genericLog(LOG_WARN, false, "Invalid packet data");
+		ep_err(ep_data, EP_INVALID_MSG);
 	}
+}
+
+/* Starts serving a connection on the given worker's loop */
+static void ep_conn_start(ep_worker_t *worker, ep_data_t *ep_data)
+{
+	comm_handle_t *handle = ep_data->ep_handle;
+
+	ep_data->worker = worker;
+
+	/* 
+	 * Setup the read event, libevent will call ep_read() whenever
+	 * the clients socket becomes read ready.  We also make the
+	 * read event persistent so we don't have to re-add after each
+	 * read. 
+	 */
+	ep_data->bev = ep_data->transport->bev_new(worker->ev_base,
+							ep_data->conn_fd, false);
+	if (ep_data->bev == NULL) {
+		genericLog(LOG_WARN, false, "Couldn't set up %s connection",
+				ep_data->transport->name);
+		free(ep_data);
+		return;
+	}
+
+	wheel_timer_init(&ep_data->ack_timer, ep_ack_timeout, ep_data);
 
-	/* Wait for all connections to be tried to be connected */
-	for (i = 0; i < NUM_EPS * NUM_SWITCHES; i++) {
-		ret = EINTR;
-		while (ret == EINTR) {
-			ret = sem_wait(&handle->connect_sem);
-		}	
+	bufferevent_setcb(ep_data->bev, ep_read, ep_write, ep_event, ep_data);
+
+	bufferevent_enable(ep_data->bev, EV_READ | EV_WRITE);
+
+	if (ep_send_ack(ep_data, MSG_RESUME) < 0) {
+		epLog(ep_data, LOG_WARN, false, "Couldn't send resume");
+		ep_conn_free(ep_data);
+		return;
 	}
 
+	/* Add to the connections list */
 	pthread_mutex_lock(&handle->lock);
-	num_conn = handle->num_succ_conns;
+	list_append(&handle->conn_list, (void*)ep_data);
 	pthread_mutex_unlock(&handle->lock);
 
-	if (num_conn == 0) {
-		genericLog(LOG_FATAL, false, "No connections established");
-		return -1;
-	}
+	__atomic_add_fetch(&worker->num_conns, 1, __ATOMIC_RELAXED);
+}
 
-	return 0;
+/* Picks up connections handed over by the accepting thread */
+static void ep_worker_incoming(evutil_socket_t fd, short what, void *arg)
+{
+	ep_worker_t *worker = (ep_worker_t *)arg;
+	ep_data_t *ep_data;
 
-thread_err:
-	pthread_mutex_destroy(&handle->lock);
+	(void)what;
 
-sock_err:
-	for (i = 0; i < NUM_EPS; i++) {
-		for (j = 0; j < NUM_SWITCHES; j++) {
-			if (handle->host_data[i][j].is_connected == false)
-				continue;
-			bufferevent_free(handle->host_data[i][j].bev_write);
-		}
+	wakeup_clear(fd, &worker->wakeup_pending);
+
+	while ((ep_data = ring_pop(&worker->conn_ring)) != NULL)
+		ep_conn_start(worker, ep_data);
+}
+
+/* Worker with least connections */
+static ep_worker_t *ep_pick_worker(comm_handle_t *handle)
+{
+	ep_worker_t *best = &handle->ep_workers[0];
+	int i;
+
+	for (i = 1; i < handle->num_ep_workers; i++) {
+		if (__atomic_load_n(&handle->ep_workers[i].num_conns,
+					__ATOMIC_RELAXED) <
+				__atomic_load_n(&best->num_conns,
+					__ATOMIC_RELAXED))
+			best = &handle->ep_workers[i];
 	}
 
-	bufferevent_free(handle->ev_outstanding);
-	bufferevent_free(handle->host_write);
-	return ret;
+	return best;
 }
 
 /*
- * This function is called on any error while ep is reading/writing
+ * Host on this machine (and its switch) connecting over a unix domain
+ * socket, by the name it bound. Only if topology has it connecting so
  */
-void ep_event(struct bufferevent *bev, short event, void *arg)
+static int ep_local_host(comm_handle_t *handle, struct sockaddr_un *addr,
+				socklen_t addr_len, int *sw)
 {
-	ep_data_t *ep_data = (ep_data_t *)arg;
-	(void)bev;
+	char name[MAX_NODE_NAME + 1];
+	bool is_host;
+	int host_num;
 
-    	if (event & BEV_EVENT_EOF) {
-		/* Host disconnected */
-		epLog(ep_data, LOG_WARN, false,
-			"Host connection terminated");
+	if (transport_unix_peer(addr, addr_len,
+				handle->topo.eps[handle->node_num].name,
+				name, sizeof(name), sw) < 0)
+		return -EINVAL;
+
+	host_num = topo_find_name(&handle->topo, name, &is_host);
+	if (host_num < 0 || !is_host || *sw >= handle->topo.num_switches ||
+			topo_get_transport(&handle->topo, host_num,
+					handle->node_num) == TRANSPORT_TCP)
+		return -ENOENT;
+
+	return host_num;
+}
+
+/* Hands a newly accepted connection from addr over to a worker */
+static void ep_accept_conn(comm_handle_t *handle, int hfd,
+				struct sockaddr_storage *addr,
+				socklen_t addr_len)
+{
+	struct sockaddr_in *s = (struct sockaddr_in *)addr;
+	transport_type_t transport = TRANSPORT_TCP;
+	ep_data_t *ep_data = NULL;
+	ep_worker_t *worker;
+	char ipstr[INET_ADDRSTRLEN];
+	int host_num, host_sw;
+
+	if (addr->ss_family == AF_UNIX) {
+		host_num = ep_local_host(handle, (struct sockaddr_un *)addr,
+						addr_len, &host_sw);
+		if (host_num < 0) {
+			genericLog(LOG_WARN, false,
+				"Unknown local host contacted endpoint");
+			goto err;
+		}
+
+		transport = topo_get_transport(&handle->topo, host_num,
+						handle->node_num);
+
+	} else if (addr->ss_family != AF_INET) {
+		/* We are only using ipv4 currently */
+		genericLog(LOG_WARN, false, "Ip is ipv6, we support only ipv4");
+		goto err;
 
-	} else if (event & BEV_EVENT_ERROR || event & BEV_EVENT_WRITING ||
-			event & BEV_EVENT_READING) {
-		/* Some other error occurred */
-		epLog(ep_data, LOG_WARN, false,
-			"Socket failure, disconnecting host");
 	} else {
-		epLog(ep_data, LOG_WARN, false,
-			"Unknown error on socket, disconnecting host");
-	} 
+		/* Check which host is it by its address */
+		host_num = topo_find_addr(&handle->topo, true,
+						s->sin_addr.s_addr, &host_sw);
+		if (host_num < 0) {
+			if (inet_ntop(AF_INET, &s->sin_addr, ipstr,
+					sizeof(ipstr)) == NULL)
+				strcpy(ipstr, "?");
+
+			genericLog(LOG_WARN, false,
+				"Unknow host contacted endpoint: %s", ipstr);
+			goto err;
+		}
+	}
+
+	ep_data = malloc(sizeof(ep_data_t));
+	if (ep_data == NULL) {
+		genericLog(LOG_WARN, false, "Out of memory");
+		goto err;
+	}
+
+	frame_parser_init(&ep_data->parser, MAX_DATA_LEN);
+
+	ep_data->ep_handle = handle;
+	ep_data->host_num = host_num;
+	ep_data->host_sw = host_sw;
+	ep_data->conn_fd = hfd;
+	ep_data->transport = transport_ops(transport);
+	ep_data->wire = FRAME_WIRE_V0;
+	ep_data->wire_session = 0;
+	ep_data->last_bad_crc = false;
+
+	/* Spread connections over the workers */
+	worker = ep_pick_worker(handle);
+	if (!worker->is_threaded) {
+		ep_conn_start(worker, ep_data);
+		return;
+	}
+
+	if (!ring_push(&worker->conn_ring, ep_data)) {
+		genericLog(LOG_WARN, false, "Worker %d too busy", worker->id);
+		goto err;
+	}
+
+	wakeup_signal(worker->wakeup_fd, &worker->wakeup_pending);
 
-	ep_err(ep_data, EP_CONNECT_TERMINATE);
 	return;
+
+err:
+	/* Close the socket. Let the host deal with RST packet. */
+	close(hfd);
+	free(ep_data);
 }
 
 /*
- * This function will be called by libevent after heartbeat is sent to host
+ * This function will be called by libevent when there are connections
+ * ready to be accepted by end point. Takes in a batch of them at a time,
+ * the rest are left for the next round of the loop
  */
-static void ep_write(struct bufferevent *bev, void *arg)
+static void ep_accept(int fd, short ev, void *arg)
 {
-	(void)bev;
-	(void)arg;
-}
+	comm_handle_t *handle = (comm_handle_t *)arg;
+	struct sockaddr_storage host_addr;
+	socklen_t addr_len;
+	int i, hfd;
 
-/*
- * This function will be called by libevent when there is a pending data to
- * be read by end point on existing connection
- */
-static void ep_read(struct bufferevent *bev, void *arg)
-{
-	ep_data_t *ep_data = (ep_data_t *)arg;
-	comm_handle_t *handle = ep_data->ep_handle;
-	ssize_t len, req_len;
-	int is_metadata;
+	(void)ev;
 
-	while (1) {
+	for (i = 0; i < EP_ACCEPT_BATCH; i++) {
 
-		is_metadata = !ep_data->is_metadata_read;
+		/* Accept the new connection, already non-blocking */
+		addr_len = sizeof(host_addr);
+		hfd = accept4(fd, (struct sockaddr *)&host_addr, &addr_len,
+				SOCK_NONBLOCK | SOCK_CLOEXEC);
+		if (hfd < 0) {
+			/* Gone before we got to it */
+			if (errno == EINTR || errno == ECONNABORTED)
+				continue;
 
-		/* We need atleast certain len */
-		if (!is_metadata) {
-		
-			req_len = ep_data->data.msg_len - ep_data->msg_read_len;
-			len = bufferevent_read(bev, &ep_data->data.buf[ep_data->msg_read_len],
-						req_len);
+			/* Out of fds etc. Will be back with the next event */
+			if (errno != EAGAIN && errno != EWOULDBLOCK)
+				genericLog(LOG_WARN, true, "Accept failed");
+			return;
+		}
 
-			if (req_len != len)
-				goto err;
+		ep_accept_conn(handle, hfd, &host_addr, addr_len);
+	}
+}
 
-			ep_data->is_metadata_read = false;
-			bufferevent_setwatermark(bev, EV_READ,
-						offsetof(comm_data_t, buf), 0);
-		
-		} else {
-			req_len = offsetof(comm_data_t, buf);
-			len = bufferevent_read(bev, (char *)&ep_data->data, 
-						req_len);
+/* Runs the event loop of a worker */
+static void *ep_worker_loop(void *arg)
+{
+	ep_worker_t *worker = (ep_worker_t *)arg;
 
-			if (len == 0)
-				return;
+	event_base_dispatch(worker->ev_base);
 
-			if (req_len != len)
-				goto err;
+	return NULL;
+}
 
-			if (ep_data->data.msg_type == MSG_DATA) {
-				assert(ep_data->data.msg_len != 0);
-
-				req_len = ep_data->data.msg_len;
-	        		len = bufferevent_read(bev, ep_data->data.buf,
-							req_len);
-
-				if (req_len != len) {
-					ep_data->msg_read_len = len;
-					ep_data->is_metadata_read = true;
-					bufferevent_setwatermark(bev, EV_READ,
-							 ep_data->data.msg_len - len,
-							 0);
-				} else {
-					is_metadata = false;
-				}
-			}
-		}
+/* Frees up a worker. Its thread must not be running */
+static void ep_worker_free(ep_worker_t *worker)
+{
+	ep_data_t *ep_data;
 
+	if (!worker->is_threaded)
+		return;
 
-		if (ep_data->data.msg_type == MSG_HEARTBEAT_REQ) {
+	/* Connections never picked up */
+	while ((ep_data = ring_pop(&worker->conn_ring)) != NULL) {
+		close(ep_data->conn_fd);
+		free(ep_data);
+	}
 
-			comm_data_t resp_data;
-			size_t len;
+	event_free(worker->ev_wakeup);
+	close(worker->wakeup_fd);
+	ring_destroy(&worker->conn_ring);
+	event_base_free(worker->ev_base);
+}
 
-			assert(ep_data->data.msg_len == 0);
+/* Sets up a worker with its own event loop (not yet running) */
+static int ep_worker_new(comm_handle_t *handle, ep_worker_t *worker)
+{
+	int ret;
 
-			resp_data.msg_type = MSG_HEARTBEAT_RESP;
-			resp_data.msg_len = 0;
+	worker->ev_base = event_base_new();
+	if (worker->ev_base == NULL) {
+		genericLog(LOG_FATAL, false, "Libevent initialization failed");
+		return -ENOMEM;
+	}
 
-			len = offsetof(comm_data_t, buf); 
-		      	if (bufferevent_write(bev, (char *)&resp_data, len) < 0) {
-				epLog(ep_data, LOG_WARN, false,
-					"Couldn't send heartbeat");
-				ep_err(ep_data, EP_HEARTBEAT_FAIL);
-			}	
+	/* Room for every connection we expect */
+	ret = ring_new(&worker->conn_ring, ep_listen_queue_size(handle));
+	if (ret < 0)
+		goto ring_err;
+
+	worker->wakeup_pending = 0;
+	worker->wakeup_fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+	if (worker->wakeup_fd < 0) {
+		ret = -errno;
+		genericLog(LOG_FATAL, true, "Couldn't open eventfd");
+		goto eventfd_err;
+	}
 
-			continue;
+	worker->ev_wakeup = event_new(worker->ev_base, worker->wakeup_fd,
+					EV_READ | EV_PERSIST,
+					ep_worker_incoming, worker);
 
-		} else if (ep_data->data.msg_type == MSG_DATA) {
-		
-			if (!is_metadata) {
-				/* Call the callback indicating reception of data */
-				handle->ep_callback(ep_data->host_num,
-							ep_data->host_sw,
-							ep_data->data.session,
-							ep_data->data.msg_num,
-							ep_data->data.buf,
-							ep_data->data.msg_len);
-			}
+	event_add(worker->ev_wakeup, NULL);
 
-			continue;
-		} else {
-			genericLog(LOG_WARN, false, "Invalid message type: %d",
-				ep_data->data.msg_type);
-			/* XXX: I assume TCP and ethernet checksum are sufficient */
-			assert(0);
-			return;
-		}
-	}
+	worker->handle = handle;
+	worker->is_threaded = true;
 
-err:
-	genericLog(LOG_WARN, false, "Invalid packet data");
-	ep_err(ep_data, EP_INVALID_MSG);
-	return;
+	return 0;
+
+eventfd_err:
+	ring_destroy(&worker->conn_ring);
+ring_err:
+	event_base_free(worker->ev_base);
+	return ret;
 }
 
-/*
- * This function will be called by libevent when there is a connection
- * ready to be accepted by end point
- */
-static void ep_accept(int fd, short ev, void *arg)
+/* Stops all the worker threads and frees them up */
+static void ep_workers_deinit(comm_handle_t *handle)
 {
+	int i;
 
-	int hfd;
-	struct sockaddr_storage host_addr;
-	socklen_t addr_len = sizeof(host_addr);
-	ep_data_t *ep_data;
-	int ret;
-	char ipstr[INET_ADDRSTRLEN];
-	int i, j;
-
-	(void)ev;
+	for (i = 0; i < handle->num_ep_workers; i++) {
+		if (!handle->ep_workers[i].is_threaded)
+			continue;
 
-	/* Accept the new connection. */
-	hfd = accept(fd, (struct sockaddr *)&host_addr, &addr_len);
-	if (fd < 0) {
-		genericLog(LOG_WARN, true, "Accept failed");
-		return;
+		event_base_loopexit(handle->ep_workers[i].ev_base, NULL);
+		pthread_join(handle->ep_workers[i].thread, NULL);
 	}
+}
 
-	ep_data = malloc(sizeof(ep_data_t));
-	if (ep_data == NULL) {
-		genericLog(LOG_WARN, false, "Out of memory");
-		goto err;
+/* Frees up workers once their connections are closed */
+static void ep_workers_free(comm_handle_t *handle)
+{
+	int i;
+
+	for (i = 0; i < handle->num_ep_workers; i++) {
+		wheel_destroy(&handle->ep_workers[i].wheel);
+		ep_worker_free(&handle->ep_workers[i]);
 	}
 
-	ep_data->is_metadata_read = false;
-	ep_data->msg_read_len = 0;
+	free(handle->ep_workers);
+	handle->ep_workers = NULL;
+}
 
-	ret = get_ip_addr(&host_addr, ipstr, sizeof(ipstr));
-	if (ret < 0)
-		goto err;
+/*
+ * Starts the workers serving ep connections. Without workers, a single
+ * worker runs on the main loop
+ */
+static int ep_workers_init(comm_handle_t *handle)
+{
+	int i, ret, num = handle->opts.ep_num_workers;
 
-	/* Check which host is it by comparing ips */
-	ep_data->ep_handle = (comm_handle_t *)arg;
-	ep_data->host_num = -1;
-	for (i = 0; i < NUM_HOSTS; i++) {
-		for (j = 0; j < NUM_SWITCHES; j++) {
-			if (strcmp(hosts[i].ip[j], ipstr) == 0) {
-				ep_data->host_num = i;
-				ep_data->host_sw = j;
-				break;
-			}
-		}
-		if (ep_data->host_num != -1)
-			break;
+	if (num < 0 || num > EP_MAX_WORKERS) {
+		genericLog(LOG_FATAL, false, "Invalid number of workers: %d",
+				num);
+		return -EINVAL;
 	}
 
-	if (ep_data->host_num == -1) {
-		genericLog(LOG_WARN, false,
-				"Unknow host contacted endpoint: %s", ipstr);
-		goto err;
-	}
+	handle->num_ep_workers = num > 0 ? num : 1;
+	handle->ep_workers = calloc(handle->num_ep_workers,
+					sizeof(ep_worker_t));
+	if (handle->ep_workers == NULL)
+		return -ENOMEM;
 
-	/* Set the client socket to non-blocking mode. */
-	ret = set_nonblock(hfd);
-	if (ret < 0) {
-		goto err;
-	}
+	for (i = 0; i < handle->num_ep_workers; i++) {
+		ep_worker_t *worker = &handle->ep_workers[i];
 
+		worker->id = i;
+		worker->handle = handle;
+		worker->ev_base = handle->ev_base;
 
-	/* Add to the connections list */
-	list_append(&ep_data->ep_handle->conn_list, (void*)ep_data);
+		if (num != 0) {
+			ret = ep_worker_new(handle, worker);
+			if (ret < 0)
+				goto err;
+		}
 
-	/* 
-	 * Setup the read event, libevent will call ep_read() whenever
-	 * the clients socket becomes read ready.  We also make the
-	 * read event persistent so we don't have to re-add after each
-	 * read. 
-	 */
-	ep_data->bev = bufferevent_socket_new(ep_data->ep_handle->ev_base,
-						hfd, BEV_OPT_CLOSE_ON_FREE);
-	bufferevent_setcb(ep_data->bev, ep_read, ep_write, ep_event, ep_data);
+		ret = wheel_new(&worker->wheel, worker->ev_base, 0);
+		if (ret < 0) {
+			genericLog(LOG_FATAL, false,
+				"Couldn't allocate timing wheel");
+			ep_worker_free(worker);
+			goto err;
+		}
 
-	/* Need to get some metadata first from host before getting payload */
-	bufferevent_setwatermark(ep_data->bev, EV_READ,
-					offsetof(comm_data_t, buf), 0);
+		if (num == 0)
+			continue;
 
-	bufferevent_enable(ep_data->bev, EV_READ | EV_WRITE);
+		ret = pthread_create(&worker->thread, NULL, ep_worker_loop,
+					worker);
+		if (ret != 0) {
+			genericLog(LOG_FATAL, false,
+				"Couldn't start worker thread");
+			wheel_destroy(&worker->wheel);
+			ep_worker_free(worker);
+			worker->is_threaded = false;
+			ret = -ret;
+			goto err;
+		}
+	}
 
-	return;
+	return 0;
 
 err:
-	/* Close the socket. Let the host deal with RST packet. */
-	close(hfd);
+	handle->num_ep_workers = i;
+	ep_workers_deinit(handle);
+	ep_workers_free(handle);
+	return ret;
 }
 
-/* Initialize the host. Return negative code on error */
-static int ep_init(comm_handle_t *handle)
+/*
+ * Opens a socket listening for hosts on ip (NULL for all addresses).
+ * Returns it, or negative code on error
+ */
+static int ep_listen(comm_handle_t *handle, const char *ip)
 {
 	int fd; /* listening socket */
 	int optval; /* flag value for setsockopt */
 	struct sockaddr_in epaddr; /* ep's addr */
 	int ret;
-	ep_data_t *ep_data;
 
-	/*
-	 * Setup a port, start listening on it and call the callback whenever
-	 * data arrives or respond to the heartbeats
-	 */
 	fd = socket(AF_INET, SOCK_STREAM, 0);
 	if (fd < 0) {
 		genericLog(LOG_FATAL, true,
 				"Couldn't open socket for endpoint");
-		return fd;
+		return -errno;
 	}
 
 	/* 
@@ -1088,27 +5297,32 @@ static int ep_init(comm_handle_t *handle)
 	epaddr.sin_family = AF_INET;
 
 	/* 
-	 * let the system figure out our IP address
-	 * (We will be listening on multiple IPs)
+	 * let the system figure out our IP address, unless we know ours
+	 * (several eps can then share a machine)
 	 */
-	epaddr.sin_addr.s_addr = htonl(INADDR_ANY);
+	if (ip == NULL)
+		epaddr.sin_addr.s_addr = htonl(INADDR_ANY);
+	else if (inet_pton(AF_INET, ip, &epaddr.sin_addr) != 1)
+		assert(0 && "Topology has numeric addresses");
 
 	epaddr.sin_port = htons((unsigned short)EP_LISTEN_PORT);
 
 	ret = bind(fd, (struct sockaddr *)&epaddr, 
 	   		sizeof(epaddr));
 	if (ret < 0) {
+		ret = -errno;
 		genericLog(LOG_FATAL, true,
-				"Endpoint couldn't bind to port: %d",
-				EP_LISTEN_PORT);
+				"Endpoint couldn't bind to %s port: %d",
+				ip != NULL ? ip : "any", EP_LISTEN_PORT);
 		goto err;
 	}
 
 	/* 
 	 * listen: make this socket ready to accept connection requests 
 	 */
-  	ret = listen(fd, EP_LISTEN_QUEUE_SIZE);
+  	ret = listen(fd, ep_listen_queue_size(handle));
 	if (ret < 0) {
+		ret = -errno;
 		genericLog(LOG_FATAL, true,
 				"Endpoint couldn't listen on port: %d",
 			    	EP_LISTEN_PORT);
@@ -1119,41 +5333,253 @@ static int ep_init(comm_handle_t *handle)
 	if (ret < 0)
 		goto err;
 
+	return fd;
+
+err:
+	close(fd);
+	return ret;
+}
+
+/* Stops listening for hosts */
+static void ep_listen_close(comm_handle_t *handle)
+{
+	int i;
+
+	for (i = 0; i < handle->num_listen; i++) {
+		if (handle->ev_accept[i] != NULL)
+			event_free(handle->ev_accept[i]);
+		close(handle->listen_fd[i]);
+	}
+
+	handle->num_listen = 0;
+}
+
+/*
+ * Listens on a unix domain socket named after us, if topology has hosts on
+ * this machine connecting to us other than by TCP. Return negative code on
+ * error
+ */
+static int ep_listen_local(comm_handle_t *handle)
+{
+	const char *name = handle->topo.eps[handle->node_num].name;
+	struct sockaddr_un addr;
+	socklen_t len;
+	int i, fd, ret;
+
+	for (i = 0; i < handle->topo.num_hosts; i++)
+		if (topo_get_transport(&handle->topo, i, handle->node_num) !=
+				TRANSPORT_TCP)
+			break;
+
+	if (i == handle->topo.num_hosts)
+		return 0;
+
+	fd = socket(AF_UNIX, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+	if (fd < 0) {
+		genericLog(LOG_FATAL, true,
+				"Couldn't open local socket for endpoint");
+		return -errno;
+	}
+
+	/* Abstract name, goes away along with the socket */
+	len = transport_unix_ep_addr(&addr, name);
+
+	if (bind(fd, (struct sockaddr *)&addr, len) < 0 ||
+			listen(fd, ep_listen_queue_size(handle)) < 0) {
+		ret = -errno;
+		genericLog(LOG_FATAL, true,
+				"Endpoint couldn't listen locally as %s", name);
+		close(fd);
+		return ret;
+	}
+
+	handle->ev_accept[handle->num_listen] = NULL;
+	handle->listen_fd[handle->num_listen++] = fd;
+
+	return 0;
+}
+
+/* Listens over the switches, see ep_listen_init() */
+static int ep_listen_switches(comm_handle_t *handle)
+{
+	int i, fd = 0;
+
+	handle->num_listen = 0;
+
+	if (handle->node_num >= 0) {
+		for (i = 0; i < handle->topo.num_switches; i++) {
+			fd = ep_listen(handle,
+					handle->topo.eps[handle->node_num].ip[i]);
+			if (fd < 0)
+				break;
+
+			handle->ev_accept[handle->num_listen] = NULL;
+			handle->listen_fd[handle->num_listen++] = fd;
+		}
+
+		if (fd >= 0)
+			return 0;
+
+		ep_listen_close(handle);
+		if (fd != -EADDRNOTAVAIL)
+			return fd;
+
+		genericLog(LOG_WARN, false, "Listening on all addresses instead");
+	}
+
+	fd = ep_listen(handle, NULL);
+	if (fd < 0)
+		return fd;
+
+	handle->ev_accept[0] = NULL;
+	handle->listen_fd[0] = fd;
+	handle->num_listen = 1;
+
+	return 0;
+}
+
+/*
+ * Listens on our own address over every switch, if the topology has us.
+ * Else on all the addresses (or if ours aren't set up). Hosts on this
+ * machine may be listened for locally as well. Return negative code on
+ * error
+ */
+static int ep_listen_init(comm_handle_t *handle)
+{
+	int ret;
+
+	ret = ep_listen_switches(handle);
+	if (ret < 0 || handle->node_num < 0)
+		return ret;
+
+	ret = ep_listen_local(handle);
+	if (ret < 0)
+		ep_listen_close(handle);
+
+	return ret;
+}
+
+/* Initialize the host. Return negative code on error */
+static int ep_init(comm_handle_t *handle)
+{
+	int i, ret;
+	ep_data_t *ep_data;
+
+	/*
+	 * Setup a port, start listening on it and call the callback whenever
+	 * data arrives or respond to the heartbeats
+	 */
+	ret = ep_listen_init(handle);
+	if (ret < 0) {
+		topo_destroy(&handle->topo);
+		return ret;
+	}
+
 	/*
 	 * We now have a listening socket, we create a read event to
 	 * be notified when a host connects
 	 */
-	handle->ev_accept = event_new(handle->ev_base, fd,
-					EV_READ | EV_PERSIST,
-					ep_accept, handle);
-	
-	event_add(handle->ev_accept, NULL);
-
 	list_new(&handle->conn_list, NULL);
 
+	ret = pthread_mutex_init(&handle->lock, NULL);
+	if (ret != 0) {
+		genericLog(LOG_FATAL, false, "Mutex init failed");
+		ret = -ret;
+		goto err;
+	}
+
+	memset(&handle->ep_stats, 0, sizeof(handle->ep_stats));
+
+	/* Datagrams are handled on the loop of the connections */
+	if (handle->opts.multicast && (handle->opts.wire_legacy ||
+				handle->opts.ep_num_workers != 0 ||
+				handle->node_num < 0)) {
+		genericLog(LOG_WARN, false, "Multicast needs the compact wire "
+				"format, no workers and an ep in topology, "
+				"not used");
+		handle->opts.multicast = false;
+	}
+
+	ret = ep_merge_init(handle);
+	if (ret < 0)
+		goto merge_err;
+
+	ret = ep_workers_init(handle);
+	if (ret < 0)
+		goto workers_err;
+
+	ret = ep_mcast_init(handle);
+	if (ret < 0) {
+		genericLog(LOG_FATAL, false, "Couldn't set up multicast");
+		goto mcast_err;
+	}
+
+	for (i = 0; i < handle->num_listen; i++) {
+		handle->ev_accept[i] = event_new(handle->ev_base,
+						handle->listen_fd[i],
+						EV_READ | EV_PERSIST,
+						ep_accept, handle);
+
+		event_add(handle->ev_accept[i], NULL);
+	}
+
 	/* Start the libevent event loop. */
 	event_base_dispatch(handle->ev_base);
 
 	/* We are now closing */
 
 	/* Refuse new connections */
-	close(fd);
+	ep_listen_close(handle);
+
+	/* Nothing runs on connections after this */
+	ep_workers_deinit(handle);
 
 	/* Close existing connections */
-	while ((ep_data = (ep_data_t *)list_pop_head(&handle->conn_list)) != NULL) {
-		bufferevent_free(ep_data->bev);
-		free(ep_data);
-	}
+	while ((ep_data = (ep_data_t *)list_pop_head(&handle->conn_list)) != NULL)
+		ep_conn_free(ep_data);
+
+	ep_mcast_free(handle);
+
+	ep_workers_free(handle);
+	ep_merge_free(handle);
+	pthread_mutex_destroy(&handle->lock);
+	topo_destroy(&handle->topo);
 
 	return 0;
+
+mcast_err:
+	ep_workers_deinit(handle);
+	ep_workers_free(handle);
+workers_err:
+	ep_merge_free(handle);
+merge_err:
+	pthread_mutex_destroy(&handle->lock);
 err:
-	close(fd);
+	ep_listen_close(handle);
+	topo_destroy(&handle->topo);
 	return ret;
 }
 
-/* Initializes the module. Return negative code on error */
+/* Fills in default values of optional settings */
+void comm_opts_init(comm_opts_t *opts)
+{
+	memset(opts, 0, sizeof(*opts));
+}
+
+/* Initializes the module with default settings */
 int comm_init(comm_handle_t *handle, comm_err_callback_t err_callback,
 		comm_ep_data_callback_t ep_callback)
+{
+	return comm_init_opts(handle, NULL, err_callback, ep_callback);
+}
+
+/*
+ * Initializes the module. opts can be NULL for default settings.
+ * Return negative code on error
+ */
+int comm_init_opts(comm_handle_t *handle, const comm_opts_t *opts,
+		comm_err_callback_t err_callback,
+		comm_ep_data_callback_t ep_callback)
 {
 	/* TODO: Run ep_init in seperate thread */
 
@@ -1165,15 +5591,40 @@ int comm_init(comm_handle_t *handle, comm_err_callback_t err_callback,
 		return -EINVAL;
 	}
 
-	handle->is_host = is_node_host();
+	/*
+	 * Writing to a connection the peer just reset must fail with EPIPE
+	 * (and be retried) instead of killing the process
+	 */
+	signal(SIGPIPE, SIG_IGN);
+
 	handle->ep_callback = ep_callback;
 	handle->err_callback = err_callback;
 
+	if (opts != NULL)
+		handle->opts = *opts;
+	else
+		comm_opts_init(&handle->opts);
+
+	if (handle->opts.compress_min_len <= 0)
+		handle->opts.compress_min_len = COMM_COMPRESS_MIN_LEN;
+
+	memset(&handle->lz_stats, 0, sizeof(handle->lz_stats));
+
+	/* Owned by handle from here on, freed by host/ep on their way out */
+	ret = comm_topo_init(handle);
+	if (ret < 0) {
+		genericLog(LOG_WARN, false, "Couldn't set up topology");
+		return ret;
+	}
+
+	handle->is_host = is_node_host(handle);
+
 	if (handle->is_host) {
 
 		if (ep_callback != NULL) {
 			genericLog(LOG_WARN, false,
 					"Callback mentioned for a host node");
+			topo_destroy(&handle->topo);
 			return -EINVAL;
 		}
 		
@@ -1184,6 +5635,7 @@ int comm_init(comm_handle_t *handle, comm_err_callback_t err_callback,
 		
 			genericLog(LOG_WARN, false,
 					"No callback for endpoint node");
+			topo_destroy(&handle->topo);
 			return -EINVAL;
 		}
 
@@ -1191,14 +5643,18 @@ int comm_init(comm_handle_t *handle, comm_err_callback_t err_callback,
 	}
 }
 
+/* Topology the module runs with */
+const topo_t *comm_get_topology(comm_handle_t *handle)
+{
+	return &handle->topo;
+}
+
 void comm_deinit(comm_handle_t *handle)
 {
 	if (!handle->is_host) {
 		/* For ep, simply quit the loop. That will close all the connections */
 		event_base_loopexit(handle->ev_base, NULL);
 	} else {
-		/* Send signal to end and force flush. Wait for response */
-		bufferevent_write(handle->host_write, HOST_END_VAL , 1);
-		pthread_join(handle->host_event_thread, NULL);
+		host_deinit(handle);
 	}
 }
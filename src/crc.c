@@ -0,0 +1,291 @@
+/*
+ * This file implements CRC32C, the checksum carried by frames when the
+ * connection asks for it. The CPU's own CRC32C instructions are used when
+ * it has them - SSE4.2 on the x86 hosts, ARMv8 CRC on the Pis. Anything
+ * else gets a table driven version (slicing by 8 bytes)
+ * A CRC instruction has to wait for the previous one, though it could
+ * start one every cycle. So longer buffers are split into three blocks
+ * checksummed side by side, and their crcs combined afterwards (shifting
+ * a crc over a block of zeros is a table lookup, see crc_shift())
+ */
+#include <stdbool.h>
+#include <string.h>
+#include <endian.h>
+#include <pthread.h>
+
+#include "crc.h"
+
+#if defined(__x86_64__)
+#include <nmmintrin.h>
+#define CRC_HW
+#define CRC_HW_NAME	"sse4.2"
+#define CRC_TARGET	__attribute__((target("sse4.2")))
+#elif defined(__aarch64__)
+#include <arm_acle.h>
+#include <sys/auxv.h>
+#define CRC_HW
+#define CRC_HW_NAME	"armv8"
+#define CRC_TARGET	__attribute__((target("+crc")))
+#ifndef HWCAP_CRC32
+#define HWCAP_CRC32	(1 << 7)
+#endif
+#elif defined(__arm__) && defined(__ARM_FEATURE_CRC32)
+#include <arm_acle.h>
+#define CRC_HW
+#define CRC_HW_NAME	"armv8"
+#define CRC_TARGET
+#endif
+
+/* Castagnoli polynomial, bit reversed */
+#define CRC32C_POLY	0x82f63b78U
+
+/* Blocks checksummed side by side, three at a time */
+#define CRC_LONG	512
+#define CRC_SHORT	64
+
+typedef uint32_t (*crc_fn_t)(uint32_t crc, const void *buf, size_t len);
+
+static uint32_t crc_table[8][256];
+static crc_fn_t crc_fn;
+static const char *crc_name;
+static pthread_once_t crc_once = PTHREAD_ONCE_INIT;
+
+#ifdef CRC_HW
+/* Shift a crc over CRC_LONG/CRC_SHORT zero bytes */
+static uint32_t crc_long[4][256];
+static uint32_t crc_short[4][256];
+#endif
+
+static uint32_t crc32c_table(uint32_t crc, const void *buf, size_t len)
+{
+	const uint8_t *p = buf;
+	uint32_t lo, hi;
+	uint64_t word;
+
+	crc = ~crc;
+
+	while (len >= 8) {
+		memcpy(&word, p, 8);
+		word = le64toh(word);
+
+		lo = (uint32_t)word ^ crc;
+		hi = word >> 32;
+
+		crc = crc_table[7][lo & 0xff] ^
+			crc_table[6][(lo >> 8) & 0xff] ^
+			crc_table[5][(lo >> 16) & 0xff] ^
+			crc_table[4][lo >> 24] ^
+			crc_table[3][hi & 0xff] ^
+			crc_table[2][(hi >> 8) & 0xff] ^
+			crc_table[1][(hi >> 16) & 0xff] ^
+			crc_table[0][hi >> 24];
+
+		p += 8;
+		len -= 8;
+	}
+
+	while (len-- > 0)
+		crc = (crc >> 8) ^ crc_table[0][(crc ^ *p++) & 0xff];
+
+	return ~crc;
+}
+
+#ifdef CRC_HW
+CRC_TARGET
+static inline uint32_t crc_hw_u64(uint32_t crc, const uint8_t *p)
+{
+	uint64_t word;
+
+	memcpy(&word, p, 8);
+
+#if defined(__x86_64__)
+	return _mm_crc32_u64(crc, word);
+#elif defined(__aarch64__)
+	return __crc32cd(crc, word);
+#else
+	word = le64toh(word);
+	return __crc32cw(__crc32cw(crc, (uint32_t)word), word >> 32);
+#endif
+}
+
+CRC_TARGET
+static inline uint32_t crc_hw_u8(uint32_t crc, uint8_t byte)
+{
+#if defined(__x86_64__)
+	return _mm_crc32_u8(crc, byte);
+#else
+	return __crc32cb(crc, byte);
+#endif
+}
+
+/* crc (not inverted) followed by as many zero bytes as shift is for */
+static inline uint32_t crc_shift(uint32_t shift[4][256], uint32_t crc)
+{
+	return shift[0][crc & 0xff] ^ shift[1][(crc >> 8) & 0xff] ^
+		shift[2][(crc >> 16) & 0xff] ^ shift[3][crc >> 24];
+}
+
+/* Checksums blocks of len bytes at p, three side by side */
+CRC_TARGET
+static inline uint32_t crc_hw_blocks(uint32_t crc, const uint8_t **p,
+					size_t *len, size_t block,
+					uint32_t shift[4][256])
+{
+	uint32_t crc1, crc2;
+	size_t i;
+
+	while (*len >= block * 3) {
+		crc1 = crc2 = 0;
+
+		for (i = 0; i < block; i += 8) {
+			crc = crc_hw_u64(crc, *p + i);
+			crc1 = crc_hw_u64(crc1, *p + block + i);
+			crc2 = crc_hw_u64(crc2, *p + block * 2 + i);
+		}
+
+		crc = crc_shift(shift, crc) ^ crc1;
+		crc = crc_shift(shift, crc) ^ crc2;
+
+		*p += block * 3;
+		*len -= block * 3;
+	}
+
+	return crc;
+}
+
+CRC_TARGET
+static uint32_t crc32c_hw(uint32_t crc, const void *buf, size_t len)
+{
+	const uint8_t *p = buf;
+
+	crc = ~crc;
+
+	crc = crc_hw_blocks(crc, &p, &len, CRC_LONG, crc_long);
+	crc = crc_hw_blocks(crc, &p, &len, CRC_SHORT, crc_short);
+
+	while (len >= 8) {
+		crc = crc_hw_u64(crc, p);
+		p += 8;
+		len -= 8;
+	}
+
+	while (len-- > 0)
+		crc = crc_hw_u8(crc, *p++);
+
+	return ~crc;
+}
+
+static bool crc_hw_ok(void)
+{
+#if defined(__x86_64__)
+	return __builtin_cpu_supports("sse4.2");
+#elif defined(__aarch64__)
+	return (getauxval(AT_HWCAP) & HWCAP_CRC32) != 0;
+#else
+	/* Built for a CPU having it */
+	return true;
+#endif
+}
+
+/* Applies operator (a 32x32 matrix over GF(2)) to vec */
+static uint32_t crc_op_apply(const uint32_t *op, uint32_t vec)
+{
+	uint32_t sum = 0;
+
+	for (; vec != 0; vec >>= 1, op++)
+		if (vec & 1)
+			sum ^= *op;
+
+	return sum;
+}
+
+static void crc_op_square(uint32_t *square, const uint32_t *op)
+{
+	int i;
+
+	for (i = 0; i < 32; i++)
+		square[i] = crc_op_apply(op, op[i]);
+}
+
+/* Builds lookup tables for shifting a crc over len zero bytes */
+static void crc_shift_init(uint32_t shift[4][256], size_t len)
+{
+	uint32_t op[32], sq[32];
+	int i;
+
+	/* A zero bit */
+	op[0] = CRC32C_POLY;
+	for (i = 1; i < 32; i++)
+		op[i] = 1U << (i - 1);
+
+	/* Squared thrice makes a zero byte */
+	crc_op_square(sq, op);
+	crc_op_square(op, sq);
+	crc_op_square(sq, op);
+
+	/* sq shifts by a byte - len is a power of 2 */
+	for (len >>= 1; len > 0; len >>= 1) {
+		crc_op_square(op, sq);
+		memcpy(sq, op, sizeof(op));
+	}
+
+	for (i = 0; i < 256; i++) {
+		shift[0][i] = crc_op_apply(sq, i);
+		shift[1][i] = crc_op_apply(sq, i << 8);
+		shift[2][i] = crc_op_apply(sq, i << 16);
+		shift[3][i] = crc_op_apply(sq, (uint32_t)i << 24);
+	}
+}
+#endif
+
+static void crc_init(void)
+{
+	uint32_t crc;
+	int i, j;
+
+	for (i = 0; i < 256; i++) {
+		crc = i;
+		for (j = 0; j < 8; j++)
+			crc = (crc >> 1) ^ (CRC32C_POLY & -(crc & 1));
+		crc_table[0][i] = crc;
+	}
+
+	for (i = 0; i < 256; i++)
+		for (j = 1; j < 8; j++)
+			crc_table[j][i] = (crc_table[j - 1][i] >> 8) ^
+				crc_table[0][crc_table[j - 1][i] & 0xff];
+
+	crc_fn = crc32c_table;
+	crc_name = "table";
+
+#ifdef CRC_HW
+	if (crc_hw_ok()) {
+		crc_shift_init(crc_long, CRC_LONG);
+		crc_shift_init(crc_short, CRC_SHORT);
+
+		crc_fn = crc32c_hw;
+		crc_name = CRC_HW_NAME;
+	}
+#endif
+}
+
+uint32_t crc32c_sw(uint32_t crc, const void *buf, size_t len)
+{
+	pthread_once(&crc_once, crc_init);
+
+	return crc32c_table(crc, buf, len);
+}
+
+uint32_t crc32c(uint32_t crc, const void *buf, size_t len)
+{
+	pthread_once(&crc_once, crc_init);
+
+	return crc_fn(crc, buf, len);
+}
+
+const char *crc32c_impl(void)
+{
+	pthread_once(&crc_once, crc_init);
+
+	return crc_name;
+}
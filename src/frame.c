@@ -0,0 +1,461 @@
+/*
+ * This file implements decoding of frames received on a connection
+ * The parser peeks into the input evbuffer instead of reading out of it.
+ * If the payload is contiguous in the evbuffer, the frame points straight
+ * into it. Only a payload split across chains is copied (to scratch), and
+ * only if someone asks for it
+ * Headers come either as a raw comm_data_t (v0) or in the compact v1
+ * format, whichever the connection agreed upon. v1 frames may also carry
+ * a checksum, checked once the whole frame has arrived, and compressed
+ * payloads, decompressed only when asked for
+ */
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <endian.h>
+#include <limits.h>
+
+#include "frame.h"
+#include "crc.h"
+#include "lz.h"
+#include "comm.h"
+
+#define FRAME_HDR_LEN	offsetof(comm_data_t, buf)
+
+/* Chains of input checksummed at a time */
+#define FRAME_CRC_VECS	8
+
+void frame_parser_init(frame_parser_t *parser, int max_len)
+{
+	memset(parser, 0, sizeof(*parser));
+
+	parser->state = FRAME_STATE_HDR;
+	parser->wire = FRAME_WIRE_V0;
+	parser->max_len = max_len;
+}
+
+void frame_parser_set_wire(frame_parser_t *parser, int wire, int session)
+{
+	parser->wire = wire;
+	parser->session = session;
+}
+
+void frame_parser_destroy(frame_parser_t *parser)
+{
+	free(parser->scratch);
+	parser->scratch = NULL;
+	free(parser->lz_buf);
+	parser->lz_buf = NULL;
+}
+
+/* Fills in the frame from a parsed header */
+static int frame_set_hdr(frame_parser_t *parser, int hdr_len, int msg_type,
+				int msg_len, int msg_num, int session,
+				bool is_lz)
+{
+	if (msg_len < 0 || msg_len > parser->max_len)
+		return -EINVAL;
+
+	parser->frame.msg_type = msg_type;
+	parser->frame.msg_len = msg_len;
+	parser->frame.msg_num = msg_num;
+	parser->frame.session = session;
+	parser->frame.buf = NULL;
+	parser->frame.is_lz = is_lz;
+	parser->frame.wire_len = msg_len;
+
+	parser->hdr_len = hdr_len;
+	parser->crc_len = (parser->wire & FRAME_WIRE_CRC) ? FRAME_CRC_LEN : 0;
+	parser->state = FRAME_STATE_PAYLOAD;
+
+	return FRAME_READY;
+}
+
+/* Parses the v0 header at the start of input */
+static int frame_parse_hdr_v0(frame_parser_t *parser, struct evbuffer *input)
+{
+	comm_data_t hdr;
+
+	if (evbuffer_get_length(input) < FRAME_HDR_LEN)
+		return FRAME_NEED_MORE;
+
+	if (evbuffer_copyout(input, &hdr, FRAME_HDR_LEN) != FRAME_HDR_LEN)
+		return -EIO;
+
+	return frame_set_hdr(parser, FRAME_HDR_LEN, hdr.msg_type, hdr.msg_len,
+				hdr.msg_num, hdr.session, false);
+}
+
+/* Decodes varint at *pos of hdr (len bytes long), moving pos past it */
+static int frame_get_varint(const uint8_t *hdr, int len, int *pos,
+				uint32_t *val)
+{
+	uint32_t v = 0;
+	int i;
+
+	for (i = 0; i < FRAME_VARINT_MAX; i++) {
+		if (*pos + i >= len)
+			return FRAME_NEED_MORE;
+
+		v |= (uint32_t)(hdr[*pos + i] & 0x7f) << (7 * i);
+
+		if ((hdr[*pos + i] & 0x80) == 0) {
+			/* Last byte has only 4 bits left of 32 */
+			if (i == FRAME_VARINT_MAX - 1 && hdr[*pos + i] > 0x0f)
+				return -EINVAL;
+
+			*pos += i + 1;
+			*val = v;
+			return FRAME_READY;
+		}
+	}
+
+	return -EINVAL;
+}
+
+/*
+ * Decodes the v1 header at hdr (having len bytes, maybe more than the
+ * header) into frame. Sets hdr_len to its length
+ */
+static int frame_decode_hdr_v1(const uint8_t *hdr, int len, int wire,
+				int conn_session, frame_t *frame, int *hdr_len)
+{
+	uint32_t msg_num, msg_len, session;
+	int pos = 2;
+	int ret;
+
+	if (len < 3)
+		return FRAME_NEED_MORE;
+
+	if ((hdr[0] & FRAME_V1_VERSION_MASK) != FRAME_V1_VERSION)
+		return -EINVAL;
+
+	ret = frame_get_varint(hdr, len, &pos, &msg_num);
+	if (ret != FRAME_READY)
+		return ret;
+
+	if (hdr[0] & FRAME_V1_EXT_LEN) {
+		ret = frame_get_varint(hdr, len, &pos, &msg_len);
+		if (ret != FRAME_READY)
+			return ret;
+	} else {
+		msg_len = hdr[0] & FRAME_V1_INLINE_MASK;
+		if (msg_len > FRAME_INLINE_MAX)
+			return -EINVAL;
+	}
+
+	if (hdr[0] & FRAME_V1_SESSION) {
+		ret = frame_get_varint(hdr, len, &pos, &session);
+		if (ret != FRAME_READY)
+			return ret;
+	} else {
+		session = conn_session;
+	}
+
+	/* Compressed payloads only if asked for, never empty */
+	frame->is_lz = (hdr[1] & FRAME_MSG_LZ) != 0;
+	if (frame->is_lz && (!(wire & FRAME_WIRE_LZ) || msg_len == 0))
+		return -EINVAL;
+
+	if (msg_len > INT_MAX)
+		return -EINVAL;
+
+	frame->msg_type = hdr[1] & ~FRAME_MSG_LZ;
+	frame->msg_len = msg_len;
+	frame->msg_num = msg_num;
+	frame->session = session;
+	*hdr_len = pos;
+
+	return FRAME_READY;
+}
+
+/* Parses the v1 header at the start of input */
+static int frame_parse_hdr_v1(frame_parser_t *parser, struct evbuffer *input)
+{
+	uint8_t buf[FRAME_MAX_HDR_LEN];
+	size_t avail = evbuffer_get_length(input);
+	struct evbuffer_iovec vec;
+	const uint8_t *hdr = buf;
+	int len, hdr_len;
+	frame_t frame;
+	int ret;
+
+	if (avail < 3)
+		return FRAME_NEED_MORE;
+
+	/* Header is no longer than this, can be shorter */
+	len = avail < sizeof(buf) ? (int)avail : (int)sizeof(buf);
+
+	/* Decode in place, unless header may straddle chains */
+	if (evbuffer_peek(input, len, NULL, &vec, 1) == 1)
+		hdr = vec.iov_base;
+	else if (evbuffer_copyout(input, buf, len) != len)
+		return -EIO;
+
+	ret = frame_decode_hdr_v1(hdr, len, parser->wire, parser->session,
+					&frame, &hdr_len);
+	if (ret != FRAME_READY)
+		return ret;
+
+	return frame_set_hdr(parser, hdr_len, frame.msg_type, frame.msg_len,
+				frame.msg_num, frame.session, frame.is_lz);
+}
+
+/* Parses the header at the start of input */
+static int frame_parse_hdr(frame_parser_t *parser, struct evbuffer *input)
+{
+	if (FRAME_WIRE_VERSION(parser->wire) == FRAME_WIRE_V1)
+		return frame_parse_hdr_v1(parser, input);
+
+	return frame_parse_hdr_v0(parser, input);
+}
+
+/* CRC32C of the first len bytes of input, wherever they lie */
+static uint32_t frame_crc_input(struct evbuffer *input, size_t len)
+{
+	struct evbuffer_iovec vecs[FRAME_CRC_VECS];
+	struct evbuffer_ptr ptr;
+	uint32_t crc = 0;
+	size_t n;
+	int i, num;
+
+	evbuffer_ptr_set(input, &ptr, 0, EVBUFFER_PTR_SET);
+
+	while (len > 0) {
+		num = evbuffer_peek(input, len, &ptr, vecs, FRAME_CRC_VECS);
+		if (num > FRAME_CRC_VECS)
+			num = FRAME_CRC_VECS;
+
+		for (i = 0; i < num && len > 0; i++) {
+			n = vecs[i].iov_len < len ? vecs[i].iov_len : len;
+			crc = crc32c(crc, vecs[i].iov_base, n);
+			len -= n;
+			evbuffer_ptr_set(input, &ptr, n, EVBUFFER_PTR_ADD);
+		}
+	}
+
+	return crc;
+}
+
+/* Checks the trailer of a frame, which has fully arrived */
+static int frame_check_crc(frame_parser_t *parser, struct evbuffer *input)
+{
+	size_t len = parser->hdr_len + parser->frame.wire_len;
+	struct evbuffer_ptr ptr;
+	uint32_t crc;
+
+	if (evbuffer_ptr_set(input, &ptr, len, EVBUFFER_PTR_SET) < 0 ||
+			evbuffer_copyout_from(input, &ptr, &crc,
+					FRAME_CRC_LEN) != FRAME_CRC_LEN)
+		return -EIO;
+
+	if (le32toh(crc) != frame_crc_input(input, len))
+		return FRAME_BAD_CRC;
+
+	return FRAME_READY;
+}
+
+/* Checks if the payload of the frame has fully arrived */
+static int frame_parse_payload(frame_parser_t *parser, struct evbuffer *input)
+{
+	size_t len = parser->hdr_len + parser->frame.wire_len + parser->crc_len;
+	int ret;
+
+	if (evbuffer_get_length(input) < len)
+		return FRAME_NEED_MORE;
+
+	if (parser->crc_len != 0) {
+		ret = frame_check_crc(parser, input);
+		if (ret != FRAME_READY)
+			return ret;
+	}
+
+	parser->num_frames++;
+
+	return FRAME_READY;
+}
+
+/* Decompresses payload buf of the frame */
+static char *frame_decompress(frame_parser_t *parser, const char *buf)
+{
+	int len;
+
+	if (parser->lz_buf == NULL) {
+		parser->lz_buf = malloc(parser->max_len);
+		if (parser->lz_buf == NULL)
+			return NULL;
+	}
+
+	len = lz_decompress(buf, parser->frame.wire_len, parser->lz_buf,
+				parser->max_len);
+	if (len < 0)
+		return NULL;
+
+	parser->frame.msg_len = len;
+	parser->frame.buf = parser->lz_buf;
+
+	return parser->frame.buf;
+}
+
+char *frame_payload(frame_parser_t *parser, struct evbuffer *input)
+{
+	struct evbuffer_iovec vec;
+	struct evbuffer_ptr ptr;
+	size_t len = parser->hdr_len + parser->frame.wire_len;
+	char *buf;
+
+	if (parser->frame.buf != NULL || parser->frame.wire_len == 0)
+		return parser->frame.buf;
+
+	/* Is whole frame in the first chain? */
+	if (evbuffer_peek(input, len, NULL, &vec, 1) == 1) {
+		buf = (char *)vec.iov_base + parser->hdr_len;
+	} else {
+		/* Straddles chains - copy it out */
+		if (parser->scratch == NULL) {
+			parser->scratch = malloc(parser->max_len);
+			if (parser->scratch == NULL)
+				return NULL;
+		}
+
+		if (evbuffer_ptr_set(input, &ptr, parser->hdr_len,
+					EVBUFFER_PTR_SET) < 0)
+			return NULL;
+
+		if (evbuffer_copyout_from(input, &ptr, parser->scratch,
+					parser->frame.wire_len) !=
+				parser->frame.wire_len)
+			return NULL;
+
+		buf = parser->scratch;
+		parser->num_copied++;
+	}
+
+	if (parser->frame.is_lz)
+		return frame_decompress(parser, buf);
+
+	parser->frame.buf = buf;
+
+	return parser->frame.buf;
+}
+
+int frame_parse(frame_parser_t *parser, struct evbuffer *input,
+		frame_t **frame)
+{
+	int ret;
+
+	if (parser->state == FRAME_STATE_HDR) {
+		ret = frame_parse_hdr(parser, input);
+		if (ret != FRAME_READY)
+			return ret;
+	}
+
+	ret = frame_parse_payload(parser, input);
+	if (ret == FRAME_READY)
+		*frame = &parser->frame;
+
+	return ret;
+}
+
+void frame_consume(frame_parser_t *parser, struct evbuffer *input)
+{
+	evbuffer_drain(input, parser->hdr_len + parser->frame.wire_len +
+				parser->crc_len);
+
+	parser->frame.buf = NULL;
+	parser->state = FRAME_STATE_HDR;
+}
+
+int frame_decode(const void *buf, int len, int conn_session, bool need_crc,
+			frame_t *frame)
+{
+	int hdr_len, crc_len = 0, ret;
+	uint32_t crc;
+
+	ret = frame_decode_hdr_v1(buf, len, FRAME_WIRE_V1, conn_session, frame,
+					&hdr_len);
+	if (ret == FRAME_READY)
+		crc_len = len - hdr_len - frame->msg_len;
+
+	if (ret == FRAME_NEED_MORE || (ret == FRAME_READY &&
+				crc_len != 0 && crc_len != FRAME_CRC_LEN))
+		return -EINVAL;
+
+	if (ret < 0)
+		return ret;
+
+	if (crc_len == 0 && need_crc)
+		return -EINVAL;
+
+	if (crc_len != 0) {
+		memcpy(&crc, (const uint8_t *)buf + hdr_len + frame->msg_len,
+			FRAME_CRC_LEN);
+		if (le32toh(crc) != crc32c(0, buf, hdr_len + frame->msg_len))
+			return FRAME_BAD_CRC;
+	}
+
+	frame->buf = (char *)buf + hdr_len;
+	frame->wire_len = frame->msg_len;
+
+	return FRAME_READY;
+}
+
+/* Appends val as varint at pos of hdr. Returns the position after it */
+static int frame_put_varint(uint8_t *hdr, int pos, uint32_t val)
+{
+	while (val >= 0x80) {
+		hdr[pos++] = (val & 0x7f) | 0x80;
+		val >>= 7;
+	}
+
+	hdr[pos++] = val;
+
+	return pos;
+}
+
+int frame_encode_hdr(int wire, uint8_t *hdr, int msg_type, int msg_len,
+			int msg_num, int session, int conn_session)
+{
+	int pos = 2;
+
+	if (FRAME_WIRE_VERSION(wire) == FRAME_WIRE_V0) {
+		memcpy(&hdr[offsetof(comm_data_t, msg_type)], &msg_type,
+			sizeof(int));
+		memcpy(&hdr[offsetof(comm_data_t, msg_len)], &msg_len,
+			sizeof(int));
+		memcpy(&hdr[offsetof(comm_data_t, msg_num)], &msg_num,
+			sizeof(int));
+		memcpy(&hdr[offsetof(comm_data_t, session)], &session,
+			sizeof(int));
+		return FRAME_HDR_LEN;
+	}
+
+	hdr[0] = FRAME_V1_VERSION;
+	hdr[1] = msg_type;
+
+	pos = frame_put_varint(hdr, pos, msg_num);
+
+	/* Tiny payloads (like acks) need no length of their own */
+	if (msg_len <= FRAME_INLINE_MAX) {
+		hdr[0] |= msg_len;
+	} else {
+		hdr[0] |= FRAME_V1_EXT_LEN;
+		pos = frame_put_varint(hdr, pos, msg_len);
+	}
+
+	if (session != conn_session) {
+		hdr[0] |= FRAME_V1_SESSION;
+		pos = frame_put_varint(hdr, pos, session);
+	}
+
+	return pos;
+}
+
+void frame_encode_crc(uint8_t *trailer, const uint8_t *hdr, int hdr_len,
+			const void *buf, int len)
+{
+	uint32_t crc;
+
+	crc = htole32(crc32c(crc32c(0, hdr, hdr_len), buf, len));
+	memcpy(trailer, &crc, FRAME_CRC_LEN);
+}
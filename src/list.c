@@ -130,7 +130,7 @@ bool list_remove(list_t *list, void *data)
 				list->head = list->head->next;
 
 			if (cur == list->tail)
-				list->tail = NULL;
+				list->tail = prev;
 
 			list->len--;
 
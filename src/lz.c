@@ -0,0 +1,226 @@
+/*
+ * This file implements a small LZ77 codec for msg payloads, producing the
+ * LZ4 block format. It is built for speed over ratio: a single hash table
+ * of recent 4 byte sequences, taking the first match found, and skipping
+ * ahead faster over data which doesn't seem to compress
+ * A block is a run of sequences, each being
+ *	token: literal length (4 bits) | match length - 4 (4 bits)
+ *	rest of literal length, if its nibble is 15 (bytes of 255, then < 255)
+ *	literals
+ *	offset of match, 2 bytes little endian
+ *	rest of match length, if its nibble is 15
+ * The last sequence has only literals. As in LZ4, the last 5 bytes are
+ * always literals and no match starts in the last 12 bytes
+ */
+#include <stdint.h>
+#include <string.h>
+#include <errno.h>
+
+#include "lz.h"
+
+#define LZ_HASH_BITS		12
+#define LZ_MIN_MATCH		4
+#define LZ_LAST_LITERALS	5
+#define LZ_MF_LIMIT		12
+#define LZ_SKIP_SHIFT		6	/* Step grows by 1 every 64 misses */
+
+static inline uint32_t lz_read32(const uint8_t *p)
+{
+	uint32_t v;
+
+	memcpy(&v, p, sizeof(v));
+	return v;
+}
+
+static inline uint32_t lz_hash(const uint8_t *p)
+{
+	return (lz_read32(p) * 2654435761U) >> (32 - LZ_HASH_BITS);
+}
+
+/* Writes the part of a length not fitting in its nibble */
+static uint8_t *lz_put_len(uint8_t *op, int len)
+{
+	for (; len >= 255; len -= 255)
+		*op++ = 255;
+
+	*op++ = len;
+
+	return op;
+}
+
+/* Most bytes a sequence of lit literals and a match of mlen can take */
+static int lz_seq_max(int lit, int mlen)
+{
+	return 1 + lit / 255 + 1 + lit + 2 + mlen / 255 + 1;
+}
+
+/* Writes a sequence of lit literals, followed by a match unless mlen is 0 */
+static uint8_t *lz_put_seq(uint8_t *op, const uint8_t *literals, int lit,
+				int offset, int mlen)
+{
+	uint8_t *token = op++;
+
+	*token = (lit < 15 ? lit : 15) << 4;
+	if (lit >= 15)
+		op = lz_put_len(op, lit - 15);
+
+	memcpy(op, literals, lit);
+	op += lit;
+
+	if (mlen == 0)
+		return op;
+
+	*op++ = offset & 0xff;
+	*op++ = offset >> 8;
+
+	mlen -= LZ_MIN_MATCH;
+	*token |= mlen < 15 ? mlen : 15;
+	if (mlen >= 15)
+		op = lz_put_len(op, mlen - 15);
+
+	return op;
+}
+
+int lz_compress(const void *src, int len, void *dst, int max)
+{
+	uint16_t table[1 << LZ_HASH_BITS];	/* Positions in src, by hash */
+	const uint8_t *base = src, *end = base + len;
+	const uint8_t *ip = base, *anchor = base, *ref;
+	const uint8_t *mf_limit, *match_limit;
+	uint8_t *op = dst, *op_end = op + max;
+	uint32_t h;
+	int lit, mlen;
+
+	if (len < 0 || len > LZ_MAX_LEN || max < 0)
+		return -EINVAL;
+
+	/* Shorter ones are all literals */
+	if (len > LZ_MF_LIMIT) {
+		mf_limit = end - LZ_MF_LIMIT;
+		match_limit = end - LZ_LAST_LITERALS;
+
+		/* Unused entries point to the start, checked like any other */
+		memset(table, 0, sizeof(table));
+		ip++;
+
+		while (ip < mf_limit) {
+			h = lz_hash(ip);
+			ref = base + table[h];
+			table[h] = ip - base;
+
+			if (lz_read32(ref) != lz_read32(ip)) {
+				ip += 1 + ((ip - anchor) >> LZ_SKIP_SHIFT);
+				continue;
+			}
+
+			/* Match may start earlier, among the literals */
+			while (ip > anchor && ref > base && ip[-1] == ref[-1]) {
+				ip--;
+				ref--;
+			}
+
+			mlen = LZ_MIN_MATCH;
+			while (ip + mlen < match_limit && ip[mlen] == ref[mlen])
+				mlen++;
+
+			lit = ip - anchor;
+			if (op + lz_seq_max(lit, mlen) > op_end)
+				return 0;
+
+			op = lz_put_seq(op, anchor, lit, ip - ref, mlen);
+
+			ip += mlen;
+			anchor = ip;
+
+			/* Helps the next match, often starting right behind */
+			if (ip < mf_limit)
+				table[lz_hash(ip - 2)] = ip - 2 - base;
+		}
+	}
+
+	lit = end - anchor;
+	if (op + lz_seq_max(lit, 0) > op_end)
+		return 0;
+
+	op = lz_put_seq(op, anchor, lit, 0, 0);
+
+	return op - (uint8_t *)dst;
+}
+
+/* Reads the part of a length not fitting in its nibble, adding it to len */
+static int lz_get_len(const uint8_t **ip, const uint8_t *end, int *len)
+{
+	uint8_t b;
+
+	do {
+		if (*ip >= end)
+			return -EINVAL;
+
+		b = *(*ip)++;
+		*len += b;
+	} while (b == 255);
+
+	return 0;
+}
+
+int lz_decompress(const void *src, int len, void *dst, int max)
+{
+	const uint8_t *ip = src, *end = ip + len;
+	uint8_t *op = dst, *op_end = op + max;
+	const uint8_t *ref;
+	int lit, mlen, offset, i;
+	uint8_t token;
+
+	if (len <= 0 || max < 0)
+		return -EINVAL;
+
+	while (ip < end) {
+		token = *ip++;
+
+		lit = token >> 4;
+		if (lit == 15 && lz_get_len(&ip, end, &lit) < 0)
+			return -EINVAL;
+
+		if (lit > end - ip || lit > op_end - op)
+			return -EINVAL;
+
+		memcpy(op, ip, lit);
+		op += lit;
+		ip += lit;
+
+		/* Last sequence, literals only */
+		if (ip == end)
+			break;
+
+		if (end - ip < 2)
+			return -EINVAL;
+
+		offset = ip[0] | ip[1] << 8;
+		ip += 2;
+
+		if (offset == 0 || offset > op - (uint8_t *)dst)
+			return -EINVAL;
+
+		mlen = token & 0x0f;
+		if (mlen == 15 && lz_get_len(&ip, end, &mlen) < 0)
+			return -EINVAL;
+
+		mlen += LZ_MIN_MATCH;
+		if (mlen > op_end - op)
+			return -EINVAL;
+
+		ref = op - offset;
+
+		/* Overlapping match repeats the bytes just written */
+		if (offset >= mlen) {
+			memcpy(op, ref, mlen);
+		} else {
+			for (i = 0; i < mlen; i++)
+				op[i] = ref[i];
+		}
+
+		op += mlen;
+	}
+
+	return op - (uint8_t *)dst;
+}
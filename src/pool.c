@@ -0,0 +1,337 @@
+/*
+ * This file implements a pool allocator with a few size classes
+ * Memory is allocated in slabs which are carved into objects of one class.
+ * Each thread keeps a small cache of free objects per class, and moves
+ * them to/from the shared free list of the class in batches, so the lock
+ * is only taken once every POOL_CACHE_SIZE / 2 allocs (or frees). A thread
+ * has caches for a few pools at a time, one making room for another gives
+ * its objects back to their pool
+ */
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <errno.h>
+
+#include "pool.h"
+
+/* Free object, linked in a free list */
+typedef struct pool_obj {
+	struct pool_obj *next;
+} pool_obj_t;
+
+/* Start of every slab */
+typedef struct pool_slab {
+	struct pool_slab *next;
+} pool_slab_t;
+
+/* Objects cached by a thread for one pool */
+typedef struct {
+	unsigned long pool_id;		/* 0 if unused */
+	pool_t *pool;
+	unsigned long last_use;
+	pool_obj_t *objs[POOL_NUM_CLASSES][POOL_CACHE_SIZE];
+	int count[POOL_NUM_CLASSES];
+} pool_cache_t;
+
+static const size_t class_sizes[POOL_NUM_CLASSES] = POOL_CLASS_SIZES;
+
+_Static_assert(sizeof(max_align_t) + POOL_MAX_OBJ_SIZE <= POOL_SLAB_SIZE,
+		"Largest class doesn't fit a slab");
+
+static unsigned long next_pool_id = 1;
+
+/* Live pools, for giving back cached objects only to those */
+static pthread_mutex_t pools_lock = PTHREAD_MUTEX_INITIALIZER;
+static pool_t *pools;
+
+static __thread pool_cache_t caches[POOL_NUM_CACHES];
+static __thread unsigned long cache_uses;
+
+/*
+ * Move all of cache's objects to the free lists of its pool, unless the
+ * pool was destroyed meanwhile (its slabs being gone along with them)
+ */
+static void pool_flush_cache(pool_cache_t *cache)
+{
+	pool_class_t *class;
+	pool_obj_t *obj;
+	pool_t *pool;
+	int c;
+
+	pthread_mutex_lock(&pools_lock);
+
+	for (pool = pools; pool != NULL; pool = pool->next) {
+		if (pool == cache->pool && pool->id == cache->pool_id)
+			break;
+	}
+
+	for (c = 0; pool != NULL && c < POOL_NUM_CLASSES; c++) {
+		class = &pool->classes[c];
+
+		pthread_mutex_lock(&class->lock);
+		while (cache->count[c] > 0) {
+			obj = cache->objs[c][--cache->count[c]];
+			obj->next = class->free_list;
+			class->free_list = obj;
+		}
+		pthread_mutex_unlock(&class->lock);
+	}
+
+	pthread_mutex_unlock(&pools_lock);
+
+	memset(cache, 0, sizeof(*cache));
+}
+
+/*
+ * Get the thread's cache for pool. If it has none, the least recently used
+ * one (or an unused one) is flushed and taken over
+ */
+static pool_cache_t *pool_get_cache(pool_t *pool)
+{
+	pool_cache_t *cache = NULL, *lru = &caches[0];
+	int i;
+
+	for (i = 0; i < POOL_NUM_CACHES; i++) {
+		if (caches[i].pool_id == pool->id) {
+			cache = &caches[i];
+			break;
+		}
+
+		if (caches[i].last_use < lru->last_use)
+			lru = &caches[i];
+	}
+
+	if (cache == NULL) {
+		cache = lru;
+		if (cache->pool_id != 0)
+			pool_flush_cache(cache);
+
+		cache->pool_id = pool->id;
+		cache->pool = pool;
+	}
+
+	cache->last_use = ++cache_uses;
+
+	return cache;
+}
+
+static int pool_get_class(size_t size)
+{
+	int i;
+
+	for (i = 0; i < POOL_NUM_CLASSES; i++) {
+		if (size <= class_sizes[i])
+			return i;
+	}
+
+	return -1;
+}
+
+/* Allocate a new slab and add its objects to free list. Lock must be held */
+static int pool_grow(pool_class_t *class)
+{
+	pool_slab_t *slab;
+	pool_obj_t *obj;
+	size_t off, slab_size;
+
+	/* Header is padded so that objects stay aligned */
+	off = sizeof(max_align_t);
+
+	/* Aligned to its size, so that objects can tell their slab */
+	slab_size = POOL_SLAB_SIZE;
+	slab = aligned_alloc(POOL_SLAB_SIZE, slab_size);
+	if (slab == NULL)
+		return -ENOMEM;
+
+	slab->next = class->slabs;
+	class->slabs = slab;
+	class->num_slabs++;
+
+	for (; off + class->obj_size <= slab_size; off += class->obj_size) {
+		obj = (pool_obj_t *)((char *)slab + off);
+		obj->next = class->free_list;
+		class->free_list = obj;
+		class->num_objs++;
+	}
+
+	return 0;
+}
+
+int pool_new(pool_t *pool)
+{
+	int i;
+
+	pool->id = __atomic_fetch_add(&next_pool_id, 1, __ATOMIC_RELAXED);
+
+	for (i = 0; i < POOL_NUM_CLASSES; i++) {
+		pool_class_t *class = &pool->classes[i];
+
+		class->obj_size = class_sizes[i];
+		class->free_list = NULL;
+		class->slabs = NULL;
+		class->num_slabs = 0;
+		class->num_objs = 0;
+		class->allocs = 0;
+		class->frees = 0;
+
+		if (pthread_mutex_init(&class->lock, NULL) != 0) {
+			while (--i >= 0)
+				pthread_mutex_destroy(&pool->classes[i].lock);
+			return -ENOMEM;
+		}
+	}
+
+	pthread_mutex_lock(&pools_lock);
+	pool->next = pools;
+	pools = pool;
+	pthread_mutex_unlock(&pools_lock);
+
+	return 0;
+}
+
+void pool_destroy(pool_t *pool)
+{
+	pool_slab_t *slab;
+	pool_t **prev;
+	int i;
+
+	pthread_mutex_lock(&pools_lock);
+	for (prev = &pools; *prev != NULL; prev = &(*prev)->next) {
+		if (*prev == pool) {
+			*prev = pool->next;
+			break;
+		}
+	}
+	pthread_mutex_unlock(&pools_lock);
+
+	/*
+	 * Caller's cache would otherwise point into freed slabs. Those of
+	 * other threads are never used again, their pool id being unique
+	 */
+	for (i = 0; i < POOL_NUM_CACHES; i++) {
+		if (caches[i].pool_id == pool->id)
+			memset(&caches[i], 0, sizeof(caches[i]));
+	}
+
+	for (i = 0; i < POOL_NUM_CLASSES; i++) {
+		pool_class_t *class = &pool->classes[i];
+
+		while ((slab = class->slabs) != NULL) {
+			class->slabs = slab->next;
+			free(slab);
+		}
+
+		pthread_mutex_destroy(&class->lock);
+	}
+}
+
+void *pool_alloc(pool_t *pool, size_t size)
+{
+	pool_cache_t *cache;
+	pool_class_t *class;
+	pool_obj_t *obj;
+	int c;
+
+	c = pool_get_class(size);
+	if (c < 0)
+		return NULL;
+
+	class = &pool->classes[c];
+	cache = pool_get_cache(pool);
+
+	if (cache->count[c] == 0) {
+
+		/* Refill half of the cache from the shared list */
+		pthread_mutex_lock(&class->lock);
+
+		while (cache->count[c] < POOL_CACHE_SIZE / 2) {
+
+			if (class->free_list == NULL &&
+					pool_grow(class) < 0)
+				break;
+
+			obj = class->free_list;
+			class->free_list = obj->next;
+			cache->objs[c][cache->count[c]++] = obj;
+		}
+
+		pthread_mutex_unlock(&class->lock);
+
+		if (cache->count[c] == 0)
+			return NULL;
+	}
+
+	obj = cache->objs[c][--cache->count[c]];
+
+	__atomic_add_fetch(&class->allocs, 1, __ATOMIC_RELAXED);
+
+	return obj;
+}
+
+void pool_free(pool_t *pool, void *ptr, size_t size)
+{
+	pool_cache_t *cache;
+	pool_class_t *class;
+	pool_obj_t *obj;
+	int c;
+
+	c = pool_get_class(size);
+	if (c < 0 || ptr == NULL)
+		return;
+
+	class = &pool->classes[c];
+	cache = pool_get_cache(pool);
+
+	if (cache->count[c] == POOL_CACHE_SIZE) {
+
+		/* Spill half of the cache to the shared list */
+		pthread_mutex_lock(&class->lock);
+
+		while (cache->count[c] > POOL_CACHE_SIZE / 2) {
+			obj = cache->objs[c][--cache->count[c]];
+			obj->next = class->free_list;
+			class->free_list = obj;
+		}
+
+		pthread_mutex_unlock(&class->lock);
+	}
+
+	cache->objs[c][cache->count[c]++] = ptr;
+
+	__atomic_add_fetch(&class->frees, 1, __ATOMIC_RELAXED);
+}
+
+void *pool_slab_of(const void *obj)
+{
+	return (void *)((uintptr_t)obj & ~((uintptr_t)POOL_SLAB_SIZE - 1));
+}
+
+void pool_get_stats(pool_t *pool, pool_stats_t *stats)
+{
+	int i;
+
+	stats->bytes_reserved = 0;
+	stats->bytes_in_use = 0;
+
+	for (i = 0; i < POOL_NUM_CLASSES; i++) {
+		pool_class_t *class = &pool->classes[i];
+
+		pthread_mutex_lock(&class->lock);
+		stats->classes[i].num_slabs = class->num_slabs;
+		stats->classes[i].num_objs = class->num_objs;
+		pthread_mutex_unlock(&class->lock);
+
+		stats->classes[i].obj_size = class->obj_size;
+		stats->classes[i].allocs =
+			__atomic_load_n(&class->allocs, __ATOMIC_RELAXED);
+		stats->classes[i].frees =
+			__atomic_load_n(&class->frees, __ATOMIC_RELAXED);
+		stats->classes[i].in_use = stats->classes[i].allocs -
+						stats->classes[i].frees;
+
+		stats->bytes_reserved += stats->classes[i].num_slabs *
+						POOL_SLAB_SIZE;
+		stats->bytes_in_use += stats->classes[i].in_use *
+						class->obj_size;
+	}
+}
@@ -0,0 +1,124 @@
+/*
+ * This file implements a bounded multi-producer/single-consumer ring
+ * Producers claim slots with a single CAS of the head (several at once if
+ * needed). Each slot carries a sequence number telling the consumer whether
+ * the producer at that position has filled it in yet
+ */
+#include <stdlib.h>
+#include <errno.h>
+
+#include "ring.h"
+
+int ring_new(ring_t *ring, unsigned long size)
+{
+	unsigned long i;
+
+	if (size < 2)
+		size = 2;
+
+	/* Round up to power of two */
+	ring->size = 1;
+	while (ring->size < size)
+		ring->size <<= 1;
+
+	ring->mask = ring->size - 1;
+	ring->slots = malloc(ring->size * sizeof(ring_slot_t));
+	if (ring->slots == NULL)
+		return -ENOMEM;
+
+	for (i = 0; i < ring->size; i++) {
+		ring->slots[i].seq = i;
+		ring->slots[i].data = NULL;
+	}
+
+	ring->head = ring->tail = 0;
+
+	return 0;
+}
+
+void ring_destroy(ring_t *ring)
+{
+	free(ring->slots);
+	ring->slots = NULL;
+}
+
+unsigned long ring_reserve(ring_t *ring, unsigned long n, unsigned long *pos)
+{
+	unsigned long head, tail, avail;
+
+	head = __atomic_load_n(&ring->head, __ATOMIC_RELAXED);
+
+	while (1) {
+		/*
+		 * Consumer frees slots in order, so everything before tail is
+		 * free for this lap. A stale tail only underestimates the room
+		 */
+		tail = __atomic_load_n(&ring->tail, __ATOMIC_ACQUIRE);
+		avail = ring->size - (head - tail);
+
+		if (avail == 0)
+			return 0;
+
+		if (n > avail)
+			n = avail;
+
+		if (__atomic_compare_exchange_n(&ring->head, &head, head + n,
+						true, __ATOMIC_RELAXED,
+						__ATOMIC_RELAXED))
+			break;
+	}
+
+	*pos = head;
+	return n;
+}
+
+void ring_commit(ring_t *ring, unsigned long pos, void *element)
+{
+	ring_slot_t *slot = &ring->slots[pos & ring->mask];
+
+	slot->data = element;
+
+	/* Publish to the consumer */
+	__atomic_store_n(&slot->seq, pos + 1, __ATOMIC_RELEASE);
+}
+
+bool ring_push(ring_t *ring, void *element)
+{
+	unsigned long pos;
+
+	if (ring_reserve(ring, 1, &pos) == 0)
+		return false;
+
+	ring_commit(ring, pos, element);
+
+	return true;
+}
+
+void *ring_pop(ring_t *ring)
+{
+	ring_slot_t *slot;
+	unsigned long pos = ring->tail;
+	void *data;
+
+	slot = &ring->slots[pos & ring->mask];
+
+	/* Empty, or producer has claimed the slot but not yet filled it */
+	if (__atomic_load_n(&slot->seq, __ATOMIC_ACQUIRE) != pos + 1)
+		return NULL;
+
+	data = slot->data;
+
+	/* Hand the slot back to producers for the next lap */
+	__atomic_store_n(&slot->seq, pos + ring->size, __ATOMIC_RELEASE);
+	__atomic_store_n(&ring->tail, pos + 1, __ATOMIC_RELEASE);
+
+	return data;
+}
+
+unsigned long ring_count(ring_t *ring)
+{
+	unsigned long head = __atomic_load_n(&ring->head, __ATOMIC_RELAXED);
+	unsigned long tail = __atomic_load_n(&ring->tail, __ATOMIC_RELAXED);
+
+	return head - tail;
+}
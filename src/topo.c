@@ -0,0 +1,482 @@
+/*
+ * This file implements the topology of a rack - the hosts, the endpoints
+ * and their addresses over the switches. It can be built up node by node
+ * or loaded from a config file at startup
+ * All the addresses are indexed in a hash table, so that a peer can be
+ * told from the address of its connection in O(1), however big the rack
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+
+#include "topo.h"
+
+#define TOPO_LINE_LEN	512
+
+/* Nodes allocated at a time */
+#define TOPO_GROW	16
+
+/* Separators of the words of a line */
+#define TOPO_SPACE	" \t\r\n"
+
+/* Smallest index (bits) */
+#define TOPO_INDEX_MIN_BITS	4
+
+/* Fibonacci hashing - Spreads nearby addresses over the index */
+#define TOPO_HASH_MUL		2654435761U
+
+int topo_new(topo_t *topo, int num_switches)
+{
+	memset(topo, 0, sizeof(*topo));
+
+	if (num_switches <= 0 || num_switches > MAX_SWITCHES)
+		return -EINVAL;
+
+	topo->num_switches = num_switches;
+
+	return 0;
+}
+
+/* Number of switches stays, for looking at per switch state left behind */
+void topo_destroy(topo_t *topo)
+{
+	free(topo->hosts);
+	free(topo->eps);
+	free(topo->index);
+	free(topo->links);
+
+	topo->hosts = topo->eps = NULL;
+	topo->num_hosts = topo->num_eps = 0;
+	topo->max_hosts = topo->max_eps = 0;
+	topo->index = NULL;
+	topo->index_bits = topo->index_used = 0;
+	topo->links = NULL;
+	topo->num_links = topo->max_links = 0;
+}
+
+/* Slot having addr in index, or the empty one where it would go */
+static topo_addr_t *topo_index_slot(topo_addr_t *index, int bits,
+					uint32_t addr)
+{
+	uint32_t mask = (1U << bits) - 1;
+	uint32_t i = (ntohl(addr) * TOPO_HASH_MUL) >> (32 - bits);
+
+	while (index[i].is_used && index[i].addr != addr)
+		i = (i + 1) & mask;
+
+	return &index[i];
+}
+
+/* Makes room in index for num more addresses */
+static int topo_index_reserve(topo_t *topo, int num)
+{
+	topo_addr_t *index, *slot;
+	int bits = topo->index_bits;
+	int i;
+
+	if (bits == 0)
+		bits = TOPO_INDEX_MIN_BITS;
+
+	while ((topo->index_used + num) * 2 > (1 << bits))
+		bits++;
+
+	if (bits == topo->index_bits)
+		return 0;
+
+	index = calloc(1 << bits, sizeof(topo_addr_t));
+	if (index == NULL)
+		return -ENOMEM;
+
+	for (i = 0; topo->index != NULL && i < (1 << topo->index_bits); i++) {
+		if (!topo->index[i].is_used)
+			continue;
+
+		slot = topo_index_slot(index, bits, topo->index[i].addr);
+		*slot = topo->index[i];
+	}
+
+	free(topo->index);
+	topo->index = index;
+	topo->index_bits = bits;
+
+	return 0;
+}
+
+int topo_find_name(const topo_t *topo, const char *name, bool *is_host)
+{
+	int i;
+
+	for (i = 0; i < topo->num_hosts; i++) {
+		if (strcmp(topo->hosts[i].name, name) == 0) {
+			*is_host = true;
+			return i;
+		}
+	}
+
+	for (i = 0; i < topo->num_eps; i++) {
+		if (strcmp(topo->eps[i].name, name) == 0) {
+			*is_host = false;
+			return i;
+		}
+	}
+
+	return -ENOENT;
+}
+
+int topo_find_addr(const topo_t *topo, bool is_host, uint32_t addr, int *sw)
+{
+	topo_addr_t *slot;
+
+	if (topo->index == NULL)
+		return -ENOENT;
+
+	slot = topo_index_slot(topo->index, topo->index_bits, addr);
+	if (!slot->is_used || slot->is_host != is_host)
+		return -ENOENT;
+
+	*sw = slot->sw;
+	return slot->num;
+}
+
+int topo_find_ip(const topo_t *topo, bool is_host, const char *ip, int *sw)
+{
+	struct in_addr addr;
+
+	if (inet_pton(AF_INET, ip, &addr) != 1)
+		return -ENOENT;
+
+	return topo_find_addr(topo, is_host, addr.s_addr, sw);
+}
+
+int topo_add_node(topo_t *topo, bool is_host, const char *name,
+			const char * const *ips)
+{
+	nodes_t **nodes = is_host ? &topo->hosts : &topo->eps;
+	int *num = is_host ? &topo->num_hosts : &topo->num_eps;
+	int *max = is_host ? &topo->max_hosts : &topo->max_eps;
+	struct in_addr addrs[MAX_SWITCHES];
+	topo_addr_t *slot;
+	nodes_t *node;
+	bool dummy;
+	int j, k, ret;
+
+	if (strlen(name) == 0 || strlen(name) > MAX_NODE_NAME)
+		return -EINVAL;
+
+	if (topo_find_name(topo, name, &dummy) >= 0)
+		return -EEXIST;
+
+	for (j = 0; j < topo->num_switches; j++) {
+		if (inet_pton(AF_INET, ips[j], &addrs[j]) != 1)
+			return -EINVAL;
+
+		/* Eps tell hosts apart by address */
+		for (k = 0; k < j; k++)
+			if (addrs[k].s_addr == addrs[j].s_addr)
+				return -EEXIST;
+
+		if (topo->index != NULL &&
+				topo_index_slot(topo->index, topo->index_bits,
+						addrs[j].s_addr)->is_used)
+			return -EEXIST;
+	}
+
+	ret = topo_index_reserve(topo, topo->num_switches);
+	if (ret < 0)
+		return ret;
+
+	if (*num == *max) {
+		node = realloc(*nodes, (*max + TOPO_GROW) * sizeof(nodes_t));
+		if (node == NULL)
+			return -ENOMEM;
+
+		*nodes = node;
+		*max += TOPO_GROW;
+	}
+
+	node = &(*nodes)[*num];
+	memset(node, 0, sizeof(*node));
+
+	strcpy(node->name, name);
+	for (j = 0; j < topo->num_switches; j++) {
+		strcpy(node->ip[j], ips[j]);
+
+		slot = topo_index_slot(topo->index, topo->index_bits,
+					addrs[j].s_addr);
+		slot->addr = addrs[j].s_addr;
+		slot->is_used = true;
+		slot->is_host = is_host;
+		slot->sw = j;
+		slot->num = *num;
+	}
+
+	topo->index_used += topo->num_switches;
+
+	return (*num)++;
+}
+
+int topo_set_transport(topo_t *topo, int host, int ep,
+			transport_type_t transport)
+{
+	topo_link_t *link;
+	int i;
+
+	if (host < 0 || host >= topo->num_hosts || ep < 0 ||
+			ep >= topo->num_eps || transport_ops(transport) == NULL)
+		return -EINVAL;
+
+	for (i = 0; i < topo->num_links; i++) {
+		if (topo->links[i].host == host && topo->links[i].ep == ep) {
+			topo->links[i].transport = transport;
+			return 0;
+		}
+	}
+
+	if (transport == TRANSPORT_TCP)
+		return 0;
+
+	if (topo->num_links == topo->max_links) {
+		link = realloc(topo->links, (topo->max_links + TOPO_GROW) *
+					sizeof(topo_link_t));
+		if (link == NULL)
+			return -ENOMEM;
+
+		topo->links = link;
+		topo->max_links += TOPO_GROW;
+	}
+
+	link = &topo->links[topo->num_links++];
+	link->host = host;
+	link->ep = ep;
+	link->transport = transport;
+
+	return 0;
+}
+
+/* Few links, at most one per co-located pair */
+transport_type_t topo_get_transport(const topo_t *topo, int host, int ep)
+{
+	int i;
+
+	for (i = 0; i < topo->num_links; i++)
+		if (topo->links[i].host == host && topo->links[i].ep == ep)
+			return topo->links[i].transport;
+
+	return TRANSPORT_TCP;
+}
+
+int topo_copy(topo_t *dst, const topo_t *src)
+{
+	int i, ret;
+
+	ret = topo_new(dst, src->num_switches);
+	if (ret < 0)
+		return ret;
+
+	dst->hosts = malloc((src->num_hosts + 1) * sizeof(nodes_t));
+	dst->eps = malloc((src->num_eps + 1) * sizeof(nodes_t));
+	dst->links = malloc((src->num_links + 1) * sizeof(topo_link_t));
+	if (dst->hosts == NULL || dst->eps == NULL || dst->links == NULL ||
+			topo_index_reserve(dst, src->index_used) < 0) {
+		topo_destroy(dst);
+		return -ENOMEM;
+	}
+
+	memcpy(dst->hosts, src->hosts, src->num_hosts * sizeof(nodes_t));
+	memcpy(dst->eps, src->eps, src->num_eps * sizeof(nodes_t));
+	memcpy(dst->links, src->links, src->num_links * sizeof(topo_link_t));
+
+	/* Index may come out smaller than the source's */
+	for (i = 0; src->index != NULL && i < (1 << src->index_bits); i++)
+		if (src->index[i].is_used)
+			*topo_index_slot(dst->index, dst->index_bits,
+					src->index[i].addr) = src->index[i];
+
+	dst->index_used = src->index_used;
+
+	dst->num_hosts = dst->max_hosts = src->num_hosts;
+	dst->num_eps = dst->max_eps = src->num_eps;
+	dst->num_links = dst->max_links = src->num_links;
+
+	return 0;
+}
+
+static void topo_log(const char *path, int line, const char *msg)
+{
+	fprintf(stderr, "ERROR: Topology %s:%d: %s\n", path, line, msg);
+}
+
+/* Parses the rest of a link line: host ep transport */
+static int topo_parse_link(topo_t *topo, char **save, const char *path,
+				int line_num)
+{
+	char *words[3];
+	int host, ep, transport, i;
+	bool is_host;
+
+	for (i = 0; i < 3; i++) {
+		words[i] = strtok_r(NULL, TOPO_SPACE, save);
+		if (words[i] == NULL) {
+			topo_log(path, line_num, "Expected link host ep transport");
+			return -EINVAL;
+		}
+	}
+
+	if (strtok_r(NULL, TOPO_SPACE, save) != NULL) {
+		topo_log(path, line_num, "Expected link host ep transport");
+		return -EINVAL;
+	}
+
+	host = topo_find_name(topo, words[0], &is_host);
+	if (host < 0 || !is_host) {
+		topo_log(path, line_num, "Link to an unknown host");
+		return -EINVAL;
+	}
+
+	ep = topo_find_name(topo, words[1], &is_host);
+	if (ep < 0 || is_host) {
+		topo_log(path, line_num, "Link to an unknown ep");
+		return -EINVAL;
+	}
+
+	transport = transport_by_name(words[2]);
+	if (transport < 0) {
+		topo_log(path, line_num, "Transport is tcp, unix or shm");
+		return -EINVAL;
+	}
+
+	if (topo_set_transport(topo, host, ep, transport) < 0) {
+		topo_log(path, line_num, "Out of memory");
+		return -ENOMEM;
+	}
+
+	return 0;
+}
+
+/* Parses a line of the config file */
+static int topo_parse_line(topo_t *topo, char *line, const char *path,
+				int line_num)
+{
+	const char *ips[MAX_SWITCHES + 1];
+	char *word, *name, *save;
+	bool is_host;
+	long num;
+	int n, ret;
+
+	/* Comments */
+	word = strchr(line, '#');
+	if (word != NULL)
+		*word = '\0';
+
+	word = strtok_r(line, TOPO_SPACE, &save);
+	if (word == NULL)
+		return 0;
+
+	if (strcmp(word, "switches") == 0) {
+
+		word = strtok_r(NULL, TOPO_SPACE, &save);
+		num = word != NULL ? strtol(word, &name, 10) : 0;
+
+		if (word == NULL || *name != '\0' ||
+				strtok_r(NULL, TOPO_SPACE, &save) != NULL ||
+				num <= 0 || num > MAX_SWITCHES) {
+			topo_log(path, line_num, "Invalid number of switches");
+			return -EINVAL;
+		}
+
+		if (topo->num_hosts != 0 || topo->num_eps != 0) {
+			topo_log(path, line_num, "Switches set after nodes");
+			return -EINVAL;
+		}
+
+		topo->num_switches = num;
+		return 0;
+	}
+
+	if (strcmp(word, "link") == 0)
+		return topo_parse_link(topo, &save, path, line_num);
+
+	if (strcmp(word, "host") == 0) {
+		is_host = true;
+	} else if (strcmp(word, "ep") == 0) {
+		is_host = false;
+	} else {
+		topo_log(path, line_num, "Expected switches, host, ep or link");
+		return -EINVAL;
+	}
+
+	name = strtok_r(NULL, TOPO_SPACE, &save);
+	if (name == NULL) {
+		topo_log(path, line_num, "Node without name");
+		return -EINVAL;
+	}
+
+	n = 0;
+	while (n <= MAX_SWITCHES &&
+			(word = strtok_r(NULL, TOPO_SPACE, &save)) != NULL)
+		ips[n++] = word;
+
+	/* First node decides */
+	if (topo->num_switches == 0 && n <= MAX_SWITCHES)
+		topo->num_switches = n;
+
+	if (n == 0 || n != topo->num_switches) {
+		topo_log(path, line_num, "Need an address per switch");
+		return -EINVAL;
+	}
+
+	ret = topo_add_node(topo, is_host, name, ips);
+	if (ret == -EEXIST)
+		topo_log(path, line_num, "Node name or address repeated");
+	else if (ret == -EINVAL)
+		topo_log(path, line_num, "Invalid node name or address");
+	else if (ret < 0)
+		topo_log(path, line_num, "Out of memory");
+
+	return ret < 0 ? ret : 0;
+}
+
+int topo_load(topo_t *topo, const char *path)
+{
+	char line[TOPO_LINE_LEN];
+	int line_num = 0;
+	int ret = 0;
+	FILE *fp;
+
+	memset(topo, 0, sizeof(*topo));
+
+	fp = fopen(path, "r");
+	if (fp == NULL) {
+		ret = -errno;
+		fprintf(stderr, "ERROR: Couldn't open topology %s: %s\n",
+				path, strerror(errno));
+		return ret;
+	}
+
+	while (fgets(line, sizeof(line), fp) != NULL) {
+		line_num++;
+
+		if (strchr(line, '\n') == NULL && !feof(fp)) {
+			topo_log(path, line_num, "Line too long");
+			ret = -EINVAL;
+			break;
+		}
+
+		ret = topo_parse_line(topo, line, path, line_num);
+		if (ret < 0)
+			break;
+	}
+
+	fclose(fp);
+
+	if (ret == 0 && (topo->num_hosts == 0 || topo->num_eps == 0)) {
+		topo_log(path, line_num, "Need atleast a host and an ep");
+		ret = -EINVAL;
+	}
+
+	if (ret < 0)
+		topo_destroy(topo);
+
+	return ret;
+}
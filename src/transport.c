@@ -0,0 +1,651 @@
+/*
+ * This file implements the transports a host and an ep talk over. Frames
+ * always go over a bufferevent. With TCP and unix domain sockets it is the
+ * socket's own
+ * Shared memory connects over a unix domain socket as well, but only for
+ * host to hand over a pair of byte rings (one each way) and an eventfd per
+ * side to ring the other with. The socket then just tells when the other
+ * end is gone. Frames go over one end of a bufferevent pair, the other end
+ * (the pump) being moved to and from the rings. Each side only rings the
+ * other when it is about to wait on its eventfd, so a busy connection
+ * takes no syscalls at all
+ */
+#define _GNU_SOURCE
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <stdarg.h>
+#include <stddef.h>
+#include <string.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <errno.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/eventfd.h>
+
+#include <event2/event.h>
+#include <event2/buffer.h>
+#include <event2/bufferevent.h>
+
+#include "transport.h"
+
+/* Keeps the indices of the two sides of a ring apart */
+#define SHM_CACHE_LINE		64
+
+#define SHM_MASK		(TRANSPORT_SHM_RING_SIZE - 1)
+
+/* The memory of the rings, and eventfds of host and ep */
+#define SHM_NUM_FDS		3
+
+/* Size of the rings can't change under ep's feet */
+#define SHM_SEALS	(F_SEAL_SHRINK | F_SEAL_GROW | F_SEAL_SEAL)
+
+/* One direction of a shared memory connection, lives in shared memory */
+typedef struct {
+	/* Producer side */
+	uint64_t head __attribute__((aligned(SHM_CACHE_LINE)));
+	uint32_t writer_waiting;		/* Ring me once there's room */
+
+	/* Consumer side */
+	uint64_t tail __attribute__((aligned(SHM_CACHE_LINE)));
+	uint32_t reader_waiting;		/* Ring me once there's data */
+
+	uint8_t data[TRANSPORT_SHM_RING_SIZE]
+			__attribute__((aligned(SHM_CACHE_LINE)));
+} shm_ring_t;
+
+typedef struct {
+	shm_ring_t ring[2];			/* Host to ep, ep to host */
+} shm_area_t;
+
+/* A side of a shared memory connection */
+typedef struct {
+	bool is_host;
+	bool is_closing;			/* Frames side freed, draining */
+	bool is_gone;				/* Other end went away */
+	int fd;					/* Unix domain socket */
+	int doorbell;				/* eventfd we are rung by */
+	int peer_doorbell;
+	shm_area_t *area;			/* NULL till handed over */
+	shm_ring_t *tx;
+	shm_ring_t *rx;
+	struct bufferevent *pump;		/* Partner of the frames side */
+	struct event *ev_sock;
+	struct event *ev_doorbell;
+} shm_conn_t;
+
+static struct bufferevent *socket_bev_new(struct event_base *base, int fd,
+						bool is_host)
+{
+	struct bufferevent *bev;
+
+	(void)is_host;
+
+	bev = bufferevent_socket_new(base, fd, BEV_OPT_CLOSE_ON_FREE);
+	if (bev == NULL)
+		close(fd);
+
+	return bev;
+}
+
+static void socket_bev_free(struct bufferevent *bev)
+{
+	bufferevent_free(bev);
+}
+
+static void shm_ring_bell(int fd)
+{
+	uint64_t val = 1;
+
+	/* Counter can't overflow, it is read back on every wakeup */
+	if (write(fd, &val, sizeof(val)) < 0)
+		fprintf(stderr, "WARNING: Couldn't ring shared memory peer\n");
+}
+
+static void shm_destroy(shm_conn_t *conn)
+{
+	if (conn->ev_doorbell != NULL)
+		event_free(conn->ev_doorbell);
+	event_free(conn->ev_sock);
+	bufferevent_free(conn->pump);
+
+	if (conn->area != NULL)
+		munmap(conn->area, sizeof(shm_area_t));
+	if (conn->doorbell >= 0)
+		close(conn->doorbell);
+	if (conn->peer_doorbell >= 0)
+		close(conn->peer_doorbell);
+	close(conn->fd);
+
+	free(conn);
+}
+
+/* Other end went away (or broke the rings). Frames side sees EOF */
+static void shm_gone(shm_conn_t *conn)
+{
+	if (conn->is_closing) {
+		shm_destroy(conn);
+		return;
+	}
+
+	if (conn->is_gone)
+		return;
+
+	conn->is_gone = true;
+
+	if (conn->ev_doorbell != NULL)
+		event_del(conn->ev_doorbell);
+	event_del(conn->ev_sock);
+
+	/* Deferred, so that frames side can free us from it */
+	bufferevent_trigger_event(bufferevent_pair_get_partner(conn->pump),
+					BEV_EVENT_EOF | BEV_EVENT_READING,
+					BEV_TRIG_DEFER_CALLBACKS);
+}
+
+/* Moves what frames side wrote into the ring, as far as it fits */
+static int shm_tx(shm_conn_t *conn)
+{
+	struct evbuffer *input = bufferevent_get_input(conn->pump);
+	shm_ring_t *ring = conn->tx;
+	uint64_t head, tail, used, pos, n;
+	bool is_moved = false;
+	size_t len;
+
+	if (ring == NULL)
+		return 0;
+
+	head = ring->head;
+
+	while ((len = evbuffer_get_length(input)) != 0) {
+		tail = __atomic_load_n(&ring->tail, __ATOMIC_ACQUIRE);
+
+		used = head - tail;
+		if (used > TRANSPORT_SHM_RING_SIZE)
+			return -EIO;
+
+		if (used == TRANSPORT_SHM_RING_SIZE) {
+			/* Full. Reader rings once it takes some, unless it did */
+			__atomic_store_n(&ring->writer_waiting, 1,
+						__ATOMIC_SEQ_CST);
+			if (__atomic_load_n(&ring->tail, __ATOMIC_SEQ_CST) ==
+					tail)
+				break;
+			continue;
+		}
+
+		pos = head & SHM_MASK;
+		n = TRANSPORT_SHM_RING_SIZE - used;
+		if (n > TRANSPORT_SHM_RING_SIZE - pos)
+			n = TRANSPORT_SHM_RING_SIZE - pos;
+		if (n > len)
+			n = len;
+
+		evbuffer_remove(input, &ring->data[pos], n);
+
+		head += n;
+		__atomic_store_n(&ring->head, head, __ATOMIC_SEQ_CST);
+		is_moved = true;
+	}
+
+	if (is_moved && __atomic_exchange_n(&ring->reader_waiting, 0,
+						__ATOMIC_SEQ_CST))
+		shm_ring_bell(conn->peer_doorbell);
+
+	if (conn->is_closing && len == 0)
+		return -ECONNRESET;
+
+	return 0;
+}
+
+/*
+ * Moves what the other end wrote over to frames side. Takes upto a ring
+ * full at a time, coming back for the rest in the next round of the loop
+ */
+static int shm_rx(shm_conn_t *conn)
+{
+	shm_ring_t *ring = conn->rx;
+	uint64_t head, tail, avail, pos, n, moved = 0;
+
+	tail = ring->tail;
+
+	while (moved < TRANSPORT_SHM_RING_SIZE) {
+		head = __atomic_load_n(&ring->head, __ATOMIC_ACQUIRE);
+
+		avail = head - tail;
+		if (avail > TRANSPORT_SHM_RING_SIZE)
+			return -EIO;
+
+		if (avail == 0) {
+			/* Empty. Writer rings once it puts some, unless it did */
+			__atomic_store_n(&ring->reader_waiting, 1,
+						__ATOMIC_SEQ_CST);
+			if (__atomic_load_n(&ring->head, __ATOMIC_SEQ_CST) ==
+					head)
+				break;
+
+			__atomic_store_n(&ring->reader_waiting, 0,
+						__ATOMIC_RELAXED);
+			continue;
+		}
+
+		pos = tail & SHM_MASK;
+		n = avail;
+		if (n > TRANSPORT_SHM_RING_SIZE - pos)
+			n = TRANSPORT_SHM_RING_SIZE - pos;
+
+		/* Nobody to take it once closing */
+		if (!conn->is_closing &&
+				bufferevent_write(conn->pump, &ring->data[pos],
+							n) < 0)
+			return -ENOMEM;
+
+		tail += n;
+		__atomic_store_n(&ring->tail, tail, __ATOMIC_SEQ_CST);
+		moved += n;
+	}
+
+	if (moved != 0 && __atomic_exchange_n(&ring->writer_waiting, 0,
+						__ATOMIC_SEQ_CST))
+		shm_ring_bell(conn->peer_doorbell);
+
+	if (moved >= TRANSPORT_SHM_RING_SIZE)
+		event_active(conn->ev_doorbell, EV_READ, 0);
+
+	return 0;
+}
+
+/* Other end rang, it wrote something or made room */
+static void shm_doorbell(evutil_socket_t fd, short what, void *arg)
+{
+	shm_conn_t *conn = (shm_conn_t *)arg;
+	uint64_t val;
+
+	(void)what;
+
+	if (read(fd, &val, sizeof(val)) < 0 && errno != EAGAIN)
+		fprintf(stderr, "WARNING: Couldn't read shared memory bell\n");
+
+	if (shm_rx(conn) < 0 || shm_tx(conn) < 0)
+		shm_gone(conn);
+}
+
+/* Frames side wrote something */
+static void shm_pump_read(struct bufferevent *bev, void *arg)
+{
+	shm_conn_t *conn = (shm_conn_t *)arg;
+
+	(void)bev;
+
+	if (shm_tx(conn) < 0)
+		shm_gone(conn);
+}
+
+/* Starts moving frames over the rings in area */
+static int shm_start(shm_conn_t *conn, shm_area_t *area)
+{
+	struct event_base *base = bufferevent_get_base(conn->pump);
+
+	conn->area = area;
+	conn->tx = &area->ring[conn->is_host ? 0 : 1];
+	conn->rx = &area->ring[conn->is_host ? 1 : 0];
+
+	conn->ev_doorbell = event_new(base, conn->doorbell,
+					EV_READ | EV_PERSIST, shm_doorbell,
+					conn);
+	if (conn->ev_doorbell == NULL)
+		return -ENOMEM;
+
+	event_add(conn->ev_doorbell, NULL);
+
+	/* Whatever either side wrote so far */
+	if (shm_rx(conn) < 0 || shm_tx(conn) < 0)
+		return -EIO;
+
+	return 0;
+}
+
+/* Host sets up the rings and bells, handing them over to ep */
+static int shm_offer(shm_conn_t *conn)
+{
+	char cbuf[CMSG_SPACE(SHM_NUM_FDS * sizeof(int))];
+	int fds[SHM_NUM_FDS] = {-1, -1, -1};
+	struct msghdr msg;
+	struct cmsghdr *cmsg;
+	struct iovec iov;
+	shm_area_t *area;
+	char byte = 0;
+	int i, ret;
+
+	fds[0] = memfd_create("comm-shm", MFD_CLOEXEC | MFD_ALLOW_SEALING);
+	fds[1] = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+	fds[2] = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+	if (fds[0] < 0 || fds[1] < 0 || fds[2] < 0 ||
+			ftruncate(fds[0], sizeof(shm_area_t)) < 0 ||
+			fcntl(fds[0], F_ADD_SEALS, SHM_SEALS) < 0) {
+		ret = -errno;
+		goto err;
+	}
+
+	area = mmap(NULL, sizeof(shm_area_t), PROT_READ | PROT_WRITE,
+			MAP_SHARED, fds[0], 0);
+	if (area == MAP_FAILED) {
+		ret = -errno;
+		goto err;
+	}
+
+	/* Both start out waiting for something */
+	area->ring[0].reader_waiting = area->ring[1].reader_waiting = 1;
+
+	memset(&msg, 0, sizeof(msg));
+	iov.iov_base = &byte;
+	iov.iov_len = sizeof(byte);
+	msg.msg_iov = &iov;
+	msg.msg_iovlen = 1;
+	msg.msg_control = cbuf;
+	msg.msg_controllen = sizeof(cbuf);
+
+	cmsg = CMSG_FIRSTHDR(&msg);
+	cmsg->cmsg_level = SOL_SOCKET;
+	cmsg->cmsg_type = SCM_RIGHTS;
+	cmsg->cmsg_len = CMSG_LEN(sizeof(fds));
+	memcpy(CMSG_DATA(cmsg), fds, sizeof(fds));
+
+	/* Socket was just connected, there's room for a byte */
+	if (sendmsg(conn->fd, &msg, MSG_NOSIGNAL) != sizeof(byte)) {
+		ret = errno != 0 ? -errno : -EIO;
+		munmap(area, sizeof(shm_area_t));
+		goto err;
+	}
+
+	close(fds[0]);
+	conn->doorbell = fds[1];
+	conn->peer_doorbell = fds[2];
+
+	return shm_start(conn, area);
+
+err:
+	for (i = 0; i < SHM_NUM_FDS; i++)
+		if (fds[i] >= 0)
+			close(fds[i]);
+	return ret;
+}
+
+/* Ep takes over the rings and bells from host. -EAGAIN if not there yet */
+static int shm_accept_offer(shm_conn_t *conn)
+{
+	char cbuf[CMSG_SPACE(SHM_NUM_FDS * sizeof(int))];
+	int fds[SHM_NUM_FDS] = {-1, -1, -1};
+	struct msghdr msg;
+	struct cmsghdr *cmsg;
+	struct iovec iov;
+	struct stat st;
+	shm_area_t *area;
+	char byte;
+	ssize_t n;
+	size_t num_fds;
+	int i, ret = -EINVAL;
+
+	memset(&msg, 0, sizeof(msg));
+	iov.iov_base = &byte;
+	iov.iov_len = sizeof(byte);
+	msg.msg_iov = &iov;
+	msg.msg_iovlen = 1;
+	msg.msg_control = cbuf;
+	msg.msg_controllen = sizeof(cbuf);
+
+	n = recvmsg(conn->fd, &msg, MSG_CMSG_CLOEXEC);
+	if (n < 0)
+		return errno == EAGAIN || errno == EINTR ? -EAGAIN : -errno;
+	if (n == 0)
+		return -ECONNRESET;
+
+	cmsg = CMSG_FIRSTHDR(&msg);
+	if (cmsg == NULL || cmsg->cmsg_level != SOL_SOCKET ||
+			cmsg->cmsg_type != SCM_RIGHTS)
+		return -EINVAL;
+
+	num_fds = (cmsg->cmsg_len - CMSG_LEN(0)) / sizeof(int);
+	if (num_fds > SHM_NUM_FDS)
+		num_fds = SHM_NUM_FDS;
+	memcpy(fds, CMSG_DATA(cmsg), num_fds * sizeof(int));
+
+	if ((msg.msg_flags & MSG_CTRUNC) || num_fds != SHM_NUM_FDS)
+		goto err;
+
+	/* Rings are trusted no further than their size */
+	if (fstat(fds[0], &st) < 0 || st.st_size != sizeof(shm_area_t) ||
+			(fcntl(fds[0], F_GET_SEALS) & SHM_SEALS) != SHM_SEALS)
+		goto err;
+
+	area = mmap(NULL, sizeof(shm_area_t), PROT_READ | PROT_WRITE,
+			MAP_SHARED, fds[0], 0);
+	if (area == MAP_FAILED) {
+		ret = -errno;
+		goto err;
+	}
+
+	close(fds[0]);
+	conn->doorbell = fds[2];
+	conn->peer_doorbell = fds[1];
+
+	return shm_start(conn, area);
+
+err:
+	for (i = 0; i < SHM_NUM_FDS; i++)
+		if (fds[i] >= 0)
+			close(fds[i]);
+	return ret;
+}
+
+/* Socket is only read by ep for the offer, after that only EOF is expected */
+static void shm_sock_read(evutil_socket_t fd, short what, void *arg)
+{
+	shm_conn_t *conn = (shm_conn_t *)arg;
+	char buf[64];
+	ssize_t n;
+	int ret;
+
+	(void)what;
+
+	if (conn->area == NULL) {
+		ret = shm_accept_offer(conn);
+		if (ret == -EAGAIN)
+			return;
+		if (ret < 0)
+			shm_gone(conn);
+		return;
+	}
+
+	n = recv(fd, buf, sizeof(buf), 0);
+	if (n < 0 && (errno == EAGAIN || errno == EINTR))
+		return;
+
+	/* Whatever it wrote before going */
+	if (!conn->is_gone && !conn->is_closing)
+		shm_rx(conn);
+
+	shm_gone(conn);
+}
+
+static struct bufferevent *shm_bev_new(struct event_base *base, int fd,
+					bool is_host)
+{
+	struct bufferevent *pair[2] = {NULL, NULL};
+	shm_conn_t *conn;
+
+	conn = calloc(1, sizeof(shm_conn_t));
+	if (conn == NULL)
+		goto err;
+
+	conn->is_host = is_host;
+	conn->fd = fd;
+	conn->doorbell = conn->peer_doorbell = -1;
+
+	/* Deferred, so that neither side runs inside the other's callbacks */
+	if (bufferevent_pair_new(base, BEV_OPT_DEFER_CALLBACKS, pair) < 0)
+		goto err;
+
+	conn->pump = pair[1];
+	bufferevent_setcb(conn->pump, shm_pump_read, NULL, NULL, conn);
+	bufferevent_enable(conn->pump, EV_READ | EV_WRITE);
+
+	conn->ev_sock = event_new(base, fd, EV_READ | EV_PERSIST,
+					shm_sock_read, conn);
+	if (conn->ev_sock == NULL)
+		goto err;
+
+	if (is_host && shm_offer(conn) < 0) {
+		event_free(conn->ev_sock);
+		goto err;
+	}
+
+	event_add(conn->ev_sock, NULL);
+
+	return pair[0];
+
+err:
+	if (conn != NULL) {
+		if (conn->ev_doorbell != NULL)
+			event_free(conn->ev_doorbell);
+		if (conn->area != NULL)
+			munmap(conn->area, sizeof(shm_area_t));
+		if (conn->doorbell >= 0)
+			close(conn->doorbell);
+		if (conn->peer_doorbell >= 0)
+			close(conn->peer_doorbell);
+	}
+
+	if (pair[0] != NULL) {
+		bufferevent_free(pair[0]);
+		bufferevent_free(pair[1]);
+	}
+
+	free(conn);
+	close(fd);
+	return NULL;
+}
+
+/* Pump stays around till what was written is in the ring */
+static void shm_bev_free(struct bufferevent *bev)
+{
+	struct bufferevent *pump = bufferevent_pair_get_partner(bev);
+	shm_conn_t *conn;
+
+	bufferevent_getcb(pump, NULL, NULL, NULL, (void **)&conn);
+	bufferevent_free(bev);
+
+	conn->is_closing = true;
+
+	if (conn->is_gone || conn->area == NULL || shm_tx(conn) < 0)
+		shm_destroy(conn);
+}
+
+static const transport_ops_t transports[TRANSPORT_NUM] = {
+	{TRANSPORT_TCP, "tcp", AF_INET, socket_bev_new, socket_bev_free},
+	{TRANSPORT_UNIX, "unix", AF_UNIX, socket_bev_new, socket_bev_free},
+	{TRANSPORT_SHM, "shm", AF_UNIX, shm_bev_new, shm_bev_free},
+};
+
+const transport_ops_t *transport_ops(transport_type_t type)
+{
+	if ((int)type < 0 || type >= TRANSPORT_NUM)
+		return NULL;
+
+	return &transports[type];
+}
+
+int transport_by_name(const char *name)
+{
+	int i;
+
+	for (i = 0; i < TRANSPORT_NUM; i++)
+		if (strcmp(transports[i].name, name) == 0)
+			return i;
+
+	return -EINVAL;
+}
+
+/* Abstract name (leading '\0') of the given length, from fmt */
+static socklen_t transport_unix_addr(struct sockaddr_un *addr,
+					const char *fmt, ...)
+	__attribute__((format(printf, 2, 3)));
+
+static socklen_t transport_unix_addr(struct sockaddr_un *addr,
+					const char *fmt, ...)
+{
+	va_list ap;
+	int len;
+
+	memset(addr, 0, sizeof(*addr));
+	addr->sun_family = AF_UNIX;
+
+	va_start(ap, fmt);
+	len = vsnprintf(&addr->sun_path[1], sizeof(addr->sun_path) - 1, fmt,
+			ap);
+	va_end(ap);
+
+	if (len > (int)sizeof(addr->sun_path) - 2)
+		len = sizeof(addr->sun_path) - 2;
+
+	return offsetof(struct sockaddr_un, sun_path) + 1 + len;
+}
+
+socklen_t transport_unix_ep_addr(struct sockaddr_un *addr, const char *ep)
+{
+	return transport_unix_addr(addr, TRANSPORT_UNIX_PREFIX "%s", ep);
+}
+
+socklen_t transport_unix_host_addr(struct sockaddr_un *addr, const char *ep,
+					const char *host, int sw)
+{
+	static unsigned int serial;
+
+	/* Unique, the last connection may still be flushing under it */
+	return transport_unix_addr(addr, TRANSPORT_UNIX_PREFIX "%s/%s/%d/%d.%u",
+				ep, host, sw, (int)getpid(),
+				__atomic_add_fetch(&serial, 1,
+							__ATOMIC_RELAXED));
+}
+
+int transport_unix_peer(const struct sockaddr_un *addr, socklen_t len,
+			const char *ep, char *host, size_t host_len, int *sw)
+{
+	char name[sizeof(addr->sun_path)];
+	size_t prefix_len = strlen(TRANSPORT_UNIX_PREFIX);
+	size_t ep_len = strlen(ep);
+	char *p, *end;
+	long num;
+
+	/* Abstract names only */
+	if (len <= offsetof(struct sockaddr_un, sun_path) + 1 ||
+			len > sizeof(*addr) ||
+			addr->sun_family != AF_UNIX || addr->sun_path[0] != '\0')
+		return -EINVAL;
+
+	len -= offsetof(struct sockaddr_un, sun_path) + 1;
+	memcpy(name, &addr->sun_path[1], len);
+	name[len] = '\0';
+
+	if (strncmp(name, TRANSPORT_UNIX_PREFIX, prefix_len) != 0 ||
+			strncmp(&name[prefix_len], ep, ep_len) != 0 ||
+			name[prefix_len + ep_len] != '/')
+		return -EINVAL;
+
+	p = &name[prefix_len + ep_len + 1];
+	end = strchr(p, '/');
+	if (end == NULL || end == p || (size_t)(end - p) >= host_len)
+		return -EINVAL;
+
+	memcpy(host, p, end - p);
+	host[end - p] = '\0';
+
+	num = strtol(end + 1, &p, 10);
+	if (p == end + 1 || *p != '/' || num < 0)
+		return -EINVAL;
+
+	*sw = num;
+	return 0;
+}
@@ -0,0 +1,258 @@
+/*
+ * This file implements a bare io_uring over the raw syscalls
+ * SQEs are filled in directly in the ring shared with the kernel, and
+ * published with the SQ tail as uring_submit() hands them over. CQEs are
+ * consumed in place
+ */
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <sys/uio.h>
+
+#include "uring.h"
+
+static int sys_io_uring_setup(unsigned int entries, struct io_uring_params *p)
+{
+	return syscall(__NR_io_uring_setup, entries, p);
+}
+
+static int sys_io_uring_enter(int fd, unsigned int to_submit,
+				unsigned int min_complete, unsigned int flags)
+{
+	return syscall(__NR_io_uring_enter, fd, to_submit, min_complete,
+			flags, NULL, 0);
+}
+
+static int sys_io_uring_register(int fd, unsigned int opcode, void *arg,
+				unsigned int nr_args)
+{
+	return syscall(__NR_io_uring_register, fd, opcode, arg, nr_args);
+}
+
+int uring_new(uring_t *ring, unsigned int entries)
+{
+	struct io_uring_params p;
+	char *sq, *cq;
+	int ret;
+
+	memset(ring, 0, sizeof(*ring));
+	memset(&p, 0, sizeof(p));
+
+	ring->fd = sys_io_uring_setup(entries, &p);
+	if (ring->fd < 0)
+		return -errno;
+
+	ring->sq_entries = p.sq_entries;
+	ring->cq_entries = p.cq_entries;
+
+	ring->sq_map_len = p.sq_off.array + p.sq_entries * sizeof(unsigned int);
+	ring->cq_map_len = p.cq_off.cqes +
+				p.cq_entries * sizeof(struct io_uring_cqe);
+
+	/* Both rings in one mapping, on all but very old kernels */
+	if (p.features & IORING_FEAT_SINGLE_MMAP) {
+		if (ring->cq_map_len > ring->sq_map_len)
+			ring->sq_map_len = ring->cq_map_len;
+		ring->cq_map_len = ring->sq_map_len;
+	}
+
+	ring->sq_map = mmap(NULL, ring->sq_map_len, PROT_READ | PROT_WRITE,
+				MAP_SHARED | MAP_POPULATE, ring->fd,
+				IORING_OFF_SQ_RING);
+	if (ring->sq_map == MAP_FAILED) {
+		ret = -errno;
+		goto sq_err;
+	}
+
+	if (p.features & IORING_FEAT_SINGLE_MMAP) {
+		ring->cq_map = ring->sq_map;
+	} else {
+		ring->cq_map = mmap(NULL, ring->cq_map_len,
+					PROT_READ | PROT_WRITE,
+					MAP_SHARED | MAP_POPULATE, ring->fd,
+					IORING_OFF_CQ_RING);
+		if (ring->cq_map == MAP_FAILED) {
+			ret = -errno;
+			goto cq_err;
+		}
+	}
+
+	ring->sqes_len = p.sq_entries * sizeof(struct io_uring_sqe);
+	ring->sqes = mmap(NULL, ring->sqes_len, PROT_READ | PROT_WRITE,
+				MAP_SHARED | MAP_POPULATE, ring->fd,
+				IORING_OFF_SQES);
+	if (ring->sqes == MAP_FAILED) {
+		ret = -errno;
+		goto sqes_err;
+	}
+
+	sq = ring->sq_map;
+	ring->sq_head = (unsigned int *)(sq + p.sq_off.head);
+	ring->sq_tail = (unsigned int *)(sq + p.sq_off.tail);
+	ring->sq_mask = (unsigned int *)(sq + p.sq_off.ring_mask);
+	ring->sq_array = (unsigned int *)(sq + p.sq_off.array);
+	ring->sq_flags = (unsigned int *)(sq + p.sq_off.flags);
+	ring->sq_local_tail = *ring->sq_tail;
+
+	cq = ring->cq_map;
+	ring->cq_head = (unsigned int *)(cq + p.cq_off.head);
+	ring->cq_tail = (unsigned int *)(cq + p.cq_off.tail);
+	ring->cq_mask = (unsigned int *)(cq + p.cq_off.ring_mask);
+	ring->cqes = (struct io_uring_cqe *)(cq + p.cq_off.cqes);
+
+	return 0;
+
+sqes_err:
+	if (ring->cq_map != ring->sq_map)
+		munmap(ring->cq_map, ring->cq_map_len);
+cq_err:
+	munmap(ring->sq_map, ring->sq_map_len);
+sq_err:
+	close(ring->fd);
+	ring->fd = -1;
+	return ret;
+}
+
+void uring_destroy(uring_t *ring)
+{
+	if (ring->fd < 0)
+		return;
+
+	munmap(ring->sqes, ring->sqes_len);
+	if (ring->cq_map != ring->sq_map)
+		munmap(ring->cq_map, ring->cq_map_len);
+	munmap(ring->sq_map, ring->sq_map_len);
+
+	/* Fixed buffers go along with the ring */
+	close(ring->fd);
+	ring->fd = -1;
+}
+
+bool uring_has_op(uring_t *ring, int op)
+{
+	struct io_uring_probe *probe;
+	size_t len;
+	bool ret = false;
+
+	len = sizeof(*probe) + IORING_OP_LAST * sizeof(struct io_uring_probe_op);
+	probe = calloc(1, len);
+	if (probe == NULL)
+		return false;
+
+	if (sys_io_uring_register(ring->fd, IORING_REGISTER_PROBE, probe,
+					IORING_OP_LAST) == 0 &&
+			op <= probe->last_op)
+		ret = probe->ops[op].flags & IO_URING_OP_SUPPORTED;
+
+	free(probe);
+	return ret;
+}
+
+unsigned int uring_sq_space(uring_t *ring)
+{
+	unsigned int head = __atomic_load_n(ring->sq_head, __ATOMIC_ACQUIRE);
+
+	return ring->sq_entries - (ring->sq_local_tail - head);
+}
+
+unsigned int uring_sq_pending(uring_t *ring)
+{
+	return ring->sq_local_tail -
+		__atomic_load_n(ring->sq_head, __ATOMIC_ACQUIRE);
+}
+
+struct io_uring_sqe *uring_get_sqe(uring_t *ring)
+{
+	struct io_uring_sqe *sqe;
+	unsigned int index;
+
+	if (uring_sq_space(ring) == 0)
+		return NULL;
+
+	index = ring->sq_local_tail & *ring->sq_mask;
+	ring->sq_array[index] = index;
+	ring->sq_local_tail++;
+
+	sqe = &ring->sqes[index];
+	memset(sqe, 0, sizeof(*sqe));
+	return sqe;
+}
+
+int uring_submit(uring_t *ring)
+{
+	unsigned int pending, flags = 0;
+	int ret;
+
+	/* Kernel sees the SQEs once the tail moves past them */
+	__atomic_store_n(ring->sq_tail, ring->sq_local_tail, __ATOMIC_RELEASE);
+
+	/* Completions which didn't fit the CQ ring wait for us to ask */
+	if (__atomic_load_n(ring->sq_flags, __ATOMIC_ACQUIRE) &
+			IORING_SQ_CQ_OVERFLOW)
+		flags |= IORING_ENTER_GETEVENTS;
+
+	/* Along with any left over by a failed submit */
+	pending = uring_sq_pending(ring);
+	if (pending == 0 && flags == 0)
+		return 0;
+
+	ret = sys_io_uring_enter(ring->fd, pending, 0, flags);
+	if (ret < 0)
+		return -errno;
+
+	return ret;
+}
+
+struct io_uring_cqe *uring_peek_cqe(uring_t *ring)
+{
+	unsigned int head = *ring->cq_head;
+
+	if (head == __atomic_load_n(ring->cq_tail, __ATOMIC_ACQUIRE))
+		return NULL;
+
+	return &ring->cqes[head & *ring->cq_mask];
+}
+
+void uring_cqe_seen(uring_t *ring)
+{
+	__atomic_store_n(ring->cq_head, *ring->cq_head + 1, __ATOMIC_RELEASE);
+}
+
+int uring_register_bufs(uring_t *ring, unsigned int nr)
+{
+	struct io_uring_rsrc_register reg;
+
+	memset(&reg, 0, sizeof(reg));
+	reg.nr = nr;
+	reg.flags = IORING_RSRC_REGISTER_SPARSE;
+
+	if (sys_io_uring_register(ring->fd, IORING_REGISTER_BUFFERS2, &reg,
+					sizeof(reg)) < 0)
+		return -errno;
+
+	return 0;
+}
+
+int uring_register_buf(uring_t *ring, unsigned int index, void *base,
+			size_t len)
+{
+	struct io_uring_rsrc_update2 update;
+	struct iovec iov;
+
+	iov.iov_base = base;
+	iov.iov_len = len;
+
+	memset(&update, 0, sizeof(update));
+	update.offset = index;
+	update.data = (unsigned long)&iov;
+	update.nr = 1;
+
+	if (sys_io_uring_register(ring->fd, IORING_REGISTER_BUFFERS_UPDATE,
+					&update, sizeof(update)) < 0)
+		return -errno;
+
+	return 0;
+}
@@ -0,0 +1,301 @@
+/*
+ * This file implements a hierarchical timing wheel
+ * Level 0 has a slot per tick, each slot of level n covers a whole lap of
+ * level n - 1. Timers far away sit in higher levels and move down (cascade)
+ * as their time comes closer, so every timer is touched only a few times
+ * whatever the number of timers. A single libevent timer is armed for the
+ * next tick having anything to do
+ */
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <time.h>
+
+#include "wheel.h"
+
+/* Furthest a timer can be (in ticks), further ones are clamped */
+#define WHEEL_MAX_TICKS	((1ULL << (WHEEL_BITS * WHEEL_LEVELS)) - 1)
+
+static void wheel_tick(evutil_socket_t fd, short what, void *arg);
+
+uint64_t wheel_now_us(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t)ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
+
+int wheel_new(wheel_t *wheel, struct event_base *ev_base, uint64_t tick_us)
+{
+	memset(wheel, 0, sizeof(*wheel));
+
+	wheel->tick_us = tick_us != 0 ? tick_us : WHEEL_TICK_US;
+	wheel->start_us = wheel_now_us();
+	wheel->ev_base = ev_base;
+
+	/* Without a base, caller runs the wheel itself */
+	if (ev_base == NULL)
+		return 0;
+
+	wheel->ev_tick = evtimer_new(ev_base, wheel_tick, wheel);
+	if (wheel->ev_tick == NULL)
+		return -ENOMEM;
+
+	return 0;
+}
+
+/* Pending timers are simply forgotten */
+void wheel_destroy(wheel_t *wheel)
+{
+	if (wheel->ev_tick != NULL)
+		event_free(wheel->ev_tick);
+
+	wheel->ev_tick = NULL;
+}
+
+void wheel_timer_init(wheel_timer_t *timer, wheel_cb_t cb, void *arg)
+{
+	timer->next = timer->prev = NULL;
+	timer->level = -1;
+	timer->period = 0;
+	timer->cb = cb;
+	timer->arg = arg;
+}
+
+/* Tick at time now_us */
+static uint64_t wheel_tick_of(wheel_t *wheel, uint64_t now_us)
+{
+	if (now_us < wheel->start_us)
+		return 0;
+
+	return (now_us - wheel->start_us) / wheel->tick_us;
+}
+
+/* Puts timer in the slot matching its expiry */
+static void wheel_link(wheel_t *wheel, wheel_timer_t *timer)
+{
+	uint64_t delta;
+	wheel_slot_t *slot;
+	int level;
+
+	if (timer->expires < wheel->now)
+		timer->expires = wheel->now;
+
+	delta = timer->expires - wheel->now;
+	if (delta > WHEEL_MAX_TICKS) {
+		delta = WHEEL_MAX_TICKS;
+		timer->expires = wheel->now + delta;
+	}
+
+	/* Lowest level whose lap covers the delta */
+	for (level = 0; level < WHEEL_LEVELS - 1; level++)
+		if (delta < (1ULL << (WHEEL_BITS * (level + 1))))
+			break;
+
+	slot = &wheel->slots[level][(timer->expires >> (WHEEL_BITS * level)) &
+					WHEEL_MASK];
+
+	timer->level = level;
+	timer->prev = NULL;
+	timer->next = slot->head;
+	if (slot->head != NULL)
+		slot->head->prev = timer;
+	slot->head = timer;
+
+	wheel->level_timers[level]++;
+	wheel->num_timers++;
+}
+
+static void wheel_unlink(wheel_t *wheel, wheel_timer_t *timer)
+{
+	wheel_slot_t *slot;
+
+	slot = &wheel->slots[timer->level][(timer->expires >>
+				(WHEEL_BITS * timer->level)) & WHEEL_MASK];
+
+	if (timer->prev != NULL)
+		timer->prev->next = timer->next;
+	else
+		slot->head = timer->next;
+
+	if (timer->next != NULL)
+		timer->next->prev = timer->prev;
+
+	wheel->level_timers[timer->level]--;
+	wheel->num_timers--;
+
+	timer->next = timer->prev = NULL;
+	timer->level = -1;
+}
+
+/* Next tick which has timers to fire (or to cascade) */
+static uint64_t wheel_next_tick(wheel_t *wheel)
+{
+	bool has_upper = wheel->num_timers != wheel->level_timers[0];
+	uint64_t tick;
+	int i;
+
+	for (i = 0; i < WHEEL_SLOTS; i++) {
+		tick = wheel->now + i;
+
+		/* Upper levels move down when level 0 wraps around */
+		if ((tick & WHEEL_MASK) == 0 && has_upper)
+			return tick;
+
+		if (wheel->slots[0][tick & WHEEL_MASK].head != NULL)
+			return tick;
+	}
+
+	return wheel->now + WHEEL_SLOTS;
+}
+
+/* Arms the libevent timer for the next tick having anything to do */
+static void wheel_arm(wheel_t *wheel)
+{
+	struct timeval tv;
+	uint64_t next, at_us, now_us;
+
+	if (wheel->ev_tick == NULL || wheel->is_running)
+		return;
+
+	if (wheel->num_timers == 0) {
+		event_del(wheel->ev_tick);
+		wheel->armed = 0;
+		return;
+	}
+
+	next = wheel_next_tick(wheel);
+
+	/* Already armed early enough */
+	if (event_pending(wheel->ev_tick, EV_TIMEOUT, NULL) &&
+			wheel->armed <= next)
+		return;
+
+	at_us = wheel->start_us + next * wheel->tick_us;
+	now_us = wheel_now_us();
+	at_us = at_us > now_us ? at_us - now_us : 0;
+
+	tv.tv_sec = at_us / 1000000;
+	tv.tv_usec = at_us % 1000000;
+
+	wheel->armed = next;
+	event_add(wheel->ev_tick, &tv);
+}
+
+void wheel_add(wheel_t *wheel, wheel_timer_t *timer, uint64_t timeout_us,
+		bool is_periodic)
+{
+	uint64_t ticks, now;
+
+	if (wheel_pending(timer))
+		wheel_unlink(wheel, timer);
+
+	/* Atleast a tick away, so that firing timers can't loop forever */
+	ticks = (timeout_us + wheel->tick_us - 1) / wheel->tick_us;
+	if (ticks == 0)
+		ticks = 1;
+
+	now = wheel_tick_of(wheel, wheel_now_us());
+
+	/* Nothing to catch up with */
+	if (wheel->num_timers == 0 && !wheel->is_running && now > wheel->now)
+		wheel->now = now;
+
+	timer->period = is_periodic ? ticks : 0;
+	timer->expires = now + ticks;
+
+	wheel_link(wheel, timer);
+	wheel_arm(wheel);
+}
+
+void wheel_del(wheel_t *wheel, wheel_timer_t *timer)
+{
+	if (!wheel_pending(timer))
+		return;
+
+	/* ev_tick may fire for nothing, not worth re-arming for */
+	wheel_unlink(wheel, timer);
+}
+
+/* Moves timers of the current slot of level down the wheel */
+static void wheel_cascade(wheel_t *wheel, int level)
+{
+	wheel_slot_t *slot;
+	wheel_timer_t *timer;
+
+	slot = &wheel->slots[level][(wheel->now >> (WHEEL_BITS * level)) &
+					WHEEL_MASK];
+
+	while ((timer = slot->head) != NULL) {
+		wheel_unlink(wheel, timer);
+		wheel_link(wheel, timer);
+	}
+}
+
+/* Runs the tick wheel->now */
+static void wheel_run_tick(wheel_t *wheel)
+{
+	wheel_slot_t *slot = &wheel->slots[0][wheel->now & WHEEL_MASK];
+	wheel_timer_t *timer;
+	int level;
+
+	/* Level 0 wrapped around - Bring down the timers due in next lap */
+	for (level = 1; level < WHEEL_LEVELS; level++) {
+		if ((wheel->now & ((1ULL << (WHEEL_BITS * level)) - 1)) != 0)
+			break;
+
+		wheel_cascade(wheel, level);
+	}
+
+	/* Callbacks may add or remove any timer, including this slot's */
+	while ((timer = slot->head) != NULL) {
+
+		wheel_unlink(wheel, timer);
+
+		/* Keeps its cadence, unless we fell behind by a period */
+		if (timer->period != 0) {
+			timer->expires += timer->period;
+			if (timer->expires <= wheel->now)
+				timer->expires = wheel->now + 1;
+			wheel_link(wheel, timer);
+		}
+
+		wheel->num_fired++;
+		timer->cb(timer->arg);
+	}
+}
+
+void wheel_run(wheel_t *wheel, uint64_t now_us)
+{
+	uint64_t now = wheel_tick_of(wheel, now_us);
+
+	wheel->is_running = true;
+
+	while (wheel->now <= now) {
+
+		/* Skip over empty ticks */
+		if (wheel->num_timers == 0) {
+			wheel->now = now + 1;
+			break;
+		}
+
+		wheel_run_tick(wheel);
+		wheel->now++;
+	}
+
+	wheel->is_running = false;
+
+	wheel_arm(wheel);
+}
+
+static void wheel_tick(evutil_socket_t fd, short what, void *arg)
+{
+	wheel_t *wheel = (wheel_t *)arg;
+
+	(void)fd;
+	(void)what;
+
+	wheel->num_wakeups++;
+	wheel_run(wheel, wheel_now_us());
+}
@@ -0,0 +1,293 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <unistd.h>
+#include <errno.h>
+#include <time.h>
+#include <pthread.h>
+#include <sys/socket.h>
+#include <sys/epoll.h>
+#include <sys/resource.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+
+#include "comm.h"
+
+/*
+ * Connection storm benchmark: like all the hosts of a rack coming back at
+ * once, opens a connection per host per switch to an ep running in this
+ * process, all together. A connection counts as up once the ep has taken
+ * it in and sent its MSG_RESUME. Reports time till all of them are up.
+ * The ep logs every connection going away, run with 2>/dev/null
+ */
+
+#define EP_ADDR		"127.0.0.1"
+
+struct flags_t {
+
+	int workers;		/* Worker threads of ep */
+	int rounds;		/* Storms of each size */
+
+} flags = {0, 3};
+
+/* Connections per storm, spread over hosts with two switches each */
+static int storms[] = {64, 256, 1024, 4096};
+
+#define MAX_CONNS	4096
+#define NUM_SWITCHES	2
+
+static comm_handle_t handle;
+
+static uint64_t now_us(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t)ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
+
+static void host_addr(int host, int sw, char *buf, size_t len)
+{
+	snprintf(buf, len, "127.%d.%d.%d", 1 + sw, host / 250, host % 250 + 1);
+}
+
+static void ep_data(int host_num, int sw, int session, int msg_num, char *buf,
+			int len)
+{
+	(void)host_num;
+	(void)sw;
+	(void)session;
+	(void)msg_num;
+	(void)buf;
+	(void)len;
+}
+
+static void ep_err(int node_num, int sw, int reason)
+{
+	(void)node_num;
+	(void)sw;
+	(void)reason;
+}
+
+static void *ep_thread(void *arg)
+{
+	comm_opts_t *opts = (comm_opts_t *)arg;
+
+	if (comm_init_opts(&handle, opts, ep_err, ep_data) < 0)
+		fprintf(stderr, "Couldn't start ep\n");
+
+	return NULL;
+}
+
+/* Non-blocking connection from address src to the ep */
+static int conn_open(const char *src)
+{
+	struct sockaddr_in addr;
+	int fd;
+
+	fd = socket(AF_INET, SOCK_STREAM | SOCK_NONBLOCK, 0);
+	if (fd < 0)
+		return -1;
+
+	memset(&addr, 0, sizeof(addr));
+	addr.sin_family = AF_INET;
+	inet_pton(AF_INET, src, &addr.sin_addr);
+
+	if (bind(fd, (struct sockaddr *)&addr, sizeof(addr)) < 0)
+		goto err;
+
+	addr.sin_port = htons(EP_LISTEN_PORT);
+	inet_pton(AF_INET, EP_ADDR, &addr.sin_addr);
+
+	if (connect(fd, (struct sockaddr *)&addr, sizeof(addr)) < 0 &&
+			errno != EINPROGRESS)
+		goto err;
+
+	return fd;
+
+err:
+	close(fd);
+	return -1;
+}
+
+/* Waits for ep to listen */
+static int ep_wait(void)
+{
+	struct sockaddr_in addr;
+	int i, fd, ret;
+
+	memset(&addr, 0, sizeof(addr));
+	addr.sin_family = AF_INET;
+	addr.sin_port = htons(EP_LISTEN_PORT);
+	inet_pton(AF_INET, EP_ADDR, &addr.sin_addr);
+
+	for (i = 0; i < 500; i++) {
+		fd = socket(AF_INET, SOCK_STREAM, 0);
+		if (fd < 0)
+			return -1;
+
+		ret = connect(fd, (struct sockaddr *)&addr, sizeof(addr));
+		close(fd);
+		if (ret == 0)
+			return 0;
+
+		usleep(10 * 1000);
+	}
+
+	return -1;
+}
+
+static int run_storm(int num)
+{
+	struct epoll_event ev, events[256];
+	static int fds[MAX_CONNS];
+	static uint64_t done_us[MAX_CONNS];
+	char hdr[offsetof(comm_data_t, buf)];
+	char src[INET_ADDRSTRLEN];
+	uint64_t start, max = 0, sum = 0;
+	int i, n, efd, up = 0;
+	ssize_t len;
+
+	efd = epoll_create1(0);
+	if (efd < 0)
+		return -1;
+
+	start = now_us();
+
+	for (i = 0; i < num; i++) {
+		host_addr(i / NUM_SWITCHES, i % NUM_SWITCHES, src, sizeof(src));
+
+		fds[i] = conn_open(src);
+		if (fds[i] < 0) {
+			perror("connect");
+			return -1;
+		}
+
+		ev.events = EPOLLIN;
+		ev.data.u32 = i;
+		epoll_ctl(efd, EPOLL_CTL_ADD, fds[i], &ev);
+	}
+
+	while (up < num) {
+		n = epoll_wait(efd, events, 256, 5000);
+		if (n <= 0) {
+			fprintf(stderr, "Only %d of %d connections up\n", up,
+					num);
+			break;
+		}
+
+		for (i = 0; i < n; i++) {
+			int c = events[i].data.u32;
+
+			/* MSG_RESUME, sent by ep first thing */
+			len = recv(fds[c], hdr, sizeof(hdr), MSG_WAITALL);
+			epoll_ctl(efd, EPOLL_CTL_DEL, fds[c], NULL);
+
+			if (len != (ssize_t)sizeof(hdr)) {
+				fprintf(stderr, "Connection %d refused\n", c);
+				done_us[c] = 0;
+			} else {
+				done_us[c] = now_us() - start;
+			}
+
+			up++;
+		}
+	}
+
+	for (i = 0; i < num; i++) {
+		sum += done_us[i];
+		if (done_us[i] > max)
+			max = done_us[i];
+	}
+
+	printf("Conns: %5d, All up in: %8.2f ms, Mean: %8.2f ms, "
+		"Per conn: %6.2f us\n", num, max / 1e3, sum / 1e3 / num,
+		(double)max / num);
+
+	for (i = 0; i < num; i++)
+		close(fds[i]);
+	close(efd);
+
+	/* Let ep clean up before the next storm */
+	usleep(200 * 1000);
+
+	return up == num ? 0 : -1;
+}
+
+int main(int argc, char **argv)
+{
+	char ips[NUM_SWITCHES][INET_ADDRSTRLEN];
+	const char *ip_ptrs[NUM_SWITCHES];
+	char name[MAX_NODE_NAME + 1];
+	struct rlimit rl;
+	pthread_t thread;
+	comm_opts_t opts;
+	topo_t topo;
+	unsigned int i;
+	int c, j, r, ret = 0;
+
+	while ((c = getopt(argc, argv, "w:r:")) != -1) {
+		switch (c) {
+		case 'w':
+			flags.workers = atoi(optarg);
+			break;
+		case 'r':
+			flags.rounds = atoi(optarg);
+			break;
+		default:
+			fprintf(stderr, "%s: Usage:\n"
+				"-w <number>: Worker threads of ep\n"
+				"-r <number>: Storms of each size\n",
+				argv[0]);
+			return -1;
+		}
+	}
+
+	/* Both ends of every connection are in this process */
+	if (getrlimit(RLIMIT_NOFILE, &rl) == 0) {
+		rl.rlim_cur = rl.rlim_max;
+		setrlimit(RLIMIT_NOFILE, &rl);
+	}
+
+	if (topo_new(&topo, NUM_SWITCHES) < 0)
+		return -1;
+
+	for (i = 0; i < MAX_CONNS / NUM_SWITCHES; i++) {
+		for (j = 0; j < NUM_SWITCHES; j++) {
+			host_addr(i, j, ips[j], sizeof(ips[j]));
+			ip_ptrs[j] = ips[j];
+		}
+
+		sprintf(name, "host%u", i);
+		if (topo_add_node(&topo, true, name, ip_ptrs) < 0)
+			return -1;
+	}
+
+	ip_ptrs[0] = EP_ADDR;
+	ip_ptrs[1] = "127.0.0.2";
+	if (topo_add_node(&topo, false, "ep", ip_ptrs) < 0)
+		return -1;
+
+	comm_opts_init(&opts);
+	opts.topology = &topo;
+	opts.node_name = "ep";
+	opts.ep_num_workers = flags.workers;
+
+	pthread_create(&thread, NULL, ep_thread, &opts);
+
+	if (ep_wait() < 0) {
+		fprintf(stderr, "Ep didn't come up\n");
+		return -1;
+	}
+
+	for (i = 0; i < sizeof(storms) / sizeof(storms[0]) && ret == 0; i++)
+		for (r = 0; r < flags.rounds && ret == 0; r++)
+			ret = run_storm(storms[i]);
+
+	comm_deinit(&handle);
+	pthread_join(thread, NULL);
+	topo_destroy(&topo);
+
+	return ret;
+}
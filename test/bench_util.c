@@ -0,0 +1,261 @@
+/*
+ * This file implements the harness shared by the loopback benchmarks
+ * (see bench_util.h)
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <time.h>
+#include <sched.h>
+#include <sys/socket.h>
+#include <sys/uio.h>
+#include <arpa/inet.h>
+
+#include "bench_util.h"
+
+bench_ep_t bench_eps[BENCH_MAX_EPS];
+void (*bench_data_hook)(int ep, char *buf, int len);
+
+static __thread int ep_index;
+
+double bench_now_sec(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+double bench_thread_cpu_sec(pthread_t thread)
+{
+	struct timespec ts;
+	clockid_t clock;
+
+	if (pthread_getcpuclockid(thread, &clock) != 0 ||
+			clock_gettime(clock, &ts) < 0)
+		return 0;
+
+	return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static void ep_data(int host_num, int sw, int session, int msg_num, char *buf,
+			int len)
+{
+	(void)host_num;
+	(void)sw;
+	(void)session;
+	(void)msg_num;
+
+	if (bench_data_hook != NULL)
+		bench_data_hook(ep_index, buf, len);
+
+	__atomic_add_fetch(&bench_eps[ep_index].delivered, 1,
+				__ATOMIC_RELEASE);
+}
+
+static void err_callback(int node_num, int sw, int reason)
+{
+	(void)node_num;
+	(void)sw;
+	(void)reason;
+}
+
+static void *ep_thread(void *arg)
+{
+	bench_ep_t *ep = (bench_ep_t *)arg;
+
+	ep_index = ep - bench_eps;
+
+	if (comm_init_opts(&ep->handle, &ep->opts, err_callback, ep_data) < 0)
+		fprintf(stderr, "Couldn't start ep %d\n", ep_index);
+
+	return NULL;
+}
+
+/* Waits for ep to listen, connecting from an address it turns away */
+static int ep_wait(const char *ip)
+{
+	struct sockaddr_in addr;
+	int i, fd, ret;
+
+	for (i = 0; i < 500; i++) {
+		fd = socket(AF_INET, SOCK_STREAM, 0);
+		if (fd < 0)
+			return -1;
+
+		memset(&addr, 0, sizeof(addr));
+		addr.sin_family = AF_INET;
+		inet_pton(AF_INET, BENCH_PROBE_ADDR, &addr.sin_addr);
+		bind(fd, (struct sockaddr *)&addr, sizeof(addr));
+
+		addr.sin_port = htons(EP_LISTEN_PORT);
+		inet_pton(AF_INET, ip, &addr.sin_addr);
+
+		ret = connect(fd, (struct sockaddr *)&addr, sizeof(addr));
+		close(fd);
+		if (ret == 0)
+			return 0;
+
+		usleep(10 * 1000);
+	}
+
+	return -1;
+}
+
+int bench_topo_new(topo_t *topo, int n)
+{
+	const char *host_ip = BENCH_HOST_ADDR, *ip;
+	bench_ep_t *ep;
+	int i;
+
+	if (n > BENCH_MAX_EPS || topo_new(topo, 1) < 0)
+		return -1;
+
+	if (topo_add_node(topo, true, BENCH_HOST_NAME, &host_ip) < 0)
+		goto err;
+
+	for (i = 0; i < n; i++) {
+		ep = &bench_eps[i];
+		snprintf(ep->ip, sizeof(ep->ip), BENCH_EP_ADDR_FMT, 11 + i);
+		snprintf(ep->name, sizeof(ep->name), "ep%d", i);
+		ip = ep->ip;
+
+		if (topo_add_node(topo, false, ep->name, &ip) < 0)
+			goto err;
+
+		comm_opts_init(&ep->opts);
+		ep->opts.topology = topo;
+		ep->opts.node_name = ep->name;
+	}
+
+	return 0;
+
+err:
+	topo_destroy(topo);
+	return -1;
+}
+
+void bench_host_opts(comm_opts_t *opts, const topo_t *topo)
+{
+	comm_opts_init(opts);
+	opts->topology = topo;
+	opts->node_name = BENCH_HOST_NAME;
+}
+
+void bench_eps_start(int n)
+{
+	int i;
+
+	for (i = 0; i < n; i++) {
+		__atomic_store_n(&bench_eps[i].delivered, 0, __ATOMIC_RELAXED);
+		pthread_create(&bench_eps[i].thread, NULL, ep_thread,
+				&bench_eps[i]);
+
+		if (ep_wait(bench_eps[i].ip) < 0) {
+			fprintf(stderr, "Ep %d didn't come up\n", i);
+			exit(-1);
+		}
+	}
+}
+
+void bench_eps_stop(int n)
+{
+	int i;
+
+	for (i = 0; i < n; i++) {
+		comm_deinit(&bench_eps[i].handle);
+		pthread_join(bench_eps[i].thread, NULL);
+	}
+}
+
+void bench_host_start(comm_handle_t *handle, comm_opts_t *opts)
+{
+	if (comm_init_opts(handle, opts, err_callback, NULL) < 0) {
+		fprintf(stderr, "Couldn't connect host to eps\n");
+		exit(-1);
+	}
+}
+
+long bench_min_delivered(int n)
+{
+	long done, min = -1;
+	int i;
+
+	for (i = 0; i < n; i++) {
+		done = __atomic_load_n(&bench_eps[i].delivered,
+					__ATOMIC_ACQUIRE);
+		if (min < 0 || done < min)
+			min = done;
+	}
+
+	return min;
+}
+
+long bench_min_acked(comm_handle_t *handle, int n)
+{
+	long acked, min = -1;
+	int i;
+
+	for (i = 0; i < n; i++) {
+		acked = host_get_acked(handle, i);
+		if (min < 0 || acked < min)
+			min = acked;
+	}
+
+	return min;
+}
+
+long bench_send(comm_handle_t *handle, int n, long count, const char *buf,
+		int len, bool by_acks, double *spent)
+{
+	struct iovec iov[BENCH_BATCH];
+	double begin, stalled;
+	long sent = 0, done, last = -1;
+	int i, ret;
+
+	for (i = 0; i < BENCH_BATCH; i++) {
+		iov[i].iov_base = (void *)buf;
+		iov[i].iov_len = len;
+	}
+
+	begin = bench_now_sec();
+
+	while (sent < count) {
+		/*
+		 * Kept within the retransmit window, so that replay (or
+		 * nacks) can make up for what gets lost. Only acks tell if
+		 * msgs before those delivered are still missing
+		 */
+		done = by_acks ? bench_min_acked(handle, n) :
+				bench_min_delivered(n);
+		if (sent - done >= BENCH_IN_FLIGHT) {
+			sched_yield();
+			continue;
+		}
+
+		ret = host_send_msgv(handle, iov, count - sent < BENCH_BATCH ?
+						count - sent : BENCH_BATCH);
+		if (ret > 0)
+			sent += ret;
+		else
+			sched_yield();
+	}
+
+	/* Don't hang should deliveries stall anyway */
+	stalled = bench_now_sec();
+	while ((done = bench_min_delivered(n)) < count) {
+		if (done != last) {
+			last = done;
+			stalled = bench_now_sec();
+		} else if (bench_now_sec() - stalled > BENCH_STALL_SEC) {
+			fprintf(stderr, "%ld msgs lost\n", count - done);
+			break;
+		}
+		usleep(100);
+	}
+
+	*spent = (done < count ? stalled : bench_now_sec()) - begin;
+
+	return done;
+}
@@ -0,0 +1,81 @@
+#ifndef __BENCH_UTIL_H__
+#define __BENCH_UTIL_H__
+
+#include <stdbool.h>
+#include <pthread.h>
+#include <netinet/in.h>
+
+#include "comm.h"
+
+/*
+ * Harness of the benchmarks running a host and its eps as threads of one
+ * process, over loopback. Each ep listens on an address of its own, all on
+ * a single switch. The eps log their connections going away, run the
+ * benchmarks with 2>/dev/null
+ */
+
+#define BENCH_HOST_ADDR		"127.0.0.1"	/* Source of loopback connects */
+#define BENCH_EP_ADDR_FMT	"127.0.0.%d"	/* 11 onwards */
+#define BENCH_PROBE_ADDR	"127.0.0.99"	/* Not in topology */
+#define BENCH_HOST_NAME		"host"
+#define BENCH_MAX_EPS		8
+
+#define BENCH_BATCH		64		/* Msgs per host_send_msgv() */
+#define BENCH_IN_FLIGHT		HOST_RETRANSMIT_WINDOW
+#define BENCH_STALL_SEC		1.0		/* Rest count as lost */
+
+/* Ep of a benchmark, run on a thread of its own */
+typedef struct {
+	comm_handle_t handle;
+	comm_opts_t opts;			/* Set up by bench_topo_new() */
+	char name[MAX_NODE_NAME + 1];
+	char ip[INET_ADDRSTRLEN];
+	pthread_t thread;
+	long delivered;
+} bench_ep_t;
+
+extern bench_ep_t bench_eps[BENCH_MAX_EPS];
+
+/*
+ * Called on the thread of ep (its index) with each msg delivered to it,
+ * before it is counted. NULL if the benchmark only counts them
+ */
+extern void (*bench_data_hook)(int ep, char *buf, int len);
+
+double bench_now_sec(void);
+
+/* CPU time of thread so far */
+double bench_thread_cpu_sec(pthread_t thread);
+
+/*
+ * Topology of the host and n eps. Opts of the eps are reset to defaults
+ * for it, for the benchmark to change before bench_eps_start()
+ */
+int bench_topo_new(topo_t *topo, int n);
+
+/* Default opts of the host in topo */
+void bench_host_opts(comm_opts_t *opts, const topo_t *topo);
+
+/* Starts the first n eps, once each listens the next one is started */
+void bench_eps_start(int n);
+void bench_eps_stop(int n);
+
+/* Brings up the host, connected to the eps */
+void bench_host_start(comm_handle_t *handle, comm_opts_t *opts);
+
+/* Msgs every one of the first n eps has got */
+long bench_min_delivered(int n);
+
+/* Msgs every one of the first n eps has acked */
+long bench_min_acked(comm_handle_t *handle, int n);
+
+/*
+ * Sends count msgs of len bytes in buf to the first n eps, with at most
+ * BENCH_IN_FLIGHT of them not yet acked (by_acks) or delivered. Waits till
+ * every ep has got them, or they stall. Returns the msgs every ep got,
+ * with spent set to the time till the last of them arrived
+ */
+long bench_send(comm_handle_t *handle, int n, long count, const char *buf,
+		int len, bool by_acks, double *spent);
+
+#endif /* __BENCH_UTIL_H__ */
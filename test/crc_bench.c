@@ -0,0 +1,198 @@
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <unistd.h>
+#include <sched.h>
+#include <pthread.h>
+
+#include "comm.h"
+#include "crc.h"
+#include "bench_util.h"
+
+/*
+ * Cost of checksumming frames. First the raw speed of CRC32C, with the
+ * CPU's instructions against the table driven version. Then msgs/s sent
+ * by a host to an ep over loopback (both in this process), with and
+ * without checksums: the median of the runs of each kind and the drop
+ * with checksums. Host and ep are pinned to CPUs of their own if there
+ * are two. The share of the run going into checksumming (host and ep
+ * together), worked out from the raw speed, is shown too - It doesn't
+ * vary from run to run. Run with 2>/dev/null (see bench_util.h)
+ */
+
+struct flags_t {
+
+	long count;		/* Msgs sent per run */
+	int rounds;		/* Runs of each kind, median counts */
+
+} flags = {200000, 5};
+
+static int sizes[] = {64, 1024, 4000};
+
+static bool is_pinned;
+
+/* Runs the calling thread (and threads it starts) on cpu only */
+static bool pin(int cpu)
+{
+	cpu_set_t set;
+
+	CPU_ZERO(&set);
+	CPU_SET(cpu, &set);
+
+	return pthread_setaffinity_np(pthread_self(), sizeof(set), &set) == 0;
+}
+
+static int cmp_double(const void *a, const void *b)
+{
+	double x = *(const double *)a, y = *(const double *)b;
+
+	return x < y ? -1 : x > y;
+}
+
+static double median(double *samples, int n)
+{
+	qsort(samples, n, sizeof(double), cmp_double);
+
+	return n % 2 ? samples[n / 2] :
+			(samples[n / 2 - 1] + samples[n / 2]) / 2;
+}
+
+/* MB/s of crc_fn over buffers of len bytes */
+static double crc_speed(uint32_t (*crc_fn)(uint32_t, const void *, size_t),
+			size_t len)
+{
+	static char buf[4096];
+	long i, n = (256L << 20) / len;
+	uint32_t crc = 0;
+	double begin;
+
+	memset(buf, 'x', sizeof(buf));
+
+	begin = bench_now_sec();
+	for (i = 0; i < n; i++)
+		crc = crc_fn(crc, buf, len);
+
+	/* Keep compiler from dropping the work */
+	if (crc == 1)
+		printf(" ");
+
+	return n * len / (bench_now_sec() - begin) / 1e6;
+}
+
+/* Msgs/s of payload len from host to ep, frames checksummed or not */
+static double run(int len, bool frame_crc)
+{
+	static char buf[MAX_DATA_LEN];
+	comm_opts_t host_opts;
+	comm_handle_t handle;
+	topo_t topo;
+	double spent;
+	long done;
+
+	if (bench_topo_new(&topo, 1) < 0)
+		exit(-1);
+
+	bench_eps[0].opts.frame_crc = frame_crc;
+	bench_host_opts(&host_opts, &topo);
+	host_opts.frame_crc = frame_crc;
+
+	/* Ep's loop runs on the thread started off main */
+	if (is_pinned)
+		pin(1);
+	bench_eps_start(1);
+	if (is_pinned)
+		pin(0);
+
+	bench_host_start(&handle, &host_opts);
+
+	memset(buf, 'x', len);
+	done = bench_send(&handle, 1, flags.count, buf, len, false, &spent);
+
+	comm_deinit(&handle);
+	bench_eps_stop(1);
+	topo_destroy(&topo);
+
+	return done / spent;
+}
+
+int main(int argc, char **argv)
+{
+	size_t crc_sizes[] = {64, 512, 4096};
+	double *plain, *crc, mid_plain, mid_crc, crc_mbps, share;
+	unsigned int i;
+	int c, r;
+
+	while ((c = getopt(argc, argv, "n:r:")) != -1) {
+		switch (c) {
+		case 'n':
+			flags.count = atol(optarg);
+			break;
+		case 'r':
+			flags.rounds = atoi(optarg);
+			break;
+		default:
+			fprintf(stderr, "%s: Usage:\n"
+				"-n <number>: Msgs sent per run\n"
+				"-r <number>: Runs of each kind\n",
+				argv[0]);
+			return -1;
+		}
+	}
+
+	if (flags.count <= 0 || flags.rounds <= 0)
+		return -1;
+
+	plain = malloc(flags.rounds * sizeof(double));
+	crc = malloc(flags.rounds * sizeof(double));
+	if (plain == NULL || crc == NULL)
+		return -1;
+
+	/* Host thread starts off main, taking its CPU */
+	if (sysconf(_SC_NPROCESSORS_ONLN) >= 2)
+		is_pinned = pin(0);
+
+	printf("CRC32C using %s\n", crc32c_impl());
+	printf("%-10s %14s %14s\n", "Bytes", "crc32c MB/s", "table MB/s");
+
+	for (i = 0; i < sizeof(crc_sizes) / sizeof(crc_sizes[0]); i++)
+		printf("%-10zu %14.0f %14.0f\n", crc_sizes[i],
+			crc_speed(crc32c, crc_sizes[i]),
+			crc_speed(crc32c_sw, crc_sizes[i]));
+
+	printf("\nHost to ep over loopback, %ld msgs, median of %d runs, "
+		"%s\n", flags.count, flags.rounds,
+		is_pinned ? "host and ep on CPUs of their own" :
+				"host and ep sharing the CPUs");
+	printf("%-10s %14s %14s %8s %10s\n", "Payload", "plain msgs/s",
+		"crc msgs/s", "Drop", "CRC share");
+
+	for (i = 0; i < sizeof(sizes) / sizeof(sizes[0]); i++) {
+
+		/* Interleaved, so that both see the same noise */
+		for (r = 0; r < flags.rounds; r++) {
+			plain[r] = run(sizes[i], false);
+			crc[r] = run(sizes[i], true);
+		}
+
+		mid_plain = median(plain, flags.rounds);
+		mid_crc = median(crc, flags.rounds);
+
+		/* Checksummed once by host and once by ep, header and all */
+		crc_mbps = crc_speed(crc32c, sizes[i]);
+		share = 2 * (sizes[i] + FRAME_MAX_HDR_LEN) / (crc_mbps * 1e6) *
+				mid_plain;
+		if (is_pinned)
+			share /= 2;
+
+		printf("%-10d %14.0f %14.0f %7.1f%% %9.2f%%\n", sizes[i],
+			mid_plain, mid_crc,
+			(mid_plain - mid_crc) * 100 / mid_plain, share * 100);
+	}
+
+	free(plain);
+	free(crc);
+
+	return 0;
+}
@@ -1,4 +1,5 @@
 #include <stdio.h>
+#include <stdlib.h>
 #include <unistd.h>
 
 #include "comm.h"
@@ -12,6 +13,30 @@ void callback(int host_num, int host_sw, int session,
 		host_num, host_sw, session, msg_num, buf);
 }
 
+/*
+ * Prints only the start and end of a stream. Chunks come in order (and
+ * once) only with -o, else the start and end may show up more than once
+ */
+void stream_callback(int host_num, int host_sw, int session, int stream_id,
+		uint64_t offset, uint64_t total_len, char *buf, int len)
+{
+	(void)buf;
+
+	if (offset == 0 || offset + len == total_len)
+		printf("Host(%d:%d): Session(%d): Stream(%d): Offset(%llu): "
+			"Len(%d): Total(%llu)\n",
+			host_num, host_sw, session, stream_id,
+			(unsigned long long)offset, len,
+			(unsigned long long)total_len);
+}
+
+/* Msgs which never arrived on any switch */
+void gap_callback(int host_num, int session, int msg_num, int count)
+{
+	printf("Host(%d): Session(%d): Lost %d msgs from MsgNum(%d)\n",
+		host_num, session, count, msg_num);
+}
+
 /* Error */
 void err_callback(int node_num, int sw, int reason)
 {
@@ -34,11 +59,59 @@ void err_callback(int node_num, int sw, int reason)
 }
 
 
-int main(void)
+int main(int argc, char **argv)
 {
 	comm_handle_t handle;
+	comm_opts_t opts;
+	int c;
+
+	comm_opts_init(&opts);
+	opts.ep_stream_callback = stream_callback;
+	opts.ep_gap_callback = gap_callback;
+
+	while ((c = getopt(argc, argv, "w:doc:lkzm")) != -1) {
+		switch (c) {
+		case 'w':
+			opts.ep_num_workers = atoi(optarg);
+			break;
+		case 'd':
+			opts.ep_dedup = true;
+			break;
+		case 'o':
+			opts.ep_ordered = true;
+			break;
+		case 'c':
+			opts.topology_file = optarg;
+			break;
+		case 'l':
+			opts.wire_legacy = true;
+			break;
+		case 'k':
+			opts.frame_crc = true;
+			break;
+		case 'z':
+			opts.frame_compress = true;
+			break;
+		case 'm':
+			opts.multicast = true;
+			break;
+		default:
+			fprintf(stderr, "%s: Usage:\n"
+				"-w <number>: Number of worker threads\n"
+				"-d: Drop msgs duplicated across switches\n"
+				"-o: Deliver msgs in order (implies -d)\n"
+				"-c <file>: Topology of the rack\n"
+				"-l: Only use the legacy (v0) wire format\n"
+				"-k: Checksum frames (if host does too)\n"
+				"-z: Take compressed msgs (if host sends them)\n"
+				"-m: Take msgs over multicast (if host sends "
+				"them, implies -d)\n",
+				argv[0]);
+			return -1;
+		}
+	}
 
-	comm_init(&handle, err_callback, callback);
+	comm_init_opts(&handle, &opts, err_callback, callback);
 	
 	return 0;
 }
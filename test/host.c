@@ -14,15 +14,44 @@ struct flags_t {
 
 	bool from_stdin;
 	int count;
+	long stream_len;
+	comm_path_policy_t policy;
+	bool show_acks;
+	char *topology;
+	comm_quorum_t quorum;
+	int quorum_eps;
+	bool wire_legacy;
+	bool frame_crc;
+	bool frame_compress;
+	bool multicast;
+	comm_engine_t engine;
+	comm_send_mode_t send_mode;
+	comm_backpressure_t backpressure;
 
-} flags = {false, 10};
+} flags = {false, 10, 0, PATH_DUPLICATE, false, NULL, QUORUM_ALL, 0, false,
+		false, false, false, COMM_ENGINE_LIBEVENT, SEND_ADAPTIVE,
+		BACKPRESSURE_EAGAIN};
 
 void usage(char **argv)
 {
 	fprintf(stderr,
 		"%s: Usage:\n"
 		"-i: Take input from stdin\n"
-		"-n <number>: Number of messages to be sent <Fixed, if not from stdin>\n",
+		"-n <number>: Number of messages to be sent <Fixed, if not from stdin>\n"
+		"-s <bytes>: Also send a stream of this size at the end\n"
+		"-p <dup|standby|stripe>: Path policy over switches\n"
+		"-a: Print acknowledgements from eps\n"
+		"-c <file>: Topology of the rack\n"
+		"-q <all|every|number>: Start once all paths are tried, a path\n"
+		"   to every ep is up, or paths to this many eps are up\n"
+		"-l: Only use the legacy (v0) wire format\n"
+		"-k: Checksum frames (if eps do too)\n"
+		"-z: Compress msgs (if eps take them)\n"
+		"-m: Multicast msgs (to eps asking for it)\n"
+		"-u: Send with io_uring (if the kernel has it)\n"
+		"-M <adaptive|latency|throughput>: Send mode\n"
+		"-b <eagain|block|drop|disconnect>: What to do about a\n"
+		"   backed up ep\n",
 		argv[0]);
 }
 
@@ -32,7 +61,7 @@ void parse_inputs(int argc, char **argv)
 	
 	opterr = 0;
 
-	while ((c = getopt (argc, argv, "in:")) != -1) {
+	while ((c = getopt (argc, argv, "in:s:p:ac:q:lkzmuM:b:")) != -1) {
 		switch (c) {
 		case 'i':
 			flags.from_stdin = true;
@@ -45,6 +74,87 @@ void parse_inputs(int argc, char **argv)
 				exit(-1);
 			}
 			break;
+		case 's':
+			errno = 0;
+			flags.stream_len = strtol(optarg, NULL, 10);
+			if (errno != 0 || flags.stream_len <= 0) {
+				usage(argv);
+				exit(-1);
+			}
+			break;
+		case 'a':
+			flags.show_acks = true;
+			break;
+		case 'c':
+			flags.topology = optarg;
+			break;
+		case 'q':
+			if (strcmp(optarg, "all") == 0) {
+				flags.quorum = QUORUM_ALL;
+			} else if (strcmp(optarg, "every") == 0) {
+				flags.quorum = QUORUM_EVERY_EP;
+			} else {
+				flags.quorum = QUORUM_EPS;
+				flags.quorum_eps = strtol(optarg, NULL, 10);
+				if (flags.quorum_eps <= 0) {
+					usage(argv);
+					exit(-1);
+				}
+			}
+			break;
+		case 'l':
+			flags.wire_legacy = true;
+			break;
+		case 'k':
+			flags.frame_crc = true;
+			break;
+		case 'z':
+			flags.frame_compress = true;
+			break;
+		case 'm':
+			flags.multicast = true;
+			break;
+		case 'u':
+			flags.engine = COMM_ENGINE_URING;
+			break;
+		case 'M':
+			if (strcmp(optarg, "adaptive") == 0) {
+				flags.send_mode = SEND_ADAPTIVE;
+			} else if (strcmp(optarg, "latency") == 0) {
+				flags.send_mode = SEND_LATENCY;
+			} else if (strcmp(optarg, "throughput") == 0) {
+				flags.send_mode = SEND_THROUGHPUT;
+			} else {
+				usage(argv);
+				exit(-1);
+			}
+			break;
+		case 'b':
+			if (strcmp(optarg, "eagain") == 0) {
+				flags.backpressure = BACKPRESSURE_EAGAIN;
+			} else if (strcmp(optarg, "block") == 0) {
+				flags.backpressure = BACKPRESSURE_BLOCK;
+			} else if (strcmp(optarg, "drop") == 0) {
+				flags.backpressure = BACKPRESSURE_DROP_OLDEST;
+			} else if (strcmp(optarg, "disconnect") == 0) {
+				flags.backpressure = BACKPRESSURE_DISCONNECT;
+			} else {
+				usage(argv);
+				exit(-1);
+			}
+			break;
+		case 'p':
+			if (strcmp(optarg, "dup") == 0) {
+				flags.policy = PATH_DUPLICATE;
+			} else if (strcmp(optarg, "standby") == 0) {
+				flags.policy = PATH_ACTIVE_STANDBY;
+			} else if (strcmp(optarg, "stripe") == 0) {
+				flags.policy = PATH_STRIPE;
+			} else {
+				usage(argv);
+				exit(-1);
+			}
+			break;
 		default:
 			usage(argv);
 			exit(-1);
@@ -52,6 +162,26 @@ void parse_inputs(int argc, char **argv)
 	}
 }
 
+/* Eps acknowledging msgs */
+void ack_callback(int ep_num, int ticket, long latency_us)
+{
+	printf("EP(%d): Acked upto Ticket(%d): Latency(%ldus)\n",
+		ep_num, ticket, latency_us);
+}
+
+/* Paths to eps coming up and going down */
+void path_callback(int ep_num, int sw, bool is_up)
+{
+	printf("EP(%d:%d): Path %s\n", ep_num, sw, is_up ? "up" : "down");
+}
+
+/* Eps falling behind and catching up */
+void wm_callback(int ep_num, int sw, bool is_high, size_t queued)
+{
+	printf("EP(%d:%d): %s (%zu bytes queued)\n", ep_num, sw,
+		is_high ? "Backed up" : "Caught up", queued);
+}
+
 /* Error */
 void err_callback(int node_num, int sw, int reason)
 {
@@ -70,15 +200,71 @@ void err_callback(int node_num, int sw, int reason)
 	}
 }
 
+/* Sends a stream of given size, a chunk at a time */
+void send_stream(comm_handle_t *handle, long len)
+{
+	comm_stream_t stream;
+	char chunk[16 * 1024];
+	long sent = 0;
+	ssize_t ret;
+	size_t n;
+
+	memset(chunk, 'x', sizeof(chunk));
+
+	if (host_stream_open(handle, &stream, len) < 0)
+		return;
+
+	printf("Stream(%d): Len(%ld)\n", stream.stream_id, len);
+
+	while (sent < len) {
+		n = len - sent;
+		if (n > sizeof(chunk))
+			n = sizeof(chunk);
+
+		ret = host_stream_write(&stream, chunk, n);
+		if (ret == -EAGAIN) {
+			/* Too much queued, let it drain */
+			usleep(1000);
+			continue;
+		} else if (ret < 0) {
+			return;
+		}
+
+		sent += ret;
+	}
+}
+
 int main(int argc, char **argv)
 {
 	comm_handle_t handle;
-	int i, ret;
+	comm_opts_t opts;
+	comm_switch_stats_t stats;
+	comm_lz_stats_t lz_stats;
+	comm_engine_stats_t engine_stats;
+	comm_conn_stats_t conn_stats;
+	int i, j, ret;
 	char buf[100];
 	
 	parse_inputs(argc, argv);
 
-	ret = comm_init(&handle, err_callback, NULL);
+	comm_opts_init(&opts);
+	opts.host_path_policy = flags.policy;
+	if (flags.show_acks)
+		opts.host_ack_callback = ack_callback;
+	opts.topology_file = flags.topology;
+	opts.host_quorum = flags.quorum;
+	opts.host_quorum_eps = flags.quorum_eps;
+	opts.host_path_callback = path_callback;
+	opts.wire_legacy = flags.wire_legacy;
+	opts.frame_crc = flags.frame_crc;
+	opts.frame_compress = flags.frame_compress;
+	opts.multicast = flags.multicast;
+	opts.host_engine = flags.engine;
+	opts.host_send_mode = flags.send_mode;
+	opts.host_backpressure = flags.backpressure;
+	opts.host_wm_callback = wm_callback;
+
+	ret = comm_init_opts(&handle, &opts, err_callback, NULL);
 	if (ret < 0)
 		return ret;
 
@@ -115,7 +301,69 @@ int main(int argc, char **argv)
 		}
 	}
 
+	if (flags.stream_len > 0)
+		send_stream(&handle, flags.stream_len);
+
+	/* Gone with the connections, once the last msgs are out */
+	sleep(1);
+	for (i = 0; i < comm_get_topology(&handle)->num_eps; i++) {
+		for (j = 0; j < comm_get_topology(&handle)->num_switches; j++) {
+			if (host_get_conn_stats(&handle, i, j, &conn_stats) < 0 ||
+					conn_stats.batches == 0)
+				continue;
+
+			printf("EP(%d:%d): Batches(%lu): Avg batch(%lu): "
+				"Max batch(%lu): Avg delay(%luus): "
+				"Max delay(%luus): Mode switches(%lu)\n", i, j,
+				conn_stats.batches,
+				conn_stats.batch_msgs / conn_stats.batches,
+				conn_stats.max_batch,
+				conn_stats.delay_ns / conn_stats.batch_msgs / 1000,
+				conn_stats.max_delay_ns / 1000,
+				conn_stats.mode_switches);
+			printf("EP(%d:%d): Queued(%zu): Backed up(%lu): "
+				"Dropped(%lu): Disconnects(%lu)\n", i, j,
+				conn_stats.queued, conn_stats.times_backed_up,
+				conn_stats.msgs_dropped, conn_stats.disconnects);
+		}
+	}
+
 	comm_deinit(&handle);
 
+	for (i = 0; i < comm_get_topology(&handle)->num_switches; i++) {
+		host_get_switch_stats(&handle, i, &stats);
+		printf("Switch(%d): Msgs(%lu): Bytes(%lu): Promotions(%lu): "
+			"Reconnects(%lu): Replayed(%lu)\n",
+			i, stats.msgs_sent, stats.bytes_sent,
+			stats.promotions, stats.reconnects,
+			stats.msgs_replayed);
+		printf("Switch(%d): Heartbeats(%lu): Suppressed(%lu): "
+			"Saved(%lu bytes): CRC errors(%lu)\n",
+			i, stats.heartbeats_sent, stats.heartbeats_suppressed,
+			stats.heartbeat_bytes_saved, stats.crc_errors);
+		if (flags.multicast)
+			printf("Switch(%d): Multicast(%lu msgs, %lu bytes): "
+				"Nacks(%lu): Resent(%lu)\n", i,
+				stats.mcast_msgs_sent, stats.mcast_bytes_sent,
+				stats.nacks, stats.msgs_resent);
+	}
+
+	comm_get_lz_stats(&handle, &lz_stats);
+	if (lz_stats.msgs + lz_stats.skipped != 0)
+		printf("Compressed(%lu): Skipped(%lu): Bytes(%lu -> %lu): "
+			"Time(%lu us)\n", lz_stats.msgs, lz_stats.skipped,
+			lz_stats.raw_bytes, lz_stats.lz_bytes,
+			lz_stats.ns / 1000);
+
+	host_get_engine_stats(&handle, &engine_stats);
+	if (engine_stats.engine == COMM_ENGINE_URING)
+		printf("io_uring: Msgs(%lu): Deferred(%lu): Submits(%lu): "
+			"Sends(%lu): Zero copy(%lu, %lu copied): "
+			"Fixed buffers(%lu): Writes(%lu)\n",
+			engine_stats.msgs, engine_stats.msgs_deferred,
+			engine_stats.submits, engine_stats.sends,
+			engine_stats.zc_sends, engine_stats.zc_copied,
+			engine_stats.bufs_registered, engine_stats.writes);
+
 	return 0;
 }
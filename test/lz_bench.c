@@ -0,0 +1,239 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <unistd.h>
+
+#include "comm.h"
+#include "lz.h"
+#include "bench_util.h"
+
+/*
+ * Payload compression benchmark. First the codec by itself, on telemetry
+ * like text and on random bytes: ratio and MB/s both ways. Then a host
+ * sending telemetry to an ep over loopback (both in this process) with
+ * and without compression: msgs/s, bytes on the wire per msg, what that
+ * allows over a 100 Mbit link, and time spent (de)compressing per msg.
+ * Every msg delivered is checked against what was sent. Run with
+ * 2>/dev/null (see bench_util.h)
+ */
+
+#define LINK_BPS	100e6			/* Second switch of the rpis */
+
+struct flags_t {
+
+	long count;		/* Msgs sent per run */
+	int rounds;		/* Runs of each kind, best one counts */
+
+} flags = {100000, 3};
+
+static int sizes[] = {256, 1024, 4000};
+
+static long corrupt;
+static char payload[MAX_DATA_LEN];
+static int payload_len;
+
+/* Lines of sensor readings, like the telemetry the rpis get */
+static void fill_telemetry(char *buf, int len)
+{
+	int pos = 0, n, i = 0;
+	char line[128];
+
+	while (pos < len) {
+		n = snprintf(line, sizeof(line),
+				"{\"node\":\"rpi%d\",\"sensor\":\"temp%d\","
+				"\"value\":%d.%02d,\"status\":\"ok\"}\n",
+				i % 3 + 1, i % 8, 20 + rand() % 15, rand() % 100);
+		if (n > len - pos)
+			n = len - pos;
+
+		memcpy(&buf[pos], line, n);
+		pos += n;
+		i++;
+	}
+}
+
+static void fill_random(char *buf, int len)
+{
+	int i;
+
+	for (i = 0; i < len; i++)
+		buf[i] = rand();
+}
+
+/* Ratio and MB/s of compressing and decompressing buf */
+static int codec_speed(const char *name, const char *buf, int len)
+{
+	static char lz[MAX_DATA_LEN], out[MAX_DATA_LEN];
+	long i, n = (64L << 20) / len;
+	double begin, comp, decomp;
+	int lz_len = 0, out_len = 0;
+
+	begin = bench_now_sec();
+	for (i = 0; i < n; i++)
+		lz_len = lz_compress(buf, len, lz, len - 1);
+	comp = n * len / (bench_now_sec() - begin) / 1e6;
+
+	/* Didn't shrink, would go as is */
+	if (lz_len <= 0) {
+		printf("%-10s %6d %8s %12.0f %12s\n", name, len, "-", comp,
+			"-");
+		return 0;
+	}
+
+	begin = bench_now_sec();
+	for (i = 0; i < n; i++)
+		out_len = lz_decompress(lz, lz_len, out, sizeof(out));
+	decomp = n * len / (bench_now_sec() - begin) / 1e6;
+
+	if (out_len != len || memcmp(buf, out, len) != 0) {
+		fprintf(stderr, "%s: Round trip of %d bytes failed\n", name,
+			len);
+		return -1;
+	}
+
+	printf("%-10s %6d %8.2f %12.0f %12.0f\n", name, len,
+		(double)len / lz_len, comp, decomp);
+
+	return 0;
+}
+
+static void check_data(int ep, char *buf, int len)
+{
+	(void)ep;
+
+	if (len != payload_len || memcmp(buf, payload, len) != 0)
+		__atomic_add_fetch(&corrupt, 1, __ATOMIC_RELAXED);
+}
+
+/* Outcome of a run */
+typedef struct {
+	double msgs_per_sec;
+	double wire_bytes;			/* Per msg */
+	double host_ns;				/* Per msg, compressing */
+	double ep_ns;				/* Per msg, decompressing */
+} result_t;
+
+/* Sends payload from host to ep, compressed or not */
+static int run(bool compress, result_t *res)
+{
+	comm_lz_stats_t host_lz, ep_lz;
+	comm_switch_stats_t stats;
+	comm_opts_t host_opts;
+	comm_handle_t handle;
+	topo_t topo;
+	double spent;
+	long done;
+
+	if (bench_topo_new(&topo, 1) < 0)
+		exit(-1);
+
+	bench_eps[0].opts.frame_compress = compress;
+	bench_host_opts(&host_opts, &topo);
+	host_opts.frame_compress = compress;
+
+	bench_eps_start(1);
+	bench_host_start(&handle, &host_opts);
+
+	done = bench_send(&handle, 1, flags.count, payload, payload_len, false,
+				&spent);
+
+	comm_deinit(&handle);
+	bench_eps_stop(1);
+
+	host_get_switch_stats(&handle, 0, &stats);
+	comm_get_lz_stats(&handle, &host_lz);
+	comm_get_lz_stats(&bench_eps[0].handle, &ep_lz);
+	topo_destroy(&topo);
+
+	res->msgs_per_sec = done / spent;
+	res->wire_bytes = (double)stats.bytes_sent / stats.msgs_sent;
+	res->host_ns = (double)host_lz.ns / flags.count;
+	res->ep_ns = done != 0 ? (double)ep_lz.ns / done : 0;
+
+	return done == 0 ? -1 : 0;
+}
+
+int main(int argc, char **argv)
+{
+	static char buf[MAX_DATA_LEN];
+	result_t res, best[2];
+	unsigned int i;
+	int c, r, z;
+
+	while ((c = getopt(argc, argv, "n:r:")) != -1) {
+		switch (c) {
+		case 'n':
+			flags.count = atol(optarg);
+			break;
+		case 'r':
+			flags.rounds = atoi(optarg);
+			break;
+		default:
+			fprintf(stderr, "%s: Usage:\n"
+				"-n <number>: Msgs sent per run\n"
+				"-r <number>: Runs of each kind\n",
+				argv[0]);
+			return -1;
+		}
+	}
+
+	if (flags.count <= 0 || flags.rounds <= 0)
+		return -1;
+
+	srand(1);
+
+	printf("%-10s %6s %8s %12s %12s\n", "Data", "Bytes", "Ratio",
+		"Comp MB/s", "Decomp MB/s");
+
+	for (i = 0; i < sizeof(sizes) / sizeof(sizes[0]); i++) {
+		fill_telemetry(buf, sizes[i]);
+		if (codec_speed("telemetry", buf, sizes[i]) < 0)
+			return -1;
+	}
+
+	for (i = 0; i < sizeof(sizes) / sizeof(sizes[0]); i++) {
+		fill_random(buf, sizes[i]);
+		if (codec_speed("random", buf, sizes[i]) < 0)
+			return -1;
+	}
+
+	bench_data_hook = check_data;
+
+	printf("\nTelemetry from host to ep over loopback, %ld msgs\n",
+		flags.count);
+	printf("%-8s %-5s %10s %10s %12s %10s %10s\n", "Payload", "LZ",
+		"msgs/s", "Wire B/msg", "100Mb msgs/s", "Host ns", "Ep ns");
+
+	for (i = 0; i < sizeof(sizes) / sizeof(sizes[0]); i++) {
+		payload_len = sizes[i];
+		fill_telemetry(payload, payload_len);
+
+		memset(best, 0, sizeof(best));
+
+		/* Interleaved, so that both see the same noise */
+		for (r = 0; r < flags.rounds; r++) {
+			for (z = 0; z < 2; z++) {
+				if (run(z, &res) < 0)
+					return -1;
+
+				if (res.msgs_per_sec > best[z].msgs_per_sec)
+					best[z] = res;
+			}
+		}
+
+		for (z = 0; z < 2; z++)
+			printf("%-8d %-5s %10.0f %10.1f %12.0f %10.0f %10.0f\n",
+				sizes[i], z ? "on" : "off",
+				best[z].msgs_per_sec, best[z].wire_bytes,
+				LINK_BPS / 8 / best[z].wire_bytes,
+				best[z].host_ns, best[z].ep_ns);
+	}
+
+	if (corrupt != 0) {
+		fprintf(stderr, "%ld msgs arrived corrupt\n", corrupt);
+		return -1;
+	}
+
+	return 0;
+}
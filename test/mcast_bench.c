@@ -0,0 +1,147 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <unistd.h>
+
+#include "comm.h"
+#include "bench_util.h"
+
+/*
+ * Host egress with multicast against sending over every connection. A
+ * host sends to 1, 2, 4 and 8 eps over loopback (all in this process, a
+ * single switch), once over TCP and once by multicast: msgs/s, bytes the
+ * host puts out per msg and CPU time of the host thread per msg. Every ep
+ * has to get every msg, multicast losses being recovered by nacks. Run
+ * with 2>/dev/null (see bench_util.h)
+ */
+
+struct flags_t {
+
+	long count;		/* Msgs sent per run */
+	int size;		/* Of each msg */
+	int rounds;		/* Runs of each kind, best one counts */
+
+} flags = {50000, 1024, 3};
+
+static int num_eps[] = {1, 2, 4, 8};
+
+/* Outcome of a run */
+typedef struct {
+	double msgs_per_sec;
+	double egress_bytes;			/* Per msg */
+	double host_ns;				/* Per msg, host thread */
+	unsigned long nacks;
+	unsigned long resent;
+} result_t;
+
+/* Sends msgs from host to n eps, by multicast or not */
+static int run(int n, bool multicast, result_t *res)
+{
+	static char buf[MAX_DATA_LEN];
+	comm_switch_stats_t stats;
+	comm_opts_t host_opts;
+	comm_handle_t handle;
+	double spent, cpu;
+	long done;
+	topo_t topo;
+	int i;
+
+	if (bench_topo_new(&topo, n) < 0)
+		return -1;
+
+	for (i = 0; i < n; i++) {
+		bench_eps[i].opts.ep_dedup = true;
+		bench_eps[i].opts.multicast = multicast;
+	}
+
+	bench_eps_start(n);
+
+	bench_host_opts(&host_opts, &topo);
+	host_opts.multicast = multicast;
+	bench_host_start(&handle, &host_opts);
+
+	memset(buf, 'x', flags.size);
+
+	/* Paced by acks, so that nacks can be answered */
+	cpu = bench_thread_cpu_sec(handle.host_event_thread);
+	done = bench_send(&handle, n, flags.count, buf, flags.size, true,
+				&spent);
+	cpu = bench_thread_cpu_sec(handle.host_event_thread) - cpu;
+
+	comm_deinit(&handle);
+	bench_eps_stop(n);
+	topo_destroy(&topo);
+
+	host_get_switch_stats(&handle, 0, &stats);
+
+	res->msgs_per_sec = done / spent;
+	res->egress_bytes = (double)(stats.bytes_sent +
+					stats.mcast_bytes_sent) / flags.count;
+	res->host_ns = cpu * 1e9 / flags.count;
+	res->nacks = stats.nacks;
+	res->resent = stats.msgs_resent;
+
+	return done < flags.count ? -1 : 0;
+}
+
+int main(int argc, char **argv)
+{
+	result_t res, best[2];
+	unsigned int i;
+	int c, r, m;
+
+	while ((c = getopt(argc, argv, "n:s:r:")) != -1) {
+		switch (c) {
+		case 'n':
+			flags.count = atol(optarg);
+			break;
+		case 's':
+			flags.size = atoi(optarg);
+			break;
+		case 'r':
+			flags.rounds = atoi(optarg);
+			break;
+		default:
+			fprintf(stderr, "%s: Usage:\n"
+				"-n <number>: Msgs sent per run\n"
+				"-s <bytes>: Size of msgs\n"
+				"-r <number>: Runs of each kind\n",
+				argv[0]);
+			return -1;
+		}
+	}
+
+	if (flags.count <= 0 || flags.rounds <= 0 || flags.size <= 0 ||
+			flags.size > MAX_DATA_LEN)
+		return -1;
+
+	printf("Host to eps over loopback, %ld msgs of %d bytes\n",
+		flags.count, flags.size);
+	printf("%-4s %-6s %10s %12s %10s %8s %8s\n", "Eps", "Path", "msgs/s",
+		"Egress B/msg", "Host ns", "Nacks", "Resent");
+
+	for (i = 0; i < sizeof(num_eps) / sizeof(num_eps[0]); i++) {
+		memset(best, 0, sizeof(best));
+
+		/* Interleaved, so that both see the same noise */
+		for (r = 0; r < flags.rounds; r++) {
+			for (m = 0; m < 2; m++) {
+				if (run(num_eps[i], m, &res) < 0)
+					return -1;
+
+				if (res.msgs_per_sec > best[m].msgs_per_sec)
+					best[m] = res;
+			}
+		}
+
+		for (m = 0; m < 2; m++)
+			printf("%-4d %-6s %10.0f %12.1f %10.0f %8lu %8lu\n",
+				num_eps[i], m ? "mcast" : "tcp",
+				best[m].msgs_per_sec, best[m].egress_bytes,
+				best[m].host_ns, best[m].nacks,
+				best[m].resent);
+	}
+
+	return 0;
+}
@@ -0,0 +1,190 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <time.h>
+
+#include "comm.h"
+#include "frame.h"
+
+/*
+ * Microbenchmark of decoding frames on ep (msgs/s on one core). Input is
+ * fed to the evbuffer in socket sized reads, like bufferevent does.
+ * Compares the zero-copy parser against reading every frame out (v0
+ * only), along with the header bytes each frame takes on the wire
+ */
+
+#define READ_SIZE	16384
+#define INPUT_SIZE	(1024 * 1024)
+
+struct flags_t {
+
+	long count;		/* Frames decoded per payload size */
+	int wire;		/* Wire format of the frames */
+
+} flags = {2000000, FRAME_WIRE_V0};
+
+static char input_bytes[INPUT_SIZE];
+static size_t input_len;
+static double hdr_bytes;		/* Per frame, on average */
+
+static frame_parser_t parser;
+
+static double cpu_sec(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_PROCESS_CPUTIME_ID, &ts);
+	return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+/* Fills up input with back to back frames of given payload size */
+static void build_input(int payload_len)
+{
+	uint8_t hdr[FRAME_MAX_HDR_LEN];
+	size_t len, total_hdr = 0;
+	int i = 0;
+
+	input_len = 0;
+	for (;;) {
+		len = frame_encode_hdr(flags.wire, hdr, MSG_DATA, payload_len,
+					i, 1, 1);
+		if (input_len + len + payload_len > INPUT_SIZE)
+			break;
+
+		memcpy(&input_bytes[input_len], hdr, len);
+		memset(&input_bytes[input_len + len], 'x', payload_len);
+		input_len += len + payload_len;
+		total_hdr += len;
+		i++;
+	}
+
+	hdr_bytes = (double)total_hdr / i;
+}
+
+/* Feeds next read worth of input. Returns time spent decoding */
+typedef double (*decode_fn_t)(struct evbuffer *input, long *left,
+				unsigned long *sum);
+
+static double decode_zero_copy(struct evbuffer *input, long *left,
+				unsigned long *sum)
+{
+	frame_t *frame;
+	double begin;
+
+	begin = cpu_sec();
+
+	while (*left > 0 &&
+		frame_parse(&parser, input, &frame) == FRAME_READY) {
+		if (frame->msg_len != 0)
+			*sum += frame_payload(&parser, input)[0];
+		frame_consume(&parser, input);
+		(*left)--;
+	}
+
+	return cpu_sec() - begin;
+}
+
+/* What ep_read() used to do - copy header and payload out */
+static double decode_copy(struct evbuffer *input, long *left,
+				unsigned long *sum)
+{
+	static comm_data_t data;
+	size_t hdr_len = offsetof(comm_data_t, buf);
+	double begin;
+
+	begin = cpu_sec();
+
+	while (*left > 0) {
+		if (evbuffer_get_length(input) < hdr_len)
+			break;
+
+		evbuffer_copyout(input, &data, hdr_len);
+		if (evbuffer_get_length(input) < hdr_len + data.msg_len)
+			break;
+
+		evbuffer_drain(input, hdr_len);
+		evbuffer_remove(input, data.buf, data.msg_len);
+		*sum += data.buf[0];
+		(*left)--;
+	}
+
+	return cpu_sec() - begin;
+}
+
+static double run(decode_fn_t decode)
+{
+	struct evbuffer *input = evbuffer_new();
+	unsigned long sum = 0;
+	long left = flags.count;
+	double spent = 0;
+	size_t off = 0, len;
+
+	frame_parser_init(&parser, MAX_DATA_LEN);
+	frame_parser_set_wire(&parser, flags.wire, 1);
+
+	while (left > 0) {
+		len = input_len - off;
+		if (len > READ_SIZE)
+			len = READ_SIZE;
+
+		evbuffer_add(input, &input_bytes[off], len);
+		off = (off + len) % input_len;
+
+		spent += decode(input, &left, &sum);
+	}
+
+	evbuffer_free(input);
+	frame_parser_destroy(&parser);
+
+	/* Keep compiler from dropping the work */
+	if (sum == 1)
+		printf(" ");
+
+	return flags.count / spent;
+}
+
+int main(int argc, char **argv)
+{
+	int sizes[] = { 0, 8, 64, 512, 4000 };
+	unsigned int i;
+	int c;
+
+	while ((c = getopt(argc, argv, "n:v:")) != -1) {
+		switch (c) {
+		case 'n':
+			flags.count = atol(optarg);
+			break;
+		case 'v':
+			flags.wire = atoi(optarg);
+			break;
+		default:
+			fprintf(stderr, "%s: Usage:\n"
+				"-n <number>: Frames decoded per payload size\n"
+				"-v <0|1>: Wire format of the frames\n",
+				argv[0]);
+			return -1;
+		}
+	}
+
+	if (flags.count <= 0 || flags.wire < FRAME_WIRE_V0 ||
+			flags.wire > FRAME_WIRE_NEWEST)
+		return -1;
+
+	printf("%-10s %10s %18s %18s\n", "Payload", "Hdr bytes",
+		"zero-copy msgs/s", "copy msgs/s");
+
+	for (i = 0; i < sizeof(sizes) / sizeof(sizes[0]); i++) {
+		build_input(sizes[i]);
+		printf("%-10d %10.1f %18.0f", sizes[i], hdr_bytes,
+			run(decode_zero_copy));
+
+		/* Reads raw headers, makes sense only in v0 */
+		if (flags.wire == FRAME_WIRE_V0)
+			printf(" %18.0f\n", run(decode_copy));
+		else
+			printf(" %18s\n", "-");
+	}
+
+	return 0;
+}
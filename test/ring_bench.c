@@ -0,0 +1,175 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <time.h>
+#include <sched.h>
+
+#include "list.h"
+#include "ring.h"
+
+/*
+ * Contention benchmark for the host submission queue: several producer
+ * threads push into one queue drained by a single consumer thread.
+ * Compares the lock-free ring against the old mutex protected list
+ */
+
+#define RING_SIZE	4096
+
+struct flags_t {
+
+	int producers;
+	long count;		/* Messages per producer */
+
+} flags = {4, 1000000};
+
+static ring_t ring;
+
+static list_t list;
+static pthread_mutex_t list_lock = PTHREAD_MUTEX_INITIALIZER;
+
+static volatile int start;
+
+static double now_sec(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static void *ring_producer(void *arg)
+{
+	long i;
+
+	(void)arg;
+
+	while (!start)
+		sched_yield();
+
+	for (i = 1; i <= flags.count; i++) {
+		while (!ring_push(&ring, (void *)(uintptr_t)i))
+			sched_yield();
+	}
+
+	return NULL;
+}
+
+static void *list_producer(void *arg)
+{
+	long i;
+
+	(void)arg;
+
+	while (!start)
+		sched_yield();
+
+	for (i = 1; i <= flags.count; i++) {
+		pthread_mutex_lock(&list_lock);
+		list_append(&list, (void *)(uintptr_t)i);
+		pthread_mutex_unlock(&list_lock);
+	}
+
+	return NULL;
+}
+
+static void ring_consume(long total)
+{
+	while (total > 0) {
+		if (ring_pop(&ring) != NULL)
+			total--;
+		else
+			sched_yield();
+	}
+}
+
+static void list_consume(long total)
+{
+	void *data;
+
+	while (total > 0) {
+		pthread_mutex_lock(&list_lock);
+		data = list_pop_head(&list);
+		pthread_mutex_unlock(&list_lock);
+
+		if (data != NULL)
+			total--;
+		else
+			sched_yield();
+	}
+}
+
+static double run(void *(*producer)(void *), void (*consume)(long))
+{
+	pthread_t *threads;
+	double begin, end;
+	int i;
+
+	threads = malloc(flags.producers * sizeof(pthread_t));
+	if (threads == NULL) {
+		perror("malloc");
+		exit(-1);
+	}
+
+	start = 0;
+
+	for (i = 0; i < flags.producers; i++)
+		pthread_create(&threads[i], NULL, producer, NULL);
+
+	begin = now_sec();
+	start = 1;
+
+	consume(flags.producers * flags.count);
+
+	end = now_sec();
+
+	for (i = 0; i < flags.producers; i++)
+		pthread_join(threads[i], NULL);
+
+	free(threads);
+
+	return flags.producers * flags.count / (end - begin);
+}
+
+int main(int argc, char **argv)
+{
+	int c;
+
+	while ((c = getopt(argc, argv, "p:n:")) != -1) {
+		switch (c) {
+		case 'p':
+			flags.producers = atoi(optarg);
+			break;
+		case 'n':
+			flags.count = atol(optarg);
+			break;
+		default:
+			fprintf(stderr, "%s: Usage:\n"
+				"-p <number>: Number of producer threads\n"
+				"-n <number>: Messages per producer\n",
+				argv[0]);
+			return -1;
+		}
+	}
+
+	if (flags.producers <= 0 || flags.count <= 0)
+		return -1;
+
+	if (ring_new(&ring, RING_SIZE) < 0)
+		return -1;
+
+	list_new(&list, NULL);
+
+	printf("Producers: %d, Messages per producer: %ld\n",
+		flags.producers, flags.count);
+	printf("mpsc ring:   %.2f Mmsgs/s\n",
+		run(ring_producer, ring_consume) / 1e6);
+	printf("locked list: %.2f Mmsgs/s\n",
+		run(list_producer, list_consume) / 1e6);
+
+	list_destroy(&list);
+	ring_destroy(&ring);
+
+	return 0;
+}
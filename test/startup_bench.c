@@ -0,0 +1,281 @@
+/* For accept4() */
+#define _GNU_SOURCE
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <unistd.h>
+#include <errno.h>
+#include <time.h>
+#include <pthread.h>
+#include <sys/socket.h>
+#include <sys/epoll.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+
+#include "comm.h"
+
+/*
+ * Host startup benchmark: times comm_init() of a host against a rack of
+ * eps, some of them live, some refusing connections (nothing listening)
+ * and some black holed (their SYNs dropped, like an ep which is down).
+ * Eps are played by this process on loopback addresses, answering
+ * heartbeats like a real one. Black holes are listeners with a full
+ * accept queue, which makes the kernel drop further SYNs
+ */
+
+#define NUM_SWITCHES	2
+#define MAX_EPS		16
+#define FILL_CONNS	3		/* Fills up a backlog of 0 */
+
+/* Eps of each kind in a run */
+typedef struct {
+	int live;
+	int refusing;
+	int black_holed;
+} mix_t;
+
+static mix_t mixes[] = {
+	{4, 0, 0},
+	{3, 1, 0},
+	{3, 0, 1},
+	{2, 1, 1},
+};
+
+/* Listening sockets and connections of a run */
+static int listen_fds[MAX_EPS * NUM_SWITCHES];
+static int num_listen_fds;
+static int fill_fds[MAX_EPS * NUM_SWITCHES * FILL_CONNS];
+static int num_fill_fds;
+static int efd;
+static volatile bool is_done;
+
+#define HDR_LEN		offsetof(comm_data_t, buf)
+
+static uint64_t now_us(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t)ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
+
+static void ep_addr(int run, int ep, int sw, char *buf, size_t len)
+{
+	snprintf(buf, len, "127.%d.%d.%d", 2 + sw, run, ep + 1);
+}
+
+static int ep_listen(const char *ip, int backlog)
+{
+	struct sockaddr_in addr;
+	int fd, optval = 1;
+
+	fd = socket(AF_INET, SOCK_STREAM | SOCK_NONBLOCK, 0);
+	if (fd < 0)
+		return -1;
+
+	setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, &optval, sizeof(optval));
+
+	memset(&addr, 0, sizeof(addr));
+	addr.sin_family = AF_INET;
+	addr.sin_port = htons(EP_LISTEN_PORT);
+	inet_pton(AF_INET, ip, &addr.sin_addr);
+
+	if (bind(fd, (struct sockaddr *)&addr, sizeof(addr)) < 0 ||
+			listen(fd, backlog) < 0) {
+		close(fd);
+		return -1;
+	}
+
+	listen_fds[num_listen_fds++] = fd;
+
+	return fd;
+}
+
+/* Sends a header only msg of type, telling host to start from scratch */
+static void ep_send(int fd, int msg_type)
+{
+	comm_data_t data;
+
+	memset(&data, 0, HDR_LEN);
+	data.msg_type = msg_type;
+
+	if (send(fd, &data, HDR_LEN, MSG_NOSIGNAL) != (ssize_t)HDR_LEN)
+		close(fd);
+}
+
+/* Plays the live eps, host sends nothing but heartbeat requests */
+static void *ep_thread(void *arg)
+{
+	struct epoll_event events[64], ev;
+	char buf[HDR_LEN * 64];
+	int i, n, fd;
+	ssize_t len;
+
+	(void)arg;
+
+	while (!is_done) {
+		n = epoll_wait(efd, events, 64, 10);
+
+		for (i = 0; i < n; i++) {
+
+			fd = (int)events[i].data.u64;
+
+			if (events[i].data.u64 >> 32) {
+				/* Listening socket */
+				fd = accept4((int)events[i].data.u64, NULL,
+						NULL, SOCK_NONBLOCK);
+				if (fd < 0)
+					continue;
+
+				ep_send(fd, MSG_RESUME);
+
+				ev.events = EPOLLIN;
+				ev.data.u64 = fd;
+				epoll_ctl(efd, EPOLL_CTL_ADD, fd, &ev);
+				continue;
+			}
+
+			/* Whole headers, as long as they are that small */
+			len = recv(fd, buf, sizeof(buf), 0);
+			if (len <= 0) {
+				close(fd);
+				continue;
+			}
+
+			for (; len >= (ssize_t)HDR_LEN; len -= HDR_LEN)
+				ep_send(fd, MSG_HEARTBEAT_RESP);
+		}
+	}
+
+	return NULL;
+}
+
+/* Listener with a full accept queue, drops all further SYNs */
+static int ep_black_hole(const char *ip)
+{
+	struct sockaddr_in addr;
+	int i, fd;
+
+	if (ep_listen(ip, 0) < 0)
+		return -1;
+
+	memset(&addr, 0, sizeof(addr));
+	addr.sin_family = AF_INET;
+	addr.sin_port = htons(EP_LISTEN_PORT);
+	inet_pton(AF_INET, ip, &addr.sin_addr);
+
+	for (i = 0; i < FILL_CONNS; i++) {
+		fd = socket(AF_INET, SOCK_STREAM | SOCK_NONBLOCK, 0);
+		if (fd < 0)
+			return -1;
+
+		connect(fd, (struct sockaddr *)&addr, sizeof(addr));
+		fill_fds[num_fill_fds++] = fd;
+	}
+
+	return 0;
+}
+
+static void err_callback(int node_num, int sw, int reason)
+{
+	(void)node_num;
+	(void)sw;
+	(void)reason;
+}
+
+static int run_mix(int run, mix_t *mix)
+{
+	char ips[NUM_SWITCHES][INET_ADDRSTRLEN];
+	const char *ip_ptrs[NUM_SWITCHES];
+	const char *host_ips[NUM_SWITCHES] = {"127.0.0.1", "127.0.1.1"};
+	char name[MAX_NODE_NAME + 1];
+	struct epoll_event ev;
+	comm_handle_t handle;
+	comm_opts_t opts;
+	pthread_t thread;
+	uint64_t start, end;
+	topo_t topo;
+	int i, j, num_eps, ret;
+
+	num_eps = mix->live + mix->refusing + mix->black_holed;
+	if (num_eps > MAX_EPS || topo_new(&topo, NUM_SWITCHES) < 0)
+		return -1;
+
+	if (topo_add_node(&topo, true, "host", host_ips) < 0)
+		return -1;
+
+	efd = epoll_create1(0);
+	num_listen_fds = num_fill_fds = 0;
+	is_done = false;
+
+	for (i = 0; i < num_eps; i++) {
+		for (j = 0; j < NUM_SWITCHES; j++) {
+			ep_addr(run, i, j, ips[j], sizeof(ips[j]));
+			ip_ptrs[j] = ips[j];
+
+			if (i < mix->live) {
+				int fd = ep_listen(ips[j], 16);
+
+				if (fd < 0)
+					return -1;
+
+				ev.events = EPOLLIN;
+				ev.data.u64 = (1ULL << 32) | fd;
+				epoll_ctl(efd, EPOLL_CTL_ADD, fd, &ev);
+			} else if (i >= mix->live + mix->refusing) {
+				if (ep_black_hole(ips[j]) < 0)
+					return -1;
+			}
+		}
+
+		sprintf(name, "ep%d", i);
+		if (topo_add_node(&topo, false, name, ip_ptrs) < 0)
+			return -1;
+	}
+
+	pthread_create(&thread, NULL, ep_thread, NULL);
+
+	comm_opts_init(&opts);
+	opts.topology = &topo;
+	opts.node_name = "host";
+
+	start = now_us();
+	ret = comm_init_opts(&handle, &opts, err_callback, NULL);
+	end = now_us();
+
+	printf("Live: %d, Refusing: %d, Black holed: %d, Startup: %8.1f ms%s\n",
+		mix->live, mix->refusing, mix->black_holed,
+		(end - start) / 1e3, ret < 0 ? " (failed)" : "");
+
+	if (ret == 0)
+		comm_deinit(&handle);
+
+	is_done = true;
+	pthread_join(thread, NULL);
+
+	for (i = 0; i < num_listen_fds; i++)
+		close(listen_fds[i]);
+	for (i = 0; i < num_fill_fds; i++)
+		close(fill_fds[i]);
+	close(efd);
+
+	topo_destroy(&topo);
+
+	return 0;
+}
+
+int main(void)
+{
+	unsigned int i;
+
+	for (i = 0; i < sizeof(mixes) / sizeof(mixes[0]); i++)
+		if (run_mix(i, &mixes[i]) < 0) {
+			fprintf(stderr, "Couldn't set up eps\n");
+			return -1;
+		}
+
+	return 0;
+}
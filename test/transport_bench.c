@@ -0,0 +1,395 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <unistd.h>
+#include <errno.h>
+#include <time.h>
+#include <signal.h>
+#include <sched.h>
+#include <pthread.h>
+#include <sys/socket.h>
+#include <sys/wait.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <arpa/inet.h>
+
+#include <event2/event.h>
+#include <event2/buffer.h>
+#include <event2/bufferevent.h>
+
+#include "comm.h"
+#include "transport.h"
+#include "bench_util.h"
+
+/*
+ * Latency of a host and an ep on the same machine, over each transport.
+ * First round trips of a small frame through the transport alone, host
+ * and ep being separate processes each running its loop: one side writes,
+ * the other echoes back. Then msgs through the whole stack, a host sending
+ * to an ep (threads of this process) one at a time: host_send_msg() to the
+ * ep getting it. The host's TCP connections are TCP_NODELAY, so each msg
+ * goes out as it is flushed. Run with 2>/dev/null (see bench_util.h)
+ */
+
+#define ECHO_NAME	"bench-echo"		/* Unix socket of echo side */
+
+struct flags_t {
+
+	long count;		/* Round trips per transport */
+	long msgs;		/* Msgs per transport */
+	int size;		/* Bytes of each */
+
+} flags = {20000, 2000, 64};
+
+static int cmp_double(const void *a, const void *b)
+{
+	double x = *(const double *)a, y = *(const double *)b;
+
+	return x < y ? -1 : x > y;
+}
+
+/* Prints mean, median and tail of samples (in us) */
+static void print_latency(const char *name, double *samples, long n)
+{
+	double sum = 0;
+	long i;
+
+	for (i = 0; i < n; i++)
+		sum += samples[i];
+
+	qsort(samples, n, sizeof(double), cmp_double);
+
+	printf("%-6s %10.2f %10.2f %10.2f %10.2f\n", name, sum / n,
+		samples[n / 2], samples[n * 99 / 100], samples[n - 1]);
+}
+
+/* Round trips through a transport alone */
+typedef struct {
+	struct bufferevent *bev;
+	double *samples;
+	long done;
+	double sent_at;
+	char *buf;
+} ping_t;
+
+/* Echo side, everything read is written back */
+static void echo_read(struct bufferevent *bev, void *arg)
+{
+	(void)arg;
+
+	bufferevent_write_buffer(bev, bufferevent_get_input(bev));
+}
+
+static void echo_event(struct bufferevent *bev, short what, void *arg)
+{
+	(void)bev;
+	(void)what;
+
+	event_base_loopbreak((struct event_base *)arg);
+}
+
+static void ping_send(ping_t *ping)
+{
+	ping->sent_at = bench_now_sec();
+	bufferevent_write(ping->bev, ping->buf, flags.size);
+}
+
+static void ping_read(struct bufferevent *bev, void *arg)
+{
+	ping_t *ping = (ping_t *)arg;
+	struct evbuffer *input = bufferevent_get_input(bev);
+
+	if (evbuffer_get_length(input) < (size_t)flags.size)
+		return;
+
+	ping->samples[ping->done++] = (bench_now_sec() - ping->sent_at) * 1e6;
+	evbuffer_drain(input, flags.size);
+
+	if (ping->done == flags.count) {
+		event_base_loopbreak(bufferevent_get_base(bev));
+		return;
+	}
+
+	ping_send(ping);
+}
+
+static void ping_event(struct bufferevent *bev, short what, void *arg)
+{
+	(void)arg;
+	(void)what;
+
+	fprintf(stderr, "Echo side went away\n");
+	event_base_loopbreak(bufferevent_get_base(bev));
+}
+
+/* Listening socket the echo side accepts on, for ops */
+static int echo_listen(const transport_ops_t *ops, struct sockaddr_storage *addr,
+			socklen_t *len)
+{
+	struct sockaddr_in *in = (struct sockaddr_in *)addr;
+	int fd;
+
+	fd = socket(ops->domain, SOCK_STREAM | SOCK_CLOEXEC, 0);
+	if (fd < 0)
+		return -1;
+
+	memset(addr, 0, sizeof(*addr));
+	if (ops->domain == AF_UNIX) {
+		*len = transport_unix_ep_addr((struct sockaddr_un *)addr,
+						ECHO_NAME);
+	} else {
+		in->sin_family = AF_INET;
+		inet_pton(AF_INET, BENCH_HOST_ADDR, &in->sin_addr);
+		*len = sizeof(*in);
+	}
+
+	if (bind(fd, (struct sockaddr *)addr, *len) < 0 || listen(fd, 1) < 0 ||
+			getsockname(fd, (struct sockaddr *)addr, len) < 0) {
+		close(fd);
+		return -1;
+	}
+
+	return fd;
+}
+
+/* TCP at its best, not held up by Nagle */
+static int bench_socket(int fd, const transport_ops_t *ops)
+{
+	int one = 1;
+
+	if (ops->domain == AF_INET)
+		setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+
+	return evutil_make_socket_nonblocking(fd);
+}
+
+/* Echo side, in a process of its own */
+static void echo_run(const transport_ops_t *ops, int lfd)
+{
+	struct event_base *base = event_base_new();
+	struct bufferevent *bev;
+	int fd;
+
+	fd = accept(lfd, NULL, NULL);
+	close(lfd);
+	if (base == NULL || fd < 0 || bench_socket(fd, ops) < 0)
+		exit(-1);
+
+	bev = ops->bev_new(base, fd, false);
+	if (bev == NULL)
+		exit(-1);
+
+	bufferevent_setcb(bev, echo_read, NULL, echo_event, base);
+	bufferevent_enable(bev, EV_READ | EV_WRITE);
+
+	event_base_dispatch(base);
+
+	ops->bev_free(bev);
+	event_base_free(base);
+	exit(0);
+}
+
+static int ping_run(const transport_ops_t *ops, double *samples)
+{
+	struct sockaddr_storage addr;
+	struct event_base *base;
+	socklen_t len = sizeof(addr);
+	ping_t ping;
+	pid_t pid;
+	int lfd, fd, status;
+
+	lfd = echo_listen(ops, &addr, &len);
+	if (lfd < 0) {
+		fprintf(stderr, "%s: Couldn't listen\n", ops->name);
+		return -1;
+	}
+
+	/* Or the child prints it again */
+	fflush(stdout);
+
+	pid = fork();
+	if (pid < 0)
+		return -1;
+	if (pid == 0)
+		echo_run(ops, lfd);
+
+	close(lfd);
+
+	base = event_base_new();
+	fd = socket(ops->domain, SOCK_STREAM | SOCK_CLOEXEC, 0);
+	if (base == NULL || fd < 0 ||
+			connect(fd, (struct sockaddr *)&addr, len) < 0 ||
+			bench_socket(fd, ops) < 0) {
+		fprintf(stderr, "%s: Couldn't connect\n", ops->name);
+		kill(pid, SIGKILL);
+		waitpid(pid, &status, 0);
+		return -1;
+	}
+
+	memset(&ping, 0, sizeof(ping));
+	ping.samples = samples;
+	ping.buf = calloc(1, flags.size);
+	ping.bev = ops->bev_new(base, fd, true);
+	if (ping.buf == NULL || ping.bev == NULL)
+		return -1;
+
+	bufferevent_setcb(ping.bev, ping_read, NULL, ping_event, &ping);
+	bufferevent_enable(ping.bev, EV_READ | EV_WRITE);
+
+	ping_send(&ping);
+	event_base_dispatch(base);
+
+	ops->bev_free(ping.bev);
+	event_base_free(base);
+	free(ping.buf);
+
+	waitpid(pid, &status, 0);
+
+	return ping.done == flags.count ? 0 : -1;
+}
+
+/* Msgs through the whole stack */
+static double *msg_samples;
+
+static void msg_latency(int ep, char *buf, int len)
+{
+	double sent_at;
+
+	if (len < (int)sizeof(sent_at))
+		return;
+
+	/* Counted right after this, on this thread */
+	memcpy(&sent_at, buf, sizeof(sent_at));
+	msg_samples[bench_eps[ep].delivered] =
+			(bench_now_sec() - sent_at) * 1e6;
+}
+
+static int msg_run(transport_type_t type)
+{
+	comm_opts_t host_opts;
+	comm_handle_t handle;
+	double sent_at, stalled;
+	char *buf;
+	long i;
+	topo_t topo;
+
+	if (bench_topo_new(&topo, 1) < 0)
+		return -1;
+
+	if (topo_set_transport(&topo, 0, 0, type) < 0) {
+		topo_destroy(&topo);
+		return -1;
+	}
+
+	bench_host_opts(&host_opts, &topo);
+
+	buf = calloc(1, flags.size);
+	if (buf == NULL)
+		return -1;
+
+	bench_eps_start(1);
+	bench_host_start(&handle, &host_opts);
+
+	/* Let the connection settle (wire format etc.) */
+	usleep(100 * 1000);
+
+	for (i = 0; i < flags.msgs; i++) {
+		sent_at = bench_now_sec();
+		memcpy(buf, &sent_at, sizeof(sent_at));
+
+		if (host_send_msg(&handle, buf, flags.size) < 0)
+			break;
+
+		/* Yielding, host and ep threads may share the CPU with us */
+		stalled = bench_now_sec();
+		while (bench_min_delivered(1) <= i &&
+				bench_now_sec() - stalled < BENCH_STALL_SEC)
+			sched_yield();
+
+		if (bench_min_delivered(1) <= i)
+			break;
+	}
+
+	comm_deinit(&handle);
+	bench_eps_stop(1);
+	topo_destroy(&topo);
+	free(buf);
+
+	if (i < flags.msgs) {
+		fprintf(stderr, "Msg %ld lost\n", i);
+		return -1;
+	}
+
+	return 0;
+}
+
+int main(int argc, char **argv)
+{
+	const transport_ops_t *ops;
+	double *samples;
+	int c, t;
+
+	while ((c = getopt(argc, argv, "n:m:s:")) != -1) {
+		switch (c) {
+		case 'n':
+			flags.count = atol(optarg);
+			break;
+		case 'm':
+			flags.msgs = atol(optarg);
+			break;
+		case 's':
+			flags.size = atoi(optarg);
+			break;
+		default:
+			fprintf(stderr, "%s: Usage:\n"
+				"-n <number>: Round trips per transport\n"
+				"-m <number>: Msgs per transport\n"
+				"-s <bytes>: Size of each\n",
+				argv[0]);
+			return -1;
+		}
+	}
+
+	if (flags.count <= 0 || flags.msgs <= 0 ||
+			flags.size < (int)sizeof(double) ||
+			flags.size > MAX_DATA_LEN)
+		return -1;
+
+	samples = malloc((flags.count > flags.msgs ? flags.count : flags.msgs) *
+				sizeof(double));
+	msg_samples = samples;
+	if (samples == NULL)
+		return -1;
+
+	bench_data_hook = msg_latency;
+
+	printf("Round trips of %d bytes between processes, in us\n",
+		flags.size);
+	printf("%-6s %10s %10s %10s %10s\n", "Path", "Mean", "p50", "p99",
+		"Max");
+
+	for (t = 0; t < TRANSPORT_NUM; t++) {
+		ops = transport_ops(t);
+		if (ping_run(ops, samples) < 0)
+			return -1;
+
+		print_latency(ops->name, samples, flags.count);
+	}
+
+	printf("\nMsgs of %d bytes, host_send_msg() to ep callback, in us\n",
+		flags.size);
+	printf("%-6s %10s %10s %10s %10s\n", "Path", "Mean", "p50", "p99",
+		"Max");
+
+	for (t = 0; t < TRANSPORT_NUM; t++) {
+		if (msg_run(t) < 0)
+			return -1;
+
+		print_latency(transport_ops(t)->name, samples, flags.msgs);
+	}
+
+	free(samples);
+
+	return 0;
+}
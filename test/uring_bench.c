@@ -0,0 +1,162 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <unistd.h>
+
+#include "comm.h"
+#include "bench_util.h"
+
+/*
+ * Host send engines against each other: libevent (a writev per connection
+ * per flush) and io_uring (one submit for all the connections). A host
+ * sends to 1, 2, 4 and 8 eps over loopback (all in this process, a single
+ * switch): msgs/s, syscalls the host makes per msg to put frames on its
+ * connections and CPU time of the host thread per msg. Run with
+ * 2>/dev/null (see bench_util.h)
+ */
+
+struct flags_t {
+
+	long count;		/* Msgs sent per run */
+	int size;		/* Of each msg */
+	int rounds;		/* Runs of each kind, best one counts */
+	int zc_min_len;		/* 0 for default */
+	comm_send_mode_t send_mode;
+
+} flags = {50000, 1024, 3, 0, SEND_ADAPTIVE};
+
+static int num_eps[] = {1, 2, 4, 8};
+
+static const char *engine_names[COMM_ENGINE_NUM] = {"libevent", "io_uring"};
+
+/* Outcome of a run */
+typedef struct {
+	double msgs_per_sec;
+	double syscalls;			/* Per msg, putting frames out */
+	double host_ns;				/* Per msg, host thread */
+	unsigned long zc_sends;
+	comm_engine_t engine;			/* Actually used */
+} result_t;
+
+/* Sends msgs from host to n eps with engine */
+static int run(int n, comm_engine_t engine, result_t *res)
+{
+	static char buf[MAX_DATA_LEN];
+	comm_engine_stats_t stats;
+	comm_opts_t host_opts;
+	comm_handle_t handle;
+	double spent, cpu;
+	long done;
+	topo_t topo;
+
+	if (bench_topo_new(&topo, n) < 0)
+		return -1;
+
+	bench_eps_start(n);
+
+	bench_host_opts(&host_opts, &topo);
+	host_opts.host_engine = engine;
+	host_opts.zc_min_len = flags.zc_min_len;
+	host_opts.host_send_mode = flags.send_mode;
+	bench_host_start(&handle, &host_opts);
+
+	host_get_engine_stats(&handle, &stats);
+	res->engine = stats.engine;
+
+	memset(buf, 'x', flags.size);
+
+	/*
+	 * Paced by acks, eps falling too far behind would miss heartbeats
+	 * (on a single CPU) and be disconnected
+	 */
+	cpu = bench_thread_cpu_sec(handle.host_event_thread);
+	done = bench_send(&handle, n, flags.count, buf, flags.size, true,
+				&spent);
+	cpu = bench_thread_cpu_sec(handle.host_event_thread) - cpu;
+
+	/* Connections carried heartbeats before, left in */
+	host_get_engine_stats(&handle, &stats);
+
+	comm_deinit(&handle);
+	bench_eps_stop(n);
+	topo_destroy(&topo);
+
+	res->msgs_per_sec = done / spent;
+	res->syscalls = (double)(stats.writes + stats.submits) / flags.count;
+	res->host_ns = cpu * 1e9 / flags.count;
+	res->zc_sends = stats.zc_sends;
+
+	return done < flags.count ? -1 : 0;
+}
+
+int main(int argc, char **argv)
+{
+	result_t res, best[COMM_ENGINE_NUM];
+	unsigned int i;
+	int c, r, e;
+
+	while ((c = getopt(argc, argv, "n:s:r:z:M:")) != -1) {
+		switch (c) {
+		case 'n':
+			flags.count = atol(optarg);
+			break;
+		case 's':
+			flags.size = atoi(optarg);
+			break;
+		case 'r':
+			flags.rounds = atoi(optarg);
+			break;
+		case 'z':
+			flags.zc_min_len = atoi(optarg);
+			break;
+		case 'M':
+			flags.send_mode = atoi(optarg);
+			break;
+		default:
+			fprintf(stderr, "%s: Usage:\n"
+				"-n <number>: Msgs sent per run\n"
+				"-s <bytes>: Size of msgs\n"
+				"-r <number>: Runs of each kind\n"
+				"-z <bytes>: Zero copy from this size on\n"
+				"-M <number>: Send mode (0 adaptive, 1 latency,"
+				" 2 throughput)\n",
+				argv[0]);
+			return -1;
+		}
+	}
+
+	if (flags.count <= 0 || flags.rounds <= 0 || flags.size <= 0 ||
+			flags.size > MAX_DATA_LEN)
+		return -1;
+
+	printf("Host to eps over loopback, %ld msgs of %d bytes\n",
+		flags.count, flags.size);
+	printf("%-4s %-9s %10s %12s %10s %10s\n", "Eps", "Engine", "msgs/s",
+		"Syscalls/msg", "Host ns", "Zero copy");
+
+	for (i = 0; i < sizeof(num_eps) / sizeof(num_eps[0]); i++) {
+		memset(best, 0, sizeof(best));
+
+		/* Interleaved, so that both see the same noise */
+		for (r = 0; r < flags.rounds; r++) {
+			for (e = 0; e < COMM_ENGINE_NUM; e++) {
+				if (run(num_eps[i], e, &res) < 0)
+					return -1;
+
+				if (res.msgs_per_sec > best[e].msgs_per_sec)
+					best[e] = res;
+			}
+		}
+
+		for (e = 0; e < COMM_ENGINE_NUM; e++)
+			printf("%-4d %-9s %10.0f %12.3f %10.0f %10lu%s\n",
+				num_eps[i], engine_names[e],
+				best[e].msgs_per_sec, best[e].syscalls,
+				best[e].host_ns, best[e].zc_sends,
+				best[e].engine != (comm_engine_t)e ?
+					" (fell back)" : "");
+	}
+
+	return 0;
+}
@@ -0,0 +1,173 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <unistd.h>
+#include <time.h>
+
+#include <event2/event.h>
+
+#include "wheel.h"
+
+/*
+ * Timer overhead benchmark: every connection has a heartbeat request timer
+ * (10 ms) and a heartbeat check timer (100 ms), like a host connection.
+ * Runs the event loop for a while with all the timers as libevent events
+ * and then on a timing wheel, and reports CPU spent per timer fired
+ */
+
+#define REQ_PERIOD_US	(10 * 1000)
+#define CHECK_PERIOD_US	(100 * 1000)
+
+struct flags_t {
+
+	int secs;		/* Seconds to run each case */
+
+} flags = {1};
+
+static int conns[] = {6, 60, 600, 6000};
+
+static unsigned long num_fired;
+
+static double cpu_sec(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_PROCESS_CPUTIME_ID, &ts);
+	return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static void event_fired(evutil_socket_t fd, short what, void *arg)
+{
+	(void)fd;
+	(void)what;
+	(void)arg;
+
+	num_fired++;
+}
+
+static void wheel_fired(void *arg)
+{
+	(void)arg;
+
+	num_fired++;
+}
+
+static void report(const char *name, int num, double cpu)
+{
+	printf("%-8s Conns: %5d, Timers fired: %8lu, CPU: %6.1f ms/s, "
+		"%6.0f ns/timer\n", name, num, num_fired,
+		cpu * 1e3 / flags.secs,
+		num_fired ? cpu * 1e9 / num_fired : 0.0);
+}
+
+static int run_libevent(int num)
+{
+	struct timeval req = { 0, REQ_PERIOD_US };
+	struct timeval check = { 0, CHECK_PERIOD_US };
+	struct timeval run = { flags.secs, 0 };
+	struct event_base *base;
+	struct event **events;
+	double start;
+	int i;
+
+	base = event_base_new();
+	events = malloc(2 * num * sizeof(struct event *));
+	if (base == NULL || events == NULL)
+		return -1;
+
+	for (i = 0; i < num; i++) {
+		events[2 * i] = event_new(base, -1, EV_PERSIST, event_fired,
+						NULL);
+		events[2 * i + 1] = event_new(base, -1, EV_PERSIST,
+						event_fired, NULL);
+		event_add(events[2 * i], &req);
+		event_add(events[2 * i + 1], &check);
+	}
+
+	num_fired = 0;
+	start = cpu_sec();
+
+	event_base_loopexit(base, &run);
+	event_base_dispatch(base);
+
+	report("libevent", num, cpu_sec() - start);
+
+	for (i = 0; i < 2 * num; i++)
+		event_free(events[i]);
+
+	free(events);
+	event_base_free(base);
+
+	return 0;
+}
+
+static int run_wheel(int num)
+{
+	struct timeval run = { flags.secs, 0 };
+	struct event_base *base;
+	wheel_timer_t *timers;
+	wheel_t wheel;
+	double start;
+	int i;
+
+	base = event_base_new();
+	timers = malloc(2 * num * sizeof(wheel_timer_t));
+	if (base == NULL || timers == NULL)
+		return -1;
+
+	if (wheel_new(&wheel, base, 0) < 0)
+		return -1;
+
+	for (i = 0; i < num; i++) {
+		wheel_timer_init(&timers[2 * i], wheel_fired, NULL);
+		wheel_timer_init(&timers[2 * i + 1], wheel_fired, NULL);
+		wheel_add(&wheel, &timers[2 * i], REQ_PERIOD_US, true);
+		wheel_add(&wheel, &timers[2 * i + 1], CHECK_PERIOD_US, true);
+	}
+
+	num_fired = 0;
+	start = cpu_sec();
+
+	event_base_loopexit(base, &run);
+	event_base_dispatch(base);
+
+	report("wheel", num, cpu_sec() - start);
+	printf("%-8s Wakeups: %lu\n", "", wheel.num_wakeups);
+
+	wheel_destroy(&wheel);
+	free(timers);
+	event_base_free(base);
+
+	return 0;
+}
+
+int main(int argc, char **argv)
+{
+	unsigned int i;
+	int c;
+
+	while ((c = getopt(argc, argv, "t:")) != -1) {
+		switch (c) {
+		case 't':
+			flags.secs = atoi(optarg);
+			break;
+		default:
+			fprintf(stderr, "%s: Usage:\n"
+				"-t <seconds>: Time to run each case\n",
+				argv[0]);
+			return -1;
+		}
+	}
+
+	if (flags.secs <= 0)
+		return -1;
+
+	for (i = 0; i < sizeof(conns) / sizeof(conns[0]); i++) {
+		if (run_libevent(conns[i]) < 0 || run_wheel(conns[i]) < 0) {
+			fprintf(stderr, "Out of memory\n");
+			return -1;
+		}
+	}
+
+	return 0;
+}